@@ -0,0 +1,184 @@
+/*
+** aio.c -- bounded thread pool running blocking filesystem calls for an event loop
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include "aio.h"
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static aio_op_t *head, *tail;   ///< waiting for a thread, oldest first
+static aio_op_t *completed;     ///< finished and not yet taken by aio_complete(), newest first
+static int efd = -1;            ///< eventfd the loop polls
+static aio_stats_t *stats;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/// Add a finished operation to the figures, with the lock held
+static void account(const aio_op_t *op) {
+    uint64_t wait = op->started - op->queued, service = op->finished - op->started;
+    uint64_t us = (op->finished - op->queued) / 1000;
+    int bucket = 0;
+
+    while (bucket < AIO_BUCKETS - 1 && us >= (1ULL << bucket)) {
+        bucket++;
+    }
+    stats->completed++;
+    stats->waitNs += wait;
+    stats->serviceNs += service;
+    stats->maxWaitNs = wait > stats->maxWaitNs ? wait : stats->maxWaitNs;
+    stats->maxServiceNs = service > stats->maxServiceNs ? service : stats->maxServiceNs;
+    stats->latency[bucket]++;
+}
+
+/// A pool thread, runs operations in the order they were submitted
+static void *aio_worker(void *arg) {
+    (void) arg;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&lock);
+    while (1) {
+        while (head == NULL) {
+            pthread_cond_wait(&work, &lock);
+        }
+        aio_op_t *op = head;
+        head = op->next;
+        if (head == NULL) {
+            tail = NULL;
+        }
+        stats->queued--;
+        stats->running++;
+        pthread_mutex_unlock(&lock);
+
+        op->started = now_ns();
+        op->run(op);
+        op->finished = now_ns();
+
+        pthread_mutex_lock(&lock);
+        stats->running--;
+        account(op);
+        op->next = completed;
+        completed = op;
+        if (write(efd, &one, sizeof one) == -1) {
+            // only fails if the counter would overflow, and then the loop is woken already
+        }
+    }
+    return NULL;
+}
+
+/// Start threads pool threads taking at most limit waiting operations. The threads block every signal, so
+/// handlers run on the loop's thread as before. Returns the eventfd the loop polls for completions, or -1
+int aio_init(int threads, int limit) {
+    sigset_t all, old;
+
+    stats = mmap(NULL, sizeof *stats, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED) {
+        stats = NULL;
+        return -1;
+    }
+    if ((efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        return -1;
+    }
+    stats->limit = limit;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (int i = 0; i < threads && i < AIO_MAXTHREADS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, aio_worker, NULL) != 0) {
+            break;
+        }
+        pthread_detach(thread);
+        stats->threads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (stats->threads == 0) {
+        close(efd);
+        efd = -1;
+        return -1;
+    }
+    return efd;
+}
+
+/// Queue op, with run and done set. Returns 0, or -1 if limit operations are already waiting
+int aio_submit(aio_op_t *op) {
+    pthread_mutex_lock(&lock);
+    if (stats->queued >= stats->limit) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    op->queued = now_ns();
+    op->next = NULL;
+    if (tail != NULL) {
+        tail->next = op;
+    } else {
+        head = op;
+    }
+    tail = op;
+    stats->queued++;
+    pthread_cond_signal(&work);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+/// Finish the operations that completed, in the order they were submitted as far as they ran in it
+void aio_complete(void) {
+    uint64_t count;
+
+    if (read(efd, &count, sizeof count) == -1) {
+        // nothing new, a completion already taken woke the loop twice
+    }
+    pthread_mutex_lock(&lock);
+    aio_op_t *op = completed;
+    completed = NULL;
+    pthread_mutex_unlock(&lock);
+
+    aio_op_t *ordered = NULL;
+    while (op != NULL) {
+        aio_op_t *next = op->next;
+        op->next = ordered;
+        ordered = op;
+        op = next;
+    }
+    while (ordered != NULL) {
+        op = ordered;
+        ordered = op->next;
+        op->done(op);
+    }
+}
+
+/// The pool's figures, NULL before aio_init()
+const aio_stats_t *aio_stats(void) {
+    return stats;
+}
+
+/// Latency under which a fraction q of the completed operations finished, in microseconds, 0 before any did.
+/// Read from the histogram, so it is the power of two bounding the bucket the quantile falls in
+uint64_t aio_quantile(const aio_stats_t *s, double q) {
+    uint64_t total = 0, seen = 0;
+
+    for (int i = 0; i < AIO_BUCKETS; i++) {
+        total += s->latency[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    for (int i = 0; i < AIO_BUCKETS; i++) {
+        seen += s->latency[i];
+        if (seen >= q * total) {
+            return 1ULL << i;
+        }
+    }
+    return 1ULL << (AIO_BUCKETS - 1);
+}
@@ -0,0 +1,54 @@
+#ifndef AIO_H
+#define AIO_H
+
+#include <stdint.h>
+
+/// A bounded pool of threads runs the blocking filesystem calls of an event loop. The loop submits an
+/// operation and goes on. A pool thread runs it and puts it on the completed list, and the loop learns of it
+/// from the eventfd becoming readable and finishes it with aio_complete(). A served directory on a slow
+/// network filesystem then only delays what waits for the disk, never the loop itself
+#define AIO_MAXTHREADS 16
+#define AIO_BUCKETS 24      ///< Latency histogram buckets, bucket i counts operations under 2^i microseconds
+
+/// One operation, embedded in whatever it is for
+typedef struct aio_op {
+    void (*run)(struct aio_op *op);     ///< the blocking call, on a pool thread
+    void (*done)(struct aio_op *op);    ///< called from aio_complete() in the loop once run returned
+    void *data;                         ///< what the operation is for
+    long long queued;                   ///< monotonic nanoseconds when submitted, started and finished
+    long long started;
+    long long finished;
+    struct aio_op *next;
+} aio_op_t;
+
+/// Queue depth and latency, in shared memory so processes forked from the loop can report them
+typedef struct aio_stats {
+    uint32_t threads;
+    uint32_t limit;                 ///< operations that may wait, aio_submit() refuses more
+    uint32_t queued;                ///< waiting for a thread
+    uint32_t running;
+    uint64_t completed;
+    uint64_t waitNs;                ///< total and longest time completed operations waited for a thread
+    uint64_t maxWaitNs;
+    uint64_t serviceNs;             ///< total and longest time they took to run
+    uint64_t maxServiceNs;
+    uint64_t latency[AIO_BUCKETS];  ///< from submitted to finished
+} aio_stats_t;
+
+/// Start threads pool threads taking at most limit waiting operations. Returns the eventfd the loop polls
+/// for completions, or -1
+int aio_init(int threads, int limit);
+
+/// Queue op, with run and done set. Returns 0, or -1 if limit operations are already waiting
+int aio_submit(aio_op_t *op);
+
+/// Finish the operations that completed, call when the eventfd is readable
+void aio_complete(void);
+
+/// The pool's figures, NULL before aio_init()
+const aio_stats_t *aio_stats(void);
+
+/// Latency under which a fraction q of the completed operations finished, in microseconds, 0 before any did
+uint64_t aio_quantile(const aio_stats_t *stats, double q);
+
+#endif
@@ -0,0 +1,134 @@
+/*
+** archive.c -- ustar headers for batch downloads, the stream can also be read by tar(1)
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "archive.h"
+
+#define NAMELEN 100     ///< ustar name field
+#define PREFIXLEN 155   ///< ustar prefix field, joined to the name with a '/'
+
+/// Write value as a null terminated octal field of width bytes, or in base-256 when it is too large
+static void tar_number(char *field, size_t width, unsigned long long value) {
+    if (value < (1ULL << (3 * (width - 1)))) {
+        snprintf(field, width, "%0*llo", (int) width - 1, value);
+        return;
+    }
+    // GNU extension for sizes of 8 GiB and up: high bit set, big endian binary
+    memset(field, 0, width);
+    for (size_t i = width - 1; i > 0; i--) {
+        field[i] = (char) (value & 0xff);
+        value >>= 8;
+    }
+    field[0] = (char) 0x80;
+}
+
+/// Read an octal or base-256 number field
+static unsigned long long tar_field(const char *field, size_t width) {
+    unsigned long long value = 0;
+
+    if ((unsigned char) field[0] & 0x80) {
+        for (size_t i = 1; i < width; i++) {
+            value = (value << 8) | (unsigned char) field[i];
+        }
+        return value;
+    }
+    for (size_t i = 0; i < width && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = (value << 3) | (field[i] - '0');
+    }
+    return value;
+}
+
+/// Sum of the header bytes with the checksum field counted as spaces
+static unsigned int tar_checksum(const char *block) {
+    unsigned int sum = 0;
+    for (int i = 0; i < TARBLOCK; i++) {
+        sum += (i >= 148 && i < 156) ? ' ' : (unsigned char) block[i];
+    }
+    return sum;
+}
+
+/// Fill the numeric fields, magic and checksum of a header whose name and type are already in block
+static void tar_finish(char *block, unsigned int mode, unsigned long long size, unsigned long long mtime) {
+    tar_number(block + 100, 8, mode);
+    tar_number(block + 108, 8, 0);
+    tar_number(block + 116, 8, 0);
+    tar_number(block + 124, 12, size);
+    tar_number(block + 136, 12, mtime);
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+    snprintf(block + 148, 8, "%06o", tar_checksum(block));
+    block[155] = ' ';
+}
+
+/// Fill blocks with the header for a regular file. A name that fits neither the name field nor a split at
+/// a '/' into prefix and name is carried by a GNU long name record in front of the header. blocks must hold
+/// TAR_MAXHEADER bytes. Returns the bytes of header written or -1 if the name is too long even for that
+int tar_header(char *blocks, const char *name, const struct stat *st) {
+    size_t len = strlen(name);
+    char *block = blocks;
+
+    if (len >= TAR_MAXNAME) {
+        return -1;
+    }
+    memset(blocks, 0, TAR_MAXHEADER);
+    if (len <= NAMELEN) {
+        memcpy(block, name, len);
+    } else {
+        // Split at a '/' so the tail fits the name field and the head the prefix field
+        const char *slash = strchr(name + len - NAMELEN - 1, '/');
+        if (slash != NULL && slash - name <= PREFIXLEN) {
+            memcpy(block + 345, name, slash - name);
+            memcpy(block, slash + 1, len - (slash - name) - 1);
+        } else {
+            // The record's data block holds the whole name and its null terminator, the header the start of it
+            strcpy(block, "././@LongLink");
+            block[156] = 'L';
+            tar_finish(block, 0644, len + 1, 0);
+            memcpy(block + TARBLOCK, name, len);
+            block += 2 * TARBLOCK;
+            memcpy(block, name, NAMELEN);
+        }
+    }
+
+    block[156] = '0';
+    tar_finish(block, st->st_mode & 07777, st->st_size, st->st_mtime);
+    return block + TARBLOCK - blocks;
+}
+
+/// Parse a header block, returns 1 for a regular file, 2 for a GNU long name record whose size bytes of
+/// data hold the next file's name, 0 for an end of archive (zero) block and -1 for anything else, including
+/// a name longer than TAR_MAXNAME allows. name must hold TAR_MAXNAME bytes
+int tar_parse(const char *block, char *name, off_t *size, time_t *mtime) {
+    static const char zero[TARBLOCK];
+
+    if (memcmp(block, zero, TARBLOCK) == 0) {
+        return 0;
+    }
+    if (tar_field(block + 148, 8) != tar_checksum(block) ||
+        (block[156] != '0' && block[156] != '\0' && block[156] != 'L')) {
+        return -1;
+    }
+
+    // The fields need not be null terminated, and a full prefix joined to a full name does not fit
+    int len;
+    if (block[345] != '\0') {
+        len = snprintf(name, TAR_MAXNAME, "%.*s/%.*s", PREFIXLEN, block + 345, NAMELEN, block);
+    } else {
+        len = snprintf(name, TAR_MAXNAME, "%.*s", NAMELEN, block);
+    }
+    if (len >= TAR_MAXNAME) {
+        return -1;
+    }
+    *size = (off_t) tar_field(block + 124, 12);
+    *mtime = (time_t) tar_field(block + 136, 12);
+    return block[156] == 'L' ? 2 : 1;
+}
+
+/// Number of zero bytes that follow size bytes of file data to complete the last block
+size_t tar_padding(off_t size) {
+    return (TARBLOCK - size % TARBLOCK) % TARBLOCK;
+}
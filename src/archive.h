@@ -0,0 +1,25 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define TARBLOCK 512    ///< Tar streams are made of 512 byte blocks
+
+#define TAR_MAXNAME 256             ///< Longest name written or read, with its null terminator
+#define TAR_MAXHEADER (3 * TARBLOCK) ///< A header with the GNU long name record in front of it
+
+/// Fill blocks with the header for a regular file, with a GNU long name record in front of it when the name
+/// does not fit ustar. blocks must hold TAR_MAXHEADER bytes. Returns the bytes written or -1 if the name is
+/// longer than TAR_MAXNAME allows
+int tar_header(char *blocks, const char *name, const struct stat *st);
+
+/// Parse a header block, returns 1 for a regular file, 2 for a GNU long name record whose size bytes of
+/// data hold the next file's name, 0 for an end of archive (zero) block and -1 for anything else, including
+/// a name longer than TAR_MAXNAME allows. name must hold TAR_MAXNAME bytes
+int tar_parse(const char *block, char *name, off_t *size, time_t *mtime);
+
+/// Number of zero bytes that follow size bytes of file data to complete the last block
+size_t tar_padding(off_t size);
+
+#endif
@@ -0,0 +1,262 @@
+/*
+** bench.c -- request latency and throughput over the TCP, unix socket and shared memory transports
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+
+#include "conn.h"
+#include "ring.h"
+
+#define PORT "3502" ///< the port the server listens on
+
+#define REQUESTS 10000  ///< Check requests timed per transport unless -n says otherwise
+
+#define BULKBUFSIZE 65536   ///< Display output is read this many bytes at a time
+
+/// The transports measured, in the order they are reported
+enum { BENCH_TCP, BENCH_UNIX, BENCH_SHM, BENCH_TRANSPORTS };
+
+static const char *transportNames[BENCH_TRANSPORTS] = {"tcp", "unix", "shm"};
+
+/// TCP segments sent by this host so far, from /proc/net/snmp, or -1 if they can't be read. On loopback
+/// this counts both ends, so it is what a request costs in packets
+static long long tcp_segments(void) {
+    char names[1024], values[1024];
+    long long segments = -1;
+    FILE *f = fopen("/proc/net/snmp", "r");
+
+    if (f == NULL) {
+        return -1;
+    }
+    while (fgets(names, sizeof names, f) != NULL && fgets(values, sizeof values, f) != NULL) {
+        if (strncmp(names, "Tcp:", 4) != 0) {
+            continue;
+        }
+        char *saveName, *saveValue;
+        char *name = strtok_r(names, " \n", &saveName), *value = strtok_r(values, " \n", &saveValue);
+        for (; name != NULL && value != NULL;
+             name = strtok_r(NULL, " \n", &saveName), value = strtok_r(NULL, " \n", &saveValue)) {
+            if (strcmp(name, "OutSegs") == 0) {
+                segments = atoll(value);
+            }
+        }
+    }
+    fclose(f);
+    return segments;
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/// Connect to the server over one transport, returns 0 or -1
+static int bench_connect(conn_t *c, int transport, const char *host, const char *path) {
+    struct addrinfo hints, *servinfo, *p;
+    int yes = 1;
+
+    memset(c, 0, sizeof *c);
+    c->fd = -1;
+    if (transport == BENCH_TCP) {
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        int rv = getaddrinfo(host, PORT, &hints, &servinfo);
+        if (rv != 0) {
+            fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+            return -1;
+        }
+        for (p = servinfo; p != NULL && c->fd == -1; p = p->ai_next) {
+            c->fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
+            if (c->fd != -1 && connect(c->fd, p->ai_addr, p->ai_addrlen) == -1) {
+                close(c->fd);
+                c->fd = -1;
+            }
+        }
+        freeaddrinfo(servinfo);
+        if (c->fd == -1) {
+            perror("bench: connect");
+            return -1;
+        }
+        // Like the server, do not hold a small request back waiting for an ACK
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+        return 0;
+    }
+
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "bench: unix socket path too long\n");
+        return -1;
+    }
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    c->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (c->fd == -1 || connect(c->fd, (struct sockaddr *) &addr, sizeof addr) == -1) {
+        perror("bench: connect");
+        if (c->fd != -1) {
+            close(c->fd);
+        }
+        return -1;
+    }
+    if (transport == BENCH_SHM && ring_connect(c, 0) == -1) {
+        close(c->fd);
+        return -1;
+    }
+    return 0;
+}
+
+/// Receive exactly len bytes, returns 0 or -1 if the server hung up
+static int recv_all(conn_t *c, char *buf, size_t len) {
+    for (size_t got = 0; got < len;) {
+        ssize_t n = conn_recv(c, buf + got, len - got);
+        if (n <= 0) {
+            return -1;
+        }
+        got += n;
+    }
+    return 0;
+}
+
+/// Read one reply up to its END or ERROR frame, data is thrown away. Returns the data bytes or -1
+static long long read_reply(conn_t *c, char *buf, size_t size) {
+    char header[FRAME_HEADER];
+    long long bytes = 0;
+    int type;
+
+    while (1) {
+        if (recv_all(c, header, sizeof header) == -1) {
+            return -1;
+        }
+        uint32_t len = frame_parse(header, &type);
+        for (uint32_t left = len; left > 0;) {
+            uint32_t take = left < size ? left : size;
+            if (recv_all(c, buf, take) == -1) {
+                return -1;
+            }
+            left -= take;
+        }
+        if (type == FRAME_END || type == FRAME_ERROR) {
+            return bytes;
+        }
+        if (type == FRAME_DATA) {
+            bytes += len;
+        }
+    }
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return x < y ? -1 : x > y;
+}
+
+/// Time count requests one after another, checks of file unless a raw request line is given, and, if bulk is
+/// set, one display of it. Over TCP the segments each request cost are reported too
+static int bench_run(int transport, const char *host, const char *path, int count, const char *file,
+                     const char *raw, const char *bulk) {
+    conn_t c;
+    char request[4200], *buf = malloc(BULKBUFSIZE);
+    long long *lat = malloc(count * sizeof *lat);
+
+    if (bench_connect(&c, transport, host, path) == -1) {
+        free(buf);
+        free(lat);
+        return -1;
+    }
+
+    int len = raw != NULL ? snprintf(request, sizeof request, "%s\n", raw)
+                          : snprintf(request, sizeof request, "C %s\n", file);
+    long long segments = transport == BENCH_TCP ? tcp_segments() : -1;
+    long long start = now_ns();
+    for (int i = 0; i < count; i++) {
+        long long t = now_ns();
+        if (conn_send(&c, request, len) == -1 || read_reply(&c, buf, BULKBUFSIZE) == -1) {
+            fprintf(stderr, "bench: %s: server closed the connection\n", transportNames[transport]);
+            conn_close(&c);
+            free(buf);
+            free(lat);
+            return -1;
+        }
+        lat[i] = now_ns() - t;
+    }
+    long long total = now_ns() - start;
+    qsort(lat, count, sizeof *lat, cmp_ll);
+    printf("%-5s %8d requests  p50 %7.1f us  p99 %7.1f us  %9.0f req/s", transportNames[transport], count,
+           lat[count / 2] / 1000.0, lat[(long long) count * 99 / 100] / 1000.0, count * 1e9 / total);
+    if (segments != -1) {
+        printf("  %5.2f segs/req", (tcp_segments() - segments) / (double) count);
+    }
+
+    if (bulk != NULL) {
+        len = snprintf(request, sizeof request, "P %s\n", bulk);
+        start = now_ns();
+        long long bytes = conn_send(&c, request, len) == -1 ? -1 : read_reply(&c, buf, BULKBUFSIZE);
+        total = now_ns() - start;
+        if (bytes > 0) {
+            printf("  display %7.1f MB/s", bytes / 1e6 / (total / 1e9));
+        }
+    }
+    printf("\n");
+
+    conn_close(&c);
+    free(buf);
+    free(lat);
+    return 0;
+}
+
+/// Bench starts execution here
+int main(int argc, char *argv[]) {
+    const char *host = "localhost", *file = "README.md", *bulk = NULL, *raw = NULL;
+    int count = REQUESTS, opt, failed = 0;
+
+    while ((opt = getopt(argc, argv, "n:f:q:p:h:")) != -1) {
+        switch (opt) {
+            case 'n':
+                count = atoi(optarg);
+                break;
+            case 'f':
+                file = optarg;
+                break;
+            case 'q':
+                raw = optarg;
+                break;
+            case 'p':
+                bulk = optarg;
+                break;
+            case 'h':
+                host = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: bench [-n requests] [-f checkfile | -q request] [-p displayfile] [-h host] socketpath\n");
+                exit(1);
+        }
+    }
+    if (argc - optind != 1 || count < 1) {
+        fprintf(stderr, "usage: bench [-n requests] [-f checkfile | -q request] [-p displayfile] [-h host] socketpath\n");
+        exit(1);
+    }
+
+    /// Writing to a server that already hung up should fail the call, not kill the bench
+    signal(SIGPIPE, SIG_IGN);
+
+    /// The server must listen on TCP and on the unix socket, shared memory is set up through the socket
+    for (int t = 0; t < BENCH_TRANSPORTS; t++) {
+        if (bench_run(t, host, argv[optind], count, file, raw, bulk) == -1) {
+            failed = 1;
+        }
+    }
+    return failed;
+}
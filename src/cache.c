@@ -0,0 +1,223 @@
+/*
+** cache.c -- download cache of the client and the relay, keyed by server and path
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+
+#define CACHELOCKS 65536    ///< Bytes of the lock file, each a lock that the names hashing to it share
+
+static char cacheDir[4000];     ///< Cache directory, empty while the cache is off, short enough for any cache path
+static int lockfd = -1;         ///< Lock file, opened by the first cache_lock() in each process
+
+/// Key of name from host, the digest of both
+static uint64_t cache_key(const char *host, const char *name) {
+    digest_t digest;
+
+    digest_init(&digest);
+    digest_update(&digest, host, strlen(host) + 1);   // the terminator keeps "ab"+"c" apart from "a"+"bc"
+    digest_update(&digest, name, strlen(name));
+    return digest_final(&digest);
+}
+
+/// Path of the body or meta file for name from host
+static void cache_path(const char *host, const char *name, const char *suffix, char *path) {
+    char hex[DIGEST_HEXLEN];
+
+    digest_hex(cache_key(host, name), hex);
+    snprintf(path, 4096, "%s/%s.%s", cacheDir, hex, suffix);
+}
+
+/// Use dir for the cache, creating it if needed. Returns 0 or -1 if the cache can't be used
+int cache_init(const char *dir) {
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        return -1;
+    }
+    snprintf(cacheDir, sizeof cacheDir, "%s", dir);
+    return 0;
+}
+
+/// Look up the copy of name from host. Returns a read only fd for the cached body and fills entry,
+/// or -1 if nothing usable is cached
+int cache_lookup(const char *host, const char *name, cache_entry_t *entry) {
+    char path[4096];
+    struct stat st;
+
+    if (cacheDir[0] == '\0') {
+        return -1;
+    }
+    cache_path(host, name, "meta", path);
+    FILE *meta = fopen(path, "r");
+    if (meta == NULL) {
+        return -1;
+    }
+    int fields = fscanf(meta, "%lld %31s %16s", &entry->size, entry->mtime, entry->hash);
+    entry->checked = fstat(fileno(meta), &st) == 0 ? st.st_mtime : 0;
+    fclose(meta);
+    if (fields != 3) {
+        return -1;
+    }
+
+    // A body that does not match its description is as good as missing
+    cache_path(host, name, "body", path);
+    int bodyfd = open(path, O_RDONLY | O_CLOEXEC);
+    if (bodyfd != -1 && (fstat(bodyfd, &st) == -1 || st.st_size != entry->size)) {
+        close(bodyfd);
+        bodyfd = -1;
+    }
+    return bodyfd;
+}
+
+/// Open a temp file in the cache to receive a new body into, its path is left in tmpPath (4096 bytes)
+int cache_begin(char *tmpPath) {
+    if (cacheDir[0] == '\0') {
+        return -1;
+    }
+    snprintf(tmpPath, 4096, "%s/.body-XXXXXX", cacheDir);
+    return mkstemp(tmpPath);
+}
+
+/// Write the meta file for name from host through a temp file so readers never see half of it
+int cache_update(const char *host, const char *name, const cache_entry_t *entry) {
+    char path[4096], tmpPath[4096];
+
+    snprintf(tmpPath, sizeof tmpPath, "%s/.meta-XXXXXX", cacheDir);
+    int fd = mkstemp(tmpPath);
+    if (fd == -1) {
+        return -1;
+    }
+    FILE *meta = fdopen(fd, "w");
+    fprintf(meta, "%lld %s %s\n", entry->size, entry->mtime, entry->hash);
+    if (fclose(meta) != 0) {
+        unlink(tmpPath);
+        return -1;
+    }
+    cache_path(host, name, "meta", path);
+    if (rename(tmpPath, path) == -1) {
+        unlink(tmpPath);
+        return -1;
+    }
+    return 0;
+}
+
+/// Make the body received into tmpPath the cached copy of name from host, described by entry.
+/// The body goes in first so a meta file never describes a body that is not there yet
+int cache_commit(const char *host, const char *name, const char *tmpPath, const cache_entry_t *entry) {
+    char path[4096];
+
+    cache_path(host, name, "body", path);
+    if (rename(tmpPath, path) == -1) {
+        unlink(tmpPath);
+        return -1;
+    }
+    return cache_update(host, name, entry);
+}
+
+/// Take or drop the lock byte of name from host in the lock file. Record locks belong to the process, so
+/// forked relay children each get their own and a lock goes away with a process that dies holding it
+static int cache_lockbyte(const char *host, const char *name, int type) {
+    char path[4096];
+
+    if (cacheDir[0] == '\0') {
+        return -1;
+    }
+    if (lockfd == -1) {
+        snprintf(path, sizeof path, "%s/.lock", cacheDir);
+        if ((lockfd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1) {
+            return -1;
+        }
+    }
+    struct flock lock = {.l_type = type, .l_whence = SEEK_SET, .l_start = cache_key(host, name) % CACHELOCKS,
+                         .l_len = 1};
+    int rv;
+    while ((rv = fcntl(lockfd, F_SETLKW, &lock)) == -1 && errno == EINTR) {
+    }
+    return rv;
+}
+
+/// Wait until no other process holds name from host, then hold it
+int cache_lock(const char *host, const char *name) {
+    return cache_lockbyte(host, name, F_WRLCK);
+}
+
+/// Let the next process waiting for name from host go ahead
+void cache_unlock(const char *host, const char *name) {
+    cache_lockbyte(host, name, F_UNLCK);
+}
+
+/// One cached copy while the cache is trimmed
+typedef struct cached {
+    time_t checked;
+    off_t size;
+    char key[DIGEST_HEXLEN];
+} cached_t;
+
+static int compare_checked(const void *a, const void *b) {
+    const cached_t *p = a, *q = b;
+    return p->checked < q->checked ? -1 : p->checked > q->checked;
+}
+
+/// Remove the copies described longest ago until the bodies take at most limit bytes. Every use of a copy
+/// rewrites its description, so this drops the least recently used. A process still sending a removed body
+/// keeps its open file
+void cache_trim(long long limit) {
+    char path[4096];
+    struct stat st;
+    DIR *dir = opendir(cacheDir);
+    if (dir == NULL) {
+        return;
+    }
+
+    size_t count = 0, room = 64;
+    cached_t *all = malloc(room * sizeof *all);
+    long long total = 0;
+    struct dirent *de;
+    while (all != NULL && (de = readdir(dir)) != NULL) {
+        char *dot = strchr(de->d_name, '.');
+        if (dot == NULL || dot - de->d_name != DIGEST_HEXLEN - 1 || strcmp(dot, ".body") != 0) {
+            continue;
+        }
+        if (count == room) {
+            cached_t *more = realloc(all, 2 * room * sizeof *all);
+            if (more == NULL) {
+                break;
+            }
+            all = more;
+            room *= 2;
+        }
+        cached_t *c = &all[count];
+        memcpy(c->key, de->d_name, DIGEST_HEXLEN - 1);
+        c->key[DIGEST_HEXLEN - 1] = '\0';
+        snprintf(path, sizeof path, "%s/%s.body", cacheDir, c->key);
+        if (stat(path, &st) == -1) {
+            continue;
+        }
+        c->size = st.st_blocks * 512LL < st.st_size ? st.st_blocks * 512LL : st.st_size;   // holes are free
+        snprintf(path, sizeof path, "%s/%s.meta", cacheDir, c->key);
+        c->checked = stat(path, &st) == 0 ? st.st_mtime : 0;
+        total += c->size;
+        count++;
+    }
+    closedir(dir);
+
+    if (all != NULL && total > limit) {
+        qsort(all, count, sizeof *all, compare_checked);
+        for (size_t i = 0; i < count && total > limit; i++) {
+            // The description goes first so a reader never finds one whose body is gone
+            snprintf(path, sizeof path, "%s/%s.meta", cacheDir, all[i].key);
+            unlink(path);
+            snprintf(path, sizeof path, "%s/%s.body", cacheDir, all[i].key);
+            unlink(path);
+            total -= all[i].size;
+        }
+    }
+    free(all);
+}
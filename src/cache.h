@@ -0,0 +1,44 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <time.h>
+
+#include "digest.h"
+
+#define CACHE_MTIMELEN 32   ///< Room for a server modification time token
+
+/// What the client knows about a cached copy of a server file
+typedef struct cache_entry {
+    long long size;                 ///< size of the cached body
+    char mtime[CACHE_MTIMELEN];     ///< server modification time as "<sec>.<nsec>", opaque to the client
+    char hash[DIGEST_HEXLEN];       ///< digest of the cached body
+    time_t checked;                 ///< when the description was last written, set by cache_lookup()
+} cache_entry_t;
+
+/// Use dir for the cache, creating it if needed. Returns 0 or -1 if the cache can't be used
+int cache_init(const char *dir);
+
+/// Look up the copy of name from host. Returns a read only fd for the cached body and fills entry,
+/// or -1 if nothing usable is cached
+int cache_lookup(const char *host, const char *name, cache_entry_t *entry);
+
+/// Open a temp file in the cache to receive a new body into, its path is left in tmpPath (4096 bytes)
+int cache_begin(char *tmpPath);
+
+/// Make the body received into tmpPath the cached copy of name from host, described by entry
+int cache_commit(const char *host, const char *name, const char *tmpPath, const cache_entry_t *entry);
+
+/// Rewrite the description of a cached copy, for when the server's mtime changed but the content did not
+int cache_update(const char *host, const char *name, const cache_entry_t *entry);
+
+/// Wait until no other process holds name from host, then hold it. Names share a fixed set of locks, so an
+/// unrelated name may wait too. Returns 0 or -1 if locking is not possible
+int cache_lock(const char *host, const char *name);
+
+/// Let the next process waiting for name from host go ahead
+void cache_unlock(const char *host, const char *name);
+
+/// Remove the copies described longest ago until the bodies take at most limit bytes
+void cache_trim(long long limit);
+
+#endif
@@ -7,252 +7,632 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <libgen.h>
 #include <netdb.h>
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
-#include <sys/wait.h>
-#include <arpa/inet.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "conn.h"
+#include "tls.h"
+#include "cache.h"
+#include "xfer.h"
 
 #define PORT "3502" ///< the port client will be connecting to
 
 //#define DEBUG       ///< uncomment to output debug information
 
-#define MAXDATASIZE 100 ///< max number of bytes we can get at once
+#define MAXXFERS 16 ///< Commands in flight before the client stops reading input
+
+#define MAXPIPELINE 64 ///< Commands pipelined in batch mode before the client stops reading input
+
+#define INPUTSIZE 65536 ///< Longest command line
+
+#define PROGRESSMS 200 ///< How often the loop wakes up to redraw progress while transfers run
+
+#define STALLTIMEOUT 60 ///< Seconds a connection with commands out may go without progress, -w changes it
+
+#define MAXEVENTS 16 ///< Events handled per epoll_wait()
+
+#define REPLICAS 2 ///< Servers of a cluster each upload is stored on, -r changes it
+
+/// Turn one line typed by the user (in message, a malloc()ed string) into the request for the server.
+/// Returns the request, which may be a new buffer, or NULL after freeing message when the command was
+/// handled here, with anything it has to say written to out. With a cacheKey display and download become
+/// conditional and download says which it was
+char *encode_command(char *message, const char *cacheKey, int *download, FILE *out) {
+#ifdef DEBUG
+    //This is debug use
+    printf("message is: %s", message);
+#endif
+
+    // else if decision tree for processing user input
+        // Check for ls command
+    if (strcmp(message, "ls\n") == 0 || strncmp(message, "ls ", 3) == 0) {
+#ifdef DEBUG
+        printf("sending ls command\n");
+#endif
+        // 'encode' ls to L, keeping any glob or -r regex filter
+        memmove(message + 1, message + 2, strlen(message + 2) + 1);
+        message[0] = 'L';
+    }
+        // Check for check command
+    else if (strncmp(message, "check\n", 4) == 0) {
+        // Change message from starting with check to C
+        memmove(message + 1, message + 5, strlen(message + 5) + 1);
+        message[0] = 'C';
+    }
+        // check for help command then print helpful list of commands then restart loop
+    else if (strcmp(message, "h\n") == 0) {
+        fprintf(out, "quit     - quit this client program and exit to the console.\n");
+        fprintf(out, "check    - check if file exists in current directory.\n");
+        fprintf(out, "ls       - print the contents of the current directory to the current console\n");
+        fprintf(out, "           'ls <glob>' or 'ls -r <regex>' only lists the matching names\n");
+        fprintf(out, "display  - this attempts to display the contents of a file\n");
+        fprintf(out, "           'display -h <n>', '-t <n>' or '-l <first>-<last>' only shows those lines,\n");
+        fprintf(out, "           '-l <first>-' shows from line first to the end\n");
+        fprintf(out, "           'display -f <n>' shows the last n lines and then whatever is appended to the\n");
+        fprintf(out, "           file until the next command, following it when it is rotated\n");
+        fprintf(out, "download - This downloads the named file to the client directory\n");
+        fprintf(out, "upload   - This uploads the named local file to the server directory\n");
+        fprintf(out, "tree     - print every file below the server directory, 'tree -d <depth>' limits the depth\n");
+        fprintf(out, "           and 'tree -L' follows symbolic links to directories\n");
+        fprintf(out, "search   - print name:line for every line of a server file containing the given text,\n");
+        fprintf(out, "           'search -m <n> <text>' stops after n matches\n");
+        fprintf(out, "get      - This downloads every file named or matching the given globs in one transfer\n");
+        fprintf(out, "mcast    - downloads a file that many clients want at once through multicast, with the\n");
+        fprintf(out, "           parts that were lost sent again over the connection\n");
+        fprintf(out, "watch    - print every file created, modified or deleted on the server as it happens,\n");
+        fprintf(out, "           'watch <glob>' or 'watch -r <regex>' only reports the matching names\n");
+        fprintf(out, "stats    - print the server's disk pool queue depth and how long its filesystem calls take\n");
+        fprintf(out, "h        - prints this help page\n");
+        free(message);
+        return NULL;
+    }
+        // Check for display command with a line range, 'encoded' as R with the first and last line
+    else if (strncmp(message, "display -", 9) == 0) {
+        long long first = 1, last = -1;
+        int follow = 0, valid = 1;
+        char *option = message + 8, *rest;
+        long long n = strtoll(option + 3, &rest, 10);
+        if (strncmp(option, "-h ", 3) == 0) {
+            last = n;                       // head: lines 1..n
+        } else if (strncmp(option, "-t ", 3) == 0) {
+            first = -n;                     // tail: the last n lines
+            valid = n >= 1;
+        } else if (strncmp(option, "-f ", 3) == 0) {
+            follow = 1;                     // follow: the last n lines, then whatever is appended
+        } else if (strncmp(option, "-l ", 3) == 0) {
+            first = n;                      // range: lines a-b, or a to the end given as a or a-
+            valid = n >= 1;
+            if (*rest == '-') {
+                char *end;
+                last = strtoll(rest + 1, &end, 10);
+                if (end == rest + 1) {
+                    last = -1;              // nothing after the '-'
+                }
+                rest = end;
+            }
+        } else {
+            valid = 0;
+        }
+        if (!valid) {
+            fprintf(out, "display options are -h <n>, -t <n>, -f <n> or -l <first>-<last>\n");
+            free(message);
+            return NULL;
+        }
+        rest += strspn(rest, " ");
+        if (*rest == '\n' || *rest == '\0') {
+            fprintf(out, "display command has no argument \n");
+            free(message);
+            return NULL;
+        }
+        size_t encodedLen = strlen(rest) + 64;
+        char *encoded = malloc(encodedLen);
+        if (follow) {
+            snprintf(encoded, encodedLen, "A %lld %s", n < 0 ? 0 : n, rest);
+        } else {
+            snprintf(encoded, encodedLen, "R %lld %lld %s", first, last, rest);
+        }
+        free(message);
+        message = encoded;
+    }
+        // Check for display command
+    else if (strncmp(message, "display\n", 7) == 0) {
+        // Check if display has any arguments
+        if (message[7] == '\n') {
+            fprintf(out, "display command has no argument \n");
+            free(message);
+            return NULL;
+        }
+
+        // Shift message to the left then replace first character with P
+        memmove(message + 1, message + 7, strlen(message + 7) + 1);
+        message[0] = 'P';
+    }
+        // Check for download command
+    else if (strncmp(message, "download\n", 8) == 0) {
+        if (message[8] == '\n') {
+            fprintf(out, "download command has no argument \n");
+            free(message);
+            return NULL;
+        }
+        // Shift message to the left then replace first character with D
+        memmove(message + 1, message + 8, strlen(message + 8) + 1);
+        message[0] = 'D';
+    }
+        // Check for tree command, 'encoded' as T with the depth limit and follow flag
+    else if (strcmp(message, "tree\n") == 0 || strncmp(message, "tree ", 5) == 0) {
+        int maxDepth = 0, follow = 0;
+        for (char *arg = strtok(message + 4, " \n"); arg != NULL; arg = strtok(NULL, " \n")) {
+            if (strcmp(arg, "-L") == 0) {
+                follow = 1;
+            } else if (strcmp(arg, "-d") == 0 && (arg = strtok(NULL, " \n")) != NULL) {
+                maxDepth = atoi(arg);
+            }
+        }
+        char *encoded = malloc(32);
+        snprintf(encoded, 32, "T %d %d\n", maxDepth, follow);
+        free(message);
+        message = encoded;
+    }
+        // Check for search command, 'encoded' as G with the result limit
+    else if (strncmp(message, "search ", 7) == 0) {
+        long maxResults = 0;
+        char *text = message + 7;
+        if (strncmp(text, "-m ", 3) == 0) {
+            maxResults = strtol(text + 3, &text, 10);
+            text += strspn(text, " ");
+        }
+        size_t encodedLen = strlen(text) + 32;
+        char *encoded = malloc(encodedLen);
+        snprintf(encoded, encodedLen, "G %ld %s", maxResults, text);
+        free(message);
+        message = encoded;
+    }
+        // Check for batch download command
+    else if (strncmp(message, "get\n", 3) == 0) {
+        if (message[3] == '\n') {
+            fprintf(out, "get command has no argument \n");
+            free(message);
+            return NULL;
+        }
+        // Shift message to the left then replace first character with B
+        memmove(message + 1, message + 3, strlen(message + 3) + 1);
+        message[0] = 'B';
+    }
+        // Check for multicast download command, 'encoded' as F
+    else if (strncmp(message, "mcast\n", 5) == 0) {
+        if (message[5] == '\n') {
+            fprintf(out, "mcast command has no argument \n");
+            free(message);
+            return NULL;
+        }
+        memmove(message + 1, message + 5, strlen(message + 5) + 1);
+        message[0] = 'F';
+    }
+        // Check for watch command, 'encoded' as W keeping any glob or -r regex filter
+    else if (strcmp(message, "watch\n") == 0 || strncmp(message, "watch ", 6) == 0) {
+        memmove(message + 1, message + 5, strlen(message + 5) + 1);
+        message[0] = 'W';
+    }
+        // Check for stats command, 'encoded' as S
+    else if (strcmp(message, "stats\n") == 0) {
+        strcpy(message, "S\n");
+    }
+        // Check for upload command
+    else if (strncmp(message, "upload\n", 6) == 0) {
+        if (message[6] == '\n') {
+            fprintf(out, "upload command has no argument \n");
+            free(message);
+            return NULL;
+        }
+        char *name = message + 7;
+        name[strcspn(name, "\n\r")] = '\0';
+
+        struct stat st;
+        if (stat(name, &st) == -1 || !S_ISREG(st.st_mode)) {
+            fprintf(out, "local file %s not found\n", name);
+            free(message);
+            return NULL;
+        }
+
+        // 'encode' upload as U followed by the size so the server can check its quota first. The server
+        // stores the file under its base name, the path only says where it is here
+        size_t encodedLen = strlen(name) + 32;
+        char *encoded = malloc(encodedLen);
+        snprintf(encoded, encodedLen, "U %lld %s\n", (long long) st.st_size, basename(name));
+        free(message);
+        message = encoded;
+    }
+        // Print this if command is not recognized then restart loop
+    else {
+        fprintf(out, "Command not recognized\n");
+        free(message);
+        return NULL;
+    }
+
+    // With the cache on display and download become conditional, 'encoded' as V with what we have cached
+    *download = message[0] == 'D';
+    if (cacheKey != NULL && (strncmp(message, "P ", 2) == 0 || strncmp(message, "D ", 2) == 0)) {
+        cache_entry_t entry;
+        char *name = message + 2;
+        name[strcspn(name, "\n\r")] = '\0';
+        int bodyfd = cache_lookup(cacheKey, name, &entry);
+        if (bodyfd == -1) {
+            entry.size = -1;
+            strcpy(entry.mtime, "-");
+            strcpy(entry.hash, "-");
+        } else {
+            close(bodyfd);
+        }
+        size_t encodedLen = strlen(name) + 96;
+        char *encoded = malloc(encodedLen);
+        snprintf(encoded, encodedLen, "V %lld %s %s %s\n", entry.size, entry.mtime, entry.hash, name);
+        free(message);
+        message = encoded;
+    }
+
+#ifdef DEBUG
+    // Print the message being sent to server for debugging purposes
+    printf(" message to send %s\n", message);
+#endif
+    return message;
+}
+
+/// Describe the unix domain socket at path as a one entry address list, released with free()
+static struct addrinfo *unix_addrinfo(const char *path) {
+    struct addrinfo *ai = calloc(1, sizeof *ai + sizeof(struct sockaddr_un));
+    struct sockaddr_un *addr = (struct sockaddr_un *) (ai + 1);
+
+    if (strlen(path) >= sizeof addr->sun_path) {
+        free(ai);
+        return NULL;
+    }
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    ai->ai_family = AF_UNIX;
+    ai->ai_socktype = SOCK_STREAM;
+    ai->ai_addr = (struct sockaddr *) addr;
+    ai->ai_addrlen = sizeof *addr;
+    return ai;
+}
+
+/// Look up one server of the list the client was started with, spec is host, host:port, [v6addr]:port or
+/// unix:path and is cut up in place. Returns 0 or -1 having said why
+static int node_lookup(char *spec, xfer_node_t *node) {
+    struct addrinfo hints;
+    char *host = spec, *port = PORT, *colon;
+    int rv;
+
+    node->name = strdup(spec);
+    if (strncmp(spec, "unix:", 5) == 0) {
+        node->hostname = node->name;
+        if ((node->servinfo = unix_addrinfo(spec + 5)) == NULL) {
+            fprintf(stderr, "client: unix socket path too long\n");
+            return -1;
+        }
+        return 0;
+    }
+    if (host[0] == '[' && (colon = strchr(host, ']')) != NULL) {
+        host++;
+        *colon++ = '\0';
+        if (*colon == ':') {
+            port = colon + 1;
+        }
+    } else if ((colon = strchr(host, ':')) != NULL && strchr(colon + 1, ':') == NULL) {
+        *colon = '\0';
+        port = colon + 1;
+    }
+    node->hostname = host;
 
-/// get sockaddr, IPv4 or IPv6:
-void *get_in_addr(struct sockaddr *sa) {
-    if (sa->sa_family == AF_INET) {
-        return &(((struct sockaddr_in *) sa)->sin_addr);
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rv = getaddrinfo(host, port, &hints, &node->servinfo)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s: %s\n", node->name, gai_strerror(rv));
+        return -1;
     }
+    return 0;
+}
 
-    return &(((struct sockaddr_in6 *) sa)->sin6_addr);
+/// Print the prompt for the next command
+static void prompt(void) {
+    printf("Command(enter 'h' for help) :");
+    fflush(stdout);
 }
 
 /// Client starts execution here
 int main(int argc, char *argv[]) {
-    int sockfd, numbytes, firstTime = 1;
-    char buf[MAXDATASIZE];
-    struct addrinfo hints, *servinfo, *p;
-    int rv;
-    char s[INET6_ADDRSTRLEN];
+    xfer_node_t nodes[XFER_MAXNODES];
+    int nodeCount = 0, replicas = REPLICAS;
+    int opt, useTls = 0, useCache = 1, stall = STALLTIMEOUT;
+    char *cafile = NULL, *cacheDir = NULL, *batchFile = NULL;
 
-    /// If number of arguments equals one, print error and exit program
-    if (argc == 1) {
-        fprintf(stderr, "usage: client hostname\n");
+    /// -t turns on TLS, -c names the CA (or self-signed) certificate used to verify the server,
+    /// -d picks the download cache directory, -n turns the cache off and -b runs the commands in a file
+    /// (- for stdin) in batch mode, -w gives up on a server that makes no progress for that many seconds,
+    /// -r stores each upload on that many servers of a cluster
+    while ((opt = getopt(argc, argv, "tc:d:nb:w:r:")) != -1) {
+        switch (opt) {
+            case 't':
+                useTls = 1;
+                break;
+            case 'c':
+                useTls = 1;
+                cafile = optarg;
+                break;
+            case 'd':
+                cacheDir = optarg;
+                break;
+            case 'n':
+                useCache = 0;
+                break;
+            case 'b':
+                batchFile = optarg;
+                break;
+            case 'w':
+                stall = atoi(optarg);
+                break;
+            case 'r':
+                replicas = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: client [-t] [-c cafile] [-d cachedir | -n] [-b file] [-w seconds] [-r replicas] "
+                        "server[,server...]|shm:path\n");
+                exit(1);
+        }
+    }
+
+    /// If no server is given, print error and exit program
+    if (argc - optind == 0) {
+        fprintf(stderr, "usage: client [-t] [-c cafile] [-d cachedir | -n] [-b file] [-w seconds] [-r replicas] "
+                        "server[,server...]|shm:path\n");
         exit(1);
     }
-    /// If number of arguments is larger than 2 print error message and exit program
-    if (argc > 2) {
+    /// If more than one server list is given print error message and exit program
+    if (argc - optind > 1) {
         fprintf(stderr, "usage: too many arguments\n");
         exit(1);
     }
+    char *servers = argv[optind];
+    if (replicas < 1) {
+        fprintf(stderr, "usage: at least one replica\n");
+        exit(1);
+    }
 
-    while (1) {
-        memset(&hints, 0, sizeof hints);
-        hints.ai_family = AF_UNSPEC;
-        hints.ai_socktype = SOCK_STREAM;
+    /// Batch mode reads the commands from a file in place of the keyboard
+    int batch = batchFile != NULL;
+    if (batch && strcmp(batchFile, "-") != 0) {
+        int batchfd = open(batchFile, O_RDONLY | O_CLOEXEC);
+        if (batchfd == -1) {
+            perror(batchFile);
+            exit(1);
+        }
+        dup2(batchfd, STDIN_FILENO);
+        close(batchfd);
+    }
 
-        if ((rv = getaddrinfo(argv[1], PORT, &hints, &servinfo)) != 0) {
-            fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));    ///< if getaddrinfo fails print error message and exit program
-            return 1;
+    /// The servers of a cluster are listed with commas between them, each a hostname with an optional port
+    /// or unix:/path for a server on this host reached through its unix domain socket instead of TCP.
+    /// shm:/path connects there too and then moves the connection to shared memory rings, on its own only
+    int ring = strncmp(servers, "shm:", 4) == 0;
+    char *list = malloc(strlen(servers) + 2), *spec, *save;
+    sprintf(list, ring ? "unix:%s" : "%s", ring ? servers + 4 : servers);
+    for (spec = strtok_r(list, ",", &save); spec != NULL; spec = strtok_r(NULL, ",", &save)) {
+        if (nodeCount == XFER_MAXNODES || (ring && nodeCount == 1)) {
+            fprintf(stderr, "usage: too many servers\n");
+            exit(1);
         }
+        if (useTls && strncmp(spec, "unix:", 5) == 0) {
+            fprintf(stderr, "usage: TLS is not used over unix sockets\n");
+            exit(1);
+        }
+        if (node_lookup(spec, &nodes[nodeCount++]) == -1) {
+            return batch ? 2 : 1;
+        }
+    }
+    if (nodeCount == 0) {
+        fprintf(stderr, "usage: no server given\n");
+        exit(1);
+    }
 
-        // loop through all the results and connect to the first we can
-        for (p = servinfo; p != NULL; p = p->ai_next) {
-            if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
-                perror("client: socket");    ///< if client socket does not exist print error message and exit program
-                continue;
-            }
+    if (useTls && tls_client_init(cafile) == -1) {
+        fprintf(stderr, "client: failed to set up TLS\n");
+        exit(1);
+    }
 
-            if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
-                perror("client: connect");  ///< if client refuses or fails to connect print error message and close the socket file descriptor
-                close(sockfd);
-                continue;
-            }
-            break;
-        }
+    /// Downloads are cached per server or cluster, by default in ~/.cache/client
+    char cacheKey[1024], defaultDir[4096];
+    if (nodeCount == 1 && nodes[0].name == nodes[0].hostname) {
+        snprintf(cacheKey, sizeof cacheKey, "%s", nodes[0].name);     // unix:/path
+    } else if (nodeCount == 1 && strcmp(nodes[0].name, nodes[0].hostname) == 0) {
+        snprintf(cacheKey, sizeof cacheKey, "%s:%s", nodes[0].hostname, PORT);
+    } else {
+        snprintf(cacheKey, sizeof cacheKey, "%s", servers);
+    }
+    if (useCache && cacheDir == NULL && getenv("HOME") != NULL) {
+        snprintf(defaultDir, sizeof defaultDir, "%s/.cache", getenv("HOME"));
+        mkdir(defaultDir, 0700);
+        strncat(defaultDir, "/client", sizeof defaultDir - strlen(defaultDir) - 1);
+        cacheDir = defaultDir;
+    }
+    if (useCache && (cacheDir == NULL || cache_init(cacheDir) == -1)) {
+        useCache = 0;
+    }
 
-        if (p == NULL) {
-            fprintf(stderr, "client: failed to connect\n");     ///< print error if the client fails to connect
-            return 2;
-        }
+    /// Writing to a server that already hung up should fail the call, not kill the client
+    signal(SIGPIPE, SIG_IGN);
 
+    /// Every command runs as a transfer on its own non-blocking connection, all driven from this loop.
+    /// Batch mode pipelines every command on one connection and reports each as a JSON line. Shared memory
+    /// pipelines too, as only one connection at a time can be waited on by sleeping on its rings
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        perror("epoll_create1");
+        return 1;
+    }
+    xfer_config_t xconfig = {epfd, nodes, nodeCount, replicas, useTls, useCache ? cacheKey : NULL, batch || ring,
+                              batch, ring, stall * 1000};
+    int maxXfers = batch ? MAXPIPELINE : MAXXFERS;
+    xfer_init(&xconfig);
 
-        inet_ntop(p->ai_family, get_in_addr((struct sockaddr *) p->ai_addr), s, sizeof s);
-        // Only display on the first connection
-        if (firstTime == 1) {
-            printf("client: connecting to %s\n", s);
-            firstTime = 0;
-        }
+    /// Input is read into one buffer and split into lines, stdin is the event with no transfer attached
+    char *input = malloc(INPUTSIZE);
+    size_t inputLen = 0;
+    int inputOpen = 1, quitting = 0, watchingInput = 0;
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    struct epoll_event events[MAXEVENTS];
 
-        char *message;
-        size_t len = 0;
+    // A regular file or /dev/null can't be polled, it is simply always ready
+    int pollInput = epoll_ctl(epfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == 0;
+    if (pollInput) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+    }
 
-        // Client prompts user for a command
-        printf("Command(enter 'h' for help) :");
-        if (getline(&message, &len, stdin) == -1) {
-            fprintf(stderr, "usage: invalid\n");
-            exit(1);
+    // Client prompts user for a command
+    if (!batch) {
+        prompt();
+    }
+    while (1) {
+        // A batch gives up on the rest of its commands once the server can't be reached
+        if (batch && xfer_lost() > 0) {
+            quitting = 1;
         }
 
-#ifdef DEBUG
-        //This is debug use
-        printf("message is: %s", message);
-#endif
+        // Start every complete line already read while there is room for more transfers
+        char *eol;
+        while (!quitting && xfer_active() < maxXfers && (eol = memchr(input, '\n', inputLen)) != NULL) {
+            size_t lineLen = eol - input + 1;
+            char *message = calloc(lineLen + 1, 1);
+            memcpy(message, input, lineLen);
+            inputLen -= lineLen;
+            memmove(input, input + lineLen, inputLen);
 
-        // else if decision tree for processing user input
-        // Check for quit command
-        if (strcmp(message, "quit\n") == 0) {
-            /// Quit the client by ending the loop
-            printf("Quiting client\n");
-            break;
-        }
-            // Check for ls command
-        else if (strcmp(message, "ls\n") == 0) {
-#ifdef DEBUG
-            printf("sending ls command\n");
-#endif
-            // 'encode' ls to L
-            strcpy(message, "L\n");
-        }
-            // Check for check command
-        else if (strncmp(message, "check\n", 4) == 0) {
-            // Change message from starting with check to C
-            for (int j = 0; j < 4; j++) {
-                for (int i = 1; i < MAXDATASIZE; i++) {
-                    message[i - 1] = message[i];
+            // Check for quit command
+            if (strcmp(message, "quit\n") == 0) {
+                /// Quit the client once the commands still running are done, watches and follows never are
+                if (!batch) {
+                    printf("Quiting client\n");
                 }
-            }
-            message[0] = 'C';
-        }
-            // check for help command then print helpful list of commands then restart loop
-        else if (strcmp(message, "h\n") == 0) {
-            printf("quit     - quit this client program and exit to the console.\n");
-            printf("check    - check if file exists in current directory.\n");
-            printf("ls       - print the contents of the current directory to the current console\n");
-            printf("display  - this attempts to display the contents of a file\n");
-            printf("download - This downloads the named file to the client directory\n");
-            printf("h        - prints this help page\n");
-            continue;
-        }
-            // Check for display command
-        else if (strncmp(message, "display\n", 7) == 0) {
-            // Check if display has any arguments
-            if (message[7] == '\n') {
-                printf("display command has no argument \n");
-                continue;
+                quitting = 1;
+                free(message);
+                break;
             }
 
-            // Shift message to the left then replace first character with P
-            for (int j = 0; j < 6; j++) {
-                for (int i = 1; i < MAXDATASIZE; i++) {
-                    message[i - 1] = message[i];
+            if (!batch) {
+                int download = 0;
+                char *command = strdup(message);
+                if ((message = encode_command(message, useCache ? cacheKey : NULL, &download, stdout)) != NULL) {
+                    xfer_start(message, command, download);
+                    free(message);
                 }
+                free(command);
+                prompt();
+                continue;
             }
-            message[0] = 'P';
-        }
-            // Check for download command
-        else if (strncmp(message, "download\n", 8) == 0) {
-            if (message[8] == '\n') {
-                printf("download command has no argument \n");
+
+            /// Batch mode skips blank lines, comments and help, and reports commands refused here as errors
+            if (message[strspn(message, " \t\n")] == '\0' || message[0] == '#' || strcmp(message, "h\n") == 0) {
+                free(message);
                 continue;
             }
-            // Shift message to the left then replace first character with D
-            for (int j = 0; j < 7; j++) {
-                for (int i = 1; i < MAXDATASIZE; i++) {
-                    message[i - 1] = message[i];
-                }
+            int download = 0;
+            char *command = strdup(message), *refusal = NULL;
+            size_t refusalLen = 0;
+            FILE *out = open_memstream(&refusal, &refusalLen);
+            if ((message = encode_command(message, useCache ? cacheKey : NULL, &download, out)) != NULL) {
+                xfer_start(message, command, download);
+                free(message);
+            }
+            fclose(out);
+            if (message == NULL) {
+                xfer_report(command, refusal);
             }
-            message[0] = 'D';
+            free(refusal);
+            free(command);
         }
-            // Print this if command is not recognized then restart loop
-        else {
-            printf("Command not recognized\n");
-            close(sockfd);
-            continue;
+
+        if (quitting || (!inputOpen && memchr(input, '\n', inputLen) == NULL)) {
+            if (quitting) {
+                xfer_stop();
+            }
+            if (xfer_active() == 0) {
+                break;
+            }
         }
 
-#ifdef DEBUG
-        // Print the message being sent to server for debugging purposes
-        printf(" message to send %s\n", message);
-#endif
+        // Only wait for input while there is room to act on it
+        int wantInput = !quitting && inputOpen && xfer_active() < maxXfers && memchr(input, '\n', inputLen) == NULL;
+        if (pollInput && wantInput != watchingInput) {
+            epoll_ctl(epfd, wantInput ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, STDIN_FILENO, &ev);
+            watchingInput = wantInput;
+        }
 
-        // Send message to server
-        if (message != NULL) {
-            send(sockfd, message, strlen(message), 0);
+        int timeout = xfer_busy() ? 0 : (xfer_active() > 0 ? PROGRESSMS : -1);
+        long due = xfer_due();
+        if (due >= 0 && (timeout == -1 || due < timeout)) {
+            timeout = (int) due;
         }
+        int n = 0;
+        if (wantInput && !pollInput) {
+            timeout = 0;
+            events[n++] = ev;
+        }
+        int ready = xfer_wait(events + n, MAXEVENTS - n, timeout);
+        if (ready == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        n += ready > 0 ? ready : 0;
 
-        pid_t child_pd, parent_pid;
-        int status = 0;
-        // Child process listens for message from server
-        if ((child_pd = fork()) == 0) {
-
-            if (strncmp(message, "P \n", 2) == 0) {
-                do {
-                    if ((numbytes = read(sockfd, buf, MAXDATASIZE - 1)) == -1) {
-                        perror("recv");
-                        exit(1);
-                    }
-                    buf[numbytes] = '\0';   // This terminates the string
-                    printf("%s", buf);
-                } while (numbytes > 0);
-
-                close(sockfd);
-                exit(0);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr != NULL) {
+                xfer_event(events[i].data.ptr, events[i].events);
+                continue;
             }
-            if (strncmp(message, "D \n", 2) == 0) {
-                FILE *filePtr;
-                for (int j = 0; j < 2; j++) {
-                    for (int i = 1; i < MAXDATASIZE; i++) {
-                        message[i - 1] = message[i];
-                    }
+            ssize_t got = read(STDIN_FILENO, input + inputLen, INPUTSIZE - inputLen);
+            if (got > 0) {
+                inputLen += got;
+            } else if (got == 0 || errno != EINTR) {
+                inputOpen = 0;
+                if (inputLen > 0 && inputLen < INPUTSIZE && input[inputLen - 1] != '\n') {
+                    input[inputLen++] = '\n';     // a last line without a newline still counts
                 }
-                char plsMsg[strlen(message) + 1];
-                strcpy(plsMsg, message);
-                plsMsg[strcspn(plsMsg, "\n\r")] = '\0';
-#ifdef DEBUG
-                printf("file will be name %s\n", plsMsg);
-#endif
-                filePtr = fopen(plsMsg, "w");
-                do {
-                    if ((numbytes = read(sockfd, buf, MAXDATASIZE - 1)) == -1) {
-                        perror("recv");
-                        exit(1);
-                    }
-                    buf[numbytes] = '\0';   // This terminates the string
-                    if (strcmp("File not Found\0", buf) == 0) {
-                        break;
-                    }
-                    fprintf(filePtr, "%s", buf);
-                } while (numbytes > 0);
-
-                free(message);
-                fclose(filePtr);
-                close(sockfd);
-                exit(0);
             }
-
-            // Receive message from server
-            if ((numbytes = recv(sockfd, buf, MAXDATASIZE - 1, 0)) == -1) {
-                perror("recv");
-                exit(1);
+            if (inputLen == INPUTSIZE && memchr(input, '\n', inputLen) == NULL) {
+                fprintf(stderr, "usage: command too long\n");
+                inputLen = 0;
             }
-
-            buf[numbytes] = '\0';   // This terminates the string
-            printf("client: received '%s'\n", buf);
-            close(sockfd);
-            exit(0);
         }
-        memset(&message, 0, sizeof(message));
+        xfer_resume();
+        xfer_progress();
+    }
 
-        // Parent waits for child process to finish
-        while ((parent_pid = wait(&status)) > 0);
-        close(sockfd);
+    free(input);
+    close(epfd);
+    for (int n = 0; n < nodeCount; n++) {
+        if (strncmp(nodes[n].name, "unix:", 5) == 0) {
+            free(nodes[n].servinfo);
+        } else {
+            freeaddrinfo(nodes[n].servinfo); // all done with this structure
+        }
+        free((char *) nodes[n].name);
     }
-    freeaddrinfo(servinfo); // all done with this structure
+    free(list);
 
-    close(sockfd);
+    /// Batch mode exits with 2 if the server could not be reached, 1 if any command failed and 0 otherwise
+    if (batch) {
+        return xfer_lost() > 0 ? 2 : (xfer_failed() > 0 ? 1 : 0);
+    }
+    if (!quitting) {
+        fprintf(stderr, "usage: invalid\n");    // input ended without quit
+        exit(1);
+    }
     return 0;
 }
-
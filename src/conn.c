@@ -0,0 +1,657 @@
+/*
+** conn.c -- socket I/O shared by the client and server, plaintext or TLS
+*/
+
+#define _GNU_SOURCE     ///< splice()
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "conn.h"
+#include "tls.h"
+#include "ring.h"
+
+#define BOUNCESIZE 16384 ///< Size of one TLS record, used when file data must pass through user space
+
+#define PIPESIZE 1048576 ///< Pipe capacity requested for splice(), the kernel may grant less
+
+#define MAXFRAME 1073741824 ///< File data is split into DATA frames of at most this many bytes
+
+#define SMALLFILE 8192  ///< File data up to this size is read and sent with its frame header in one sendmsg()
+
+/// What holds reply data back on a plaintext socket until the reply ends
+enum { HELD_NONE, HELD_MORE, HELD_CORK };
+
+/// Fill in a frame header
+void frame_header(char *header, int type, uint32_t length) {
+    uint32_t be = htonl(length);
+
+    header[0] = (char) type;
+    header[1] = header[2] = header[3] = 0;
+    memcpy(header + 4, &be, sizeof be);
+}
+
+/// Read a frame header, returns the payload length and leaves the type in *type
+uint32_t frame_parse(const char *header, int *type) {
+    uint32_t be;
+
+    *type = (unsigned char) header[0];
+    memcpy(&be, header + 4, sizeof be);
+    return ntohl(be);
+}
+
+/// A call on the connection failed, note whether a deadline set with conn_set_timeout() was behind it.
+/// Returns -1
+static ssize_t conn_failed(conn_t *c) {
+    if (errno == EAGAIN) {
+        c->timedOut = 1;
+    }
+    return -1;
+}
+
+/// Send all len bytes of buf, flags are extra send() flags for plaintext sockets. Returns len or -1 on error
+static ssize_t send_all(conn_t *c, const void *buf, size_t len, int flags) {
+    const char *p = buf;
+    size_t left = len;
+
+    while (left > 0) {
+        ssize_t n;
+        if (c->ring != NULL) {
+            n = ring_write(c, p, left);
+        } else if (c->tls != NULL) {
+            n = tls_write(c, p, left);
+        } else {
+            n = send(c->fd, p, left, MSG_NOSIGNAL | flags);
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return conn_failed(c);
+        }
+        p += n;
+        left -= n;
+    }
+    return len;
+}
+
+/// Send all of the cnt pieces in iov with one sendmsg() when the socket takes them, a plaintext socket only.
+/// iov is used up as it goes. Returns 0 or -1 on error
+static int send_iov(conn_t *c, struct iovec *iov, int cnt, int flags) {
+    struct msghdr msg = {NULL, 0, iov, cnt, NULL, 0, 0};
+
+    while (msg.msg_iovlen > 0) {
+        ssize_t n = sendmsg(c->fd, &msg, MSG_NOSIGNAL | flags);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return conn_failed(c);
+        }
+        while (msg.msg_iovlen > 0 && (size_t) n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/// Send what MSG_MORE or TCP_CORK held back now, before waiting for the peer who may be waiting for it.
+/// Turning TCP_NODELAY on pushes out what is queued even when it already was on
+static void conn_push(conn_t *c) {
+    int off = 0, on = 1;
+
+    if (c->held == HELD_CORK) {
+        setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &off, sizeof off);
+    } else if (c->held == HELD_MORE) {
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+    }
+    c->held = HELD_NONE;
+}
+
+/// Send a frame header, telling the kernel the payload follows so both leave in the same segment
+static int send_header(conn_t *c, int type, size_t len) {
+    char header[FRAME_HEADER];
+
+    frame_header(header, type, len);
+    return send_all(c, header, sizeof header, MSG_MORE) == -1 ? -1 : 0;
+}
+
+/// Send one frame of the given type no matter whether the connection is framed, returns len or -1 on error.
+/// On a plaintext socket the header and payload go out together with sendmsg(), and every frame but the END
+/// or ERROR one is sent with MSG_MORE so the kernel fills segments with a reply and sends the rest with its
+/// status. Small frames for TLS or the rings are built in one buffer so they make one record
+ssize_t conn_send_frame(conn_t *c, int type, const void *buf, size_t len) {
+    char frame[BOUNCESIZE];
+
+    if (c->tls == NULL && c->ring == NULL) {
+        int last = type == FRAME_END || type == FRAME_ERROR;
+        struct iovec iov[2] = {{frame, FRAME_HEADER}, {(void *) buf, len}};
+        frame_header(frame, type, len);
+        if (send_iov(c, iov, len > 0 ? 2 : 1, last ? 0 : MSG_MORE) == -1) {
+            return -1;
+        }
+        if (!last) {
+            c->held = c->held == HELD_CORK ? HELD_CORK : HELD_MORE;
+        } else if (c->held == HELD_CORK) {
+            conn_push(c);   // the status went out without MSG_MORE, only a cork still holds anything back
+        } else {
+            c->held = HELD_NONE;
+        }
+        return len;
+    }
+
+    if (len <= sizeof frame - FRAME_HEADER) {
+        frame_header(frame, type, len);
+        memcpy(frame + FRAME_HEADER, buf, len);
+        return send_all(c, frame, FRAME_HEADER + len, 0) == -1 ? -1 : (ssize_t) len;
+    }
+    if (send_header(c, type, len) == -1) {
+        return -1;
+    }
+    return send_all(c, buf, len, 0);
+}
+
+/// Send all len bytes of buf, as a DATA frame on a framed connection. Returns len or -1 on error
+ssize_t conn_send(conn_t *c, const void *buf, size_t len) {
+    if (c->framed) {
+        return len > 0 ? conn_send_frame(c, FRAME_DATA, buf, len) : 0;
+    }
+    return send_all(c, buf, len, 0);
+}
+
+/// Send one frame with the file descriptor fd attached as SCM_RIGHTS, over a plain unix socket.
+/// Returns len or -1 on error
+ssize_t conn_send_fd(conn_t *c, int type, const void *buf, size_t len, int fd) {
+    char header[FRAME_HEADER];
+    char control[CMSG_SPACE(sizeof fd)];
+    struct iovec iov[2] = {{header, sizeof header}, {(void *) buf, len}};
+    struct msghdr msg = {NULL, 0, iov, 2, control, sizeof control, 0};
+
+    frame_header(header, type, len);
+    memset(control, 0, sizeof control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof fd);
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof fd);
+
+    ssize_t n;
+    do {
+        n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+    if (n != (ssize_t) (sizeof header + len)) {
+        return -1;  // a frame this small goes out whole on a unix socket
+    }
+    return len;
+}
+
+/// Receive one whole frame of at most max - 1 payload bytes from a plain blocking unix socket into buf as a
+/// string, with its type in *type and an attached file descriptor, if any, in *fd. The descriptor travels with
+/// the first byte of the frame, so the header is read with recvmsg(). Returns the length or -1
+ssize_t conn_recv_fd(conn_t *c, int *type, char *buf, size_t max, int *fd) {
+    char header[FRAME_HEADER];
+    char control[CMSG_SPACE(sizeof *fd)];
+    struct iovec iov = {header, sizeof header};
+    struct msghdr msg = {NULL, 0, &iov, 1, control, sizeof control, 0};
+
+    *fd = -1;
+    ssize_t n;
+    do {
+        n = recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    } while (n == -1 && errno == EINTR);
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); n > 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(fd, CMSG_DATA(cmsg), sizeof *fd);
+        }
+    }
+    if (n != sizeof header) {
+        return -1;
+    }
+
+    uint32_t len = frame_parse(header, type);
+    if (len > max - 1 || (len > 0 && recv(c->fd, buf, len, MSG_WAITALL) != (ssize_t) len)) {
+        if (*fd != -1) {
+            close(*fd);
+            *fd = -1;
+        }
+        return -1;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+/// Receive up to len bytes into buf, returns bytes read, 0 on end of stream or -1 on error
+ssize_t conn_recv(conn_t *c, void *buf, size_t len) {
+    ssize_t n;
+
+    if (c->held != HELD_NONE) {
+        conn_push(c);
+    }
+    do {
+        if (c->ring != NULL) {
+            n = ring_read(c, buf, len, 0);
+        } else if (c->tls != NULL) {
+            n = tls_read(c, buf, len);
+        } else {
+            n = recv(c->fd, buf, len, 0);
+        }
+    } while (n == -1 && errno == EINTR);
+    return n == -1 ? conn_failed(c) : n;
+}
+
+/// Receive one request line of at most max - 1 bytes into buf without reading past its newline, so the next
+/// request stays on the connection. The data is peeked at to find the newline and then only the line is read.
+/// Returns the length, 0 on end of stream or -1 on error
+ssize_t conn_recvline(conn_t *c, char *buf, size_t max) {
+    size_t len = 0;
+
+    if (c->held != HELD_NONE) {
+        conn_push(c);
+    }
+    while (len < max - 1) {
+        ssize_t n;
+        do {
+            if (c->ring != NULL) {
+                n = ring_read(c, buf + len, max - 1 - len, RING_PEEK);
+            } else if (c->tls != NULL) {
+                n = tls_peek(c, buf + len, max - 1 - len);
+            } else {
+                n = recv(c->fd, buf + len, max - 1 - len, MSG_PEEK);
+            }
+        } while (n == -1 && errno == EINTR);
+        if (n <= 0) {
+            if (n == -1 && len == 0) {
+                return conn_failed(c);
+            }
+            break;
+        }
+
+        char *newline = memchr(buf + len, '\n', n);
+        size_t take = newline != NULL ? (size_t) (newline - (buf + len)) + 1 : (size_t) n;
+        for (size_t got = 0; got < take;) {
+            ssize_t m = conn_recv(c, buf + len + got, take - got);
+            if (m <= 0) {
+                return -1;
+            }
+            got += m;
+        }
+        len += take;
+        if (newline != NULL) {
+            break;
+        }
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+/// Send count bytes of filefd starting at offset without copying through user space when possible.
+/// Plaintext sockets use sendfile(), TLS sockets use sendfile() through kTLS when the kernel took over
+/// record encryption and otherwise fall back to reading the file into a bounce buffer. Shared memory rings
+/// have the file read straight into them.
+static ssize_t sendfile_all(conn_t *c, int filefd, off_t offset, size_t count) {
+    size_t left = count;
+    char bounce[BOUNCESIZE];
+
+    if (c->ring != NULL) {
+        return ring_sendfile(c, filefd, offset, count);
+    }
+
+    while (left > 0) {
+        ssize_t n;
+        if (c->tls == NULL) {
+            n = sendfile(c->fd, filefd, &offset, left);
+        } else if (tls_ktls_send(c)) {
+            n = tls_sendfile(c, filefd, offset, left);
+            if (n > 0) {
+                offset += n;
+            }
+        } else {
+            n = pread(filefd, bounce, left < sizeof bounce ? left : sizeof bounce, offset);
+            if (n > 0) {
+                if (send_all(c, bounce, n, 0) == -1) {
+                    return -1;
+                }
+                offset += n;
+            }
+        }
+
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return conn_failed(c);
+        }
+        if (n == 0) {   // The file shrank underneath us
+            break;
+        }
+        left -= n;
+    }
+    return count - left;
+}
+
+/// Send count bytes of filefd starting at offset, in DATA frames on a framed connection. The frame length is
+/// promised up front, so a file that shrinks underneath us is made up with zeros. On a plaintext socket a
+/// small file is read and sent with its header by one sendmsg(), held back with MSG_MORE like any other
+/// frame, and a big one goes out under TCP_CORK so its last partial segment leaves with the status.
+/// Returns the number of bytes of the file that were sent or -1 on error
+ssize_t conn_sendfile(conn_t *c, int filefd, off_t offset, size_t count) {
+    if (!c->framed) {
+        return sendfile_all(c, filefd, offset, count);
+    }
+
+    if (c->tls == NULL && c->ring == NULL && count <= SMALLFILE) {
+        char header[FRAME_HEADER], data[SMALLFILE];
+        ssize_t n = pread(filefd, data, count, offset);
+        if (n == -1) {
+            return -1;
+        }
+        memset(data + n, 0, count - n);
+        frame_header(header, FRAME_DATA, count);
+        struct iovec iov[2] = {{header, FRAME_HEADER}, {data, count}};
+        if (send_iov(c, iov, 2, MSG_MORE) == -1) {
+            return -1;
+        }
+        c->held = c->held == HELD_CORK ? HELD_CORK : HELD_MORE;
+        return n;
+    }
+    if (c->tls == NULL && c->ring == NULL && c->held != HELD_CORK) {
+        int on = 1;
+        if (setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof on) == 0) {
+            c->held = HELD_CORK;
+        }
+    }
+
+    size_t done = 0;
+    while (done < count) {
+        size_t len = count - done < MAXFRAME ? count - done : MAXFRAME;
+        if (send_header(c, FRAME_DATA, len) == -1) {
+            return -1;
+        }
+        ssize_t n = sendfile_all(c, filefd, offset + done, len);
+        if (n == -1) {
+            return -1;
+        }
+        done += n;
+        if ((size_t) n < len) {
+            char zeros[BOUNCESIZE];
+            memset(zeros, 0, sizeof zeros);
+            for (size_t gap = len - n; gap > 0;) {
+                size_t z = gap < sizeof zeros ? gap : sizeof zeros;
+                if (send_all(c, zeros, z, 0) == -1) {
+                    return -1;
+                }
+                gap -= z;
+            }
+            break;
+        }
+    }
+    return done;
+}
+
+/// Receive count bytes from the connection and write them to filefd at offset. Plaintext sockets move the
+/// data socket -> pipe -> file with splice() so it never enters user space, TLS sockets are decrypted by
+/// OpenSSL and go through a bounce buffer. Returns the number of bytes stored, which is short if the peer
+/// hung up, or -1 on error
+ssize_t conn_recvfile(conn_t *c, int filefd, off_t offset, size_t count) {
+    size_t left = count;
+
+    if (c->held != HELD_NONE) {
+        conn_push(c);
+    }
+    if (c->ring != NULL) {
+        while (left > 0) {
+            ssize_t n = ring_recvfile(c, filefd, offset, left);
+            if (n == -1) {
+                return conn_failed(c);
+            }
+            if (n == 0) {
+                break;
+            }
+            offset += n;
+            left -= n;
+        }
+        return count - left;
+    }
+    if (c->tls != NULL) {
+        char bounce[BOUNCESIZE];
+        while (left > 0) {
+            ssize_t n = conn_recv(c, bounce, left < sizeof bounce ? left : sizeof bounce);
+            if (n == -1) {
+                return -1;
+            }
+            if (n == 0) {
+                break;
+            }
+            for (ssize_t done = 0; done < n;) {
+                ssize_t m = pwrite(filefd, bounce + done, n - done, offset);
+                if (m == -1) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return -1;
+                }
+                done += m;
+                offset += m;
+            }
+            left -= n;
+        }
+        return count - left;
+    }
+
+    int pfd[2];
+    if (pipe2(pfd, O_CLOEXEC) == -1) {
+        return -1;
+    }
+    fcntl(pfd[1], F_SETPIPE_SZ, PIPESIZE);     // A bigger pipe means fewer splice round trips
+
+    ssize_t rv = 0;
+    while (left > 0) {
+        ssize_t n = splice(c->fd, NULL, pfd[1], NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            rv = conn_failed(c);
+            break;
+        }
+        if (n == 0) {   // Peer hung up early
+            break;
+        }
+        left -= n;
+        while (n > 0) {
+            ssize_t m = splice(pfd[0], NULL, filefd, &offset, n, SPLICE_F_MOVE);
+            if (m == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                rv = -1;
+                break;
+            }
+            n -= m;
+        }
+        if (rv == -1) {
+            break;
+        }
+    }
+
+    close(pfd[0]);
+    close(pfd[1]);
+    return rv == -1 ? -1 : (ssize_t) (count - left);
+}
+
+/// Send as much of buf as a non-blocking socket takes right now, returns bytes sent or -1 on error
+/// (EAGAIN when the socket is full)
+ssize_t conn_trysend(conn_t *c, const void *buf, size_t len) {
+    ssize_t n;
+
+    do {
+        if (c->ring != NULL) {
+            n = ring_write(c, buf, len);
+        } else if (c->tls != NULL) {
+            n = tls_write(c, buf, len);
+        } else {
+            n = send(c->fd, buf, len, MSG_NOSIGNAL);
+        }
+    } while (n == -1 && errno == EINTR);
+    return n;
+}
+
+/// Send as much of count bytes of filefd at offset as a non-blocking socket takes right now, returns bytes
+/// sent, 0 if the file ended early, or -1 on error (EAGAIN when the socket is full)
+ssize_t conn_trysendfile(conn_t *c, int filefd, off_t offset, size_t count) {
+    char bounce[BOUNCESIZE];
+    ssize_t n;
+
+    do {
+        if (c->ring != NULL) {
+            n = ring_sendfile(c, filefd, offset, count);
+        } else if (c->tls == NULL) {
+            n = sendfile(c->fd, filefd, &offset, count);
+        } else if (tls_ktls_send(c)) {
+            n = tls_sendfile(c, filefd, offset, count);
+        } else {
+            // A refused record is offered again from the same offset, so it holds the same bytes
+            n = pread(filefd, bounce, count < sizeof bounce ? count : sizeof bounce, offset);
+            if (n > 0) {
+                n = tls_write(c, bounce, n);
+            }
+        }
+    } while (n == -1 && errno == EINTR);
+    return n;
+}
+
+/// Store up to count bytes that already arrived on a non-blocking socket into filefd at offset. Plaintext
+/// goes socket -> pipe -> file with splice() through one pipe kept for the whole process, which is always
+/// drained before returning. Returns bytes stored, 0 on end of stream or -1 on error (EAGAIN when nothing
+/// has arrived). Not for use from several threads at once
+ssize_t conn_tryrecvfile(conn_t *c, int filefd, off_t offset, size_t count) {
+    static int pfd[2] = {-1, -1};
+    ssize_t n;
+
+    if (c->ring != NULL) {
+        return ring_recvfile(c, filefd, offset, count);
+    }
+    if (c->tls != NULL) {
+        char bounce[BOUNCESIZE];
+        n = conn_recv(c, bounce, count < sizeof bounce ? count : sizeof bounce);
+        for (ssize_t done = 0; n > 0 && done < n;) {
+            ssize_t m = pwrite(filefd, bounce + done, n - done, offset + done);
+            if (m == -1 && errno != EINTR) {
+                return -1;
+            }
+            done += m > 0 ? m : 0;
+        }
+        return n;
+    }
+
+    if (pfd[0] == -1) {
+        if (pipe2(pfd, O_CLOEXEC) == -1) {
+            return -1;
+        }
+        fcntl(pfd[1], F_SETPIPE_SZ, PIPESIZE);
+    }
+    do {
+        n = splice(c->fd, NULL, pfd[1], NULL, count, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (n == -1 && errno == EINTR);
+
+    for (ssize_t left = n; left > 0;) {
+        ssize_t m = splice(pfd[0], NULL, filefd, &offset, left, SPLICE_F_MOVE);
+        if (m == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Whatever is stuck in the pipe belongs to nobody now
+            close(pfd[0]);
+            close(pfd[1]);
+            pfd[0] = pfd[1] = -1;
+            return -1;
+        }
+        left -= m;
+    }
+    return n;
+}
+
+/// Returns 1 if a receive would not block: data has arrived, or the other side hung up. TLS may hold on to
+/// data it already took off the socket
+int conn_readable(conn_t *c) {
+    struct pollfd pfd = {c->fd, POLLIN, 0};
+
+    if (c->ring != NULL) {
+        return ring_ready(c, EPOLLIN);
+    }
+    if (c->tls != NULL && tls_pending(c)) {
+        return 1;
+    }
+    return poll(&pfd, 1, 0) == 1;
+}
+
+/// Send reply data held back for a following frame now, for replies that go quiet before their END frame
+void conn_flush(conn_t *c) {
+    if (c->held != HELD_NONE) {
+        conn_push(c);
+    }
+}
+
+/// Have SIGIO raised in this process when data or a hangup arrives on the socket (on set), or no longer.
+/// Data sent through shared memory rings raises nothing, only the socket closing does
+void conn_notify(conn_t *c, int on) {
+    int flags = fcntl(c->fd, F_GETFL);
+
+    fcntl(c->fd, F_SETOWN, getpid());
+    fcntl(c->fd, F_SETFL, on ? flags | O_ASYNC : flags & ~O_ASYNC);
+}
+
+/// Blocking receives (reading set) or sends that make no progress for ms milliseconds fail with EAGAIN
+void conn_set_timeout(conn_t *c, int reading, int ms) {
+    struct timeval tv = {ms / 1000, (ms % 1000) * 1000};
+
+    if (c->ring != NULL) {
+        ring_timeout(c, reading, ms);
+        return;
+    }
+    setsockopt(c->fd, SOL_SOCKET, reading ? SO_RCVTIMEO : SO_SNDTIMEO, &tv, sizeof tv);
+}
+
+/// Close the connection and release its TLS session or shared memory rings
+void conn_close(conn_t *c) {
+    if (c->ring != NULL) {
+        ring_close(c);
+    }
+    if (c->tls != NULL) {
+        tls_close(c);
+    }
+    if (c->fd != -1) {
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+/// Close this process's copy of a connection that a forked process now owns, without ending the TLS session
+void conn_detach(conn_t *c) {
+    if (c->tls != NULL) {
+        tls_free(c);
+    }
+    if (c->fd != -1) {
+        close(c->fd);
+        c->fd = -1;
+    }
+}
@@ -0,0 +1,92 @@
+#ifndef CONN_H
+#define CONN_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/// Replies are a run of frames, each a FRAME_HEADER byte header (type, three zero bytes, big endian payload
+/// length) followed by the payload. Output travels in DATA frames and exactly one END or ERROR frame, whose
+/// payload is the status text, ends every reply so several commands can share a connection
+#define FRAME_HEADER 8
+#define FRAME_DATA 'D'      ///< command output
+#define FRAME_INFO 'I'      ///< status text in the middle of a reply ("Ready", "Modified <size> <mtime>")
+#define FRAME_END 'E'       ///< the command succeeded, ends the reply
+#define FRAME_ERROR 'X'     ///< the command failed, ends the reply
+#define FRAME_MAXTEXT 1024  ///< longest INFO, END or ERROR payload
+
+/// A connected stream socket, optionally carrying a TLS session
+typedef struct conn {
+    int fd;         ///< socket file descriptor
+    void *tls;      ///< TLS session (SSL *) or NULL when the connection is plaintext
+    int framed;     ///< conn_send() and conn_sendfile() wrap what they send in DATA frames
+    void *ring;     ///< shared memory rings (ring_t *) once the connection moved to them, NULL otherwise
+    int timedOut;   ///< a blocking call gave up at a deadline set with conn_set_timeout()
+    int held;       ///< reply data sent with MSG_MORE or under TCP_CORK may still be held back
+} conn_t;
+
+/// Fill in a frame header
+void frame_header(char *header, int type, uint32_t length);
+
+/// Read a frame header, returns the payload length and leaves the type in *type
+uint32_t frame_parse(const char *header, int *type);
+
+/// Send all len bytes of buf, returns len or -1 on error
+ssize_t conn_send(conn_t *c, const void *buf, size_t len);
+
+/// Receive up to len bytes into buf, returns bytes read, 0 on end of stream or -1 on error
+ssize_t conn_recv(conn_t *c, void *buf, size_t len);
+
+/// Receive one request line of at most max - 1 bytes into buf without reading past its newline, so the next
+/// request stays on the connection. Returns the length, 0 on end of stream or -1 on error
+ssize_t conn_recvline(conn_t *c, char *buf, size_t max);
+
+/// Send one frame of the given type no matter whether the connection is framed, returns len or -1 on error
+ssize_t conn_send_frame(conn_t *c, int type, const void *buf, size_t len);
+
+/// Send one frame with the file descriptor fd attached, over a plain unix socket. Returns len or -1 on error
+ssize_t conn_send_fd(conn_t *c, int type, const void *buf, size_t len, int fd);
+
+/// Receive one whole frame of at most max - 1 payload bytes from a plain blocking unix socket into buf as a
+/// string, with its type in *type and an attached file descriptor, if any, in *fd. Returns the length or -1
+ssize_t conn_recv_fd(conn_t *c, int *type, char *buf, size_t max, int *fd);
+
+/// Send count bytes of filefd starting at offset without copying through user space when possible,
+/// returns the number of bytes sent or -1 on error
+ssize_t conn_sendfile(conn_t *c, int filefd, off_t offset, size_t count);
+
+/// Receive count bytes into filefd at offset without copying through user space when possible,
+/// returns the number of bytes stored (short if the peer hung up) or -1 on error
+ssize_t conn_recvfile(conn_t *c, int filefd, off_t offset, size_t count);
+
+/// Send as much of buf as a non-blocking socket takes right now, returns bytes sent or -1 on error
+/// (EAGAIN when the socket is full)
+ssize_t conn_trysend(conn_t *c, const void *buf, size_t len);
+
+/// Send as much of count bytes of filefd at offset as a non-blocking socket takes right now, returns bytes
+/// sent, 0 if the file ended early, or -1 on error (EAGAIN when the socket is full)
+ssize_t conn_trysendfile(conn_t *c, int filefd, off_t offset, size_t count);
+
+/// Store up to count bytes that already arrived on a non-blocking socket into filefd at offset,
+/// returns bytes stored, 0 on end of stream or -1 on error (EAGAIN when nothing has arrived)
+ssize_t conn_tryrecvfile(conn_t *c, int filefd, off_t offset, size_t count);
+
+/// Returns 1 if a receive would not block: data has arrived, or the other side hung up
+int conn_readable(conn_t *c);
+
+/// Send reply data held back for a following frame now, for replies that go quiet before their END frame
+void conn_flush(conn_t *c);
+
+/// Have SIGIO raised in this process when data or a hangup arrives on the socket (on set), or no longer
+void conn_notify(conn_t *c, int on);
+
+/// Make blocking receives (reading set) or sends that make no progress for ms milliseconds fail with EAGAIN,
+/// 0 waits forever. Shared memory rings get the same limit
+void conn_set_timeout(conn_t *c, int reading, int ms);
+
+/// Close the connection and release its TLS session or shared memory rings
+void conn_close(conn_t *c);
+
+/// Close this process's copy of a connection that a forked process now owns, without ending the TLS session
+void conn_detach(conn_t *c);
+
+#endif
@@ -0,0 +1,158 @@
+/*
+** digest.c -- streaming XXH64 content digest
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "digest.h"
+
+#define P1 0x9E3779B185EBCA87ULL    ///< XXH64 primes
+#define P2 0xC2B2AE3D27D4EB4FULL
+#define P3 0x165667B19E3779F9ULL
+#define P4 0x85EBCA77C2B2AE63ULL
+#define P5 0x27D4EB2F165667C5ULL
+
+#define READSIZE 65536  ///< Chunk size used when hashing file data
+
+static uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input) {
+    acc += input * P2;
+    acc = rotl(acc, 31);
+    return acc * P1;
+}
+
+static uint64_t merge64(uint64_t acc, uint64_t val) {
+    acc ^= round64(0, val);
+    return acc * P1 + P4;
+}
+
+/// Consume whole 32 byte stripes from p, returns the number of bytes used
+static size_t digest_stripes(digest_t *d, const unsigned char *p, size_t len) {
+    const unsigned char *start = p;
+    const unsigned char *end = p + (len & ~(size_t) 31);
+
+    while (p < end) {
+        d->v[0] = round64(d->v[0], read64(p));
+        d->v[1] = round64(d->v[1], read64(p + 8));
+        d->v[2] = round64(d->v[2], read64(p + 16));
+        d->v[3] = round64(d->v[3], read64(p + 24));
+        p += 32;
+    }
+    return p - start;
+}
+
+/// Start a new digest
+void digest_init(digest_t *d) {
+    memset(d, 0, sizeof *d);
+    d->v[0] = P1 + P2;
+    d->v[1] = P2;
+    d->v[2] = 0;
+    d->v[3] = -P1;
+}
+
+/// Add len bytes of data to the digest
+void digest_update(digest_t *d, const void *data, size_t len) {
+    const unsigned char *p = data;
+
+    d->total += len;
+
+    // Top up a partial stripe left over from the previous call first
+    if (d->memsize > 0) {
+        size_t take = 32 - d->memsize < len ? 32 - d->memsize : len;
+        memcpy(d->mem + d->memsize, p, take);
+        d->memsize += take;
+        p += take;
+        len -= take;
+        if (d->memsize < 32) {
+            return;
+        }
+        digest_stripes(d, d->mem, 32);
+        d->memsize = 0;
+    }
+
+    size_t used = digest_stripes(d, p, len);
+    memcpy(d->mem, p + used, len - used);
+    d->memsize = len - used;
+}
+
+/// Add len bytes of filefd starting at offset to the digest, returns 0 or -1 on a read error
+int digest_update_fd(digest_t *d, int filefd, off_t offset, size_t len) {
+    unsigned char buf[READSIZE];
+
+    while (len > 0) {
+        ssize_t n = pread(filefd, buf, len < sizeof buf ? len : sizeof buf, offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        digest_update(d, buf, n);
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/// Return the digest of everything added so far, the state is left untouched
+uint64_t digest_final(const digest_t *d) {
+    uint64_t h;
+    const unsigned char *p = d->mem;
+    const unsigned char *end = d->mem + d->memsize;
+
+    if (d->total >= 32) {
+        h = rotl(d->v[0], 1) + rotl(d->v[1], 7) + rotl(d->v[2], 12) + rotl(d->v[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = merge64(h, d->v[i]);
+        }
+    } else {
+        h = P5;
+    }
+    h += d->total;
+
+    while (p + 8 <= end) {
+        h ^= round64(0, read64(p));
+        h = rotl(h, 27) * P1 + P4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t) read32(p) * P1;
+        h = rotl(h, 23) * P2 + P3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= *p * P5;
+        h = rotl(h, 11) * P1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/// Format a digest value as 16 hex digits into hex, which must hold DIGEST_HEXLEN bytes
+void digest_hex(uint64_t value, char *hex) {
+    snprintf(hex, DIGEST_HEXLEN, "%016llx", (unsigned long long) value);
+}
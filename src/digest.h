@@ -0,0 +1,33 @@
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define DIGEST_HEXLEN 17    ///< Room for a digest printed as 16 hex digits plus the null terminator
+
+/// Streaming 64 bit content digest (XXH64) so data can be hashed as it arrives
+typedef struct digest {
+    uint64_t v[4];          ///< the four lane accumulators
+    uint64_t total;         ///< bytes hashed so far
+    unsigned char mem[32];  ///< partial stripe carried between updates
+    size_t memsize;         ///< bytes used in mem
+} digest_t;
+
+/// Start a new digest
+void digest_init(digest_t *d);
+
+/// Add len bytes of data to the digest
+void digest_update(digest_t *d, const void *data, size_t len);
+
+/// Add len bytes of filefd starting at offset to the digest, returns 0 or -1 on a read error
+int digest_update_fd(digest_t *d, int filefd, off_t offset, size_t len);
+
+/// Return the digest of everything added so far, the state is left untouched
+uint64_t digest_final(const digest_t *d);
+
+/// Format a digest value as 16 hex digits into hex, which must hold DIGEST_HEXLEN bytes
+void digest_hex(uint64_t value, char *hex);
+
+#endif
@@ -0,0 +1,101 @@
+/*
+** hashring.c -- consistent hashing with virtual nodes, spreads files over the servers of a cluster
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashring.h"
+#include "digest.h"
+
+/// Position of len bytes of data on the ring
+static uint64_t ring_hash(const void *data, size_t len) {
+    digest_t digest;
+
+    digest_init(&digest);
+    digest_update(&digest, data, len);
+    return digest_final(&digest);
+}
+
+/// One point while the ring is sorted
+typedef struct point {
+    uint64_t at;
+    int owner;
+} point_t;
+
+static int compare_points(const void *a, const void *b) {
+    const point_t *p = a, *q = b;
+    if (p->at != q->at) {
+        return p->at < q->at ? -1 : 1;
+    }
+    return p->owner - q->owner;     // the same order whatever order the nodes were listed in
+}
+
+/// Build the ring for nodes named names[0..nodes-1], returns 0 or -1 when out of memory
+int hashring_init(hashring_t *r, const char *const *names, int nodes) {
+    size_t count = (size_t) nodes * HASHRING_VNODES;
+    point_t *points = malloc(count * sizeof *points);
+
+    r->points = malloc(count * sizeof *r->points);
+    r->owner = malloc(count * sizeof *r->owner);
+    if (points == NULL || r->points == NULL || r->owner == NULL) {
+        free(points);
+        hashring_free(r);
+        return -1;
+    }
+    for (int n = 0; n < nodes; n++) {
+        for (int v = 0; v < HASHRING_VNODES; v++) {
+            char label[1024];
+            int len = snprintf(label, sizeof label, "%s#%d", names[n], v);
+            points[n * HASHRING_VNODES + v] = (point_t) {ring_hash(label, len), n};
+        }
+    }
+    qsort(points, count, sizeof *points, compare_points);
+    for (size_t i = 0; i < count; i++) {
+        r->points[i] = points[i].at;
+        r->owner[i] = points[i].owner;
+    }
+    free(points);
+    r->count = count;
+    r->nodes = nodes;
+    return 0;
+}
+
+/// Fill order with the distinct nodes met going around the ring from key, the key's owner first and then
+/// the nodes its replicas go to. Returns how many, at most max
+int hashring_route(const hashring_t *r, const char *key, int *order, int max) {
+    uint64_t at = ring_hash(key, strlen(key));
+    size_t lo = 0, hi = r->count;
+    int found = 0;
+
+    // First point at or after the key, wrapping around to the start
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (r->points[mid] < at) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (size_t i = 0; i < r->count && found < max && found < r->nodes; i++) {
+        int node = r->owner[(lo + i) % r->count];
+        int seen = 0;
+        for (int j = 0; j < found && !seen; j++) {
+            seen = order[j] == node;
+        }
+        if (!seen) {
+            order[found++] = node;
+        }
+    }
+    return found;
+}
+
+/// Release the ring
+void hashring_free(hashring_t *r) {
+    free(r->points);
+    free(r->owner);
+    r->points = NULL;
+    r->owner = NULL;
+    r->count = 0;
+}
@@ -0,0 +1,30 @@
+#ifndef HASHRING_H
+#define HASHRING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define HASHRING_VNODES 128     ///< Points each node gets on the ring, more spread the keys more evenly
+
+/// Consistent hash ring. Every node owns HASHRING_VNODES points placed by hashing its name, and a key
+/// belongs to the node of the first point at or after the key's hash. The points only depend on the
+/// node's own name, so a node joining takes over keys only from the nodes before its points and a node
+/// leaving hands only its own keys on, about 1/n of them either way
+typedef struct hashring {
+    uint64_t *points;       ///< sorted positions on the ring
+    int *owner;             ///< node of each point
+    size_t count;
+    int nodes;
+} hashring_t;
+
+/// Build the ring for nodes named names[0..nodes-1], returns 0 or -1 when out of memory
+int hashring_init(hashring_t *r, const char *const *names, int nodes);
+
+/// Fill order with the distinct nodes met going around the ring from key, the key's owner first and then
+/// the nodes its replicas go to. Returns how many, at most max
+int hashring_route(const hashring_t *r, const char *key, int *order, int max);
+
+/// Release the ring
+void hashring_free(hashring_t *r);
+
+#endif
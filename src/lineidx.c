@@ -0,0 +1,267 @@
+/*
+** lineidx.c -- persistent line offset index so line ranges of big files are found in constant time
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "lineidx.h"
+#include "digest.h"
+
+#define LINEIDX_MAGIC 0x31584449454e494cULL ///< "LINEIDX1"
+
+#define TAILCHECK 4096      ///< Bytes before the old end of file that must be unchanged to extend the index
+
+#define BATCH 8192          ///< Offsets collected before they are written to the index file
+
+#define CHUNKSIZE 1048576   ///< Bytes of the file read at a time while scanning for newlines
+
+/// Digest of the last TAILCHECK bytes before end, used to recognise a file that was only appended to
+static uint64_t tail_digest(int filefd, uint64_t end) {
+    digest_t digest;
+    uint64_t start = end > TAILCHECK ? end - TAILCHECK : 0;
+
+    digest_init(&digest);
+    digest_update_fd(&digest, filefd, start, end - start);
+    return digest_final(&digest);
+}
+
+/// Write the batched offsets after the newlines already stored
+static int flush_offsets(int idxfd, const uint64_t *batch, size_t n, uint64_t *newlines) {
+    off_t at = sizeof(lineidx_header_t) + *newlines * sizeof(uint64_t);
+    size_t len = n * sizeof(uint64_t);
+
+    if (pwrite(idxfd, batch, len, at) != (ssize_t) len) {
+        return -1;
+    }
+    *newlines += n;
+    return 0;
+}
+
+/// Append the offset after every newline in bytes [from, to) of the file to the index. The file is read a
+/// chunk at a time rather than mapped, so one truncated during the scan ends it with an error instead of
+/// a SIGBUS. With SSE2 each chunk is compared against '\n' 16 bytes at a time and the hits are read out of
+/// the movemask bits
+static int scan_newlines(int idxfd, int filefd, uint64_t from, uint64_t to, uint64_t *newlines) {
+    uint64_t batch[BATCH];
+    size_t n = 0;
+
+    if (from >= to) {
+        return 0;
+    }
+    char *chunk = malloc(CHUNKSIZE);
+    if (chunk == NULL) {
+        return -1;
+    }
+    posix_fadvise(filefd, from, to - from, POSIX_FADV_SEQUENTIAL);
+
+    for (uint64_t offset = from; offset < to;) {
+        size_t want = to - offset < CHUNKSIZE ? to - offset : CHUNKSIZE;
+        ssize_t got = pread(filefd, chunk, want, offset);
+        if (got <= 0) {
+            // Shrank since it was stated, the offsets collected so far would not match the file
+            free(chunk);
+            return -1;
+        }
+
+        size_t i = 0, len = got;
+#ifdef __SSE2__
+        const __m128i newline = _mm_set1_epi8('\n');
+        for (; i + 16 <= len; i += 16) {
+            __m128i bytes = _mm_loadu_si128((const __m128i *) (chunk + i));
+            unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline));
+            if (n + 16 > BATCH) {
+                if (flush_offsets(idxfd, batch, n, newlines) == -1) {
+                    free(chunk);
+                    return -1;
+                }
+                n = 0;
+            }
+            while (mask != 0) {
+                batch[n++] = offset + i + __builtin_ctz(mask) + 1;
+                mask &= mask - 1;
+            }
+        }
+#endif
+        for (; i < len; i++) {
+            if (chunk[i] == '\n') {
+                if (n == BATCH) {
+                    if (flush_offsets(idxfd, batch, n, newlines) == -1) {
+                        free(chunk);
+                        return -1;
+                    }
+                    n = 0;
+                }
+                batch[n++] = offset + i + 1;
+            }
+        }
+        offset += len;
+    }
+
+    free(chunk);
+    return flush_offsets(idxfd, batch, n, newlines);
+}
+
+/// Open the index for the file open as filefd (with stat st), building it on first use, extending it
+/// when the file only grew and rebuilding it when it was rewritten. Index files live in cacheDir.
+/// Returns 0 or -1 on error
+int lineidx_open(lineidx_t *idx, const char *cacheDir, int filefd, const struct stat *st) {
+    char path[4096];
+    lineidx_header_t header;
+    uint64_t size = st->st_size;
+
+    memset(idx, 0, sizeof *idx);
+    snprintf(path, sizeof path, "%s/%llx-%llx", cacheDir, (unsigned long long) st->st_dev,
+             (unsigned long long) st->st_ino);
+    if ((idx->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1) {
+        return -1;
+    }
+
+    // Writers hold the lock exclusively while they bring the index up to date
+    flock(idx->fd, LOCK_EX);
+    int valid = pread(idx->fd, &header, sizeof header, 0) == sizeof header && header.magic == LINEIDX_MAGIC &&
+                header.dev == (uint64_t) st->st_dev && header.ino == (uint64_t) st->st_ino;
+
+    if (!valid || header.size != size || header.mtimeSec != st->st_mtim.tv_sec ||
+        header.mtimeNsec != st->st_mtim.tv_nsec) {
+        uint64_t from = 0, newlines = 0;
+
+        // A file that grew and still ends the same way where the index stopped was appended to,
+        // so only the new bytes need scanning
+        if (valid && size >= header.size && tail_digest(filefd, header.size) == header.tailDigest) {
+            from = header.size;
+            newlines = header.newlines;
+        }
+        if (ftruncate(idx->fd, sizeof header + newlines * sizeof(uint64_t)) == -1 ||
+            scan_newlines(idx->fd, filefd, from, size, &newlines) == -1) {
+            lineidx_close(idx);
+            return -1;
+        }
+
+        header.magic = LINEIDX_MAGIC;
+        header.dev = st->st_dev;
+        header.ino = st->st_ino;
+        header.size = size;
+        header.mtimeSec = st->st_mtim.tv_sec;
+        header.mtimeNsec = st->st_mtim.tv_nsec;
+        header.newlines = newlines;
+        header.tailDigest = tail_digest(filefd, size);
+        if (pwrite(idx->fd, &header, sizeof header, 0) != sizeof header) {
+            lineidx_close(idx);
+            return -1;
+        }
+        idx->grew = 1;
+    }
+    futimens(idx->fd, NULL);    // marks the index as used for lineidx_trim()
+
+    // Readers keep a shared lock so nobody truncates the index under the mapping
+    flock(idx->fd, LOCK_SH);
+    idx->mapLen = sizeof header + header.newlines * sizeof(uint64_t);
+    void *map = mmap(NULL, idx->mapLen, PROT_READ, MAP_SHARED, idx->fd, 0);
+    if (map == MAP_FAILED) {
+        idx->mapLen = 0;
+        lineidx_close(idx);
+        return -1;
+    }
+    idx->header = map;
+    idx->offsets = (const uint64_t *) (idx->header + 1);
+
+    uint64_t lastStart = header.newlines > 0 ? idx->offsets[header.newlines - 1] : 0;
+    idx->lines = header.newlines + (size > lastStart ? 1 : 0);
+    return 0;
+}
+
+/// Byte range [start, end) of lines first to last (1 based, inclusive) in constant time
+void lineidx_range(const lineidx_t *idx, uint64_t first, uint64_t last, off_t *start, off_t *end) {
+    *start = first <= 1 ? 0 : (off_t) idx->offsets[first - 2];
+    *end = last <= idx->header->newlines ? (off_t) idx->offsets[last - 1] : (off_t) idx->header->size;
+}
+
+/// Release the index
+void lineidx_close(lineidx_t *idx) {
+    if (idx->mapLen > 0) {
+        munmap((void *) idx->header, idx->mapLen);
+    }
+    if (idx->fd != -1) {
+        close(idx->fd);     // also drops the lock
+    }
+    memset(idx, 0, sizeof *idx);
+    idx->fd = -1;
+}
+
+/// An index file and when it was last used, for lineidx_trim()
+typedef struct indexed {
+    time_t used;
+    off_t size;
+    char name[40];
+} indexed_t;
+
+static int compare_used(const void *a, const void *b) {
+    const indexed_t *p = a, *q = b;
+    return p->used < q->used ? -1 : p->used > q->used;
+}
+
+/// Remove the indexes in cacheDir used longest ago until they take at most limit bytes. Every open marks
+/// its index as used, so this drops the least recently used, and the indexes of deleted or rotated files
+/// go first. A process still reading a removed index keeps its mapping
+void lineidx_trim(const char *cacheDir, long long limit) {
+    char path[4096];
+    struct stat st;
+    DIR *dir = opendir(cacheDir);
+    if (dir == NULL) {
+        return;
+    }
+
+    size_t count = 0, room = 64;
+    indexed_t *all = malloc(room * sizeof *all);
+    long long total = 0;
+    struct dirent *de;
+    while (all != NULL && (de = readdir(dir)) != NULL) {
+        // Index files are named <dev>-<ino> in hex, anything else in the directory is left alone
+        size_t dev = strspn(de->d_name, "0123456789abcdef");
+        if (dev == 0 || de->d_name[dev] != '-' || de->d_name[dev + 1] == '\0' ||
+            strlen(de->d_name) >= sizeof all->name ||
+            strspn(de->d_name + dev + 1, "0123456789abcdef") != strlen(de->d_name + dev + 1)) {
+            continue;
+        }
+        if (count == room) {
+            indexed_t *more = realloc(all, 2 * room * sizeof *all);
+            if (more == NULL) {
+                break;
+            }
+            all = more;
+            room *= 2;
+        }
+        snprintf(path, sizeof path, "%s/%s", cacheDir, de->d_name);
+        if (stat(path, &st) == -1) {
+            continue;
+        }
+        indexed_t *x = &all[count++];
+        strcpy(x->name, de->d_name);
+        x->used = st.st_mtime;
+        x->size = st.st_size;
+        total += x->size;
+    }
+    closedir(dir);
+
+    if (all != NULL && total > limit) {
+        qsort(all, count, sizeof *all, compare_used);
+        for (size_t i = 0; i < count && total > limit; i++) {
+            snprintf(path, sizeof path, "%s/%s", cacheDir, all[i].name);
+            unlink(path);
+            total -= all[i].size;
+        }
+    }
+    free(all);
+}
@@ -0,0 +1,44 @@
+#ifndef LINEIDX_H
+#define LINEIDX_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/// Index file header, followed by one uint64_t per newline holding the offset just after it
+typedef struct lineidx_header {
+    uint64_t magic;         ///< LINEIDX_MAGIC
+    uint64_t dev;           ///< device and inode of the indexed file
+    uint64_t ino;
+    uint64_t size;          ///< bytes of the file covered by the index
+    int64_t mtimeSec;       ///< modification time when the index was last brought up to date
+    int64_t mtimeNsec;
+    uint64_t newlines;      ///< offsets stored after the header
+    uint64_t tailDigest;    ///< digest of the last bytes covered, tells an append from a rewrite
+} lineidx_header_t;
+
+/// An open line index for one file
+typedef struct lineidx {
+    int fd;                         ///< the index file
+    const lineidx_header_t *header; ///< mapped header
+    const uint64_t *offsets;        ///< mapped newline offsets
+    size_t mapLen;                  ///< length of the mapping
+    uint64_t lines;                 ///< lines in the file, a final line without a newline included
+    int grew;                       ///< this open built or extended the index
+} lineidx_t;
+
+/// Open the index for the file open as filefd (with stat st), building it on first use, extending it
+/// when the file only grew and rebuilding it when it was rewritten. Index files live in cacheDir.
+/// Returns 0 or -1 on error
+int lineidx_open(lineidx_t *idx, const char *cacheDir, int filefd, const struct stat *st);
+
+/// Byte range [start, end) of lines first to last (1 based, inclusive) in constant time
+void lineidx_range(const lineidx_t *idx, uint64_t first, uint64_t last, off_t *start, off_t *end);
+
+/// Release the index
+void lineidx_close(lineidx_t *idx);
+
+/// Remove the least recently used indexes in cacheDir until they take at most limit bytes
+void lineidx_trim(const char *cacheDir, long long limit);
+
+#endif
@@ -0,0 +1,560 @@
+/*
+** manifest.c -- persistent memory mapped index of the served directory kept current with inotify
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+
+#include "manifest.h"
+#include "digest.h"
+
+#define MANIFEST_MAGIC 0x315453464e414d4dULL ///< "MMANFST1"
+
+#define MINCAPACITY 64      ///< Slots in the smallest table
+
+#define SPINLIMIT 1000      ///< Yields before an entry that stays odd is given up on, its writer died
+
+#define EVENTBUF 65536      ///< Bytes of inotify events read at a time
+
+/// Changes to the directory that can add, remove or change a name
+#define WATCHED (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB)
+
+enum { SLOT_EMPTY, SLOT_USED, SLOT_DELETED };
+
+/// Hash of a name, the content digest does well enough on short keys
+static uint64_t name_hash(const char *name, size_t len) {
+    digest_t digest;
+
+    digest_init(&digest);
+    digest_update(&digest, name, len);
+    return digest_final(&digest);
+}
+
+/// Bytes in a manifest file of capacity slots
+static size_t table_len(uint64_t capacity) {
+    return sizeof(manifest_header_t) + capacity * sizeof(manifest_entry_t);
+}
+
+/// Smallest table that holds n names at most half full
+static uint64_t capacity_for(uint64_t n) {
+    uint64_t capacity = MINCAPACITY;
+
+    while (capacity < 2 * n) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+/// Make seq odd so readers hold off. Returns -1 if it stayed odd, unless force takes it over anyway
+static int entry_begin(manifest_entry_t *e, int force) {
+    for (int spins = 0;; spins++) {
+        uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+        if (seq & 1) {
+            if (spins < SPINLIMIT) {
+                sched_yield();
+                continue;
+            }
+            if (!force) {
+                return -1;
+            }
+            seq++;      // whoever made it odd is gone
+        }
+        if (__atomic_compare_exchange_n(&e->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            return 0;
+        }
+    }
+}
+
+/// Make seq even again, publishing what was written
+static void entry_end(manifest_entry_t *e) {
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+}
+
+/// Copy an entry that may be changing, returns -1 if its writer never finished
+static int entry_copy(const manifest_entry_t *e, manifest_entry_t *out) {
+    uint32_t seq;
+
+    do {
+        int spins = 0;
+        while ((seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE)) & 1) {
+            if (++spins > SPINLIMIT) {
+                return -1;
+            }
+            sched_yield();
+        }
+        memcpy(out, e, sizeof *out);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq);
+    out->name[MANIFEST_NAMELEN - 1] = '\0';
+    return 0;
+}
+
+/// Make the table mapped at map (len bytes, file fd) the current one, dropping the old mapping
+static void install(manifest_t *m, int fd, void *map, size_t len) {
+    if (m->mapLen > 0) {
+        munmap(m->header, m->mapLen);
+    }
+    if (m->fd != -1) {
+        close(m->fd);
+    }
+    m->fd = fd;
+    m->header = map;
+    m->entries = (manifest_entry_t *) (m->header + 1);
+    m->mapLen = len;
+}
+
+/// Map the manifest file open as fd if it holds a whole table, returns 0 or -1
+static int map_table(manifest_t *m, int fd) {
+    manifest_header_t header;
+    struct stat st;
+
+    if (pread(fd, &header, sizeof header, 0) != sizeof header || header.magic != MANIFEST_MAGIC ||
+        header.capacity < MINCAPACITY || (header.capacity & (header.capacity - 1)) != 0 ||
+        fstat(fd, &st) == -1 || (uint64_t) st.st_size != table_len(header.capacity)) {
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    install(m, fd, map, st.st_size);
+    return 0;
+}
+
+/// Follow the table to its new file once a bigger one replaced it
+static int refresh(manifest_t *m) {
+    if (!__atomic_load_n(&m->header->stale, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    int fd = open(m->path, O_RDWR | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    if (map_table(m, fd) == -1) {
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+/// Find name in the current table without the seq protocol, only for the process that changes names.
+/// Returns the entry or NULL, and leaves the slot an insert would use in *slot
+static manifest_entry_t *lookup(manifest_t *m, const char *name, uint64_t hash, manifest_entry_t **slot) {
+    uint64_t mask = m->header->capacity - 1;
+
+    *slot = NULL;
+    for (uint64_t i = hash & mask;; i = (i + 1) & mask) {
+        manifest_entry_t *e = &m->entries[i];
+        if (e->state == SLOT_EMPTY) {
+            if (*slot == NULL) {
+                *slot = e;
+            }
+            return NULL;
+        }
+        if (e->state == SLOT_DELETED) {
+            if (*slot == NULL) {
+                *slot = e;
+            }
+        } else if (e->hash == hash && strcmp(e->name, name) == 0) {
+            return e;
+        }
+    }
+}
+
+/// Put an entry into a table nobody else sees yet
+static void table_insert(manifest_header_t *header, manifest_entry_t *entries, const manifest_entry_t *e) {
+    uint64_t mask = header->capacity - 1, i = e->hash & mask;
+
+    while (entries[i].state != SLOT_EMPTY) {
+        i = (i + 1) & mask;
+    }
+    entries[i] = *e;
+    entries[i].seq = 0;
+    entries[i].state = SLOT_USED;
+    header->used++;
+}
+
+/// Fill in what stat says about name, the digest is kept only while the file is unchanged
+static void fill_entry(manifest_entry_t *e, const char *name, uint64_t hash, const struct stat *st) {
+    if (e->ino != (uint64_t) st->st_ino || e->size != (uint64_t) st->st_size ||
+        e->mtimeSec != st->st_mtim.tv_sec || e->mtimeNsec != st->st_mtim.tv_nsec) {
+        e->hasDigest = 0;
+        e->digest = 0;
+    }
+    e->hash = hash;
+    e->size = st->st_size;
+    e->mtimeSec = st->st_mtim.tv_sec;
+    e->mtimeNsec = st->st_mtim.tv_nsec;
+    e->ino = st->st_ino;
+    e->mode = st->st_mode;
+    strcpy(e->name, name);
+}
+
+/// Read the served directory into *scan, the names with what stat says about them. Only reads the directory,
+/// so it can run on another thread than the one changing the table. Returns 0 or -1
+int manifest_scan(manifest_scan_t *scan) {
+    size_t capacity = 64;
+    struct dirent *de;
+    struct stat st;
+
+    memset(scan, 0, sizeof *scan);
+    DIR *d = opendir(".");
+    // The directory's mtime is taken first, a change made while it is read shows up as a newer one
+    if (d == NULL || fstat(dirfd(d), &scan->dir) == -1) {
+        if (d != NULL) {
+            closedir(d);
+        }
+        return -1;
+    }
+    if ((scan->items = malloc(capacity * sizeof *scan->items)) == NULL) {
+        closedir(d);
+        return -1;
+    }
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.' || strlen(de->d_name) >= MANIFEST_NAMELEN ||
+            fstatat(dirfd(d), de->d_name, &st, 0) == -1) {
+            continue;
+        }
+        if (scan->count == capacity) {
+            struct manifest_scanned *items = realloc(scan->items, 2 * capacity * sizeof *items);
+            if (items == NULL) {
+                break;
+            }
+            scan->items = items;
+            capacity *= 2;
+        }
+        if ((scan->items[scan->count].name = strdup(de->d_name)) == NULL) {
+            break;
+        }
+        scan->items[scan->count++].st = st;
+    }
+    closedir(d);
+    // Out of memory, a partial scan would drop names from the manifest
+    if (de != NULL) {
+        manifest_scan_free(scan);
+        return -1;
+    }
+    return 0;
+}
+
+/// Free what manifest_scan() read
+void manifest_scan_free(manifest_scan_t *scan) {
+    for (size_t i = 0; i < scan->count; i++) {
+        free(scan->items[i].name);
+    }
+    free(scan->items);
+    memset(scan, 0, sizeof *scan);
+}
+
+/// Write a table of capacity slots next to the manifest and rename it into place. With a scan the entries
+/// come from it, keeping the digests the old table has for unchanged files, otherwise the old table's
+/// entries move over and it is still catching up. Readers of the old table are told to follow. Returns 0
+/// or -1
+static int rebuild(manifest_t *m, uint64_t capacity, const manifest_scan_t *scan) {
+    char tmp[sizeof m->path + 4];
+
+    if (scan != NULL && capacity < capacity_for(scan->count)) {
+        capacity = capacity_for(scan->count);
+    }
+    size_t len = table_len(capacity);
+    snprintf(tmp, sizeof tmp, "%s.new", m->path);
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return -1;
+    }
+    manifest_header_t *header = MAP_FAILED;
+    if (ftruncate(fd, len) == -1 ||
+        (header = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    manifest_entry_t *entries = (manifest_entry_t *) (header + 1);
+    header->capacity = capacity;
+
+    if (scan != NULL) {
+        for (size_t i = 0; i < scan->count; i++) {
+            const char *name = scan->items[i].name;
+            manifest_entry_t e, *slot, *old = NULL;
+            uint64_t hash = name_hash(name, strlen(name));
+            if (m->header != NULL) {
+                old = lookup(m, name, hash, &slot);
+            }
+            if (old != NULL) {
+                e = *old;
+            } else {
+                memset(&e, 0, sizeof e);
+            }
+            fill_entry(&e, name, hash, &scan->items[i].st);
+            table_insert(header, entries, &e);
+        }
+        header->dev = scan->dir.st_dev;
+        header->ino = scan->dir.st_ino;
+        header->mtimeSec = scan->dir.st_mtim.tv_sec;
+        header->mtimeNsec = scan->dir.st_mtim.tv_nsec;
+    } else {
+        for (uint64_t i = 0; i < m->header->capacity; i++) {
+            if (m->entries[i].state == SLOT_USED) {
+                table_insert(header, entries, &m->entries[i]);
+            }
+        }
+        header->dev = m->header->dev;
+        header->ino = m->header->ino;
+        header->mtimeSec = m->header->mtimeSec;
+        header->mtimeNsec = m->header->mtimeNsec;
+        header->busy = 1;   // grown in the middle of a batch, the rest of it goes into the new table
+    }
+
+    header->magic = MANIFEST_MAGIC;
+    if (rename(tmp, m->path) == -1) {
+        munmap(header, len);
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    if (m->header != NULL) {
+        __atomic_store_n(&m->header->stale, 1, __ATOMIC_RELEASE);
+    }
+    install(m, fd, header, len);
+    return 0;
+}
+
+/// Map the manifest of the current directory kept in cacheDir. A manifest left for the same directory mtime
+/// is mapped as it is but left busy, since a file rewritten in place while the server was down does not
+/// change the directory's mtime; the caller verifies it with manifest_scan() and manifest_rescan(). Anything
+/// else is rebuilt from a scan that keeps the digests of unchanged files. The directory is watched from then
+/// on. Returns 0 or -1 on error
+int manifest_open(manifest_t *m, const char *cacheDir) {
+    struct stat dir;
+
+    memset(m, 0, sizeof *m);
+    m->fd = -1;
+    m->watchfd = -1;
+    if (stat(".", &dir) == -1) {
+        return -1;
+    }
+    snprintf(m->path, sizeof m->path, "%s/manifest-%llx-%llx", cacheDir, (unsigned long long) dir.st_dev,
+             (unsigned long long) dir.st_ino);
+
+    // Watching starts before the table is looked at so nothing that changes meanwhile is missed
+    m->watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m->watchfd == -1 || inotify_add_watch(m->watchfd, ".", WATCHED) == -1) {
+        manifest_close(m);
+        return -1;
+    }
+
+    int fd = open(m->path, O_RDWR | O_CLOEXEC);
+    if (fd != -1 && map_table(m, fd) == -1) {
+        close(fd);
+    }
+    manifest_header_t *h = m->header;
+    if (h != NULL && h->dev == (uint64_t) dir.st_dev && h->ino == (uint64_t) dir.st_ino && !h->busy &&
+        h->mtimeSec == dir.st_mtim.tv_sec && h->mtimeNsec == dir.st_mtim.tv_nsec) {
+        manifest_begin(m);
+        return 0;
+    }
+    manifest_scan_t scan;
+    if (manifest_scan(&scan) == -1) {
+        manifest_close(m);
+        return -1;
+    }
+    int rv = rebuild(m, capacity_for(h != NULL ? h->used : 0), &scan);
+    manifest_scan_free(&scan);
+    if (rv == -1) {
+        manifest_close(m);
+        return -1;
+    }
+    return 0;
+}
+
+/// Mark the table as catching up with the directory. Until manifest_settle() lookups go to the filesystem
+/// and a table left this way is rebuilt on the next start
+void manifest_begin(manifest_t *m) {
+    __atomic_store_n(&m->header->busy, 1, __ATOMIC_RELEASE);
+}
+
+/// Read the events waiting on the inotify descriptor, call when it is readable. pending is told every name
+/// that may have been created, modified or deleted, for manifest_apply(). Returns 1 if events were lost and
+/// only manifest_rescan() can tell what changed, otherwise 0
+int manifest_events(manifest_t *m, void (*pending)(const char *name)) {
+    char buf[EVENTBUF] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    int overflow = 0;
+
+    while ((n = read(m->watchfd, buf, sizeof buf)) > 0) {
+        for (char *p = buf; p < buf + n;) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                overflow = 1;
+            } else if (ev->len > 0 && ev->name[0] != '.' && strlen(ev->name) < MANIFEST_NAMELEN) {
+                pending(ev->name);
+            }
+            p += sizeof *ev + ev->len;
+        }
+    }
+    return overflow;
+}
+
+/// Bring the entry for name up to date with what stat said about it, st is NULL if the name is gone.
+/// Returns what happened to the name, 0 if nothing did
+int manifest_apply(manifest_t *m, const char *name, const struct stat *st) {
+    size_t len = strlen(name);
+
+    if (name[0] == '.' || len >= MANIFEST_NAMELEN) {
+        return 0;
+    }
+    uint64_t hash = name_hash(name, len);
+    manifest_entry_t *slot, *e = lookup(m, name, hash, &slot);
+
+    if (st == NULL) {
+        if (e != NULL) {
+            entry_begin(e, 1);
+            e->state = SLOT_DELETED;
+            entry_end(e);
+            m->header->used--;
+            m->header->deleted++;
+            return MANIFEST_DELETED;
+        }
+        return 0;
+    }
+    int change = MANIFEST_MODIFIED;
+    if (e == NULL) {
+        if ((m->header->used + m->header->deleted + 1) * 4 > m->header->capacity * 3) {
+            if (rebuild(m, capacity_for(m->header->used + 1), NULL) == -1) {
+                return 0;
+            }
+            lookup(m, name, hash, &slot);
+        }
+        e = slot;
+        if (e->state == SLOT_DELETED) {
+            m->header->deleted--;
+        }
+        m->header->used++;
+        entry_begin(e, 1);
+        e->ino = 0;     // nothing to keep from the name that was here
+        e->state = SLOT_USED;
+        change = MANIFEST_CREATED;
+    } else if (e->ino == (uint64_t) st->st_ino && e->size == (uint64_t) st->st_size && e->mode == st->st_mode &&
+               e->mtimeSec == st->st_mtim.tv_sec && e->mtimeNsec == st->st_mtim.tv_nsec) {
+        return 0;       // already up to date, say by an earlier event for the same write
+    } else {
+        entry_begin(e, 1);
+    }
+    fill_entry(e, name, hash, st);
+    entry_end(e);
+    return change;
+}
+
+/// Replace every entry with what scan read, after events were lost. Returns 0 or -1
+int manifest_rescan(manifest_t *m, const manifest_scan_t *scan) {
+    return rebuild(m, capacity_for(m->header->used), scan);
+}
+
+/// The table has caught up with the directory as it was when dir was taken, NULL if that is not known.
+/// The directory's mtime goes into the header so a restart can tell whether it changed since
+void manifest_settle(manifest_t *m, const struct stat *dir) {
+    if (dir != NULL) {
+        m->header->mtimeSec = dir->st_mtim.tv_sec;
+        m->header->mtimeNsec = dir->st_mtim.tv_nsec;
+    }
+    __atomic_store_n(&m->header->busy, 0, __ATOMIC_RELEASE);
+}
+
+/// Returns 1 if the manifest is in step with the directory, 0 while it is catching up and the filesystem
+/// has to be asked
+int manifest_ready(manifest_t *m) {
+    return m->header != NULL && refresh(m) == 0 && !__atomic_load_n(&m->header->busy, __ATOMIC_ACQUIRE);
+}
+
+/// The entry for name and a copy of it in *entry, or NULL with 0 in *found if there is none and -1 if the
+/// manifest cannot tell
+static manifest_entry_t *find_entry(manifest_t *m, const char *name, manifest_entry_t *entry, int *found) {
+    size_t len = strlen(name);
+
+    *found = -1;
+    if (name[0] == '.' || len >= MANIFEST_NAMELEN || !manifest_ready(m)) {
+        return NULL;
+    }
+    uint64_t hash = name_hash(name, len), mask = m->header->capacity - 1;
+    for (uint64_t i = hash & mask, probes = 0; probes <= mask; i = (i + 1) & mask, probes++) {
+        if (entry_copy(&m->entries[i], entry) == -1) {
+            return NULL;
+        }
+        if (entry->state == SLOT_EMPTY) {
+            break;
+        }
+        if (entry->state == SLOT_USED && entry->hash == hash && strcmp(entry->name, name) == 0) {
+            *found = 1;
+            return &m->entries[i];
+        }
+    }
+    *found = 0;
+    return NULL;
+}
+
+/// Copy the entry for name into *entry. Returns 1 if found, 0 if the directory has no such name or -1 if
+/// the manifest cannot answer and the filesystem has to be asked
+int manifest_find(manifest_t *m, const char *name, manifest_entry_t *entry) {
+    int found;
+
+    find_entry(m, name, entry, &found);
+    return found;
+}
+
+/// Copy the next entry in use from *slot on into *entry, start with *slot at 0. Returns 0 after the last
+int manifest_next(manifest_t *m, size_t *slot, manifest_entry_t *entry) {
+    if (m->header == NULL || (*slot == 0 && refresh(m) == -1)) {
+        return 0;
+    }
+    while (*slot < m->header->capacity) {
+        const manifest_entry_t *e = &m->entries[(*slot)++];
+        if (entry_copy(e, entry) == 0 && entry->state == SLOT_USED) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/// Remember the digest of name, worked out for the file as it was when st was taken
+void manifest_set_digest(manifest_t *m, const char *name, const struct stat *st, uint64_t digest) {
+    manifest_entry_t copy;
+    int found;
+    manifest_entry_t *e = find_entry(m, name, &copy, &found);
+
+    if (e == NULL || entry_begin(e, 0) == -1) {
+        return;
+    }
+    // Only if the entry still describes the file that was hashed
+    if (e->state == SLOT_USED && strcmp(e->name, name) == 0 && e->ino == (uint64_t) st->st_ino &&
+        e->size == (uint64_t) st->st_size && e->mtimeSec == st->st_mtim.tv_sec &&
+        e->mtimeNsec == st->st_mtim.tv_nsec) {
+        e->digest = digest;
+        e->hasDigest = 1;
+    }
+    entry_end(e);
+}
+
+/// Unmap the manifest and stop watching
+void manifest_close(manifest_t *m) {
+    if (m->mapLen > 0) {
+        munmap(m->header, m->mapLen);
+    }
+    if (m->fd != -1) {
+        close(m->fd);
+    }
+    if (m->watchfd != -1) {
+        close(m->watchfd);
+    }
+    memset(m, 0, sizeof *m);
+    m->fd = -1;
+    m->watchfd = -1;
+}
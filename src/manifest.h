@@ -0,0 +1,119 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define MANIFEST_NAMELEN 256    ///< Room for the longest name a directory entry can have plus the null terminator
+
+/// What happened to a name, as returned by manifest_apply() and told to watchers
+#define MANIFEST_CREATED 1
+#define MANIFEST_MODIFIED 2
+#define MANIFEST_DELETED 3
+#define MANIFEST_RESCANNED 4    ///< events were lost and the directory was read again, any name may have changed
+
+/// Manifest file header, followed by capacity entries making an open addressing hash table of names
+typedef struct manifest_header {
+    uint64_t magic;         ///< MANIFEST_MAGIC
+    uint64_t dev;           ///< device and inode of the served directory
+    uint64_t ino;
+    int64_t mtimeSec;       ///< modification time of the directory when the table last caught up with it
+    int64_t mtimeNsec;
+    uint64_t capacity;      ///< slots in the table, a power of two
+    uint64_t used;          ///< slots holding a name
+    uint64_t deleted;       ///< slots whose name was removed, probes go on past them
+    uint32_t busy;          ///< set while the table is being changed, a table left busy is rebuilt
+    uint32_t stale;         ///< set once a bigger table replaced this file, readers map the new one
+} manifest_header_t;
+
+/// One name in the served directory. seq is odd while the entry is being written, readers copy the
+/// entry and retry until they saw the same even seq before and after
+typedef struct manifest_entry {
+    uint32_t seq;
+    uint32_t state;         ///< empty, used or deleted
+    uint64_t hash;          ///< of the name
+    uint64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint64_t ino;
+    uint32_t mode;          ///< st_mode, so directories and other entries can be told from files
+    uint32_t hasDigest;     ///< 1 once digest has been worked out for this size and mtime
+    uint64_t digest;        ///< content digest, see digest.h
+    char name[MANIFEST_NAMELEN];
+} manifest_entry_t;
+
+/// The served directory's manifest. The server process keeps it up to date from inotify events and the
+/// children forked for connections read it through the same shared mapping
+typedef struct manifest {
+    char path[4096];                ///< the manifest file
+    int fd;
+    manifest_header_t *header;      ///< mapped table
+    manifest_entry_t *entries;
+    size_t mapLen;
+    int watchfd;                    ///< inotify descriptor the server polls, see manifest_events()
+} manifest_t;
+
+/// The served directory as read by manifest_scan()
+typedef struct manifest_scan {
+    struct stat dir;                ///< the directory itself, taken before it was read
+    struct manifest_scanned {
+        char *name;
+        struct stat st;
+    } *items;
+    size_t count;
+} manifest_scan_t;
+
+/// Map the manifest of the current directory kept in cacheDir. A manifest left for the same directory mtime
+/// is mapped but not trusted until manifest_rescan() verified it, see manifest_ready(). Anything else is
+/// rebuilt from a scan that keeps the digests of unchanged files. The directory is watched from then on.
+/// Returns 0 or -1 on error
+int manifest_open(manifest_t *m, const char *cacheDir);
+
+/// The server catches up with the directory in steps that can wait for the disk elsewhere: manifest_begin(),
+/// manifest_events() for the names that changed, manifest_apply() with what stat says about each, and
+/// manifest_settle(). While it does, lookups report that the filesystem has to be asked
+
+/// Mark the table as catching up with the directory, until manifest_settle()
+void manifest_begin(manifest_t *m);
+
+/// Read the events waiting on the inotify descriptor, call when it is readable. pending is told every name
+/// that may have been created, modified or deleted. Returns 1 if events were lost and only
+/// manifest_rescan() can tell what changed, otherwise 0
+int manifest_events(manifest_t *m, void (*pending)(const char *name));
+
+/// Bring the entry for name up to date with what stat said about it, st is NULL if the name is gone.
+/// Returns MANIFEST_CREATED, MANIFEST_MODIFIED, MANIFEST_DELETED or 0 if nothing changed
+int manifest_apply(manifest_t *m, const char *name, const struct stat *st);
+
+/// Read the served directory into *scan. Only reads the directory, so it can run on another thread than the
+/// one changing the table. Returns 0 or -1
+int manifest_scan(manifest_scan_t *scan);
+
+/// Free what manifest_scan() read
+void manifest_scan_free(manifest_scan_t *scan);
+
+/// Replace every entry with what scan read, after events were lost. Returns 0 or -1
+int manifest_rescan(manifest_t *m, const manifest_scan_t *scan);
+
+/// The table has caught up with the directory as it was when dir was taken, NULL if that is not known
+void manifest_settle(manifest_t *m, const struct stat *dir);
+
+/// Returns 1 if the manifest is in step with the directory, 0 while it is catching up
+int manifest_ready(manifest_t *m);
+
+/// Copy the entry for name into *entry. Returns 1 if found, 0 if the directory has no such name or -1 if
+/// the manifest cannot answer and the filesystem has to be asked
+int manifest_find(manifest_t *m, const char *name, manifest_entry_t *entry);
+
+/// Copy the next entry in use from *slot on into *entry, start with *slot at 0. Returns 0 after the last
+int manifest_next(manifest_t *m, size_t *slot, manifest_entry_t *entry);
+
+/// Remember the digest of name, worked out for the file as it was when st was taken
+void manifest_set_digest(manifest_t *m, const char *name, const struct stat *st, uint64_t digest);
+
+/// Unmap the manifest and stop watching
+void manifest_close(manifest_t *m);
+
+#endif
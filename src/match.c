@@ -0,0 +1,145 @@
+/*
+** match.c -- cached glob and regex name patterns for filtered directory listings
+*/
+
+#define _GNU_SOURCE     ///< memmem()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+
+#include "match.h"
+
+#define PATTERNCACHE 16 ///< Compiled patterns kept around for repeated queries
+
+static pattern_t cache[PATTERNCACHE];   ///< Compiled patterns, entries with text == NULL are free
+static unsigned long useClock = 0;      ///< Incremented on every lookup to order entries by last use
+
+/// Returns 1 if the len bytes at s contain none of the characters in special
+static int is_literal(const char *s, size_t len, const char *special) {
+    for (size_t i = 0; i < len; i++) {
+        if (strchr(special, s[i]) != NULL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/// Work out whether a glob is really a literal, prefix, suffix or substring test
+static void classify_glob(pattern_t *p) {
+    const char *t = p->text;
+    size_t len = strlen(t);
+    const char *special = "*?[\\";
+
+    if (len == 0 || strcmp(t, "*") == 0) {
+        p->kind = MATCH_ALL;
+    } else if (is_literal(t, len, special)) {
+        p->kind = MATCH_EXACT;
+        p->literal = strdup(t);
+    } else if (len > 2 && t[0] == '*' && t[len - 1] == '*' && is_literal(t + 1, len - 2, special)) {
+        p->kind = MATCH_SUBSTRING;
+        p->literal = strndup(t + 1, len - 2);
+    } else if (t[0] == '*' && is_literal(t + 1, len - 1, special)) {
+        p->kind = MATCH_SUFFIX;
+        p->literal = strdup(t + 1);
+    } else if (t[len - 1] == '*' && is_literal(t, len - 1, special)) {
+        p->kind = MATCH_PREFIX;
+        p->literal = strndup(t, len - 1);
+    } else {
+        p->kind = MATCH_GLOB;
+    }
+}
+
+/// Work out whether a regex is really a literal, prefix, suffix or substring test, compiling it if not
+static int classify_regex(pattern_t *p) {
+    const char *t = p->text;
+    size_t len = strlen(t);
+    const char *special = ".[]()*+?{}|^$\\";
+    int anchorStart = len > 0 && t[0] == '^';
+    int anchorEnd = len > (size_t) anchorStart && t[len - 1] == '$';
+    const char *body = t + anchorStart;
+    size_t bodyLen = len - anchorStart - anchorEnd;
+
+    if (len == 0 || strcmp(t, ".*") == 0) {
+        p->kind = MATCH_ALL;
+    } else if (is_literal(body, bodyLen, special)) {
+        p->kind = anchorStart ? (anchorEnd ? MATCH_EXACT : MATCH_PREFIX) : (anchorEnd ? MATCH_SUFFIX : MATCH_SUBSTRING);
+        p->literal = strndup(body, bodyLen);
+    } else {
+        p->kind = MATCH_REGEX;
+        if (regcomp(&p->re, t, REG_EXTENDED | REG_NOSUB) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/// Release everything an entry owns and mark it free
+static void pattern_free(pattern_t *p) {
+    if (p->kind == MATCH_REGEX) {
+        regfree(&p->re);
+    }
+    free(p->text);
+    free(p->literal);
+    memset(p, 0, sizeof *p);
+}
+
+/// Look up a compiled pattern in the cache, compiling and caching it on a miss. Returns NULL if a regex
+/// does not compile. The result stays valid until PATTERNCACHE other patterns have been looked up
+const pattern_t *pattern_get(const char *text, int regex) {
+    pattern_t *victim = &cache[0];
+
+    useClock++;
+    for (int i = 0; i < PATTERNCACHE; i++) {
+        if (cache[i].text != NULL && cache[i].regex == regex && strcmp(cache[i].text, text) == 0) {
+            cache[i].used = useClock;
+            return &cache[i];
+        }
+        if (cache[i].used < victim->used) {
+            victim = &cache[i];
+        }
+    }
+
+    if (victim->text != NULL) {
+        pattern_free(victim);
+    }
+    victim->text = strdup(text);
+    victim->regex = regex;
+    if (regex) {
+        if (classify_regex(victim) == -1) {
+            free(victim->text);
+            memset(victim, 0, sizeof *victim);
+            return NULL;
+        }
+    } else {
+        classify_glob(victim);
+    }
+    if (victim->literal != NULL) {
+        victim->literalLen = strlen(victim->literal);
+    }
+    victim->used = useClock;
+    return victim;
+}
+
+/// Returns 1 if name (of length len) matches the pattern. The literal kinds are a length check plus a
+/// memcmp()/memmem(), which glibc runs with vector instructions
+int pattern_match(const pattern_t *p, const char *name, size_t len) {
+    switch (p->kind) {
+        case MATCH_ALL:
+            return 1;
+        case MATCH_EXACT:
+            return len == p->literalLen && memcmp(name, p->literal, len) == 0;
+        case MATCH_PREFIX:
+            return len >= p->literalLen && memcmp(name, p->literal, p->literalLen) == 0;
+        case MATCH_SUFFIX:
+            return len >= p->literalLen && memcmp(name + len - p->literalLen, p->literal, p->literalLen) == 0;
+        case MATCH_SUBSTRING:
+            return memmem(name, len, p->literal, p->literalLen) != NULL;
+        case MATCH_GLOB:
+            return fnmatch(p->text, name, 0) == 0;
+        case MATCH_REGEX:
+            return regexec(&p->re, name, 0, NULL, 0) == 0;
+    }
+    return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef MATCH_H
+#define MATCH_H
+
+#include <stddef.h>
+#include <regex.h>
+
+/// How a pattern is matched, globs and regexes that boil down to a literal skip the general matcher
+typedef enum match_kind {
+    MATCH_ALL,          ///< matches every name
+    MATCH_EXACT,        ///< the whole name equals the literal
+    MATCH_PREFIX,       ///< the name starts with the literal
+    MATCH_SUFFIX,       ///< the name ends with the literal
+    MATCH_SUBSTRING,    ///< the literal appears anywhere in the name
+    MATCH_GLOB,         ///< general fnmatch() glob
+    MATCH_REGEX         ///< general POSIX extended regex
+} match_kind_t;
+
+/// A compiled name pattern
+typedef struct pattern {
+    char *text;         ///< pattern as given, the cache key together with regex
+    int regex;          ///< 1 if text is a regex, 0 for a glob
+    match_kind_t kind;  ///< how names are tested
+    char *literal;      ///< the literal for the MATCH_EXACT .. MATCH_SUBSTRING kinds
+    size_t literalLen;  ///< length of literal
+    regex_t re;         ///< compiled regex for MATCH_REGEX
+    unsigned long used; ///< last use, for evicting the least recently used entry
+} pattern_t;
+
+/// Look up a compiled pattern in the cache, compiling and caching it on a miss. Returns NULL if a regex
+/// does not compile. The result stays valid until PATTERNCACHE other patterns have been looked up
+const pattern_t *pattern_get(const char *text, int regex);
+
+/// Returns 1 if name (of length len) matches the pattern
+int pattern_match(const pattern_t *p, const char *name, size_t len);
+
+#endif
@@ -0,0 +1,179 @@
+/*
+** mcast.c -- multicast distribution of one file to many subscribers, repaired over their TCP connections
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "mcast.h"
+#include "digest.h"
+
+#define MCASTENDS 3         ///< The end marker is repeated this often, MCASTENDMS apart, in case one is lost
+#define MCASTENDMS 20
+
+#define MCASTRCVBUF 4194304 ///< Receive buffer asked for, a receiver busy writing must not drop datagrams
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_ns(long long ns) {
+    struct timespec ts = {ns / 1000000000LL, ns % 1000000000LL};
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+/// Session id of one version of a file, subscribers to the same name, size and mtime share a session
+uint32_t mcast_session(const char *name, const struct stat *st) {
+    digest_t digest;
+    int64_t version[3] = {st->st_size, st->st_mtim.tv_sec, st->st_mtim.tv_nsec};
+
+    digest_init(&digest);
+    digest_update(&digest, name, strlen(name));
+    digest_update(&digest, version, sizeof version);
+    return (uint32_t) digest_final(&digest);
+}
+
+/// Multicast group of a session, in 239.255.0.0/16 which is scoped to the site
+struct in_addr mcast_group(uint32_t session) {
+    struct in_addr group;
+    uint32_t host = (session ^ (session >> 16)) & 0xffff;
+
+    group.s_addr = htonl(0xefff0000u | (host == 0 || host == 0xffff ? 1 : host));
+    return group;
+}
+
+/// IPv4 interface multicast for the connection on sockfd goes over
+struct in_addr mcast_interface(int sockfd) {
+    struct sockaddr_storage local;
+    socklen_t len = sizeof local;
+    struct in_addr interface = {htonl(INADDR_ANY)};
+
+    if (getsockname(sockfd, (struct sockaddr *) &local, &len) == -1 || local.ss_family == AF_UNIX) {
+        interface.s_addr = htonl(INADDR_LOOPBACK);
+    } else if (local.ss_family == AF_INET) {
+        interface = ((struct sockaddr_in *) &local)->sin_addr;
+    } else if (local.ss_family == AF_INET6) {
+        struct in6_addr *a = &((struct sockaddr_in6 *) &local)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(a)) {
+            memcpy(&interface, a->s6_addr + 12, sizeof interface);
+        } else if (IN6_IS_ADDR_LOOPBACK(a)) {
+            interface.s_addr = htonl(INADDR_LOOPBACK);
+        }
+    }
+    return interface;
+}
+
+/// Number of datagrams carrying size bytes
+uint32_t mcast_count(off_t size) {
+    return (size + MCASTPAYLOAD - 1) / MCASTPAYLOAD;
+}
+
+static void mcast_header(char *datagram, uint32_t session, uint32_t seq, uint32_t count) {
+    uint32_t header[3] = {htonl(session), htonl(seq), htonl(count)};
+    memcpy(datagram, header, sizeof header);
+}
+
+/// Send size bytes of filefd as session to group through interface, at most rate bytes per second, after
+/// waiting MCASTGATHERMS for subscribers. A full socket buffer is waited out rather than dropping the datagram
+int mcast_send(int filefd, off_t size, uint32_t session, struct in_addr group, struct in_addr interface,
+               long long rate) {
+    struct sockaddr_in to;
+    char datagram[MCASTDATAGRAM];
+    unsigned char ttl = 1;
+
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("mcast: socket");
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &interface, sizeof interface);
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof ttl);
+    memset(&to, 0, sizeof to);
+    to.sin_family = AF_INET;
+    to.sin_port = htons(MCASTPORT);
+    to.sin_addr = group;
+
+    sleep_ns(MCASTGATHERMS * 1000000LL);
+
+    uint32_t count = mcast_count(size);
+    long long start = now_ns();
+    for (uint32_t seq = 0; seq < count; seq++) {
+        off_t offset = (off_t) seq * MCASTPAYLOAD;
+        size_t len = size - offset < MCASTPAYLOAD ? size - offset : MCASTPAYLOAD;
+        mcast_header(datagram, session, seq, count);
+        if (pread(filefd, datagram + MCASTHEADER, len, offset) != (ssize_t) len) {
+            perror("mcast: read");
+            close(fd);
+            return -1;
+        }
+        while (sendto(fd, datagram, MCASTHEADER + len, 0, (struct sockaddr *) &to, sizeof to) == -1) {
+            if (errno != ENOBUFS && errno != EAGAIN && errno != EINTR) {
+                perror("mcast: sendto");
+                close(fd);
+                return -1;
+            }
+            sleep_ns(100000);
+        }
+
+        // Keep to the rate, receivers that fall behind lose datagrams and have to ask for them again
+        long long due = start + (long long) ((offset + len) * 1e9 / rate);
+        long long ahead = due - now_ns();
+        if (ahead > 1000000) {
+            sleep_ns(ahead);
+        }
+    }
+
+    for (int i = 0; i < MCASTENDS; i++) {
+        mcast_header(datagram, session, count, count);
+        sendto(fd, datagram, MCASTHEADER, 0, (struct sockaddr *) &to, sizeof to);
+        sleep_ns(MCASTENDMS * 1000000LL);
+    }
+    close(fd);
+    return 0;
+}
+
+/// Non-blocking UDP socket joined to group on interface, or -1 on error. It is bound to the group address
+/// so it only sees that group's datagrams
+int mcast_join(struct in_addr group, struct in_addr interface) {
+    struct sockaddr_in addr;
+    struct ip_mreq mreq = {group, interface};
+    int yes = 1, size = MCASTRCVBUF;
+
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(MCASTPORT);
+    addr.sin_addr = group;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof addr) == -1 ||
+        setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof mreq) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/// Read the header of a datagram of len bytes, returns the payload length or -1 if it is not a datagram
+ssize_t mcast_parse(const char *datagram, size_t len, uint32_t *session, uint32_t *seq, uint32_t *count) {
+    uint32_t header[3];
+
+    if (len < MCASTHEADER || len > MCASTDATAGRAM) {
+        return -1;
+    }
+    memcpy(header, datagram, sizeof header);
+    *session = ntohl(header[0]);
+    *seq = ntohl(header[1]);
+    *count = ntohl(header[2]);
+    return len - MCASTHEADER;
+}
@@ -0,0 +1,43 @@
+#ifndef MCAST_H
+#define MCAST_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+/// A file many clients want at once goes out once as numbered datagrams to a multicast group. Each datagram
+/// is MCASTHEADER bytes of header (session, sequence number and datagram count, big endian) and up to
+/// MCASTPAYLOAD bytes of the file at sequence * MCASTPAYLOAD. Sequence number count marks the end, and
+/// receivers ask for what they missed over their TCP connection
+#define MCASTPORT 3503
+#define MCASTHEADER 12
+#define MCASTPAYLOAD 1400   ///< File bytes per datagram, fits an Ethernet frame
+#define MCASTDATAGRAM (MCASTHEADER + MCASTPAYLOAD)
+#define MCASTGATHERMS 250   ///< The sender waits this long after the first subscriber so others can join
+
+/// Session id of one version of a file, subscribers to the same name, size and mtime share a session
+uint32_t mcast_session(const char *name, const struct stat *st);
+
+/// Multicast group of a session, in 239.255.0.0/16
+struct in_addr mcast_group(uint32_t session);
+
+/// IPv4 interface multicast for the connection on sockfd goes over: its own address for IPv4, loopback
+/// for a unix socket or IPv6 loopback connection and the default otherwise
+struct in_addr mcast_interface(int sockfd);
+
+/// Number of datagrams carrying size bytes
+uint32_t mcast_count(off_t size);
+
+/// Send size bytes of filefd as session to group through interface, at most rate bytes per second, after
+/// waiting MCASTGATHERMS for subscribers. Returns 0 or -1 on error
+int mcast_send(int filefd, off_t size, uint32_t session, struct in_addr group, struct in_addr interface,
+               long long rate);
+
+/// Non-blocking UDP socket joined to group on interface, or -1 on error
+int mcast_join(struct in_addr group, struct in_addr interface);
+
+/// Read the header of a datagram of len bytes, returns the payload length or -1 if it is not a datagram
+ssize_t mcast_parse(const char *datagram, size_t len, uint32_t *session, uint32_t *seq, uint32_t *count);
+
+#endif
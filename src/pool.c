@@ -0,0 +1,80 @@
+/*
+** pool.c -- per worker free lists of I/O buffers in a few size classes
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+#define POOL_CLASSES 3
+
+static const size_t classSize[POOL_CLASSES] = {POOL_SMALL, POOL_MEDIUM, POOL_LARGE};
+
+/// A free buffer keeps the link to the next one in its first bytes
+typedef struct freebuf {
+    struct freebuf *next;
+} freebuf_t;
+
+static freebuf_t *freeList[POOL_CLASSES];
+static int freeCount[POOL_CLASSES];
+
+/// Class of a buffer of size bytes, or of the smallest one holding want bytes
+static int pool_class(size_t want) {
+    int c = 0;
+
+    while (c < POOL_CLASSES - 1 && classSize[c] < want) {
+        c++;
+    }
+    return c;
+}
+
+/// Take a buffer of the smallest class holding want bytes, or of the largest class. NULL without memory
+void *pool_get(size_t want, size_t *size) {
+    int c = pool_class(want);
+    freebuf_t *b = freeList[c];
+
+    if (b != NULL) {
+        freeList[c] = b->next;
+        freeCount[c]--;
+    } else if ((b = malloc(classSize[c])) == NULL) {
+        return NULL;
+    }
+    *size = classSize[c];
+    return b;
+}
+
+/// Give back a buffer of size bytes from pool_get()
+void pool_put(void *buf, size_t size) {
+    int c = pool_class(size);
+
+    if (buf == NULL) {
+        return;
+    }
+    if (freeCount[c] >= POOL_KEEP) {
+        free(buf);
+        return;
+    }
+    freebuf_t *b = buf;
+    b->next = freeList[c];
+    freeList[c] = b;
+    freeCount[c]++;
+}
+
+/// Move the first keep bytes of buf to a buffer of the next class up and give buf back. NULL without memory,
+/// buf and *size stay as they were
+void *pool_grow(void *buf, size_t *size, size_t keep) {
+    size_t bigger;
+
+    if (*size >= POOL_LARGE) {
+        return buf;
+    }
+    void *b = pool_get(*size + 1, &bigger);
+    if (b == NULL) {
+        return NULL;
+    }
+    memcpy(b, buf, keep);
+    pool_put(buf, *size);
+    *size = bigger;
+    return b;
+}
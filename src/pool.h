@@ -0,0 +1,26 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/// Reusable I/O buffers in three size classes. Every worker, a forked server child or the client's event
+/// loop, has its own free lists, so taking and giving back a buffer never locks. A connection starts on a
+/// small buffer and moves up a class when a transfer keeps filling it
+#define POOL_SMALL 4096
+#define POOL_MEDIUM 65536
+#define POOL_LARGE 1048576
+#define POOL_KEEP 8         ///< Free buffers kept per class, more go back to the system
+
+/// Take a buffer of the smallest class holding want bytes, or of the largest class, and leave its size in *size.
+/// Returns NULL without memory, *size is then left alone
+void *pool_get(size_t want, size_t *size);
+
+/// Give back a buffer of size bytes from pool_get(), NULL is ignored
+void pool_put(void *buf, size_t size);
+
+/// Move the first keep bytes of buf to a buffer of the next class up and give buf back. Returns the new
+/// buffer with its size in *size, or buf itself if it already is of the largest class. Returns NULL without
+/// memory, buf and *size are then left as they were
+void *pool_grow(void *buf, size_t *size, size_t keep);
+
+#endif
@@ -0,0 +1,567 @@
+/*
+** relay.c -- caching relay, serves clients with the server's protocol and fetches from one upstream server
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+
+#include "conn.h"
+#include "cache.h"
+#include "digest.h"
+
+#define PORT "3502"  ///< The port clients connect to, and the upstream server's unless one is given
+
+#define BACKLOG 10   ///< how many pending connections queue will hold
+
+#define CACHEDIR "/tmp/relay-cache" ///< Where fetched files are kept, -d changes it
+
+#define CACHELIMIT (1LL << 30) ///< Bytes of cached files kept before the least recently used go, -s changes it
+
+#define FRESHSECS 2 ///< A copy confirmed current this recently is served without asking upstream again
+
+#define UPSTREAMTIMEOUT 30000 ///< Milliseconds the upstream server may make no progress on a reply
+
+#define LINESIZE 65536 ///< Longest request line
+
+#define COPYSIZE 65536 ///< Bytes passed on at a time
+
+static char *upstreamHost, *upstreamPort = PORT;
+static char upstreamKey[1024];                      ///< names the upstream server in the cache
+static long long cacheLimit = CACHELIMIT;
+static conn_t up = {-1, NULL, 0, NULL, 0, 0};       ///< this process's upstream connection, requests go unframed
+
+static void sigchld_handler(int s) {
+    (void) s; ///< quiet unused variable warning
+
+    /// waitpid() might overwrite errno, so we save and restore it:
+    int saved_errno = errno;
+
+    while (waitpid(-1, NULL, WNOHANG) > 0);
+
+    errno = saved_errno;
+}
+
+/// Connect to the upstream server unless this process already is, returns 0 or -1
+static int upstream_open(void) {
+    struct addrinfo hints, *servinfo, *p;
+    int rv, yes = 1;
+
+    if (up.fd != -1) {
+        return 0;
+    }
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rv = getaddrinfo(upstreamHost, upstreamPort, &hints, &servinfo)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        return -1;
+    }
+    for (p = servinfo; p != NULL && up.fd == -1; p = p->ai_next) {
+        up.fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
+        if (up.fd != -1 && connect(up.fd, p->ai_addr, p->ai_addrlen) == -1) {
+            close(up.fd);
+            up.fd = -1;
+        }
+    }
+    freeaddrinfo(servinfo);
+    if (up.fd == -1) {
+        perror("relay: connect upstream");
+        return -1;
+    }
+    setsockopt(up.fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+    conn_set_timeout(&up, 0, UPSTREAMTIMEOUT);
+    conn_set_timeout(&up, 1, UPSTREAMTIMEOUT);
+    return 0;
+}
+
+/// Drop the upstream connection, after it failed or when it is left in the middle of a reply
+static void upstream_close(void) {
+    if (up.fd != -1) {
+        conn_close(&up);
+        up.fd = -1;
+    }
+}
+
+/// Receive exactly len bytes, returns 0 or -1 if the connection failed or ended first
+static int recv_all(conn_t *c, void *buf, size_t len) {
+    for (size_t got = 0; got < len;) {
+        ssize_t n = conn_recv(c, (char *) buf + got, len - got);
+        if (n <= 0) {
+            return -1;
+        }
+        got += n;
+    }
+    return 0;
+}
+
+/// Read the next frame header of an upstream reply, returns the payload length with the type in *type or -1
+static long long upstream_frame(int *type) {
+    char header[FRAME_HEADER];
+
+    if (recv_all(&up, header, sizeof header) == -1) {
+        return -1;
+    }
+    return frame_parse(header, type);
+}
+
+/// Read a status payload of len bytes into text as a string, returns 0 or -1
+static int upstream_text(char *text, long long len) {
+    if (len >= FRAME_MAXTEXT || recv_all(&up, text, len) == -1) {
+        return -1;
+    }
+    text[len] = '\0';
+    return 0;
+}
+
+/// Send one frame as it came from upstream, returns 0 or -1
+static int send_raw_frame(conn_t *c, int type, const void *buf, size_t len) {
+    char header[FRAME_HEADER];
+
+    frame_header(header, type, len);
+    return conn_send(c, header, sizeof header) == -1 || conn_send(c, buf, len) == -1 ? -1 : 0;
+}
+
+/// Pass a request on to upstream and its reply back to the client frame by frame, up to the END or ERROR
+/// frame that ends it. An upload's body follows the server's "Ready". A watch or follow only ends when the
+/// client sends its next request: the upstream connection is then dropped, which ends it there, and the
+/// relay ends the reply. Returns 0, or -1 once the client connection is no longer usable
+static int forward(conn_t *client, const char *line) {
+    char buf[COPYSIZE];
+    int streaming = line[0] == 'W' || line[0] == 'A';
+    long long uploadSize = line[0] == 'U' ? atoll(line + 2) : -1;
+    int rv = 0;
+
+    if (upstream_open() == -1 || conn_send(&up, line, strlen(line)) == -1) {
+        upstream_close();
+        return conn_send_frame(client, FRAME_ERROR, "Upstream unreachable", 20) == -1 ? -1 : 0;
+    }
+
+    // Frames go out to the client just as they came, each in plain sends so a quiet stream is never held back
+    client->framed = 0;
+    while (1) {
+        if (streaming) {
+            struct pollfd fds[2] = {{up.fd, POLLIN, 0}, {client->fd, POLLIN, 0}};
+            while (poll(fds, 2, -1) == -1 && errno == EINTR) {
+            }
+            if (!(fds[0].revents & POLLIN) && fds[1].revents) {
+                upstream_close();
+                const char *ended = line[0] == 'W' ? "Watch ended" : "Follow ended";
+                rv = send_raw_frame(client, FRAME_END, ended, strlen(ended));
+                break;
+            }
+        }
+
+        int type = 0;
+        long long len = upstream_frame(&type);
+        if (len == -1) {
+            upstream_close();
+            rv = send_raw_frame(client, FRAME_ERROR, "Upstream connection lost", 24);
+            break;
+        }
+        if (type != FRAME_DATA && len < FRAME_MAXTEXT) {
+            if (upstream_text(buf, len) == -1) {
+                upstream_close();
+                rv = send_raw_frame(client, FRAME_ERROR, "Upstream connection lost", 24);
+                break;
+            }
+            if (send_raw_frame(client, type, buf, len) == -1) {
+                upstream_close();
+                rv = -1;
+                break;
+            }
+            if (type == FRAME_END || type == FRAME_ERROR) {
+                break;
+            }
+            if (type == FRAME_INFO && uploadSize >= 0 && strcmp(buf, "Ready") == 0) {
+                for (long long left = uploadSize; left > 0 && rv == 0;) {
+                    ssize_t n = conn_recv(client, buf, left < COPYSIZE ? left : COPYSIZE);
+                    if (n <= 0 || conn_send(&up, buf, n) == -1) {
+                        upstream_close();
+                        rv = -1;
+                    }
+                    left -= n;
+                }
+                if (rv == -1) {
+                    break;
+                }
+            }
+            continue;
+        }
+
+        // Output, passed on a buffer at a time however large the frame
+        char header[FRAME_HEADER];
+        frame_header(header, type, len);
+        if (conn_send(client, header, sizeof header) == -1) {
+            rv = -1;
+        }
+        while (len > 0 && rv == 0) {
+            size_t chunk = len < COPYSIZE ? len : COPYSIZE;
+            if (recv_all(&up, buf, chunk) == -1 || conn_send(client, buf, chunk) == -1) {
+                rv = -1;
+            }
+            len -= chunk;
+        }
+        if (rv == -1) {
+            upstream_close();
+            break;
+        }
+    }
+    client->framed = 1;
+    return rv;
+}
+
+/// Receive the body that follows upstream's "Modified" into the cache and make it the cached copy described
+/// by entry. A sparse body's "Extent" notices say where its data goes. Returns an fd for the new body, or -1
+/// with the error for the client in msgToSend
+static int cache_receive(const char *name, cache_entry_t *entry, char *msgToSend) {
+    char tmpPath[4096], text[FRAME_MAXTEXT] = "";
+    long long offset = 0, len;
+    int type = 0;
+
+    int tmpfd = cache_begin(tmpPath);
+    if (tmpfd == -1) {
+        perror("relay: cache");
+        upstream_close();   // the body is still on its way
+        strcpy(msgToSend, "Relay cache unavailable\0");
+        return -1;
+    }
+    while ((len = upstream_frame(&type)) != -1) {
+        if (type == FRAME_DATA) {
+            if (conn_recvfile(&up, tmpfd, offset, len) != len) {
+                len = -1;
+                break;
+            }
+            offset += len;
+        } else if (upstream_text(text, len) == -1) {
+            len = -1;
+            break;
+        } else if (type == FRAME_INFO) {
+            sscanf(text, "Extent %lld", &offset);
+        } else {
+            break;
+        }
+    }
+    if (len == -1 || type != FRAME_END) {
+        if (len == -1) {
+            upstream_close();
+        }
+        close(tmpfd);
+        unlink(tmpPath);
+        snprintf(msgToSend, FRAME_MAXTEXT, "%s", len == -1 ? "Upstream connection lost" : text);
+        return -1;
+    }
+
+    // The description carries the digest, so a client's own copy can be confirmed current without the mtime
+    digest_t digest;
+    digest_init(&digest);
+    if (ftruncate(tmpfd, entry->size) == -1 || digest_update_fd(&digest, tmpfd, 0, entry->size) == -1) {
+        perror("relay: cache");
+        close(tmpfd);
+        unlink(tmpPath);
+        strcpy(msgToSend, "Relay cache unavailable\0");
+        return -1;
+    }
+    digest_hex(digest_final(&digest), entry->hash);
+    if (cache_commit(upstreamKey, name, tmpPath, entry) == -1) {
+        perror("relay: cache commit");  // still served from the open file
+    }
+    cache_trim(cacheLimit);
+    printf("Relay: fetched %lld bytes of %s\n", entry->size, name);
+    return tmpfd;
+}
+
+/// Ask upstream whether the copy of name described by entry, bodyfd if there is one, is still current and
+/// fetch the file if it is not. Returns an fd for the current body, the cached one when upstream can't be
+/// reached, or -1 with the error for the client in msgToSend
+static int cache_refresh(const char *name, cache_entry_t *entry, int bodyfd, char *msgToSend) {
+    char line[LINESIZE], text[FRAME_MAXTEXT];
+    long long len = -1;
+    int type = 0;
+
+    // A size of -1 never matches, so a name not cached yet is always sent
+    if (bodyfd == -1) {
+        entry->size = -1;
+        strcpy(entry->mtime, "0");
+        strcpy(entry->hash, "0");
+    }
+    snprintf(line, sizeof line, "V %lld %s %s %s\n", entry->size, entry->mtime, entry->hash, name);
+    if (upstream_open() == -1 || conn_send(&up, line, strlen(line)) == -1 || (len = upstream_frame(&type)) == -1 ||
+        type == FRAME_DATA || upstream_text(text, len) == -1) {
+        upstream_close();
+        if (bodyfd != -1) {
+            printf("Relay: upstream unreachable, serving cached %s\n", name);
+            return bodyfd;
+        }
+        strcpy(msgToSend, "Upstream unreachable\0");
+        return -1;
+    }
+
+    if (type == FRAME_END && bodyfd != -1 && sscanf(text, "Not Modified %31s", entry->mtime) == 1) {
+        cache_update(upstreamKey, name, entry);     // also marks the copy used, see cache_trim()
+        printf("Relay: %s not modified\n", name);
+        return bodyfd;
+    }
+    if (bodyfd != -1) {
+        close(bodyfd);
+    }
+    if (type == FRAME_INFO && sscanf(text, "Modified %lld %31s", &entry->size, entry->mtime) == 2) {
+        return cache_receive(name, entry, msgToSend);
+    }
+    if (type == FRAME_INFO) {
+        upstream_close();   // not a reply this relay understands, the rest of it can't be skipped
+    }
+    snprintf(msgToSend, FRAME_MAXTEXT, "%s", text);
+    return -1;
+}
+
+/// Current copy of name, fetched from upstream once per version. A copy confirmed current in the last
+/// FRESHSECS seconds is used as it is. Requests for the same name in other processes wait on its cache lock
+/// meanwhile, so of a burst of misses the first fetches and the rest find that copy fresh. Returns a read
+/// only fd for the body with entry filled, or -1 with the error for the client in msgToSend
+static int cache_fetch(const char *name, cache_entry_t *entry, char *msgToSend) {
+    if (cache_lock(upstreamKey, name) == -1) {
+        perror("relay: cache lock");    // not coalesced, but still served
+    }
+    int bodyfd = cache_lookup(upstreamKey, name, entry);
+    if (bodyfd == -1 || time(NULL) - entry->checked >= FRESHSECS) {
+        bodyfd = cache_refresh(name, entry, bodyfd, msgToSend);
+    }
+    cache_unlock(upstreamKey, name);
+    return bodyfd;
+}
+
+/// Serve a display (P), download (D) or cached download (V) from the relay's copy, returns -1 with the
+/// error in msgToSend if the file could not be had
+static int serve_cached(conn_t *client, char *buff, char *msgToSend) {
+    cache_entry_t entry, theirs;
+    char *name = buff + 2;
+    int used = 0;
+
+    if (buff[0] == 'V') {
+        if (sscanf(name, "%lld %31s %16s %n", &theirs.size, theirs.mtime, theirs.hash, &used) != 3 ||
+            name[used] == '\0') {
+            strcpy(msgToSend, "display command with no argument\0");
+            return -1;
+        }
+        name += used;
+    }
+    name[strcspn(name, "\n\r")] = '\0';
+
+    int bodyfd = cache_fetch(name, &entry, msgToSend);
+    if (bodyfd == -1) {
+        return -1;
+    }
+
+    // The client's own copy may be as current as the relay's, told the way the server tells it
+    if (buff[0] == 'V' && theirs.size == entry.size &&
+        (strcmp(theirs.mtime, entry.mtime) == 0 || strcmp(theirs.hash, entry.hash) == 0)) {
+        snprintf(msgToSend, FRAME_MAXTEXT, "Not Modified %s", entry.mtime);
+        close(bodyfd);
+        return 0;
+    }
+    if (buff[0] == 'V') {
+        char info[FRAME_MAXTEXT];
+        int len = snprintf(info, sizeof info, "Modified %lld %s", entry.size, entry.mtime);
+        conn_send_frame(client, FRAME_INFO, info, len);
+    }
+    ssize_t sent = conn_sendfile(client, bodyfd, 0, entry.size);
+    close(bodyfd);
+    if (sent == -1) {
+        perror("sendfile");
+        strcpy(msgToSend, "Display failed\0");
+        return -1;
+    }
+    printf("Relay: sent %zd bytes of %s\n", sent, name);
+    return 0;
+}
+
+/// Serve the requests of one client until it hangs up. Reads of one file come from the cache, anything else
+/// goes upstream
+static void relay_client(int new_fd) {
+    conn_t conn = {new_fd, NULL, 1, NULL, 0, 0};   ///< replies are framed
+    char buff[LINESIZE], msgToSend[FRAME_MAXTEXT];
+    ssize_t numbytes;
+    int yes = 1;
+
+    setsockopt(new_fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+    while ((numbytes = conn_recvline(&conn, buff, sizeof buff)) > 0) {
+        buff[numbytes] = '\0';
+        printf("Relay: received %s", buff);
+        memset(msgToSend, 0, sizeof msgToSend);
+
+        int rv;
+        if (strncmp(buff, "P ", 2) == 0 || strncmp(buff, "D ", 2) == 0 || strncmp(buff, "V ", 2) == 0) {
+            rv = serve_cached(&conn, buff, msgToSend);
+        }
+            // Case of multicast download, the group would be joined on the relay's network, not the client's
+        else if (strncmp(buff, "F ", 2) == 0) {
+            strcpy(msgToSend, "Multicast is not relayed\0");
+            rv = -1;
+        }
+            // Case of every other request, whose reply upstream sends whole
+        else {
+            if (forward(&conn, buff) == -1) {
+                break;
+            }
+            continue;
+        }
+
+        if (conn_send_frame(&conn, rv == 0 ? FRAME_END : FRAME_ERROR, msgToSend, strlen(msgToSend)) == -1) {
+            perror("send");
+            break;
+        }
+    }
+    if (numbytes == -1) {
+        perror("recv");
+    }
+    upstream_close();
+    conn_close(&conn);
+}
+
+int main(int argc, char *argv[]) {
+    int sockfd, new_fd;  ///< listen on sock_fd, new connection on new_fd
+    struct addrinfo hints, *servinfo, *p;
+    struct sockaddr_storage their_addr; ///< connector's address information
+    socklen_t sin_size;
+    struct sigaction sa;
+    int yes = 1;
+
+    int rv, opt;
+    char *port = PORT, *cacheDir = CACHEDIR;
+
+    /// -p picks the port clients connect to, -d the cache directory and -s how many bytes it may hold
+    while ((opt = getopt(argc, argv, "p:d:s:")) != -1) {
+        switch (opt) {
+            case 'p':
+                port = optarg;
+                break;
+            case 'd':
+                cacheDir = optarg;
+                break;
+            case 's':
+                cacheLimit = strtoll(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "usage: relay [-p port] [-d cachedir] [-s cachebytes] upstream[:port]\n");
+                exit(1);
+        }
+    }
+    if (argc - optind != 1 || cacheLimit <= 0) {
+        fprintf(stderr, "usage: relay [-p port] [-d cachedir] [-s cachebytes] upstream[:port]\n");
+        exit(1);
+    }
+
+    /// The upstream server is a hostname or address with an optional port, [v6addr]:port for IPv6
+    upstreamHost = argv[optind];
+    char *colon;
+    if (upstreamHost[0] == '[' && (colon = strchr(upstreamHost, ']')) != NULL) {
+        upstreamHost++;
+        *colon++ = '\0';
+        if (*colon == ':') {
+            upstreamPort = colon + 1;
+        }
+    } else if ((colon = strchr(upstreamHost, ':')) != NULL && strchr(colon + 1, ':') == NULL) {
+        *colon = '\0';
+        upstreamPort = colon + 1;
+    }
+    snprintf(upstreamKey, sizeof upstreamKey, "relay:%s:%s", upstreamHost, upstreamPort);
+
+    if (cache_init(cacheDir) == -1) {
+        perror(cacheDir);
+        exit(1);
+    }
+    cache_trim(cacheLimit);     // the limit may have been lowered since the last run
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE; ///< use my IP
+
+    if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        return 1;
+    }
+
+    /// Loop through all the results and bind to the first we can
+    for (p = servinfo; p != NULL; p = p->ai_next) {
+        if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
+            perror("relay: socket");
+            continue;
+        }
+
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+            perror("setsockopt");
+            exit(1);
+        }
+
+        if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
+            close(sockfd);
+            perror("relay: bind");
+            continue;
+        }
+
+        break;
+    }
+
+    freeaddrinfo(servinfo); ///< all done with this structure
+
+    if (p == NULL) {
+        fprintf(stderr, "relay: failed to bind\n");
+        exit(1);
+    }
+
+    if (listen(sockfd, BACKLOG) == -1) {
+        perror("listen");
+        exit(1);
+    }
+
+    sa.sa_handler = sigchld_handler; // reap all dead processes
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
+        perror("sigaction");
+        exit(1);
+    }
+
+    /// A client or upstream hanging up mid-transfer should fail the send, not kill the process
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sa, NULL) == -1) {
+        perror("sigaction");
+        exit(1);
+    }
+
+    printf("relay: waiting for connections, upstream %s port %s...\n", upstreamHost, upstreamPort);
+
+    /// Every client gets a process of its own with its own upstream connection, the cache on disk is what
+    /// they share
+    while (1) {
+        sin_size = sizeof their_addr;
+        new_fd = accept(sockfd, (struct sockaddr *) &their_addr, &sin_size);
+        if (new_fd == -1) {
+            if (errno != EINTR) {
+                perror("accept");
+            }
+            continue;
+        }
+
+        if (!fork()) {
+            close(sockfd);
+            relay_client(new_fd);
+            exit(0);
+        }
+        close(new_fd);
+    }
+}
@@ -0,0 +1,354 @@
+/*
+** ring.c -- shared memory transport, a pair of single producer single consumer byte rings in a memfd
+*/
+
+#define _GNU_SOURCE     ///< memfd_create(), POLLRDHUP
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "ring.h"
+
+#define RINGMASK (RINGSIZE - 1)
+
+#define RINGCHECKMS 1000    ///< A sleeping side looks at the socket this often in case the other side died
+
+/// One direction, shared by both processes. Positions are byte counts since the start that wrap at 2^32, so
+/// head - tail is what is in the ring. Each side only stores its own position and the fields either side
+/// sleeps on are in their own cache lines
+typedef struct ring_half {
+    uint32_t head;              ///< bytes written, stored by the producer, the consumer sleeps on it
+    uint32_t readerSleeping;    ///< the consumer is asleep or about to be, wake it after writing
+    char pad1[56];
+    uint32_t tail;              ///< bytes read, stored by the consumer, the producer sleeps on it
+    uint32_t writerSleeping;    ///< the producer is asleep or about to be, wake it after reading
+    char pad2[56];
+    uint32_t closed;            ///< either side went away
+    char pad3[60];
+    char data[RINGSIZE];
+} ring_half_t;
+
+/// This process's end of the rings
+typedef struct ring {
+    ring_half_t *in;    ///< what the other side sends us
+    ring_half_t *out;   ///< what we send
+    ring_half_t *map;   ///< both halves, requests first
+    int nonblock;       ///< return EAGAIN instead of sleeping
+    int timeout[2];     ///< milliseconds a blocking read and write wait before EAGAIN, 0 for no limit
+} ring_t;
+
+static void futex_wait(uint32_t *word, uint32_t value, int timeout) {
+    struct timespec ts = {timeout / 1000, (timeout % 1000) * 1000000L};
+    syscall(SYS_futex, word, FUTEX_WAIT, value, timeout >= 0 ? &ts : NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/// The other side closed its end, or, when checkSocket is set, its process is gone
+static int ring_gone(conn_t *c, int checkSocket) {
+    ring_t *r = c->ring;
+    struct pollfd pfd = {c->fd, POLLRDHUP, 0};
+
+    if (__atomic_load_n(&r->in->closed, __ATOMIC_ACQUIRE)) {
+        return 1;
+    }
+    return checkSocket && poll(&pfd, 1, 0) == 1 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR)) != 0;
+}
+
+/// Bytes waiting in the incoming ring
+static uint32_t ring_avail(ring_t *r) {
+    return __atomic_load_n(&r->in->head, __ATOMIC_ACQUIRE) - r->in->tail;
+}
+
+/// Free bytes in the outgoing ring
+static uint32_t ring_space(ring_t *r) {
+    return RINGSIZE - (r->out->head - __atomic_load_n(&r->out->tail, __ATOMIC_ACQUIRE));
+}
+
+/// Make n more bytes of the outgoing ring visible and wake the consumer if it sleeps
+static void ring_publish(ring_t *r, uint32_t n) {
+    __atomic_store_n(&r->out->head, r->out->head + n, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->out->readerSleeping, __ATOMIC_SEQ_CST)) {
+        futex_wake(&r->out->head);
+    }
+}
+
+/// Give n bytes of the incoming ring back and wake the producer if it sleeps
+static void ring_consume(ring_t *r, uint32_t n) {
+    __atomic_store_n(&r->in->tail, r->in->tail + n, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->in->writerSleeping, __ATOMIC_SEQ_CST)) {
+        futex_wake(&r->in->tail);
+    }
+}
+
+/// Returns 1 if the ring end can go on without waiting
+int ring_ready(conn_t *c, uint32_t events) {
+    ring_t *r = c->ring;
+
+    return ((events & EPOLLIN) && ring_avail(r) > 0) || ((events & EPOLLOUT) && ring_space(r) > 0) ||
+           ring_gone(c, 0);
+}
+
+/// Sleep until ring_ready() or for at most timeout milliseconds. The sleeping flag goes up before the last
+/// look at the ring, so the other side either sees it and wakes us or made its change before that look
+void ring_wait(conn_t *c, uint32_t events, int timeout) {
+    ring_t *r = c->ring;
+    int reading = (events & EPOLLIN) != 0;
+    uint32_t *flag = reading ? &r->in->readerSleeping : &r->out->writerSleeping;
+    uint32_t *word = reading ? &r->in->head : &r->out->tail;
+
+    __atomic_store_n(flag, 1, __ATOMIC_SEQ_CST);
+    uint32_t seen = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+    if (!ring_ready(c, events)) {
+        futex_wait(word, seen, timeout);
+    }
+    __atomic_store_n(flag, 0, __ATOMIC_RELAXED);
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/// Wait for the ring to become ready on a blocking end, returns -1 once the other side is gone or the
+/// timeout set for this direction passed (EAGAIN)
+static int ring_block(conn_t *c, uint32_t events) {
+    ring_t *r = c->ring;
+    int timeout = r->timeout[(events & EPOLLIN) ? 0 : 1];
+    long long deadline = timeout > 0 ? now_ms() + timeout : 0;
+
+    while (!ring_ready(c, events)) {
+        int wait = RINGCHECKMS;
+        if (deadline != 0) {
+            long long left = deadline - now_ms();
+            wait = left < wait ? (int) left : wait;
+        }
+        if (r->nonblock || wait <= 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        ring_wait(c, events, wait);
+        if (!ring_ready(c, events) && ring_gone(c, 1)) {
+            errno = EPIPE;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/// Map both rings of memfd
+static ring_t *ring_map(int memfd, int nonblock) {
+    ring_t *r = calloc(1, sizeof *r);
+
+    r->map = mmap(NULL, 2 * sizeof(ring_half_t), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (r->map == MAP_FAILED) {
+        free(r);
+        return NULL;
+    }
+    r->nonblock = nonblock;
+    return r;
+}
+
+/// Give up on a blocking read (reading set) or write that waits longer than ms milliseconds, 0 waits as
+/// long as the other side is there
+void ring_timeout(conn_t *c, int reading, int ms) {
+    ((ring_t *) c->ring)->timeout[reading ? 0 : 1] = ms;
+}
+
+/// Map a new pair of rings, attach them to c as the server end and return the memfd to hand to the client,
+/// or -1 on error
+int ring_create(conn_t *c) {
+    int memfd = memfd_create("ring", MFD_CLOEXEC);
+    if (memfd == -1) {
+        return -1;
+    }
+    ring_t *r;
+    if (ftruncate(memfd, 2 * sizeof(ring_half_t)) == -1 || (r = ring_map(memfd, 0)) == NULL) {
+        close(memfd);
+        return -1;
+    }
+    r->in = &r->map[0];
+    r->out = &r->map[1];
+    c->ring = r;
+    return memfd;
+}
+
+/// Map the rings in memfd and attach them to c as the client end, memfd is closed. Returns 0 or -1
+int ring_attach(conn_t *c, int memfd, int nonblock) {
+    struct stat st;
+
+    if (fstat(memfd, &st) == -1 || st.st_size != 2 * (off_t) sizeof(ring_half_t)) {
+        close(memfd);
+        errno = EPROTO;
+        return -1;
+    }
+    ring_t *r = ring_map(memfd, nonblock);
+    close(memfd);
+    if (r == NULL) {
+        return -1;
+    }
+    r->in = &r->map[1];
+    r->out = &r->map[0];
+    c->ring = r;
+    return 0;
+}
+
+/// Ask the server on the connected unix socket c->fd to move the connection to shared memory. The request is
+/// "M\n" and the reply an END frame carrying the memfd. Returns 0 or -1
+int ring_connect(conn_t *c, int nonblock) {
+    char text[FRAME_MAXTEXT + 1];
+    int type, memfd = -1;
+
+    if (send(c->fd, "M\n", 2, MSG_NOSIGNAL) != 2 || conn_recv_fd(c, &type, text, sizeof text, &memfd) == -1) {
+        perror("client: shared memory");
+        return -1;
+    }
+    if (type != FRAME_END || memfd == -1) {
+        if (memfd != -1) {
+            close(memfd);
+        }
+        fprintf(stderr, "client: server refused shared memory: %s\n", text);
+        errno = EPROTO;
+        return -1;
+    }
+    if (ring_attach(c, memfd, nonblock) == -1) {
+        perror("client: shared memory");
+        return -1;
+    }
+    return 0;
+}
+
+/// Read up to len bytes, waiting for the first one unless the end is non-blocking
+ssize_t ring_read(conn_t *c, void *buf, size_t len, int flags) {
+    ring_t *r = c->ring;
+
+    if (ring_block(c, EPOLLIN) == -1) {
+        return errno == EAGAIN ? -1 : 0;
+    }
+    uint32_t n = ring_avail(r);
+    if (n == 0) {
+        return 0;   // ready because the other side is gone
+    }
+    if (n > len) {
+        n = len;
+    }
+    uint32_t at = r->in->tail & RINGMASK;
+    uint32_t first = n < RINGSIZE - at ? n : RINGSIZE - at;
+    memcpy(buf, r->in->data + at, first);
+    memcpy((char *) buf + first, r->in->data, n - first);
+    if (!(flags & RING_PEEK)) {
+        ring_consume(r, n);
+    }
+    return n;
+}
+
+/// Write len bytes, a blocking end waits for room for all of them and a non-blocking one writes what fits
+ssize_t ring_write(conn_t *c, const void *buf, size_t len) {
+    ring_t *r = c->ring;
+    size_t done = 0;
+
+    while (done < len) {
+        if (ring_block(c, EPOLLOUT) == -1) {
+            if (errno == EAGAIN && done > 0) {
+                break;
+            }
+            return -1;
+        }
+        if (__atomic_load_n(&r->in->closed, __ATOMIC_ACQUIRE)) {
+            errno = EPIPE;
+            return -1;
+        }
+        uint32_t n = ring_space(r);
+        if (n > len - done) {
+            n = len - done;
+        }
+        uint32_t at = r->out->head & RINGMASK;
+        uint32_t first = n < RINGSIZE - at ? n : RINGSIZE - at;
+        memcpy(r->out->data + at, (const char *) buf + done, first);
+        memcpy(r->out->data, (const char *) buf + done + first, n - first);
+        ring_publish(r, n);
+        done += n;
+    }
+    return done;
+}
+
+/// Like ring_write() for count bytes of filefd at offset, read straight into the ring
+ssize_t ring_sendfile(conn_t *c, int filefd, off_t offset, size_t count) {
+    ring_t *r = c->ring;
+    size_t done = 0;
+
+    while (done < count) {
+        if (ring_block(c, EPOLLOUT) == -1) {
+            if (errno == EAGAIN && done > 0) {
+                break;
+            }
+            return -1;
+        }
+        if (__atomic_load_n(&r->in->closed, __ATOMIC_ACQUIRE)) {
+            errno = EPIPE;
+            return -1;
+        }
+        uint32_t n = ring_space(r);
+        if (n > count - done) {
+            n = count - done;
+        }
+        uint32_t at = r->out->head & RINGMASK;
+        ssize_t got = pread(filefd, r->out->data + at, n < RINGSIZE - at ? n : RINGSIZE - at, offset + done);
+        if (got == -1) {
+            return -1;
+        }
+        if (got == 0) {
+            break;  // the file ended early
+        }
+        ring_publish(r, got);
+        done += got;
+    }
+    return done;
+}
+
+/// Like ring_read() but the data is written straight from the ring to filefd at offset
+ssize_t ring_recvfile(conn_t *c, int filefd, off_t offset, size_t count) {
+    ring_t *r = c->ring;
+
+    if (ring_block(c, EPOLLIN) == -1) {
+        return errno == EAGAIN ? -1 : 0;
+    }
+    uint32_t n = ring_avail(r);
+    if (n > count) {
+        n = count;
+    }
+    uint32_t at = r->in->tail & RINGMASK;
+    ssize_t put = pwrite(filefd, r->in->data + at, n < RINGSIZE - at ? n : RINGSIZE - at, offset);
+    if (put > 0) {
+        ring_consume(r, put);
+    }
+    return put;
+}
+
+/// Tell the other side we are gone and unmap the rings
+void ring_close(conn_t *c) {
+    ring_t *r = c->ring;
+
+    __atomic_store_n(&r->in->closed, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->out->closed, 1, __ATOMIC_RELEASE);
+    futex_wake(&r->out->head);
+    futex_wake(&r->in->tail);
+    munmap(r->map, 2 * sizeof(ring_half_t));
+    free(r);
+    c->ring = NULL;
+}
@@ -0,0 +1,58 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "conn.h"
+
+/// A connection can move from its unix socket to a pair of single producer single consumer byte rings in one
+/// memfd mapped by both sides, requests in one and replies in the other. An idle side sleeps on a futex in
+/// the shared mapping and is woken by the other side only when it said it is sleeping. The socket stays open
+/// so either side notices when the other goes away
+#define RINGSIZE 1048576    ///< Bytes in each ring, a power of two
+
+#define RING_PEEK 1         ///< ring_read() leaves the data in the ring
+
+/// Map a new pair of rings, attach them to c as the server end and return the memfd to hand to the client,
+/// or -1 on error
+int ring_create(conn_t *c);
+
+/// Map the rings in memfd and attach them to c as the client end. A non-blocking end returns EAGAIN
+/// instead of waiting. Returns 0 or -1
+int ring_attach(conn_t *c, int memfd, int nonblock);
+
+/// Ask the server on the connected unix socket c->fd to move the connection to shared memory and attach the
+/// rings it hands over, returns 0 or -1
+int ring_connect(conn_t *c, int nonblock);
+
+/// Read up to len bytes, waiting for the first one unless the end is non-blocking.
+/// Returns bytes read, 0 once the other side closed or -1 on error (EAGAIN when nothing is there)
+ssize_t ring_read(conn_t *c, void *buf, size_t len, int flags);
+
+/// Write len bytes, a blocking end waits for room for all of them and a non-blocking one writes what fits.
+/// Returns bytes written or -1 on error (EAGAIN when the ring is full, EPIPE once the other side closed)
+ssize_t ring_write(conn_t *c, const void *buf, size_t len);
+
+/// Like ring_write() for count bytes of filefd at offset, read straight into the ring. Returns bytes
+/// written, 0 if the file ended early or -1 on error
+ssize_t ring_sendfile(conn_t *c, int filefd, off_t offset, size_t count);
+
+/// Like ring_read() but the data is written straight from the ring to filefd at offset
+ssize_t ring_recvfile(conn_t *c, int filefd, off_t offset, size_t count);
+
+/// Returns 1 if the ring end can go on without waiting: something to read for EPOLLIN, room to write for
+/// EPOLLOUT, or the other side is gone
+int ring_ready(conn_t *c, uint32_t events);
+
+/// Sleep until ring_ready() or for at most timeout milliseconds
+void ring_wait(conn_t *c, uint32_t events, int timeout);
+
+/// Give up on a blocking read (reading set) or write that waits longer than ms milliseconds, it then fails
+/// with EAGAIN. 0 waits as long as the other side is there
+void ring_timeout(conn_t *c, int reading, int ms);
+
+/// Tell the other side we are gone and unmap the rings
+void ring_close(conn_t *c);
+
+#endif
@@ -0,0 +1,129 @@
+/*
+** sched.c -- fair turns and token bucket rate limits for the server's bulk output
+*/
+
+#define _GNU_SOURCE     ///< SCHED_BATCH
+
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/pkt_sched.h>
+
+#include "sched.h"
+
+#define SCHED_STUCKMS 2000  ///< A turn that lasts this long belonged to a process that died, the next one goes
+
+/// Token bucket. Sends may run it into debt, which the sender then sleeps off, and it holds at most a quantum
+typedef struct bucket {
+    long long tokens;
+    long long stamp;    ///< when tokens was last brought up to date, 0 before the first take
+} bucket_t;
+
+/// Turns of the bulk senders of every connection, in shared memory. The ticket lock hands turns out in the
+/// order they were asked for, and only the sender whose turn it is touches the bucket
+typedef struct sched_queue {
+    uint32_t next;      ///< next ticket to hand out
+    uint32_t serving;   ///< ticket whose turn it is, a futex word
+    bucket_t bucket;    ///< for totalRate
+} sched_queue_t;
+
+static sched_queue_t *queue;    ///< NULL without a total rate
+static long long totalRate, clientRate;
+static bucket_t own;            ///< this connection's bucket for clientRate
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_ns(long long ns) {
+    struct timespec ts = {ns / 1000000000LL, ns % 1000000000LL};
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+/// Take n tokens from b, which fills at rate bytes per second, sleeping while it is in debt
+static void bucket_take(bucket_t *b, long long rate, size_t n) {
+    long long now = now_ns();
+
+    if (b->stamp == 0) {
+        b->tokens = SCHED_QUANTUM;
+    } else {
+        b->tokens += (long long) ((now - b->stamp) / 1e9 * rate);
+        if (b->tokens > SCHED_QUANTUM) {
+            b->tokens = SCHED_QUANTUM;
+        }
+    }
+    b->stamp = now;
+    b->tokens -= n;
+    if (b->tokens < 0) {
+        sleep_ns((long long) (-b->tokens * 1e9 / rate));
+    }
+}
+
+/// Wait until serving reaches ticket. A turn that does not move for SCHED_STUCKMS is taken over
+static void wait_turn(uint32_t ticket) {
+    while (1) {
+        uint32_t serving = __atomic_load_n(&queue->serving, __ATOMIC_ACQUIRE);
+        if (serving == ticket) {
+            return;
+        }
+        struct timespec ts = {SCHED_STUCKMS / 1000, (SCHED_STUCKMS % 1000) * 1000000L};
+        if (syscall(SYS_futex, &queue->serving, FUTEX_WAIT, serving, &ts, NULL, 0) == -1 && errno == ETIMEDOUT) {
+            __atomic_compare_exchange_n(&queue->serving, &serving, serving + 1, 0, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/// Set up the rates in bytes per second, 0 for no limit. Call before forking. Returns 0 or -1 if the shared
+/// queue can't be mapped
+int sched_init(long long client, long long total) {
+    clientRate = client;
+    totalRate = total;
+    if (totalRate > 0) {
+        queue = mmap(NULL, sizeof *queue, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (queue == MAP_FAILED) {
+            queue = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/// Mark the output of c as bulk (on set) or back to interactive. The socket priority picks the band of the
+/// packet scheduler its packets queue in, and SCHED_BATCH lets a process with a short reply to send preempt
+/// this one as soon as it wakes
+void sched_bulk(conn_t *c, int on) {
+    int priority = on ? TC_PRIO_BULK : TC_PRIO_INTERACTIVE;
+    struct sched_param param = {0};
+
+    setsockopt(c->fd, SOL_SOCKET, SO_PRIORITY, &priority, sizeof priority);
+    sched_setscheduler(0, on ? SCHED_BATCH : SCHED_OTHER, &param);
+}
+
+/// Wait for the connection's turn and the tokens to send up to want bytes. Returns how many may be sent now,
+/// at most SCHED_QUANTUM
+size_t sched_grant(size_t want) {
+    size_t n = want < SCHED_QUANTUM ? want : SCHED_QUANTUM;
+
+    if (clientRate > 0) {
+        bucket_take(&own, clientRate, n);
+    }
+    if (queue != NULL) {
+        uint32_t ticket = __atomic_fetch_add(&queue->next, 1, __ATOMIC_ACQ_REL);
+        wait_turn(ticket);
+        bucket_take(&queue->bucket, totalRate, n);
+        __atomic_add_fetch(&queue->serving, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &queue->serving, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+    return n;
+}
@@ -0,0 +1,28 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stddef.h>
+
+#include "conn.h"
+
+/// Bulk output, a file body larger than one quantum, is sent a quantum at a time and only when the
+/// connection's turn comes. With a total rate set, the turns of every connection's process come from one
+/// ticket queue in shared memory. A sender that had its turn queues up again at the back, so backlogged
+/// transfers share the rate round robin, each getting a quantum per round. Replies smaller than a quantum
+/// never queue, and while bulk output runs its socket and process have a lower priority. A waiting check
+/// or listing is therefore sent ahead of the bulk data and does not wait behind it
+#define SCHED_QUANTUM 262144    ///< Bytes a bulk sender sends per turn
+
+/// Set up the rates in bytes per second, 0 for no limit: clientRate for each connection on its own,
+/// totalRate for all of them together. Call before forking. Returns 0 or -1 if the shared queue can't be
+/// mapped
+int sched_init(long long clientRate, long long totalRate);
+
+/// Mark the output of c as bulk (on set) or back to interactive, for the packet scheduler and the CPU
+void sched_bulk(conn_t *c, int on);
+
+/// Wait for the connection's turn and the tokens to send up to want bytes. Returns how many may be sent now,
+/// at most SCHED_QUANTUM
+size_t sched_grant(size_t want);
+
+#endif
@@ -0,0 +1,278 @@
+/*
+** search.c -- parallel content search over files read in chunks with a SIMD substring scan
+*/
+
+#define _GNU_SOURCE     ///< memmem()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "search.h"
+
+#define MAXTHREADS 16       ///< Upper bound on search threads
+#define OUTBUFSIZE 16384    ///< Each thread batches this many bytes of results per send
+#define CHUNKSIZE 1048576   ///< Bytes of a file read at a time
+
+/// State shared by the search threads
+typedef struct search {
+    conn_t *conn;
+    const char *needle;
+    size_t needleLen;
+    char **names;           ///< files to search
+    size_t count;
+    size_t next;            ///< index of the next unclaimed file
+    long maxResults;        ///< stop after this many matches, 0 for no limit
+    long results;           ///< matches claimed so far
+    int failed;             ///< set once a send fails
+    pthread_mutex_t outLock;
+} search_t;
+
+/// Per thread state
+typedef struct searcher {
+    search_t *search;
+    char *chunk;            ///< CHUNKSIZE bytes plus the end of the previous chunk a match may start in
+    size_t used;
+    char out[OUTBUFSIZE];
+} searcher_t;
+
+/// Find needle (of length len) in haystack (of length n), returns a pointer to the first occurrence or NULL.
+/// With SSE2 16 candidate positions are tested at once by comparing the first and last byte of the needle,
+/// only positions where both match are checked with memcmp()
+const char *search_find(const char *haystack, size_t n, const char *needle, size_t len) {
+    if (len == 0) {
+        return haystack;
+    }
+    if (n < len) {
+        return NULL;
+    }
+    if (len == 1) {
+        return memchr(haystack, needle[0], n);
+    }
+
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[len - 1]);
+
+    for (; i + len - 1 + 16 <= n; i += 16) {
+        __m128i blockFirst = _mm_loadu_si128((const __m128i *) (haystack + i));
+        __m128i blockLast = _mm_loadu_si128((const __m128i *) (haystack + i + len - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(blockFirst, first),
+                                                        _mm_cmpeq_epi8(blockLast, last)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(haystack + i + bit + 1, needle + 1, len - 2) == 0) {
+                return haystack + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    return memmem(haystack + i, n - i, needle, len);
+}
+
+/// Send whatever the thread has batched up
+static void searcher_flush(searcher_t *w) {
+    search_t *search = w->search;
+
+    if (w->used == 0) {
+        return;
+    }
+    pthread_mutex_lock(&search->outLock);
+    if (!search->failed && conn_send(search->conn, w->out, w->used) == -1) {
+        __atomic_store_n(&search->failed, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&search->outLock);
+    w->used = 0;
+}
+
+/// Record one match, returns 0 once the result limit has been reached
+static int searcher_emit(searcher_t *w, const char *name, long line) {
+    search_t *search = w->search;
+
+    long claimed = __atomic_fetch_add(&search->results, 1, __ATOMIC_RELAXED);
+    if (search->maxResults > 0 && claimed >= search->maxResults) {
+        return 0;
+    }
+    if (w->used + strlen(name) + 24 > sizeof w->out) {
+        searcher_flush(w);
+    }
+    w->used += snprintf(w->out + w->used, sizeof w->out - w->used, "%s:%ld\n", name, line);
+    return 1;
+}
+
+/// Read one file a chunk at a time and report every line holding the needle. The last needle length - 1
+/// bytes of a chunk are searched again in front of the next one, so a match across the boundary is found.
+/// Reading rather than mapping the file lets it be truncated meanwhile, as rotated logs are, and the search
+/// just ends early
+static int searcher_file(searcher_t *w, const char *name) {
+    search_t *search = w->search;
+    size_t len = search->needleLen, keep = len > 0 ? len - 1 : 0;
+    struct stat st;
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        return 1;
+    }
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return 1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    off_t offset = 0;
+    size_t have = 0;    // bytes in the chunk buffer, the kept end of the previous chunk first
+    long line = 1;      // of the first byte in the buffer not looked at yet
+    int more = 1;
+    int skipping = 0;   // a match was reported on this line, go on after its end
+
+    while (more && offset < st.st_size) {
+        size_t want = st.st_size - offset < CHUNKSIZE ? st.st_size - offset : CHUNKSIZE;
+        ssize_t n = pread(fd, w->chunk + have, want, offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;      // the file shrank underneath us
+        }
+        offset += n;
+        have += n;
+
+        const char *p = w->chunk, *end = w->chunk + have, *hit;
+        while (p < end) {
+            if (skipping) {
+                const char *eol = memchr(p, '\n', end - p);
+                if (eol == NULL) {
+                    p = end;
+                    break;
+                }
+                p = eol + 1;
+                line++;
+                skipping = 0;
+                continue;
+            }
+            if ((hit = search_find(p, end - p, search->needle, len)) == NULL) {
+                break;
+            }
+            for (const char *nl; (nl = memchr(p, '\n', hit - p)) != NULL; p = nl + 1) {
+                line++;
+            }
+            if (!(more = searcher_emit(w, name, line))) {
+                break;
+            }
+            // One result per line, carry on after it
+            p = hit;
+            skipping = 1;
+        }
+
+        // A match may start in the last len - 1 bytes and end in the next chunk, they move to the front
+        const char *kept = p;
+        if (!skipping && (size_t) (end - p) > keep) {
+            kept = end - keep;
+        }
+        for (const char *nl; (nl = memchr(p, '\n', kept - p)) != NULL; p = nl + 1) {
+            line++;
+        }
+        have = end - kept;
+        memmove(w->chunk, kept, have);
+    }
+
+    close(fd);
+    return more;
+}
+
+/// Search thread: claim files one at a time until none are left or enough matches were found
+static void *searcher_run(void *arg) {
+    searcher_t *w = arg;
+    search_t *search = w->search;
+
+    w->chunk = malloc(CHUNKSIZE + search->needleLen);
+    while (w->chunk != NULL && !__atomic_load_n(&search->failed, __ATOMIC_RELAXED)) {
+        size_t i = __atomic_fetch_add(&search->next, 1, __ATOMIC_RELAXED);
+        if (i >= search->count || !searcher_file(w, search->names[i])) {
+            break;
+        }
+    }
+    searcher_flush(w);
+    free(w->chunk);
+    return NULL;
+}
+
+/// Search every regular file in the current directory for needle in parallel and stream one "name:line"
+/// per matching line to conn, stopping after maxResults lines when it is above 0. Returns the number of
+/// matches sent or -1 if the connection failed
+long search_files(conn_t *conn, const char *needle, long maxResults) {
+    search_t search;
+    pthread_t threads[MAXTHREADS];
+    searcher_t *searchers;
+    DIR *dir = opendir(".");
+    struct dirent *entry;
+    size_t capacity = 64;
+
+    if (dir == NULL) {
+        return 0;
+    }
+    memset(&search, 0, sizeof search);
+    search.conn = conn;
+    search.needle = needle;
+    search.needleLen = strlen(needle);
+    search.maxResults = maxResults;
+    search.names = malloc(capacity * sizeof *search.names);
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.' || (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN)) {
+            continue;
+        }
+        if (search.count == capacity) {
+            capacity *= 2;
+            search.names = realloc(search.names, capacity * sizeof *search.names);
+        }
+        search.names[search.count++] = strdup(entry->d_name);
+    }
+    closedir(dir);
+    pthread_mutex_init(&search.outLock, NULL);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = cpus < 1 ? 1 : (cpus > MAXTHREADS ? MAXTHREADS : (int) cpus);
+    if ((size_t) nthreads > search.count) {
+        nthreads = search.count > 0 ? (int) search.count : 1;
+    }
+
+    // The calling thread is searcher 0
+    searchers = calloc(nthreads, sizeof *searchers);
+    int started = 1;
+    for (int i = 0; i < nthreads; i++) {
+        searchers[i].search = &search;
+    }
+    for (; started < nthreads; started++) {
+        if (pthread_create(&threads[started], NULL, searcher_run, &searchers[started]) != 0) {
+            break;
+        }
+    }
+    searcher_run(&searchers[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (size_t i = 0; i < search.count; i++) {
+        free(search.names[i]);
+    }
+    free(search.names);
+    free(searchers);
+    pthread_mutex_destroy(&search.outLock);
+
+    if (search.failed) {
+        return -1;
+    }
+    return search.maxResults > 0 && search.results > search.maxResults ? search.maxResults : search.results;
+}
@@ -0,0 +1,15 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+#include "conn.h"
+
+/// Find needle (of length len) in haystack (of length n), returns a pointer to the first occurrence or NULL
+const char *search_find(const char *haystack, size_t n, const char *needle, size_t len);
+
+/// Search every regular file in the current directory for needle in parallel and stream one "name:line"
+/// per matching line to conn, stopping after maxResults lines when it is above 0. Returns the number of
+/// matches sent or -1 if the connection failed
+long search_files(conn_t *conn, const char *needle, long maxResults);
+
+#endif
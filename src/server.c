@@ -2,6 +2,8 @@
 ** server.c -- a stream socket server demo
 */
 
+#define _GNU_SOURCE     ///< SEEK_DATA, SEEK_HOLE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -10,60 +12,1733 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
+#include <sys/un.h>
+#include <poll.h>
 #include <signal.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <glob.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+#include "conn.h"
+#include "tls.h"
+#include "digest.h"
+#include "archive.h"
+#include "match.h"
+#include "tree.h"
+#include "search.h"
+#include "lineidx.h"
+#include "ring.h"
+#include "mcast.h"
+#include "wheel.h"
+#include "pool.h"
+#include "manifest.h"
+#include "watch.h"
+#include "sched.h"
+#include "aio.h"
+
+#define PORT "3502"  ///< The port users will be connecting to
+
+//#define DEBUG         ///< Uncomment to print debug information during execution
+
+#define BACKLOG 10     ///< How many pending connections queue will hold
+
+#define FASTOPENQUEUE 256 ///< Connections whose first request came in the SYN that may wait for accept()
+
+#define UPLOADCHUNK 1048576 ///< Uploads are spliced and hashed this many bytes at a time
+
+#define MAXREQUEST 65536 ///< Longest batch request line accepted
+
+#define LISTBUFSIZE 16384 ///< Listing entries are batched into sends of this size
+
+#define MCASTRATE 100 ///< Default multicast send rate in MB/s
+
+#define INDEXLIMIT 1073741824LL ///< Default bytes the line indexes may take, -s changes it
+
+#define MAXPENDING 1024 ///< Accepted connections waiting for their first request, the rest wait in the backlog
+
+#define WATCHPOLL 200 ///< Milliseconds between looks for the client ending a watch or follow over shared memory rings
+
+#define DISKTHREADS 4 ///< Default threads of the disk pool, -D changes it
+
+#define DISKQUEUE 256 ///< Filesystem calls that may wait for a disk pool thread
+
+#define CHANGEBATCH 4096 ///< Changed names looked up one by one, a batch with more rescans the directory instead
+
+/// Default deadlines in seconds, -T changes them
+#define FIRSTTIMEOUT 10     ///< from accepting a connection to its first request
+#define IDLETIMEOUT 300     ///< between requests
+#define READTIMEOUT 30      ///< for more of a request, an upload or multicast repair ranges, to arrive
+#define WRITETIMEOUT 60     ///< for the client to take more of a reply
+
+static off_t quota = 0;    ///< Maximum bytes stored in the served directory, 0 for no limit
+
+static char *indexDir = "/tmp/server-lineidx";    ///< Where line offset indexes and the manifest are kept between requests
+
+static long long indexLimit = INDEXLIMIT;   ///< Bytes the line indexes may take before the least recently used go
+
+static manifest_t served;       ///< Index of the served directory
+static manifest_t *manifest;    ///< &served once it is open, NULL to look everything up on disk
+
+static watch_log_t *watchLog;   ///< Changes to the served directory for watchers, NULL without a manifest
+
+static long long mcastRate = MCASTRATE * 1000000LL;  ///< Bytes per second a multicast session is sent at
+
+/// Deadlines in milliseconds, 0 for none
+static struct {
+    int first, idle, read, write;
+} timeouts = {FIRSTTIMEOUT * 1000, IDLETIMEOUT * 1000, READTIMEOUT * 1000, WRITETIMEOUT * 1000};
+
+/// Connections closed for missing a deadline. The counters are in shared memory so the children add to the
+/// same totals as the accept loop
+typedef struct expiries {
+    unsigned long first;    ///< never sent a request
+    unsigned long idle;     ///< went quiet between requests
+    unsigned long stalled;  ///< stopped sending or taking data in the middle of a request
+} expiries_t;
+
+static expiries_t *expired;
+
+/// An accepted connection that has not sent anything yet. The accept loop holds on to it with its deadline
+/// in the timer wheel and only forks a child once there is a request to serve
+typedef struct pending {
+    int fd;
+    int tcp;                        ///< came in over TCP rather than the unix socket
+    int slot;                       ///< index in the pending table
+    char peer[INET6_ADDRSTRLEN];    ///< where it came from, for messages
+    wtimer_t timer;                 ///< first request deadline
+} pending_t;
+
+/// Handles sigchild
+void sigchld_handler(int s) {
+    (void) s; ///< quiet unused variable warning
+
+    /// waitpid() might overwrite errno, so we save and restore it:
+    int saved_errno = errno;
+
+    while (waitpid(-1, NULL, WNOHANG) > 0);
+
+    errno = saved_errno;
+}
+
+/// Handles SIGIO, raised when a watching or following client sends something or hangs up. The nudge ends
+/// this process's sleep in wait_change() without waking anyone else's
+void sigio_handler(int s) {
+    (void) s;
+
+    int saved_errno = errno;
+    if (watchLog != NULL) {
+        watch_nudge(watchLog);
+    }
+    errno = saved_errno;
+}
+
+
+/// Count a connection closed for missing a deadline and say so with the running total
+void note_expiry(unsigned long *counter, const char *what, const char *peer) {
+    unsigned long total = __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+    printf("server: closed connection from %s, %s (%lu so far)\n", peer, what, total);
+}
+
+/// Read -T first=S,idle=S,read=S,write=S, returns 0 or -1 if it is not understood
+int parse_timeouts(char *options) {
+    char *const names[] = {"first", "idle", "read", "write", NULL};
+    int *fields[] = {&timeouts.first, &timeouts.idle, &timeouts.read, &timeouts.write};
+    char *value;
+
+    while (*options != '\0') {
+        int i = getsubopt(&options, names, &value);
+        if (i == -1 || value == NULL || atoi(value) < 0) {
+            return -1;
+        }
+        *fields[i] = atoi(value) * 1000;
+    }
+    return 0;
+}
+
+/// Read the bandwidth caps given with -B in MB/s, returns -1 if they are not understood
+int parse_rates(char *options, long long *client, long long *total) {
+    char *const names[] = {"client", "total", NULL};
+    long long *fields[] = {client, total};
+    char *value;
+
+    while (*options != '\0') {
+        int i = getsubopt(&options, names, &value);
+        if (i == -1 || value == NULL || atoll(value) < 0) {
+            return -1;
+        }
+        *fields[i] = atoll(value) * 1000000LL;
+    }
+    return 0;
+}
+
+/// get sockaddr, IPv4 or IPv6:
+void *get_in_addr(struct sockaddr *sa) {
+    if (sa->sa_family == AF_INET) {
+        return &(((struct sockaddr_in *) sa)->sin_addr);
+    }
+
+    return &(((struct sockaddr_in6 *) sa)->sin6_addr);
+}
+
+/// Total size of the regular files in a directory, hidden in-progress uploads included
+off_t dir_usage(const char *path) {
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    struct stat st;
+    off_t total = 0;
+
+    if (dir == NULL) {
+        return 0;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode)) {
+            total += st.st_size;
+        }
+    }
+    closedir(dir);
+    return total;
+}
+
+/// Receive an uploaded file, args is "<size> <name>\n". After the quota checks the client is told to go
+/// ahead, the data is spliced from the socket into a hidden temp file while it is hashed, and the temp file
+/// is renamed over name once everything arrived so nobody ever sees a partial file.
+/// The final status for the client is left in msgToSend. Returns 0 once the file is in place or -1
+int receive_upload(conn_t *conn, char *args, char *msgToSend) {
+    char *name;
+    long long size = strtoll(args, &name, 10);
+    name += strspn(name, " ");
+    name[strcspn(name, "\n\r")] = '\0';
+
+    // Only plain names in the served directory, dot files are where uploads are staged
+    if (size < 0 || name[0] == '\0' || name[0] == '.' || strchr(name, '/') != NULL) {
+        strcpy(msgToSend, "Upload rejected: invalid file name\0");
+        return -1;
+    }
+
+    struct statvfs vfs;
+    if (statvfs(".", &vfs) == 0 && (unsigned long long) size > (unsigned long long) vfs.f_bavail * vfs.f_frsize) {
+        strcpy(msgToSend, "Upload rejected: not enough disk space\0");
+        return -1;
+    }
+
+    if (quota > 0) {
+        struct stat old;
+        off_t used = dir_usage(".");
+        if (stat(name, &old) == 0 && S_ISREG(old.st_mode)) {
+            used -= old.st_size;    // The old version goes away when the upload replaces it
+        }
+        if (used + size > quota) {
+            strcpy(msgToSend, "Upload rejected: quota exceeded\0");
+            return -1;
+        }
+    }
+
+    char tmpName[] = ".upload-XXXXXX";
+    int filefd = mkstemp(tmpName);
+    if (filefd == -1) {
+        perror("mkstemp");
+        strcpy(msgToSend, "Upload failed\0");
+        return -1;
+    }
+
+    // Reserve the space now so a full disk is reported before any data is sent
+    if (size > 0 && posix_fallocate(filefd, 0, size) != 0) {
+        close(filefd);
+        unlink(tmpName);
+        strcpy(msgToSend, "Upload rejected: not enough disk space\0");
+        return -1;
+    }
+
+    if (conn_send_frame(conn, FRAME_INFO, "Ready", 5) == -1) {
+        perror("send");
+        close(filefd);
+        unlink(tmpName);
+        strcpy(msgToSend, "Upload failed\0");
+        return -1;
+    }
+
+    digest_t digest;
+    digest_init(&digest);
+    off_t received = 0;
+    while (received < size) {
+        size_t chunk = size - received < UPLOADCHUNK ? size - received : UPLOADCHUNK;
+        ssize_t n = conn_recvfile(conn, filefd, received, chunk);
+        if (n <= 0) {
+            break;
+        }
+        // The chunk was just written so hashing it reads from the page cache
+        if (digest_update_fd(&digest, filefd, received, n) == -1) {
+            perror("digest");
+            break;
+        }
+        received += n;
+    }
+
+    if (received < size) {
+        close(filefd);
+        unlink(tmpName);
+        snprintf(msgToSend, FRAME_MAXTEXT, "Upload failed after %lld of %lld bytes", (long long) received, size);
+        return -1;
+    }
+
+    fchmod(filefd, 0644);   // mkstemp() creates the file private to us
+    close(filefd);
+    if (rename(tmpName, name) == -1) {
+        perror("rename");
+        unlink(tmpName);
+        strcpy(msgToSend, "Upload failed\0");
+        return -1;
+    }
+
+    char hex[DIGEST_HEXLEN];
+    digest_hex(digest_final(&digest), hex);
+    printf("Server: received %lld bytes into %s, digest %s\n", size, name, hex);
+    snprintf(msgToSend, FRAME_MAXTEXT, "Upload complete %s", hex);
+    return 0;
+}
+
+/// qsort() comparison putting names in the same order as ls
+static int compare_names(const void *a, const void *b) {
+    return strcoll(*(char *const *) a, *(char *const *) b);
+}
+
+/// Compile the name filter of a listing or watch, args is empty for every name, " <glob>" or " -r <regex>".
+/// Returns NULL for a regex that does not compile
+static const pattern_t *parse_pattern(char *args) {
+    args[strcspn(args, "\n\r")] = '\0';
+    args += strspn(args, " ");
+    if (strncmp(args, "-r ", 3) == 0) {
+        return pattern_get(args + 3 + strspn(args + 3, " "), 1);
+    }
+    return pattern_get(args, 0);
+}
+
+/// List the served directory, one name per line like ls. args is empty for every entry, " <glob>" or
+/// " -r <regex>" to only list matching names; the pattern is applied while the names are gathered, from the
+/// manifest when it is in step with the directory, so only matches are sent. Returns 0 once the listing has been sent or -1 with an error left in msgToSend
+int send_listing(conn_t *conn, char *args, char *msgToSend) {
+    const pattern_t *pattern = parse_pattern(args);
+
+    if (pattern == NULL) {
+        strcpy(msgToSend, "invalid regular expression\0");
+        return -1;
+    }
+
+    size_t count = 0, capacity = 64;
+    char **names = malloc(capacity * sizeof *names);
+    if (manifest != NULL && manifest_ready(manifest)) {
+        // The names come from the manifest, the directory itself is not read
+        manifest_entry_t entry;
+        size_t slot = 0;
+        while (manifest_next(manifest, &slot, &entry)) {
+            if (!pattern_match(pattern, entry.name, strlen(entry.name))) {
+                continue;
+            }
+            if (count == capacity) {
+                capacity *= 2;
+                names = realloc(names, capacity * sizeof *names);
+            }
+            names[count++] = strdup(entry.name);
+        }
+    } else {
+        DIR *dir = opendir(".");
+        if (dir == NULL) {
+            perror("opendir");
+            free(names);
+            strcpy(msgToSend, "could not read directory\0");
+            return -1;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            size_t len = strlen(entry->d_name);
+            if (entry->d_name[0] == '.' || !pattern_match(pattern, entry->d_name, len)) {
+                continue;
+            }
+            if (count == capacity) {
+                capacity *= 2;
+                names = realloc(names, capacity * sizeof *names);
+            }
+            names[count++] = strdup(entry->d_name);
+        }
+        closedir(dir);
+    }
+    qsort(names, count, sizeof *names, compare_names);
+
+    char out[LISTBUFSIZE];
+    size_t used = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t len = strlen(names[i]);
+        if (used + len + 1 > sizeof out) {
+            conn_send(conn, out, used);
+            used = 0;
+        }
+        if (len + 1 > sizeof out) {
+            conn_send(conn, names[i], len);
+            conn_send(conn, "\n", 1);
+        } else {
+            memcpy(out + used, names[i], len);
+            out[used + len] = '\n';
+            used += len + 1;
+        }
+        free(names[i]);
+    }
+    if (used > 0) {
+        conn_send(conn, out, used);
+    }
+    free(names);
+
+    printf("Server: listed %zu entries\n", count);
+    return 0;
+}
+
+/// Tell the accept loop's changes to watchers
+static void log_change(int change, const char *name) {
+    watch_post(watchLog, change, name);
+}
+
+/// A stat of a changed name on the disk pool
+typedef struct change_op {
+    aio_op_t op;
+    char *name;
+    struct stat st;
+    int exists;
+} change_op_t;
+
+enum { CHANGES_IDLE, CHANGES_DIR, CHANGES_NAMES, CHANGES_RESCAN };
+
+/// The manifest catching up with the served directory, one batch of inotify events at a time. The directory
+/// is stat'ed, the events are read and every name they mention is stat'ed, each on the disk pool, and what
+/// comes back goes into the manifest in the accept loop. Lost events or more than CHANGEBATCH names turn
+/// the batch into a scan of the directory on the pool. Events that come meanwhile wait in inotify
+static struct {
+    int phase;              ///< CHANGES_IDLE, CHANGES_DIR, CHANGES_NAMES or CHANGES_RESCAN
+    aio_op_t dirOp;         ///< stat of the directory, or its scan
+    struct stat dir;
+    int haveDir;
+    manifest_scan_t scan;
+    char **names;           ///< reported by inotify
+    size_t count, capacity;
+    int lost;               ///< events were dropped or there were too many names
+    change_op_t *ops;
+    size_t submitted, completed;
+} changes;
+
+/// Submit what the batch has not handed to the disk pool yet. A full queue is tried again as operations
+/// complete
+static void changes_submit(void) {
+    if (changes.phase == CHANGES_NAMES) {
+        while (changes.submitted < changes.count && aio_submit(&changes.ops[changes.submitted].op) == 0) {
+            changes.submitted++;
+        }
+    } else if (changes.submitted == 0 && aio_submit(&changes.dirOp) == 0) {
+        changes.submitted = 1;
+    }
+}
+
+/// End the batch, the manifest is in step with the directory as it was when dir was taken
+static void changes_finish(const struct stat *dir) {
+    manifest_settle(manifest, dir);
+    for (size_t i = 0; i < changes.count; i++) {
+        free(changes.names[i]);
+    }
+    free(changes.ops);
+    changes.ops = NULL;
+    changes.count = 0;
+    changes.phase = CHANGES_IDLE;
+    if (watchLog != NULL) {
+        watch_wake(watchLog);
+    }
+}
+
+/// Note a name inotify reported. Past CHANGEBATCH names, or without memory for another, the batch becomes a
+/// rescan
+static void queue_change(const char *name) {
+    if (changes.lost) {
+        return;
+    }
+    if (changes.count == CHANGEBATCH) {
+        changes.lost = 1;
+        return;
+    }
+    if (changes.count == changes.capacity) {
+        size_t capacity = changes.capacity == 0 ? 64 : changes.capacity * 2;
+        char **names = realloc(changes.names, capacity * sizeof *names);
+        if (names == NULL) {
+            changes.lost = 1;
+            return;
+        }
+        changes.names = names;
+        changes.capacity = capacity;
+    }
+    if ((changes.names[changes.count] = strdup(name)) == NULL) {
+        changes.lost = 1;
+        return;
+    }
+    changes.count++;
+}
+
+static void stat_name(aio_op_t *op) {
+    change_op_t *c = op->data;
+    c->exists = stat(c->name, &c->st) == 0;
+}
+
+static void name_stated(aio_op_t *op) {
+    change_op_t *c = op->data;
+    int change = manifest_apply(manifest, c->name, c->exists ? &c->st : NULL);
+
+    if (change != 0 && watchLog != NULL) {
+        log_change(change, c->name);
+    }
+    if (++changes.completed == changes.count) {
+        changes_finish(changes.haveDir ? &changes.dir : NULL);
+    } else {
+        changes_submit();
+    }
+}
+
+static void scan_dir(aio_op_t *op) {
+    (void) op;
+    changes.haveDir = manifest_scan(&changes.scan) == 0;
+}
+
+static void dir_scanned(aio_op_t *op) {
+    (void) op;
+    int ok = changes.haveDir && manifest_rescan(manifest, &changes.scan) == 0;
+
+    if (!ok) {
+        fprintf(stderr, "server: manifest rescan failed\n");     // errno stayed with the pool thread
+    }
+    if (watchLog != NULL) {
+        log_change(MANIFEST_RESCANNED, "");
+    }
+    changes_finish(ok ? &changes.scan.dir : NULL);
+    if (changes.haveDir) {
+        manifest_scan_free(&changes.scan);
+    }
+}
+
+static void stat_dir(aio_op_t *op) {
+    (void) op;
+    changes.haveDir = stat(".", &changes.dir) == 0;
+}
+
+/// The directory's mtime was taken before the events are read, so a change that lands after it leaves the
+/// manifest behind the directory and a restart rescans rather than missing it
+static void dir_stated(aio_op_t *op) {
+    (void) op;
+    // queue_change() sets lost itself past CHANGEBATCH names or when it runs out of memory
+    int overflow = manifest_events(manifest, queue_change);
+    changes.lost = changes.lost || overflow;
+    changes.submitted = changes.completed = 0;
+
+    if (!changes.lost) {
+        // A write reports the same name several times, each is looked up once
+        qsort(changes.names, changes.count, sizeof *changes.names, compare_names);
+        size_t unique = 0;
+        for (size_t i = 0; i < changes.count; i++) {
+            if (unique > 0 && strcmp(changes.names[unique - 1], changes.names[i]) == 0) {
+                free(changes.names[i]);
+            } else {
+                changes.names[unique++] = changes.names[i];
+            }
+        }
+        changes.count = unique;
+        if (changes.count == 0) {
+            changes_finish(changes.haveDir ? &changes.dir : NULL);
+            return;
+        }
+        changes.lost = (changes.ops = calloc(changes.count, sizeof *changes.ops)) == NULL;
+    }
+    if (changes.lost) {
+        for (size_t i = 0; i < changes.count; i++) {
+            free(changes.names[i]);
+        }
+        changes.count = 0;
+        changes.phase = CHANGES_RESCAN;
+        changes.dirOp = (aio_op_t) {.run = scan_dir, .done = dir_scanned};
+        changes_submit();
+        return;
+    }
+
+    for (size_t i = 0; i < changes.count; i++) {
+        changes.ops[i] = (change_op_t) {{.run = stat_name, .done = name_stated, .data = &changes.ops[i]},
+                                        changes.names[i], {0}, 0};
+    }
+    changes.phase = CHANGES_NAMES;
+    changes_submit();
+}
+
+/// Start a batch, call when the inotify descriptor is readable and no batch runs. Until it ends lookups in
+/// the manifest go to the filesystem
+static void changes_start(void) {
+    manifest_begin(manifest);
+    changes.phase = CHANGES_DIR;
+    changes.lost = 0;
+    changes.submitted = 0;
+    changes.dirOp = (aio_op_t) {.run = stat_dir, .done = dir_stated};
+    changes_submit();
+}
+
+/// Check a manifest left by an earlier run against the directory with a rescan on the pool. Files rewritten
+/// in place while the server was down do not change the directory's mtime, so until the rescan ends lookups
+/// go to the filesystem
+static void changes_verify(void) {
+    changes.phase = CHANGES_RESCAN;
+    changes.lost = 0;
+    changes.submitted = 0;
+    changes.dirOp = (aio_op_t) {.run = scan_dir, .done = dir_scanned};
+    changes_submit();
+}
+
+/// Send the disk pool's queue depth and latencies, one figure per line
+int send_stats(conn_t *conn, char *msgToSend) {
+    const aio_stats_t *pool = aio_stats();
+    char out[LISTBUFSIZE];
+
+    if (pool == NULL) {
+        strcpy(msgToSend, "no disk pool\0");
+        return -1;
+    }
+    aio_stats_t s = *pool;
+    unsigned long long n = s.completed > 0 ? s.completed : 1;
+    int used = snprintf(out, sizeof out,
+                        "disk threads %u\n"
+                        "disk queued %u of %u\n"
+                        "disk running %u\n"
+                        "disk completed %llu\n"
+                        "disk wait avg %llu us, max %llu us\n"
+                        "disk service avg %llu us, max %llu us\n"
+                        "disk latency p50 under %llu us, p99 under %llu us\n",
+                        s.threads, s.queued, s.limit, s.running, (unsigned long long) s.completed,
+                        (unsigned long long) s.waitNs / n / 1000, (unsigned long long) s.maxWaitNs / 1000,
+                        (unsigned long long) s.serviceNs / n / 1000, (unsigned long long) s.maxServiceNs / 1000,
+                        (unsigned long long) aio_quantile(&s, 0.5), (unsigned long long) aio_quantile(&s, 0.99));
+    if (conn_send(conn, out, used) == -1) {
+        strcpy(msgToSend, "stats not sent\0");
+        return -1;
+    }
+    printf("Server: stats sent\n");
+    strcpy(msgToSend, "Stats sent\0");
+    return 0;
+}
+
+/// Send the queued changes as lines "<change> <name>", returns how many or -1 if the client did not take them
+static long send_changes(conn_t *conn, watch_queue_t *queue) {
+    char out[LISTBUFSIZE];
+    size_t used = 0;
+    long lines = 0;
+
+    if (queue->rescanned) {
+        used = snprintf(out, sizeof out, "%s\n", watch_change_name(MANIFEST_RESCANNED));
+    }
+    for (size_t i = 0; i < queue->count; i++) {
+        if (queue->change[i] == 0) {
+            continue;
+        }
+        if (used + MANIFEST_NAMELEN + 16 > sizeof out) {
+            if (conn_send(conn, out, used) == -1) {
+                return -1;
+            }
+            used = 0;
+        }
+        used += snprintf(out + used, sizeof out - used, "%s %s\n", watch_change_name(queue->change[i]),
+                         queue->name[i]);
+        lines++;
+    }
+    watch_queue_init(queue);
+    if (used > 0 && conn_send(conn, out, used) == -1) {
+        return -1;
+    }
+    conn_flush(conn);
+    return lines;
+}
+
+/// Sleep until the served directory changes, the client sends something or hangs up, or for timeout
+/// milliseconds (-1 for no limit), with mark taken from watch_mark() before the last look. Rings raise no
+/// SIGIO, so over them the client is looked for every WATCHPOLL milliseconds
+static void wait_change(conn_t *conn, uint32_t mark, int timeout) {
+    if (conn->ring != NULL && (timeout < 0 || timeout > WATCHPOLL)) {
+        timeout = WATCHPOLL;
+    }
+    watch_wait(watchLog, mark, timeout);
+}
+
+/// Push changes to the served directory until the client sends anything or hangs up. args is empty for
+/// every name, " <glob>" or " -r <regex>" like a listing. An INFO frame "Watching" starts the reply, then
+/// each burst of changes, once it settled for WATCH_SETTLE milliseconds, arrives as DATA lines
+/// "created <name>", "modified <name>" or "deleted <name>", and "rescanned" when the server lost track and
+/// the client should list again. A client that takes changes more slowly than they happen falls behind the
+/// shared log and is dropped. Returns 0 once the client ended the watch or -1 with an error in msgToSend
+int send_watch(conn_t *conn, char *args, char *msgToSend) {
+    const pattern_t *pattern = parse_pattern(args);
+
+    if (pattern == NULL) {
+        strcpy(msgToSend, "invalid regular expression\0");
+        return -1;
+    }
+    if (watchLog == NULL) {
+        strcpy(msgToSend, "watch not available\0");
+        return -1;
+    }
+    if (conn_send_frame(conn, FRAME_INFO, "Watching", 8) == -1) {
+        strcpy(msgToSend, "Watch failed\0");
+        return -1;
+    }
+
+    watch_queue_t *queue = malloc(sizeof *queue);
+    watch_queue_init(queue);
+    uint64_t seq = watch_head(watchLog);
+    uint64_t settled = 0;       // when the queued burst goes out, 0 while nothing is queued
+    long sent = 0, n;
+    int rv = 0;
+
+    // Whatever the client sends next ends the watch and is left for the request loop
+    conn_notify(conn, 1);
+    while (rv == 0) {
+        uint32_t mark = watch_mark(watchLog);
+        if (conn_readable(conn)) {
+            break;
+        }
+        for (uint64_t head = watch_head(watchLog); seq < head && rv == 0; seq++) {
+            watch_event_t event;
+            if (watch_read(watchLog, seq, &event) == -1) {
+                // Dropped like any other client that stopped taking its reply, after being told why
+                strcpy(msgToSend, "Watch fell behind, changes were lost\0");
+                conn_send_frame(conn, FRAME_ERROR, msgToSend, strlen(msgToSend));
+                conn->timedOut = 1;
+                rv = -1;
+                break;
+            }
+            if (event.change != MANIFEST_RESCANNED && !pattern_match(pattern, event.name, strlen(event.name))) {
+                continue;
+            }
+            // A burst bigger than the queue goes out without waiting for it to settle
+            if (watch_queue_add(queue, event.change, event.name) == -1) {
+                if ((n = send_changes(conn, queue)) == -1) {
+                    strcpy(msgToSend, "Watch failed\0");
+                    rv = -1;
+                    break;
+                }
+                sent += n;
+                watch_queue_add(queue, event.change, event.name);
+            }
+            if (settled == 0) {
+                settled = wheel_now() + WATCH_SETTLE;
+            }
+        }
+        if (rv == 0 && settled != 0 && wheel_now() >= settled) {
+            if ((n = send_changes(conn, queue)) == -1) {
+                strcpy(msgToSend, "Watch failed\0");
+                rv = -1;
+            } else {
+                sent += n;
+            }
+            settled = 0;
+        }
+        if (rv == 0) {
+            long long left = settled != 0 ? (long long) (settled - wheel_now()) : -1;
+            wait_change(conn, mark, left > 0 || left == -1 ? (int) left : 0);
+        }
+    }
+    conn_notify(conn, 0);
+    free(queue);
+    if (rv == 0) {
+        strcpy(msgToSend, "Watch ended\0");
+    }
+    printf("Server: watch sent %ld changes\n", sent);
+    return rv;
+}
+
+/// Send count bytes of filefd at offset like conn_sendfile(). Anything over a quantum is bulk output, sent in
+/// the turns sched_grant() gives out so it shares the link fairly and lets short replies go first
+static ssize_t send_paced(conn_t *conn, int filefd, off_t offset, size_t count) {
+    if (count <= SCHED_QUANTUM) {
+        return conn_sendfile(conn, filefd, offset, count);
+    }
+
+    size_t done = 0;
+    sched_bulk(conn, 1);
+    while (done < count) {
+        size_t grant = sched_grant(count - done);
+        ssize_t n = conn_sendfile(conn, filefd, offset + done, grant);
+        if (n == -1) {
+            sched_bulk(conn, 0);
+            return -1;
+        }
+        done += n;
+        if ((size_t) n < grant) {
+            break;      // the file ended early
+        }
+    }
+    sched_bulk(conn, 0);
+    return done;
+}
+
+/// Send whatever was appended to filefd since *offset and move *offset past it. A file that got shorter was
+/// truncated in place, as copytruncate log rotation does, and is sent again from its start after an INFO
+/// frame "Truncated". Returns the bytes sent or -1 if the client did not take them
+static long long send_appended(conn_t *conn, int filefd, off_t *offset) {
+    struct stat st;
+
+    if (fstat(filefd, &st) == -1) {
+        perror("fstat");
+        return -1;
+    }
+    if (st.st_size < *offset) {
+        *offset = 0;
+        if (conn_send_frame(conn, FRAME_INFO, "Truncated", 9) == -1) {
+            return -1;
+        }
+    }
+    if (st.st_size == *offset) {
+        return 0;
+    }
+    ssize_t n = send_paced(conn, filefd, *offset, st.st_size - *offset);
+    if (n == -1) {
+        return -1;
+    }
+    *offset += n;
+    conn_flush(conn);
+    return n;
+}
+
+/// Open the line index of filefd, trimming the index directory to indexLimit when the index grew. Returns 0
+/// or -1 on error
+static int open_index(lineidx_t *idx, int filefd, const struct stat *st) {
+    if (lineidx_open(idx, indexDir, filefd, st) == -1) {
+        return -1;
+    }
+    if (idx->grew) {
+        lineidx_trim(indexDir, indexLimit);
+    }
+    return 0;
+}
+
+/// Send the end of a file and then whatever is appended to it until the client sends anything or hangs up,
+/// like tail -f. args is "<lines> <name>\n", starting with the last lines of the file, 0 for only what is
+/// written from now on. The follower sleeps on the watch log like a watcher and looks at the file when
+/// anything in the served directory changes, so an idle follower costs a sleeping process and nothing more.
+/// When the name is moved away and a new file takes its place, as log rotation does, the rest of the old
+/// file is sent, then an INFO frame "Rotated" and the new file from its start. Returns 0 once the client
+/// ended the follow or -1 with an error in msgToSend
+int send_follow(conn_t *conn, char *args, char *msgToSend) {
+    char *name;
+    long long lines = strtoll(args, &name, 10);
+    name += strspn(name, " ");
+    name[strcspn(name, "\n\r")] = '\0';
+
+    if (watchLog == NULL) {
+        strcpy(msgToSend, "follow not available\0");
+        return -1;
+    }
+    // Only changes to names in the served directory wake a follower
+    if (name[0] == '.' || strchr(name, '/') != NULL) {
+        strcpy(msgToSend, "File not Found\0");
+        return -1;
+    }
+
+    struct stat st;
+    int filefd = open(name, O_RDONLY);
+    if (filefd == -1 || fstat(filefd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        if (filefd != -1) {
+            close(filefd);
+        }
+        strcpy(msgToSend, "File not Found\0");
+        return -1;
+    }
+
+    off_t offset = st.st_size, end;
+    if (lines > 0) {
+        lineidx_t idx;
+        if (open_index(&idx, filefd, &st) == -1) {
+            perror("lineidx");
+            close(filefd);
+            strcpy(msgToSend, "could not index file\0");
+            return -1;
+        }
+        if (idx.lines > 0) {
+            lineidx_range(&idx, lines < (long long) idx.lines ? idx.lines - lines + 1 : 1, idx.lines, &offset, &end);
+        }
+        lineidx_close(&idx);
+    }
+
+    if (conn_send_frame(conn, FRAME_INFO, "Following", 9) == -1) {
+        close(filefd);
+        strcpy(msgToSend, "Follow failed\0");
+        return -1;
+    }
+
+    long long sent = 0, n;
+    int rv = 0;
+
+    // Whatever the client sends next ends the follow, once what the file held by then was sent, and is left
+    // for the request loop
+    conn_notify(conn, 1);
+    while (rv == 0) {
+        uint32_t mark = watch_mark(watchLog);
+        if ((n = send_appended(conn, filefd, &offset)) == -1) {
+            rv = -1;
+            break;
+        }
+        sent += n;
+
+        // Rotated: the old file was sent to its end above, anything written to it since goes out before the
+        // new one starts
+        struct stat now;
+        if (stat(name, &now) == 0 && S_ISREG(now.st_mode) && (now.st_ino != st.st_ino || now.st_dev != st.st_dev)) {
+            int newfd = open(name, O_RDONLY);
+            if (newfd == -1 || fstat(newfd, &st) == -1) {
+                if (newfd != -1) {
+                    close(newfd);
+                }
+            } else {
+                if ((n = send_appended(conn, filefd, &offset)) == -1 ||
+                    conn_send_frame(conn, FRAME_INFO, "Rotated", 7) == -1) {
+                    close(newfd);
+                    rv = -1;
+                    break;
+                }
+                sent += n;
+                close(filefd);
+                filefd = newfd;
+                offset = 0;
+                continue;
+            }
+        }
+        if (conn_readable(conn)) {
+            break;
+        }
+        wait_change(conn, mark, -1);
+    }
+    conn_notify(conn, 0);
+    close(filefd);
+    if (rv == 0) {
+        strcpy(msgToSend, "Follow ended\0");
+    } else {
+        strcpy(msgToSend, "Follow failed\0");
+    }
+    printf("Server: follow of %s sent %lld bytes\n", name, sent);
+    return rv;
+}
+
+/// Copy the start of a request (args) into a new buffer and complete it from the connection up to the
+/// newline, for requests that may not fit in the first read. The newline is stripped, free() the result
+char *read_request(conn_t *conn, const char *args) {
+    size_t len = strlen(args);
+    char *line = malloc(MAXREQUEST + 1);
+    memcpy(line, args, len + 1);
+
+    while (strchr(line, '\n') == NULL && len < MAXREQUEST) {
+        ssize_t n = conn_recv(conn, line + len, MAXREQUEST - len);
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+        line[len] = '\0';
+    }
+    line[strcspn(line, "\n\r")] = '\0';
+    return line;
+}
+
+/// Send the whole of filefd (with stat st) for the client to store. A file with holes, like a VM image or a
+/// preallocated database, goes as its data extents only. Each extent follows an INFO frame "Extent <offset>"
+/// telling where it belongs, and a last "Extent <size>" marks the end. The client leaves the holes between
+/// them unwritten, so neither the zeros nor the disk space they would take are sent. Files without holes are
+/// sent as they are. Returns the data bytes sent or -1
+static ssize_t send_body(conn_t *conn, int filefd, const struct stat *st) {
+    if ((off_t) st->st_blocks * 512 >= st->st_size) {
+        return send_paced(conn, filefd, 0, st->st_size);
+    }
+
+    char info[64];
+    ssize_t sent = 0;
+    int len;
+    for (off_t data = 0; data < st->st_size && (data = lseek(filefd, data, SEEK_DATA)) != -1;) {
+        off_t hole = lseek(filefd, data, SEEK_HOLE);
+        if (hole == -1 || hole > st->st_size) {
+            hole = st->st_size;     // it grew since st was taken, the rest is for the next download
+        }
+        if (data >= hole) {
+            break;
+        }
+        len = snprintf(info, sizeof info, "Extent %lld", (long long) data);
+        ssize_t n = -1;
+        if (conn_send_frame(conn, FRAME_INFO, info, len) == -1 ||
+            (n = send_paced(conn, filefd, data, hole - data)) == -1) {
+            return -1;
+        }
+        sent += n;
+        data = hole;
+    }
+    len = snprintf(info, sizeof info, "Extent %lld", (long long) st->st_size);
+    if (conn_send_frame(conn, FRAME_INFO, info, len) == -1) {
+        return -1;
+    }
+    return sent;
+}
+
+/// Conditional display or download, args is "<size> <mtime> <hash> <name>\n" describing the client's cached
+/// copy. A copy with the same size and mtime is current without reading the file, and one whose mtime
+/// changed is still current when the file's digest equals its hash, so a touched file is not sent again.
+/// The manifest answers both without opening the file when it can. A current copy gets the status
+/// "Not Modified <mtime>" and no data, otherwise "Modified <size> <mtime>" is sent as an INFO frame followed
+/// by the whole file. Returns 0 or -1 with an error left in msgToSend
+int send_if_modified(conn_t *conn, char *args, char *msgToSend) {
+    char *line = read_request(conn, args);
+    char mtime[32], hash[DIGEST_HEXLEN], current[32];
+    long long size;
+    int used = 0;
+
+    if (sscanf(line, "%lld %31s %16s %n", &size, mtime, hash, &used) != 3 || line[used] == '\0') {
+        free(line);
+        strcpy(msgToSend, "display command with no argument\0");
+        return -1;
+    }
+    char *name = line + used;
+
+    // The manifest can tell a current copy without touching the file, from its size and mtime or the
+    // digest remembered the last time the file was hashed
+    manifest_entry_t entry;
+    if (manifest != NULL && strchr(name, '/') == NULL && manifest_find(manifest, name, &entry) == 1 &&
+        S_ISREG(entry.mode) && (unsigned long long) size == entry.size) {
+        char hex[DIGEST_HEXLEN];
+        snprintf(current, sizeof current, "%lld.%09lld", (long long) entry.mtimeSec, (long long) entry.mtimeNsec);
+        digest_hex(entry.digest, hex);
+        if (strcmp(mtime, current) == 0 || (entry.hasDigest && strcmp(hex, hash) == 0)) {
+            snprintf(msgToSend, FRAME_MAXTEXT, "Not Modified %s", current);
+            printf("Server: %s not modified\n", name);
+            free(line);
+            return 0;
+        }
+    }
+
+    struct stat st;
+    int filefd = open(name, O_RDONLY);
+    if (filefd == -1 || fstat(filefd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        if (filefd != -1) {
+            close(filefd);
+        }
+        free(line);
+        strcpy(msgToSend, "File not Found\0");
+        return -1;
+    }
+    snprintf(current, sizeof current, "%lld.%09ld", (long long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+
+    int unchanged = 0;
+    if (size == st.st_size) {
+        if (strcmp(mtime, current) == 0) {
+            unchanged = 1;
+        } else {
+            digest_t digest;
+            char hex[DIGEST_HEXLEN];
+            digest_init(&digest);
+            if (digest_update_fd(&digest, filefd, 0, st.st_size) == 0) {
+                digest_hex(digest_final(&digest), hex);
+                unchanged = strcmp(hex, hash) == 0;
+                if (manifest != NULL && strchr(name, '/') == NULL) {
+                    manifest_set_digest(manifest, name, &st, digest_final(&digest));
+                }
+            }
+        }
+    }
+
+    if (unchanged) {
+        snprintf(msgToSend, FRAME_MAXTEXT, "Not Modified %s", current);
+        printf("Server: %s not modified\n", name);
+    } else {
+        char info[FRAME_MAXTEXT];
+        int len = snprintf(info, sizeof info, "Modified %lld %s", (long long) st.st_size, current);
+        ssize_t sent = -1;
+        if (conn_send_frame(conn, FRAME_INFO, info, len) != -1) {
+            sent = send_body(conn, filefd, &st);
+        }
+        if (sent == -1) {
+            perror("sendfile");
+        } else {
+            printf("Server: sent %zd bytes of %s\n", sent, name);
+        }
+    }
+    close(filefd);
+    free(line);
+    return 0;
+}
+
+/// Send a range of lines of a file, args is "<first> <last> <name>\n" with 1 based inclusive line numbers,
+/// negative numbers count from the end so "-50 -1" is the last 50 lines. The byte range comes from the
+/// file's line index, so only the requested lines are read and sent no matter where they are in the file.
+/// Returns 0 once the lines have been sent or -1 with an error left in msgToSend
+int send_lines(conn_t *conn, char *args, char *msgToSend) {
+    char *name;
+    long long first = strtoll(args, &name, 10);
+    long long last = strtoll(name, &name, 10);
+    name += strspn(name, " ");
+    name[strcspn(name, "\n\r")] = '\0';
+
+    struct stat st;
+    int filefd = open(name, O_RDONLY);
+    if (filefd == -1 || fstat(filefd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        if (filefd != -1) {
+            close(filefd);
+        }
+        strcpy(msgToSend, "File not Found\0");
+        return -1;
+    }
 
-#define PORT "3502"  ///< The port users will be connecting to
+    lineidx_t idx;
+    if (open_index(&idx, filefd, &st) == -1) {
+        perror("lineidx");
+        close(filefd);
+        strcpy(msgToSend, "could not index file\0");
+        return -1;
+    }
 
-//#define DEBUG         ///< Uncomment to print debug information during execution
+    long long lines = idx.lines;
+    if (first < 0) {
+        first += lines + 1;
+    }
+    if (last < 0) {
+        last += lines + 1;
+    }
+    if (first < 1) {
+        first = 1;
+    }
+    if (last > lines) {
+        last = lines;
+    }
+    if (first > last) {
+        lineidx_close(&idx);
+        close(filefd);
+        strcpy(msgToSend, "No lines in range\0");
+        return -1;
+    }
 
-#define MAXDATASIZE 100 ///< Maximum data size
+    off_t start, end;
+    lineidx_range(&idx, first, last, &start, &end);
+    lineidx_close(&idx);
 
-#define BACKLOG 10     ///< How many pending connections queue will hold
+    if (send_paced(conn, filefd, start, end - start) == -1) {
+        perror("sendfile");
+    }
+    printf("Server: sent lines %lld-%lld of %s\n", first, last, name);
+    close(filefd);
+    return 0;
+}
 
-/// Handles sigchild
-void sigchld_handler(int s) {
-    (void) s; ///< quiet unused variable warning
+/// Stream every regular file matching the names or globs in args as one ustar archive. Each file costs a
+/// 512 byte header, with a long name record in front of it for names over 100 bytes, and its padding, which
+/// are sent together so per file overhead is a single extra send. A request longer than the first read is
+/// completed from the connection. The summary, with the matches that could not be sent, is left in msgToSend
+void send_archive(conn_t *conn, char *args, char *msgToSend) {
+    char *line = read_request(conn, args);
 
-    /// waitpid() might overwrite errno, so we save and restore it:
-    int saved_errno = errno;
+    // Expand every argument, names outside the served directory are skipped
+    glob_t matches;
+    int flags = 0;
+    memset(&matches, 0, sizeof matches);
+    for (char *arg = strtok(line, " "); arg != NULL; arg = strtok(NULL, " ")) {
+        if (arg[0] == '.' || strchr(arg, '/') != NULL) {
+            continue;
+        }
+        if (glob(arg, flags, NULL, &matches) == 0) {
+            flags |= GLOB_APPEND;
+        }
+    }
 
-    while (waitpid(-1, NULL, WNOHANG) > 0);
+    // Room for the previous file's padding plus the next header, or the two blocks that end the archive
+    char blocks[TARBLOCK + TAR_MAXHEADER];
+    size_t pending = 0;
+    int files = 0, skipped = 0, header = 0;
+    long long total = 0;
 
-    errno = saved_errno;
+    for (size_t i = 0; i < matches.gl_pathc; i++) {
+        struct stat st;
+        int filefd = open(matches.gl_pathv[i], O_RDONLY);
+        if (filefd != -1 && (fstat(filefd, &st) == -1 || !S_ISREG(st.st_mode))) {
+            close(filefd);      // directories and other entries are left out on purpose
+            continue;
+        }
+        // A file that cannot be read or named in the archive is counted for the status
+        if (filefd == -1 || (header = tar_header(blocks + pending, matches.gl_pathv[i], &st)) == -1) {
+            if (filefd != -1) {
+                close(filefd);
+            }
+            skipped++;
+            continue;
+        }
+        if (conn_send(conn, blocks, pending + header) == -1) {
+            close(filefd);
+            break;
+        }
+
+        ssize_t sent = send_paced(conn, filefd, 0, st.st_size);
+        close(filefd);
+        if (sent == -1) {
+            perror("sendfile");
+            break;
+        }
+        // A file that shrank under us is zero filled so the archive stays well formed
+        for (off_t gap = st.st_size - sent; gap > 0;) {
+            size_t n = gap < TARBLOCK ? gap : TARBLOCK;
+            memset(blocks, 0, n);
+            if (conn_send(conn, blocks, n) == -1) {
+                break;
+            }
+            gap -= n;
+        }
+
+        pending = tar_padding(st.st_size);
+        memset(blocks, 0, pending);
+        files++;
+        total += st.st_size;
+    }
+
+    // Two zero blocks end the archive
+    memset(blocks, 0, sizeof blocks);
+    conn_send(conn, blocks, pending + 2 * TARBLOCK);
+
+    printf("Server: sent %d files, %lld bytes, skipped %d\n", files, total, skipped);
+    if (skipped > 0) {
+        snprintf(msgToSend, FRAME_MAXTEXT, "Sent %d files, %lld bytes, %d could not be sent", files, total, skipped);
+    } else {
+        snprintf(msgToSend, FRAME_MAXTEXT, "Sent %d files, %lld bytes", files, total);
+    }
+    globfree(&matches);
+    free(line);
 }
 
+/// Multicast a file to every client subscribed to it at about the same time, args is "<name>\n". The first
+/// subscriber starts a sender process, which holds an exclusive lock on the file while it multicasts, and
+/// later ones join its session. The client is told the group in an INFO frame, then sends "N <offset> <length>"
+/// for every range it missed and a bare "N" once done, and each range is answered with DATA frames. So the
+/// server sends the file once however many clients subscribe, plus what they lost.
+/// The final status is left in msgToSend. Returns 0 or -1
+int send_multicast(conn_t *conn, char *args, char *msgToSend) {
+    char *name = args;
+    name[strcspn(name, "\n\r")] = '\0';
 
-/// get sockaddr, IPv4 or IPv6:
-void *get_in_addr(struct sockaddr *sa) {
-    if (sa->sa_family == AF_INET) {
-        return &(((struct sockaddr_in *) sa)->sin_addr);
+    struct stat st;
+    int filefd = open(name, O_RDONLY | O_CLOEXEC);
+    if (filefd == -1 || fstat(filefd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        if (filefd != -1) {
+            close(filefd);
+        }
+        strcpy(msgToSend, "File not Found\0");
+        return -1;
     }
 
-    return &(((struct sockaddr_in6 *) sa)->sin6_addr);
+    uint32_t session = mcast_session(name, &st);
+    struct in_addr group = mcast_group(session), interface = mcast_interface(conn->fd);
+    char groupName[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &group, groupName, sizeof groupName);
+
+    // The lock is taken on an open file of its own so that only the sender holds it
+    int lockfd = open(name, O_RDONLY | O_CLOEXEC);
+    if (lockfd != -1 && flock(lockfd, LOCK_EX | LOCK_NB) == 0) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(conn->fd);
+            exit(mcast_send(lockfd, st.st_size, session, group, interface, mcastRate) == 0 ? 0 : 1);
+        }
+        if (pid == -1) {
+            perror("fork");
+        } else {
+            printf("Server: multicasting %s to %s\n", name, groupName);
+        }
+    }
+    if (lockfd != -1) {
+        close(lockfd);
+    }
+
+    char info[FRAME_MAXTEXT];
+    snprintf(info, sizeof info, "Group %s %d %u %lld", groupName, MCASTPORT, session, (long long) st.st_size);
+    if (conn_send_frame(conn, FRAME_INFO, info, strlen(info)) == -1) {
+        close(filefd);
+        strcpy(msgToSend, "Multicast failed\0");
+        return -1;
+    }
+
+    // The client only asks for ranges once the multicast is over, so the wait for them includes sending it
+    if (timeouts.read > 0) {
+        conn_set_timeout(conn, 1, timeouts.read + MCASTGATHERMS + (int) (st.st_size * 1000 / mcastRate));
+    }
+
+    // Ranges are read up to the bare N even after a failure, so the connection stays in step
+    char line[128];
+    long long repaired = 0;
+    int ranges = 0, failed = 0;
+    while (1) {
+        if (conn_recvline(conn, line, sizeof line) <= 0) {
+            close(filefd);
+            strcpy(msgToSend, "Multicast failed\0");
+            return -1;
+        }
+        if (strcmp(line, "N\n") == 0) {
+            break;
+        }
+        long long offset, length;
+        if (sscanf(line, "N %lld %lld", &offset, &length) != 2 || offset < 0 || length <= 0 ||
+            offset + length > st.st_size) {
+            failed = 1;
+        }
+        if (failed) {
+            continue;
+        }
+        if (send_paced(conn, filefd, offset, length) != length) {
+            perror("sendfile");
+            failed = 1;
+            continue;
+        }
+        repaired += length;
+        ranges++;
+    }
+    close(filefd);
+
+    if (failed) {
+        strcpy(msgToSend, "Multicast repair failed\0");
+        return -1;
+    }
+    printf("Server: multicast of %s repaired %d ranges, %lld bytes\n", name, ranges, repaired);
+    snprintf(msgToSend, FRAME_MAXTEXT, "Multicast %lld bytes, %lld repaired", (long long) st.st_size, repaired);
+    return 0;
+}
+
+/// Carry out one request and leave its status, if it has one, in msgToSend. Output goes to conn as it is
+/// produced, the caller ends the reply with the status. Returns 0 if the command succeeded or -1 if it failed
+int handle_request(conn_t *conn, char *buff, char *msgToSend) {
+    // Case of ls listing command to the server
+    if (strncmp(buff, "L", 1) == 0) {      // This checks if command is 'encoded' as L
+        if (send_listing(conn, buff + 1, msgToSend) == -1) {
+            return -1;
+        }
+#ifdef DEBUG
+        printf("listing sent\n");
+#endif
+    }
+        // Case of check command 'encoded' as C
+    else if (strncmp(buff, "C ", 2) == 0) {
+#ifdef DEBUG
+        printf("Attempt to check if %s exists \n", buff);
+#endif
+        // The name is the rest of the request, used where it is
+        char *tmpMsg = buff + 2;
+        tmpMsg[strcspn(tmpMsg, "\n\r")] = '\0';
+#ifdef DEBUG
+        printf("buff = %s\n", buff);
+        printf("temp msg = %s\n", tmpMsg);
+        printf("length of tmpMsg = %lu \n", strlen(tmpMsg));
+#endif
+        // The manifest knows every name in the served directory, paths below it are looked up on disk
+        manifest_entry_t entry;
+        int found = manifest != NULL && strchr(tmpMsg, '/') == NULL ? manifest_find(manifest, tmpMsg, &entry) : -1;
+        if (found == -1) {
+            found = access(tmpMsg, F_OK) == 0;
+        }
+        if (!found) {
+            strcpy(msgToSend, "File not found\0");
+            return -1;
+        } else {
+            strcpy(msgToSend, "File exists\0");
+        }
+    }
+        // Case of check command with no entry
+    else if (strncmp(buff, "C\n", 2) == 0) {
+        strcpy(msgToSend, "check command with no argument\0");
+        return -1;
+    }
+        // Case of display command 'encoded' as P
+    else if (strncmp(buff, "P ", 2) == 0 || strncmp(buff, "D ", 2) == 0) {
+
+#ifdef DEBUG
+        // Print buff when debugging
+        printf("Attempt to display %s \n", buff);
+#endif
+
+        // The name is the rest of the request, used where it is
+        char *tmpMsg = buff + 2;
+        tmpMsg[strcspn(tmpMsg, "\n\r")] = '\0';
+
+#ifdef DEBUG    // Show current strings and their lengths when debugging
+        printf("buff = %s\n", buff);
+        printf("temp msg = %s\n", tmpMsg);
+        printf("length of tmpMsg = %lu \n", strlen(tmpMsg));
+#endif
+        // Now determine if the file exists and is something we can send
+        struct stat st;
+        int filefd = open(tmpMsg, O_RDONLY);
+        if (filefd == -1 || fstat(filefd, &st) == -1 || !S_ISREG(st.st_mode)) {
+            if (filefd != -1) {
+                close(filefd);
+            }
+            strcpy(msgToSend, "File not Found\0");
+            return -1;
+        }
+
+            // The file exists, so now send the contents to the user straight from the page cache
+        else {
+#ifdef DEBUG
+            printf("now trying to send File ");
+#endif
+            // A download keeps the holes of a sparse file, a display needs every byte
+            ssize_t sent = buff[0] == 'D' ? send_body(conn, filefd, &st) : send_paced(conn, filefd, 0, st.st_size);
+            if (sent == -1) {
+                perror("sendfile");
+                close(filefd);
+                strcpy(msgToSend, "Display failed\0");
+                return -1;
+            }
+            printf("Server: sent %zd bytes of %s\n", sent, tmpMsg);
+
+#ifdef DEBUG
+            printf("closing FILE\n");
+#endif
+            close(filefd);
+        }
+
+    }
+        // Case of upload command 'encoded' as U
+    else if (strncmp(buff, "U ", 2) == 0) {
+        return receive_upload(conn, buff + 2, msgToSend);
+    }
+        // Case of tree listing command 'encoded' as T, followed by the depth limit and follow flag
+    else if (strncmp(buff, "T", 1) == 0) {
+        int maxDepth = 0, follow = 0;
+        sscanf(buff + 1, "%d %d", &maxDepth, &follow);
+        long entries = tree_walk(conn, maxDepth < 0 ? 0 : maxDepth, follow);
+        printf("Server: tree listing sent %ld entries\n", entries);
+    }
+        // Case of search command 'encoded' as G, followed by the result limit and the text to find
+    else if (strncmp(buff, "G ", 2) == 0) {
+        char *needle;
+        long maxResults = strtol(buff + 2, &needle, 10);
+        needle += strspn(needle, " ");
+        needle[strcspn(needle, "\n\r")] = '\0';
+        if (needle[0] == '\0') {
+            strcpy(msgToSend, "search command with no argument\0");
+            return -1;
+        }
+        long matches = search_files(conn, needle, maxResults);
+        printf("Server: search for '%s' sent %ld matches\n", needle, matches);
+    }
+        // Case of line range display command 'encoded' as R
+    else if (strncmp(buff, "R ", 2) == 0) {
+        return send_lines(conn, buff + 2, msgToSend);
+    }
+        // Case of conditional display or download 'encoded' as V, followed by what the client has cached
+    else if (strncmp(buff, "V ", 2) == 0) {
+        return send_if_modified(conn, buff + 2, msgToSend);
+    }
+        // Case of batch download command 'encoded' as B
+    else if (strncmp(buff, "B ", 2) == 0) {
+        send_archive(conn, buff + 2, msgToSend);
+    }
+        // Case of multicast download command 'encoded' as F
+    else if (strncmp(buff, "F ", 2) == 0) {
+        return send_multicast(conn, buff + 2, msgToSend);
+    }
+        // Case of watch command 'encoded' as W, keeping any glob or -r regex filter
+    else if (strncmp(buff, "W", 1) == 0) {
+        return send_watch(conn, buff + 1, msgToSend);
+    }
+        // Case of follow command 'encoded' as A, followed by the lines to start with and the file name
+    else if (strncmp(buff, "A ", 2) == 0) {
+        return send_follow(conn, buff + 2, msgToSend);
+    }
+        // Case of stats command 'encoded' as S
+    else if (strncmp(buff, "S\n", 2) == 0) {
+        return send_stats(conn, msgToSend);
+    }
+        /// Case of display command with no entry
+    else if (strncmp(buff, "P\n", 2) == 0) {
+        strcpy(msgToSend, "display command with no argument\0");
+        return -1;
+    } else if (strncmp(buff, "D\n", 2) == 0) {
+        strcpy(msgToSend, "download command with no argument\0");
+        return -1;
+    } else if (strncmp(buff, "B\n", 2) == 0) {
+        strcpy(msgToSend, "get command with no argument\0");
+        return -1;
+    } else if (strncmp(buff, "U\n", 2) == 0) {
+        strcpy(msgToSend, "upload command with no argument\0");
+        return -1;
+    } else if (strncmp(buff, "F\n", 2) == 0) {
+        strcpy(msgToSend, "mcast command with no argument\0");
+        return -1;
+    }
+        /// If command is not recognized tell client
+    else {
+        strcpy(msgToSend, "command not recognized by server\0");
+        return -1;
+    }
+    return 0;
+}
+
+/// Receive one request line into *buff, a pool buffer of *size bytes, moving to a bigger one while the line
+/// does not fit, up to MAXREQUEST. Most requests fit the smallest buffer. Returns the length, 0 on end of
+/// stream or -1 on error, also when there is no memory for the rest of the line
+ssize_t recv_request(conn_t *conn, char **buff, size_t *size) {
+    size_t len = 0;
+
+    while (1) {
+        ssize_t n = conn_recvline(conn, *buff + len, *size - len);
+        if (n <= 0) {
+            return len > 0 ? (ssize_t) len : n;
+        }
+        len += n;
+        if ((*buff)[len - 1] == '\n' || *size >= MAXREQUEST) {
+            return len;
+        }
+        char *bigger = pool_grow(*buff, size, len);
+        if (bigger == NULL) {
+            return -1;      // errno is ENOMEM
+        }
+        *buff = bigger;
+    }
+}
+
+/// Serve the requests of one client on new_fd until it hangs up, tcp says whether it came in over TCP.
+/// peer names the client in messages. Runs in the forked child, where the idle, read and write deadlines are
+/// socket timeouts: a client that stays quiet too long between requests, stops sending the rest of one or
+/// stops taking a reply is dropped
+void serve_client(int new_fd, int tcp, const char *peer) {
+    int numbytes, yes = 1;
+    conn_t conn = {new_fd, NULL, 1, NULL, 0, 0};   ///< replies are framed
+
+    conn_set_timeout(&conn, 0, timeouts.write);
+    conn_set_timeout(&conn, 1, timeouts.read);
+
+    /// The handshake runs in the child so a slow client can't stall the accept loop, local clients on the
+    /// unix socket are trusted like any other local user and skip it
+    if (tcp && tls_enabled() && tls_accept(&conn) == -1) {
+        fprintf(stderr, "server: TLS handshake with %s failed\n", peer);
+        close(new_fd);
+        exit(1);
+    }
+    // Every reply now ends with a small status frame, which must not wait for the ACK of the output
+    if (tcp) {
+        setsockopt(new_fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+    }
+    sched_bulk(&conn, 0);   // replies start out interactive, send_paced() marks the bulk output
+
+    /// Requests are served in order until the client hangs up, so a client can pipeline them
+    size_t size;
+    char *buff = pool_get(POOL_SMALL, &size);
+    if (buff == NULL) {
+        perror("server: request buffer");
+        conn_close(&conn);
+        return;
+    }
+    while (1) {
+        // Quiet between requests is the idle deadline, once a request came in the rest of it gets the read one
+        conn_set_timeout(&conn, 1, timeouts.idle);
+        if ((numbytes = recv_request(&conn, &buff, &size)) <= 0) {
+            break;
+        }
+        conn_set_timeout(&conn, 1, timeouts.read);
+        printf("Server: received %s\n", buff);
+
+        /// A client on the unix socket can move the connection to shared memory rings, the memfd holding them
+        /// goes back over the socket and every later request and reply goes through the rings
+        if (!tcp && conn.ring == NULL && strcmp(buff, "M\n") == 0) {
+            int memfd = ring_create(&conn);
+            if (memfd == -1) {
+                perror("server: shared memory");
+                conn_send_frame(&conn, FRAME_ERROR, "shared memory unavailable", 25);
+                continue;
+            }
+            if (conn_send_fd(&conn, FRAME_END, "Ring", 4, memfd) == -1) {
+                perror("sendmsg");
+                close(memfd);
+                break;
+            }
+            close(memfd);
+            conn_set_timeout(&conn, 0, timeouts.write);  // the rings keep their own deadlines
+            continue;
+        }
+
+        // Create a string to hold the message to send
+        char msgToSend[FRAME_MAXTEXT];
+        for (int i = 0; i < FRAME_MAXTEXT; i++) {
+            msgToSend[i] = 0;
+        }
+
+        int rv = handle_request(&conn, buff, msgToSend);
+        if (conn.timedOut) {
+            note_expiry(&expired->stalled, "transfer stalled", peer);
+            break;
+        }
+
+#ifdef DEBUG
+        printf("sending message to client: %s\n", msgToSend);
+#endif
+
+        // This ends the reply with the status and prints an error if it fails
+        if (conn_send_frame(&conn, rv == 0 ? FRAME_END : FRAME_ERROR, msgToSend, strlen(msgToSend)) == -1) {
+            if (conn.timedOut) {
+                note_expiry(&expired->stalled, "reply not taken", peer);
+            } else {
+                perror("send");
+            }
+            break;
+        }
+    }
+    if (numbytes == -1 && conn.timedOut) {
+        note_expiry(&expired->idle, "idle", peer);
+    } else if (numbytes == -1) {
+        perror("recv");
+    }
+    pool_put(buff, size);
+
+#ifdef DEBUG
+    printf("now closing listener and exiting fork\n");
+#endif
+
+    conn_close(&conn);     ///< close connection
+}
+
+/// Listen on a unix domain socket at path as well, a stale socket left by an earlier run is replaced.
+/// Returns the listening socket or -1
+int listen_unix(const char *path) {
+    struct sockaddr_un addr;
+    struct stat st;
+
+    if (strlen(path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "server: unix socket path too long\n");
+        return -1;
+    }
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("server: socket");
+        return -1;
+    }
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    if (bind(fd, (struct sockaddr *) &addr, sizeof addr) == -1 || listen(fd, BACKLOG) == -1) {
+        perror("server: unix socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
-int main(void) {
-    int sockfd, new_fd, numbytes;  ///< listen on sock_fd, new connection on new_fd
+int main(int argc, char *argv[]) {
+    int sockfd, new_fd;  ///< listen on sock_fd, new connection on new_fd
+    int unixfd = -1;     ///< optional unix domain socket listener
     struct addrinfo hints, *servinfo, *p;
     struct sockaddr_storage their_addr; ///< connector's address information
     socklen_t sin_size;
     struct sigaction sa;
     int yes = 1;
     char s[INET6_ADDRSTRLEN];
-    char buff[MAXDATASIZE];
 
-    int rv;
+    int rv, opt, badTimeouts = 0, badRates = 0, diskThreads = DISKTHREADS, aiofd = -1;
+    long long clientRate = 0, totalRate = 0;
+    char *certfile = NULL, *keyfile = NULL, *unixPath = NULL, *port = PORT;
+
+    /// Supplying a certificate and key turns on TLS for every TCP connection, -u also listens on a unix socket,
+    /// -T sets deadlines in seconds (0 for none), -p picks another port so several servers of a cluster can
+    /// share a host, -B caps the bandwidth of each connection and of all of them in MB/s (0 for none), -D sets
+    /// the threads of the disk pool, -s the bytes the line indexes may take
+    while ((opt = getopt(argc, argv, "c:k:q:i:s:u:r:T:p:B:D:")) != -1) {
+        switch (opt) {
+            case 'c':
+                certfile = optarg;
+                break;
+            case 'k':
+                keyfile = optarg;
+                break;
+            case 'q':
+                quota = strtoll(optarg, NULL, 10);
+                break;
+            case 'i':
+                indexDir = optarg;
+                break;
+            case 's':
+                indexLimit = strtoll(optarg, NULL, 10);
+                break;
+            case 'u':
+                unixPath = optarg;
+                break;
+            case 'r':
+                mcastRate = strtoll(optarg, NULL, 10) * 1000000LL;
+                break;
+            case 'T':
+                badTimeouts |= parse_timeouts(optarg) == -1;
+                break;
+            case 'p':
+                port = optarg;
+                break;
+            case 'B':
+                badRates |= parse_rates(optarg, &clientRate, &totalRate) == -1;
+                break;
+            case 'D':
+                diskThreads = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: server [-c certfile -k keyfile] [-q quotabytes] [-i indexdir] [-s indexbytes] [-u socketpath] "
+                                "[-r mcastMBps] [-T first=S,idle=S,read=S,write=S] [-p port] [-B client=MBps,total=MBps] [-D diskthreads]\n");
+                exit(1);
+        }
+    }
+    if ((certfile == NULL) != (keyfile == NULL) || mcastRate <= 0 || badTimeouts || badRates || diskThreads < 1 ||
+        diskThreads > AIO_MAXTHREADS) {
+        fprintf(stderr, "usage: server [-c certfile -k keyfile] [-q quotabytes] [-i indexdir] [-s indexbytes] [-u socketpath] "
+                        "[-r mcastMBps] [-T first=S,idle=S,read=S,write=S] [-p port] [-B client=MBps,total=MBps] [-D diskthreads]\n");
+        exit(1);
+    }
+    if (sched_init(clientRate, totalRate) == -1) {
+        perror("server: bandwidth scheduler");
+        exit(1);
+    }
+    if (certfile != NULL && tls_server_init(certfile, keyfile) == -1) {
+        fprintf(stderr, "server: failed to load TLS certificate\n");
+        exit(1);
+    }
+
+    if (mkdir(indexDir, 0700) == -1 && errno != EEXIST) {
+        perror("server: index directory");
+        exit(1);
+    }
+    lineidx_trim(indexDir, indexLimit);
+
+    /// The accept loop's own filesystem calls run on the disk pool, see changes_start(). Its threads exist
+    /// only in this process, the children forked from it make their calls themselves
+    if ((aiofd = aio_init(diskThreads, DISKQUEUE)) == -1) {
+        perror("server: disk pool");
+        exit(1);
+    }
+
+    /// Without a manifest every lookup goes to the filesystem, which still works
+    if (manifest_open(&served, indexDir) == 0) {
+        manifest = &served;
+        watchLog = watch_log_create();
+        printf("server: manifest holds %llu names\n", (unsigned long long) served.header->used);
+        if (!manifest_ready(manifest)) {
+            changes_verify();
+        }
+    } else {
+        perror("server: manifest");
+    }
 
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE; ///< use my IP
 
-    if ((rv = getaddrinfo(NULL, PORT, &hints, &servinfo)) != 0) {
+    if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
         return 1;
     }
@@ -96,11 +1771,22 @@ int main(void) {
         exit(1);
     }
 
+    /// A client that connected before may send its first request in the SYN, TCP Fast Open. The kernel only
+    /// takes it up when the net.ipv4.tcp_fastopen sysctl has the server bit (2) set
+    int fastopen = FASTOPENQUEUE;
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, sizeof fastopen) == -1) {
+        perror("setsockopt TCP_FASTOPEN");
+    }
+
     if (listen(sockfd, BACKLOG) == -1) {
         perror("listen");
         exit(1);
     }
 
+    if (unixPath != NULL && (unixfd = listen_unix(unixPath)) == -1) {
+        exit(1);
+    }
+
     sa.sa_handler = sigchld_handler; // reap all dead processes
     sigemptyset(&sa.sa_mask);
     sa.sa_flags = SA_RESTART;
@@ -109,180 +1795,146 @@ int main(void) {
         exit(1);
     }
 
-    printf("server: waiting for connections...\n");
+    /// A client hanging up mid-transfer should fail the send, not kill the process
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sa, NULL) == -1) {
+        perror("sigaction");
+        exit(1);
+    }
 
-    while (1) {  ///< main accept() loop
-        sin_size = sizeof their_addr;
-        new_fd = accept(sockfd, (struct sockaddr *) &their_addr, &sin_size);
-        if (new_fd == -1) {
-            perror("accept");
-            continue;
-        }
+    /// Watchers and followers are told about their client's input by SIGIO, see conn_notify()
+    sa.sa_handler = sigio_handler;
+    if (sigaction(SIGIO, &sa, NULL) == -1) {
+        perror("sigaction");
+        exit(1);
+    }
 
-        inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr *) &their_addr), s, sizeof s);
-        printf("server: got connection from %s\n", s);  ///< Print where the connection is from
+    printf("server: waiting for connections...\n");
 
-        if (!fork()) { ///< this is the child process
-            close(sockfd); ///< child doesn't need the listener
-            if ((numbytes = recv(new_fd, buff, MAXDATASIZE - 1, 0)) == -1) {
-                perror("recv");
-                exit(1);
-            }
-            buff[numbytes] = '\0';                  // Null terminate string
+    /// Expiries are counted across every child
+    expired = mmap(NULL, sizeof *expired, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (expired == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
 
-            printf("Server: received %s\n", buff);
+    /// Both listeners, the manifest's watch, the disk pool's completions and every accepted connection still
+    /// waiting for its first request are served from one loop. poll() says which has something waiting and
+    /// sleeps no longer than the timer wheel's next deadline
+    struct pollfd *fds = malloc((4 + MAXPENDING) * sizeof *fds);
+    pending_t *pending[MAXPENDING];
+    int nlisteners = unixfd != -1 ? 2 : 1, nfixed = nlisteners, npending = 0;
+    wheel_t wheel;
+    wheel_init(&wheel, wheel_now());
+    fds[0] = (struct pollfd) {sockfd, POLLIN, 0};
+    fds[1] = (struct pollfd) {unixfd, POLLIN, 0};
+    if (manifest != NULL) {
+        fds[nfixed++] = (struct pollfd) {served.watchfd, POLLIN, 0};
+    }
+    int aioslot = nfixed;
+    fds[nfixed++] = (struct pollfd) {aiofd, POLLIN, 0};
 
-            // Create a string to hold the message to send
-            char msgToSend[MAXDATASIZE];
-            for (int i = 0; i < MAXDATASIZE; i++) {
-                msgToSend[i] = 0;
+    while (1) {  ///< main accept() loop
+        // A full pending table leaves new connections in the listen backlog
+        for (int l = 0; l < nlisteners; l++) {
+            fds[l].events = npending < MAXPENDING ? POLLIN : 0;
+        }
+        // Changes that come while a batch runs wait for the next one
+        if (manifest != NULL) {
+            fds[nlisteners].events = changes.phase == CHANGES_IDLE ? POLLIN : 0;
+        }
+        for (int i = 0; i < npending; i++) {
+            fds[nfixed + i] = (struct pollfd) {pending[i]->fd, POLLIN, 0};
+        }
+        if (poll(fds, nfixed + npending, (int) wheel_timeout(&wheel)) == -1) {
+            if (errno != EINTR) {
+                perror("poll");
             }
+            continue;
+        }
 
-            // Case of ls listing command to the server
-            if (strncmp(buff, "L", 1) == 0) {      // This checks if command is 'encoded' as L
-                FILE *fp;
-                execl(".", "ls", NULL);
-                fp = popen("ls", "r");
-                while (fgets(buff, sizeof(buff), fp) != NULL) {
-                    strncat(msgToSend, buff, sizeof(msgToSend) - strlen(msgToSend) - 1);
-                    printf("%s", buff);
-                }
-#ifdef DEBUG
-                printf("closing FILE\n");
-#endif
-                pclose(fp);
-            }
-                // Case of check command 'encoded' as C
-            else if (strncmp(buff, "C ", 2) == 0) {
-#ifdef DEBUG
-                printf("Attempt to check if %s exists \n", buff);
-#endif
-                // Create temp string to hold message
-                char tmpMsg[MAXDATASIZE];
-                for (int i = 0; i < MAXDATASIZE; i++) {
-                    tmpMsg[i] = 0;
-                }
-                // Check rest of command
-                for (int i = 2; i < MAXDATASIZE; i++) {
-                    tmpMsg[i - 2] = buff[i];
-                }
+        /// The manifest catches up with the directory without the loop waiting for the disk, and watchers are
+        /// told what changed. Children forked meanwhile look names up on disk
+        if (fds[aioslot].revents & POLLIN) {
+            aio_complete();
+        }
+        if (manifest != NULL && changes.phase == CHANGES_IDLE && (fds[nlisteners].revents & POLLIN)) {
+            changes_start();
+        }
 
-                // Null terminate string
-                tmpMsg[strlen(tmpMsg) - 1] = '\0';
-#ifdef DEBUG
-                printf("buff = %s\n", buff);
-                printf("temp msg = %s\n", tmpMsg);
-                printf("length of tmpMsg = %lu \n", strlen(tmpMsg));
-#endif
-                int tmp = access(tmpMsg, F_OK);
-                if ((tmp) == -1) {
-                    strcpy(msgToSend, "File not found\0");
-                } else {
-                    strcpy(msgToSend, "File exists\0");
-                }
-            }
-                // Case of check command with no entry
-            else if (strncmp(buff, "C\n", 2) == 0) {
-                strcpy(msgToSend, "check command with no argument\0");
+        /// A connection with something to read, or that hung up, gets its child. Going backwards keeps the
+        /// entries not looked at yet where they were when a served one is taken out of the table
+        for (int i = npending - 1; i >= 0; i--) {
+            if (!(fds[nfixed + i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
             }
-                // Case of display command 'encoded' as P
-            else if (strncmp(buff, "P ", 2) == 0 || strncmp(buff, "D ", 2) == 0) {
-
-#ifdef DEBUG
-                // Print buff when debugging
-                printf("Attempt to display %s \n", buff);
-#endif
-
-                // Create temp string to hold message
-                char tmpMsg[MAXDATASIZE];
-                for (int i = 0; i < MAXDATASIZE; i++) {
-                    tmpMsg[i] = 0;
+            pending_t *pc = pending[i];
+            wheel_cancel(&wheel, &pc->timer);
+            fflush(stdout);     ///< or the child prints what is still buffered a second time
+            if (!fork()) { ///< this is the child process
+                close(sockfd); ///< child doesn't need the listeners or the other connections
+                if (unixfd != -1) {
+                    close(unixfd);
                 }
-
-                // shift buff into tmpMsg
-                for (int i = 2; i < MAXDATASIZE; i++) {
-                    tmpMsg[i - 2] = buff[i];
-                }
-
-                // Null terminate string
-                tmpMsg[strlen(tmpMsg) - 1] = '\0';
-
-#ifdef DEBUG    // Show current strings and their lengths when debugging
-                printf("buff = %s\n", buff);
-                printf("temp msg = %s\n", tmpMsg);
-                printf("length of tmpMsg = %lu \n", strlen(tmpMsg));
-#endif
-                // Now determine if the file exists
-                int tmp = access(tmpMsg, F_OK);
-                if ((tmp) == -1) {
-                    strcpy(msgToSend, "File not Found\0");
+                if (manifest != NULL) {
+                    close(served.watchfd);
                 }
-
-                    // The file exists, so now attempt to send the contents to the user
-                else {
-#ifdef DEBUG
-                    printf("now trying to read File ");
-#endif
-
-                    char tmpMsg2[MAXDATASIZE] = "cat \0";
-
-                    strcat(tmpMsg2, tmpMsg);
-#ifdef DEBUG
-                    printf("tmpMsg2 = %s \n", tmpMsg2);
-#endif
-
-                    FILE *fp;
-                    fp = popen(tmpMsg2, "r");
-                    while (fgets(buff, sizeof(buff), fp) != NULL) {
-                        strcpy(msgToSend, buff);
-
-#ifdef DEBUG
-                        printf("msgToSend = %s\n", msgToSend);
-#endif
-
-                        if (send(new_fd, msgToSend, sizeof msgToSend, 0) == -1) {
-                            perror("send");
-                        }
-                        printf("%s", buff);
+                close(aiofd);
+                for (int j = 0; j < npending; j++) {
+                    if (j != i) {
+                        close(pending[j]->fd);
                     }
-
-#ifdef DEBUG
-                    printf("closing FILE\n");
-#endif
-                    pclose(fp);
-                    close(new_fd);
-                    exit(0);
                 }
-
+                serve_client(pc->fd, pc->tcp, pc->peer);
+                exit(0);        ///< exit fork
             }
-                /// Case of display command with no entry
-            else if (strncmp(buff, "P\n", 2) == 0) {
-                strcpy(msgToSend, "display command with no argument\0");
-            } else if (strncmp(buff, "D\n", 2) == 0) {
-                strcpy(msgToSend, "download command with no argument\0");
+            close(pc->fd);  ///< parent doesn't need this
+            pending[i] = pending[--npending];
+            pending[i]->slot = i;
+            free(pc);
+        }
+
+        for (int l = 0; l < nlisteners; l++) {
+            if (!(fds[l].revents & POLLIN)) {
+                continue;
             }
-                /// If command is not recognized tell client
-            else {
-                strcpy(msgToSend, "command not recognized by server\0");
+            sin_size = sizeof their_addr;
+            new_fd = accept(fds[l].fd, (struct sockaddr *) &their_addr, &sin_size);
+            if (new_fd == -1) {
+                perror("accept");
+                continue;
             }
 
-#ifdef DEBUG
-            printf("sending message to client: %s\n", msgToSend);
-#endif
-
-            // This sends the message to the client and prints an error if it fails
-            if (send(new_fd, msgToSend, sizeof msgToSend, 0) == -1) {
-                perror("send");
+            if (their_addr.ss_family == AF_UNIX) {
+                strcpy(s, "unix socket");
+            } else {
+                inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr *) &their_addr), s, sizeof s);
             }
+            printf("server: got connection from %s\n", s);  ///< Print where the connection is from
 
-#ifdef DEBUG
-            printf("now closing listener and exiting fork\n");
-#endif
+            pending_t *pc = calloc(1, sizeof *pc);
+            pc->fd = new_fd;
+            pc->tcp = fds[l].fd == sockfd;
+            pc->slot = npending;
+            strcpy(pc->peer, s);
+            pc->timer.data = pc;
+            pending[npending++] = pc;
+            if (timeouts.first > 0) {
+                wheel_arm(&wheel, &pc->timer, wheel_now() + timeouts.first);
+            }
+        }
 
-            close(new_fd);     ///< close listener
-            exit(0);        ///< exit fork
+        /// Connections that sent nothing before their deadline are closed without ever getting a child
+        wtimer_t *t = wheel_expire(&wheel, wheel_now());
+        while (t != NULL) {
+            pending_t *pc = t->data;
+            t = t->next;
+            note_expiry(&expired->first, "no request", pc->peer);
+            close(pc->fd);
+            pending[pc->slot] = pending[--npending];
+            pending[pc->slot]->slot = pc->slot;
+            free(pc);
         }
-        close(new_fd);  ///< parent doesn't need this
     }
 
     return 0;
@@ -1,5 +1,63 @@
 /// Handles sigchild
 void sigchld_handler(int s);
 
+/// Handles SIGIO for watchers and followers
+void sigio_handler(int s);
+
+/// Count a connection closed for missing a deadline and say so with the running total
+void note_expiry(unsigned long *counter, const char *what, const char *peer);
+
+/// Read the deadlines given with -T, returns -1 if they are not understood
+int parse_timeouts(char *options);
+
+/// Read the bandwidth caps given with -B in MB/s, returns -1 if they are not understood
+int parse_rates(char *options, long long *client, long long *total);
+
 /// get sockaddr, IPv4 or IPv6:
-void *get_in_addr(struct sockaddr *sa)
\ No newline at end of file
+void *get_in_addr(struct sockaddr *sa)
+/// Total size of the regular files in a directory, hidden in-progress uploads included
+off_t dir_usage(const char *path);
+
+/// Receive an uploaded file into the served directory, leaves the final status in msgToSend, -1 if it failed
+int receive_upload(conn_t *conn, char *args, char *msgToSend);
+
+/// Stream the files matching the names or globs in args as one ustar archive, leaves a summary in msgToSend
+void send_archive(conn_t *conn, char *args, char *msgToSend);
+
+/// List the served directory, optionally filtered by a glob or regex, returns -1 with an error in msgToSend
+int send_listing(conn_t *conn, char *args, char *msgToSend);
+
+/// Send a range of lines of a file using its line index, returns -1 with an error in msgToSend
+int send_lines(conn_t *conn, char *args, char *msgToSend);
+
+/// Complete a request line that may not fit in the first read, returns it without the newline
+char *read_request(conn_t *conn, const char *args);
+
+/// Send a file only if the client's cached copy is stale, returns -1 with an error in msgToSend
+int send_if_modified(conn_t *conn, char *args, char *msgToSend);
+
+/// Multicast a file to its subscribers and repair what each missed, returns -1 with an error in msgToSend
+int send_multicast(conn_t *conn, char *args, char *msgToSend);
+
+/// Push changes to the served directory until the client sends anything or hangs up, returns -1 with an
+/// error in msgToSend if the watch could not start or fell behind
+int send_watch(conn_t *conn, char *args, char *msgToSend);
+
+/// Send the end of a file and what is appended to it until the client sends anything or hangs up, following
+/// it across rotation and truncation. Returns -1 with an error in msgToSend if the follow could not start
+int send_follow(conn_t *conn, char *args, char *msgToSend);
+
+/// Send the disk pool's queue depth and latencies, returns -1 with an error in msgToSend
+int send_stats(conn_t *conn, char *msgToSend);
+
+/// Carry out one request, output goes to conn and the status is left in msgToSend, returns -1 if it failed
+int handle_request(conn_t *conn, char *buff, char *msgToSend);
+
+/// Receive one request line into a pool buffer that grows to fit it, returns the length, 0 or -1
+ssize_t recv_request(conn_t *conn, char **buff, size_t *size);
+
+/// Serve the requests of one client until it hangs up, tcp says whether it came in over TCP
+void serve_client(int new_fd, int tcp, const char *peer);
+
+/// Listen on a unix domain socket at path as well, returns the listening socket or -1
+int listen_unix(const char *path);
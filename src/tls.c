@@ -0,0 +1,348 @@
+/*
+** tls.c -- optional TLS transport, handshake in user space and record encryption in the kernel (kTLS)
+*/
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "tls.h"
+
+#ifdef HAVE_OPENSSL
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+//#define DEBUG         ///< Uncomment to print debug information during execution
+
+/// kTLS, SSL_sendfile() and tolerating a peer that closes without close_notify came with OpenSSL 3.0. Older
+/// libraries encrypt every record in user space
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#define HAVE_KTLS
+#endif
+
+static SSL_CTX *ctx = NULL;   ///< Process wide TLS context, NULL while TLS is disabled
+
+/// Settings shared by both sides: only offer ciphers the kernel can take over
+static int tls_ctx_setup(SSL_CTX *c) {
+    SSL_CTX_set_min_proto_version(c, TLS1_2_VERSION);
+#ifdef HAVE_KTLS
+    SSL_CTX_set_options(c, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+    // Writes that hit a full non-blocking socket are retried from reused buffers, possibly at another address
+    SSL_CTX_set_mode(c, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if (SSL_CTX_set_cipher_list(c, "ECDHE+AESGCM:ECDHE+CHACHA20") != 1 ||
+        SSL_CTX_set_ciphersuites(c, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:"
+                                    "TLS_CHACHA20_POLY1305_SHA256") != 1) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    return 0;
+}
+
+/// Load the server certificate and key, returns 0 on success or -1 on error
+int tls_server_init(const char *certfile, const char *keyfile) {
+    if ((ctx = SSL_CTX_new(TLS_server_method())) == NULL || tls_ctx_setup(ctx) == -1) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    if (SSL_CTX_use_certificate_chain_file(ctx, certfile) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, keyfile, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        ctx = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/// Set up client side TLS, cafile may be NULL to use the system trust store
+int tls_client_init(const char *cafile) {
+    if ((ctx = SSL_CTX_new(TLS_client_method())) == NULL || tls_ctx_setup(ctx) == -1) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    int rv = cafile != NULL ? SSL_CTX_load_verify_locations(ctx, cafile, NULL)
+                            : SSL_CTX_set_default_verify_paths(ctx);
+    if (rv != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        ctx = NULL;
+        return -1;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    return 0;
+}
+
+/// Returns 1 if tls_server_init() or tls_client_init() succeeded
+int tls_enabled(void) {
+    return ctx != NULL;
+}
+
+/// Print whether the kernel took over each direction of the record layer
+static void tls_report(SSL *ssl) {
+#ifdef DEBUG
+    printf("tls: %s %s, kTLS send %s, kTLS recv %s\n", SSL_get_version(ssl), SSL_get_cipher(ssl),
+           BIO_get_ktls_send(SSL_get_wbio(ssl)) ? "on" : "off",
+           BIO_get_ktls_recv(SSL_get_rbio(ssl)) ? "on" : "off");
+#else
+    (void) ssl;
+#endif
+}
+
+/// Run the server side handshake on c->fd and attach the session to c
+int tls_accept(conn_t *c) {
+    SSL *ssl = SSL_new(ctx);
+    if (ssl == NULL || SSL_set_fd(ssl, c->fd) != 1 || SSL_accept(ssl) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        return -1;
+    }
+    tls_report(ssl);
+    c->tls = ssl;
+    return 0;
+}
+
+/// Create the client session for c->fd, set up to verify the certificate against hostname
+static SSL *tls_client_session(conn_t *c, const char *hostname) {
+    SSL *ssl = SSL_new(ctx);
+    unsigned char addr[sizeof(struct in6_addr)];
+
+    if (ssl == NULL || SSL_set_fd(ssl, c->fd) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        return NULL;
+    }
+
+    // Numeric addresses are matched against IP SANs, names against DNS SANs
+    if (inet_pton(AF_INET, hostname, addr) == 1 || inet_pton(AF_INET6, hostname, addr) == 1) {
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), hostname);
+    } else {
+        SSL_set_tlsext_host_name(ssl, hostname);
+        SSL_set1_host(ssl, hostname);
+    }
+    return ssl;
+}
+
+/// Run the client side handshake on c->fd, verifying the certificate against hostname
+int tls_connect(conn_t *c, const char *hostname) {
+    SSL *ssl = tls_client_session(c, hostname);
+
+    if (ssl == NULL) {
+        return -1;
+    }
+    if (SSL_connect(ssl) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        return -1;
+    }
+    tls_report(ssl);
+    c->tls = ssl;
+    return 0;
+}
+
+/// Start or continue the client side handshake on a non-blocking c->fd. Returns 0 once it is done,
+/// TLS_WANT_READ or TLS_WANT_WRITE while it waits on the socket, or -1 if it failed
+int tls_connect_step(conn_t *c, const char *hostname) {
+    if (c->tls == NULL && (c->tls = tls_client_session(c, hostname)) == NULL) {
+        return -1;
+    }
+    int rv = SSL_connect((SSL *) c->tls);
+    if (rv == 1) {
+        tls_report((SSL *) c->tls);
+        return 0;
+    }
+    switch (SSL_get_error((SSL *) c->tls, rv)) {
+        case SSL_ERROR_WANT_READ:
+            return TLS_WANT_READ;
+        case SSL_ERROR_WANT_WRITE:
+            return TLS_WANT_WRITE;
+        default:
+            ERR_print_errors_fp(stderr);
+            tls_free(c);
+            return -1;
+    }
+}
+
+/// Returns 1 if record encryption for sending has been handed to the kernel (kTLS)
+int tls_ktls_send(conn_t *c) {
+#ifdef HAVE_KTLS
+    return BIO_get_ktls_send(SSL_get_wbio((SSL *) c->tls)) ? 1 : 0;
+#else
+    (void) c;
+    return 0;
+#endif
+}
+
+/// Read decrypted data, returns bytes read, 0 on end of stream or -1 on error
+ssize_t tls_read(conn_t *c, void *buf, size_t len) {
+    size_t n;
+    if (SSL_read_ex((SSL *) c->tls, buf, len, &n) == 1) {
+        return n;
+    }
+    int err = SSL_get_error((SSL *) c->tls, 0);
+    if (err == SSL_ERROR_ZERO_RETURN) {
+        return 0;
+    }
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        errno = EAGAIN;
+    } else if (err != SSL_ERROR_SYSCALL) {
+        errno = EPROTO;
+    }
+    return -1;
+}
+
+/// Like tls_read() but leaves the data to be read again
+ssize_t tls_peek(conn_t *c, void *buf, size_t len) {
+    size_t n;
+    if (SSL_peek_ex((SSL *) c->tls, buf, len, &n) == 1) {
+        return n;
+    }
+    int err = SSL_get_error((SSL *) c->tls, 0);
+    if (err == SSL_ERROR_ZERO_RETURN) {
+        return 0;
+    }
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        errno = EAGAIN;
+    } else if (err != SSL_ERROR_SYSCALL) {
+        errno = EPROTO;
+    }
+    return -1;
+}
+
+/// Returns 1 if decrypted data is waiting to be read without the socket being readable
+int tls_pending(conn_t *c) {
+    return SSL_pending((SSL *) c->tls) > 0;
+}
+
+/// Write data as TLS records, returns bytes written or -1 on error
+ssize_t tls_write(conn_t *c, const void *buf, size_t len) {
+    size_t n;
+    if (SSL_write_ex((SSL *) c->tls, buf, len, &n) == 1) {
+        return n;
+    }
+    int err = SSL_get_error((SSL *) c->tls, 0);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        errno = EAGAIN;
+    } else if (err != SSL_ERROR_SYSCALL) {
+        errno = EPROTO;
+    }
+    return -1;
+}
+
+/// Send file data through kTLS, only valid when tls_ktls_send() is true
+ssize_t tls_sendfile(conn_t *c, int filefd, off_t offset, size_t count) {
+#ifdef HAVE_KTLS
+    return SSL_sendfile((SSL *) c->tls, filefd, offset, count, 0);
+#else
+    char buf[16384];
+    ssize_t n = pread(filefd, buf, count < sizeof buf ? count : sizeof buf, offset);
+    return n > 0 ? tls_write(c, buf, n) : n;
+#endif
+}
+
+/// Send close_notify and free the session
+void tls_close(conn_t *c) {
+    SSL_shutdown((SSL *) c->tls);
+    SSL_free((SSL *) c->tls);
+    c->tls = NULL;
+}
+
+/// Free the session without sending anything to the peer
+void tls_free(conn_t *c) {
+    SSL_free((SSL *) c->tls);
+    c->tls = NULL;
+}
+
+#else
+
+/// Built without OpenSSL, every attempt to enable TLS fails
+int tls_server_init(const char *certfile, const char *keyfile) {
+    (void) certfile;
+    (void) keyfile;
+    fprintf(stderr, "tls: built without OpenSSL support\n");
+    return -1;
+}
+
+int tls_client_init(const char *cafile) {
+    (void) cafile;
+    fprintf(stderr, "tls: built without OpenSSL support\n");
+    return -1;
+}
+
+int tls_enabled(void) {
+    return 0;
+}
+
+int tls_accept(conn_t *c) {
+    (void) c;
+    return -1;
+}
+
+int tls_connect(conn_t *c, const char *hostname) {
+    (void) c;
+    (void) hostname;
+    return -1;
+}
+
+int tls_connect_step(conn_t *c, const char *hostname) {
+    (void) c;
+    (void) hostname;
+    return -1;
+}
+
+int tls_ktls_send(conn_t *c) {
+    (void) c;
+    return 0;
+}
+
+ssize_t tls_read(conn_t *c, void *buf, size_t len) {
+    (void) c;
+    (void) buf;
+    (void) len;
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t tls_peek(conn_t *c, void *buf, size_t len) {
+    (void) c;
+    (void) buf;
+    (void) len;
+    errno = ENOTSUP;
+    return -1;
+}
+
+int tls_pending(conn_t *c) {
+    (void) c;
+    return 0;
+}
+
+ssize_t tls_write(conn_t *c, const void *buf, size_t len) {
+    (void) c;
+    (void) buf;
+    (void) len;
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t tls_sendfile(conn_t *c, int filefd, off_t offset, size_t count) {
+    (void) c;
+    (void) filefd;
+    (void) offset;
+    (void) count;
+    errno = ENOTSUP;
+    return -1;
+}
+
+void tls_close(conn_t *c) {
+    c->tls = NULL;
+}
+
+void tls_free(conn_t *c) {
+    c->tls = NULL;
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/types.h>
+#include "conn.h"
+
+#define TLS_WANT_READ 1     ///< tls_connect_step() waits for the socket to become readable
+#define TLS_WANT_WRITE 2    ///< tls_connect_step() waits for the socket to become writable
+
+/// Load the server certificate and key, returns 0 on success or -1 on error
+int tls_server_init(const char *certfile, const char *keyfile);
+
+/// Set up client side TLS, cafile may be NULL to use the system trust store
+int tls_client_init(const char *cafile);
+
+/// Returns 1 if tls_server_init() or tls_client_init() succeeded
+int tls_enabled(void);
+
+/// Run the server side handshake on c->fd and attach the session to c
+int tls_accept(conn_t *c);
+
+/// Run the client side handshake on c->fd, verifying the certificate against hostname
+int tls_connect(conn_t *c, const char *hostname);
+
+/// Start or continue the client side handshake on a non-blocking c->fd. Returns 0 once it is done,
+/// TLS_WANT_READ or TLS_WANT_WRITE while it waits on the socket, or -1 if it failed
+int tls_connect_step(conn_t *c, const char *hostname);
+
+/// Returns 1 if record encryption for sending has been handed to the kernel (kTLS)
+int tls_ktls_send(conn_t *c);
+
+/// Read decrypted data, returns bytes read, 0 on end of stream or -1 on error (EAGAIN on a non-blocking
+/// socket with nothing to read yet)
+ssize_t tls_read(conn_t *c, void *buf, size_t len);
+
+/// Like tls_read() but leaves the data to be read again
+ssize_t tls_peek(conn_t *c, void *buf, size_t len);
+
+/// Returns 1 if decrypted data is waiting to be read without the socket being readable
+int tls_pending(conn_t *c);
+
+/// Write data as TLS records, returns bytes written or -1 on error (EAGAIN on a full non-blocking socket,
+/// the same data must be offered again)
+ssize_t tls_write(conn_t *c, const void *buf, size_t len);
+
+/// Send file data through kTLS, only valid when tls_ktls_send() is true
+ssize_t tls_sendfile(conn_t *c, int filefd, off_t offset, size_t count);
+
+/// Send close_notify and free the session
+void tls_close(conn_t *c);
+
+/// Free the session without sending anything to the peer
+void tls_free(conn_t *c);
+
+#endif
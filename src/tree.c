@@ -0,0 +1,324 @@
+/*
+** tree.c -- parallel recursive directory listing with a work-stealing thread pool
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "tree.h"
+
+#define MAXTHREADS 16       ///< Upper bound on walker threads
+#define OUTBUFSIZE 16384    ///< Each worker batches this many bytes of entries per send
+#define IDLESLEEP 50000     ///< Nanoseconds an idle worker sleeps before trying to steal again
+
+/// One directory waiting to be read
+typedef struct task {
+    char *path;     ///< path relative to the served directory, "" for the top
+    int depth;      ///< number of directories between the top and this one
+} task_t;
+
+/// A worker's queue of directories. The owner pushes and pops at the tail so it goes depth first through
+/// what it just found, thieves take from the head where the oldest, usually biggest, subtrees are
+typedef struct deque {
+    pthread_mutex_t lock;
+    task_t *items;  ///< ring buffer of cap entries
+    size_t head;    ///< index of the oldest task
+    size_t tail;    ///< index one past the newest task
+    size_t cap;
+} deque_t;
+
+/// A device and inode pair, used to not walk a directory twice when following symlinks
+typedef struct seen {
+    dev_t dev;
+    ino_t ino;
+} seen_t;
+
+/// State shared by every worker of one walk
+typedef struct walk {
+    conn_t *conn;
+    int maxDepth;               ///< levels to list, 0 for no limit
+    int follow;                 ///< descend into symlinked directories
+    int nthreads;
+    deque_t deques[MAXTHREADS];
+    long pending;               ///< tasks queued or being processed, the walk is over when it reaches 0
+    int failed;                 ///< set once a send fails so everybody stops
+    pthread_mutex_t outLock;    ///< serializes sends, a TLS session is not thread safe
+    pthread_mutex_t seenLock;
+    seen_t *seen;               ///< open addressing set of directories already queued
+    size_t seenCount;
+    size_t seenCap;
+} walk_t;
+
+/// Per thread state
+typedef struct worker {
+    walk_t *walk;
+    int id;
+    long entries;           ///< entries this worker sent
+    size_t used;            ///< bytes waiting in out
+    char out[OUTBUFSIZE];
+} worker_t;
+
+static void deque_push(deque_t *d, task_t t) {
+    pthread_mutex_lock(&d->lock);
+    if (d->tail - d->head == d->cap) {
+        size_t cap = d->cap ? 2 * d->cap : 64;
+        task_t *items = malloc(cap * sizeof *items);
+        for (size_t i = d->head; i < d->tail; i++) {
+            items[i - d->head] = d->items[i % d->cap];
+        }
+        free(d->items);
+        d->items = items;
+        d->tail -= d->head;
+        d->head = 0;
+        d->cap = cap;
+    }
+    d->items[d->tail++ % d->cap] = t;
+    pthread_mutex_unlock(&d->lock);
+}
+
+/// Take the newest task, for the owner
+static int deque_pop(deque_t *d, task_t *t) {
+    int found = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->tail != d->head) {
+        *t = d->items[--d->tail % d->cap];
+        found = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+/// Take the oldest task, for thieves
+static int deque_steal(deque_t *d, task_t *t) {
+    int found = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->tail != d->head) {
+        *t = d->items[d->head++ % d->cap];
+        found = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+/// Record a directory, returns 1 if it had not been seen before
+static int seen_insert(walk_t *walk, dev_t dev, ino_t ino) {
+    int added = 1;
+
+    pthread_mutex_lock(&walk->seenLock);
+    if (2 * (walk->seenCount + 1) > walk->seenCap) {
+        size_t cap = walk->seenCap ? 2 * walk->seenCap : 256;
+        seen_t *table = calloc(cap, sizeof *table);
+        for (size_t i = 0; i < walk->seenCap; i++) {
+            if (walk->seen[i].ino != 0) {
+                size_t h = (walk->seen[i].ino * 0x9E3779B97F4A7C15ULL ^ walk->seen[i].dev) & (cap - 1);
+                while (table[h].ino != 0) {
+                    h = (h + 1) & (cap - 1);
+                }
+                table[h] = walk->seen[i];
+            }
+        }
+        free(walk->seen);
+        walk->seen = table;
+        walk->seenCap = cap;
+    }
+
+    size_t h = (ino * 0x9E3779B97F4A7C15ULL ^ dev) & (walk->seenCap - 1);
+    while (walk->seen[h].ino != 0) {
+        if (walk->seen[h].ino == ino && walk->seen[h].dev == dev) {
+            added = 0;
+            break;
+        }
+        h = (h + 1) & (walk->seenCap - 1);
+    }
+    if (added) {
+        walk->seen[h].dev = dev;
+        walk->seen[h].ino = ino;
+        walk->seenCount++;
+    }
+    pthread_mutex_unlock(&walk->seenLock);
+    return added;
+}
+
+/// Send whatever the worker has batched up
+static void worker_flush(worker_t *w) {
+    walk_t *walk = w->walk;
+
+    if (w->used == 0) {
+        return;
+    }
+    pthread_mutex_lock(&walk->outLock);
+    if (!walk->failed && conn_send(walk->conn, w->out, w->used) == -1) {
+        __atomic_store_n(&walk->failed, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&walk->outLock);
+    w->used = 0;
+}
+
+/// Add one entry to the worker's batch
+static void worker_emit(worker_t *w, const char *path, int isDir) {
+    size_t len = strlen(path);
+
+    if (w->used + len + 2 > sizeof w->out) {
+        worker_flush(w);
+    }
+    if (len + 2 > sizeof w->out) {
+        return;     // Longer than any real path
+    }
+    memcpy(w->out + w->used, path, len);
+    w->used += len;
+    if (isDir) {
+        w->out[w->used++] = '/';
+    }
+    w->out[w->used++] = '\n';
+    w->entries++;
+}
+
+/// Read one directory, emitting its entries and queueing its subdirectories on our own deque
+static void worker_process(worker_t *w, task_t *t) {
+    walk_t *walk = w->walk;
+    int fd = open(t->path[0] ? t->path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir;
+    struct dirent *entry;
+
+    if (fd == -1 || (dir = fdopendir(fd)) == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+
+    size_t baseLen = strlen(t->path);
+    while ((entry = readdir(dir)) != NULL && !__atomic_load_n(&walk->failed, __ATOMIC_RELAXED)) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+
+        // d_type saves a stat() per entry on most filesystems
+        int isDir = entry->d_type == DT_DIR;
+        struct stat st;
+        int haveStat = 0;
+        if (entry->d_type == DT_UNKNOWN || (entry->d_type == DT_LNK && walk->follow)) {
+            if (fstatat(dirfd(dir), entry->d_name, &st, walk->follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0) {
+                isDir = S_ISDIR(st.st_mode);
+                haveStat = 1;
+            }
+        }
+
+        size_t len = baseLen + strlen(entry->d_name) + 2;
+        char *path = malloc(len);
+        snprintf(path, len, "%s%s%s", t->path, baseLen ? "/" : "", entry->d_name);
+        worker_emit(w, path, isDir);
+
+        if (isDir && (walk->maxDepth == 0 || t->depth + 1 < walk->maxDepth)) {
+            // When following links the same directory can be reached twice, or from inside itself
+            if (walk->follow && !haveStat && fstatat(dirfd(dir), entry->d_name, &st, 0) == 0) {
+                haveStat = 1;
+            }
+            if (!walk->follow || (haveStat && seen_insert(walk, st.st_dev, st.st_ino))) {
+                task_t sub = {path, t->depth + 1};
+                __atomic_add_fetch(&walk->pending, 1, __ATOMIC_SEQ_CST);
+                deque_push(&walk->deques[w->id], sub);
+                continue;
+            }
+        }
+        free(path);
+    }
+    closedir(dir);
+}
+
+/// Worker loop: drain our own deque, then steal, and stop once nothing is queued or running anywhere
+static void *worker_run(void *arg) {
+    worker_t *w = arg;
+    walk_t *walk = w->walk;
+    struct timespec idle = {0, IDLESLEEP};
+
+    while (1) {
+        task_t t;
+        int found = deque_pop(&walk->deques[w->id], &t);
+        for (int i = 1; !found && i < walk->nthreads; i++) {
+            found = deque_steal(&walk->deques[(w->id + i) % walk->nthreads], &t);
+        }
+
+        if (found) {
+            worker_process(w, &t);
+            free(t.path);
+            __atomic_sub_fetch(&walk->pending, 1, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        if (__atomic_load_n(&walk->pending, __ATOMIC_SEQ_CST) == 0) {
+            break;
+        }
+        nanosleep(&idle, NULL);
+    }
+    worker_flush(w);
+    return NULL;
+}
+
+/// Walk the tree below the current directory with a work-stealing pool of threads and stream every entry
+/// to conn as a relative path on its own line, directories ending in '/'. maxDepth limits how many levels
+/// are listed (0 for no limit) and follow descends into symlinked directories. Returns the number of
+/// entries sent or -1 if the connection failed
+long tree_walk(conn_t *conn, int maxDepth, int follow) {
+    walk_t walk;
+    pthread_t threads[MAXTHREADS];
+    worker_t *workers;
+    struct stat st;
+    long entries = 0;
+
+    memset(&walk, 0, sizeof walk);
+    walk.conn = conn;
+    walk.maxDepth = maxDepth;
+    walk.follow = follow;
+
+    // Directory reads block on the disk, so use more threads than cores to keep an SSD's queue full
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    walk.nthreads = cpus < 1 ? 2 : (cpus * 2 > MAXTHREADS ? MAXTHREADS : (int) cpus * 2);
+
+    pthread_mutex_init(&walk.outLock, NULL);
+    pthread_mutex_init(&walk.seenLock, NULL);
+    for (int i = 0; i < walk.nthreads; i++) {
+        pthread_mutex_init(&walk.deques[i].lock, NULL);
+    }
+    if (follow && stat(".", &st) == 0) {
+        seen_insert(&walk, st.st_dev, st.st_ino);
+    }
+
+    task_t top = {strdup(""), 0};
+    walk.pending = 1;
+    deque_push(&walk.deques[0], top);
+
+    // The calling thread works as worker 0
+    workers = calloc(walk.nthreads, sizeof *workers);
+    for (int i = 0; i < walk.nthreads; i++) {
+        workers[i].walk = &walk;
+        workers[i].id = i;
+    }
+    int started = 1;
+    for (; started < walk.nthreads; started++) {
+        if (pthread_create(&threads[started], NULL, worker_run, &workers[started]) != 0) {
+            break;
+        }
+    }
+    worker_run(&workers[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < walk.nthreads; i++) {
+        entries += workers[i].entries;
+        free(walk.deques[i].items);
+        pthread_mutex_destroy(&walk.deques[i].lock);
+    }
+    pthread_mutex_destroy(&walk.outLock);
+    pthread_mutex_destroy(&walk.seenLock);
+    free(walk.seen);
+    free(workers);
+    return walk.failed ? -1 : entries;
+}
@@ -0,0 +1,12 @@
+#ifndef TREE_H
+#define TREE_H
+
+#include "conn.h"
+
+/// Walk the tree below the current directory with a work-stealing pool of threads and stream every entry
+/// to conn as a relative path on its own line, directories ending in '/'. maxDepth limits how many levels
+/// are listed (0 for no limit) and follow descends into symlinked directories. Returns the number of
+/// entries sent or -1 if the connection failed
+long tree_walk(conn_t *conn, int maxDepth, int follow);
+
+#endif
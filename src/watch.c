@@ -0,0 +1,151 @@
+/*
+** watch.c -- shared log of changes to the served directory and the merged queue each watcher sends from
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "watch.h"
+#include "digest.h"
+
+static void futex_wait(uint32_t *word, uint32_t value, int timeout) {
+    struct timespec ts = {timeout / 1000, (timeout % 1000) * 1000000L};
+    syscall(SYS_futex, word, FUTEX_WAIT, value, timeout >= 0 ? &ts : NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/// Map an empty log shared with every process forked after it, returns NULL on error
+watch_log_t *watch_log_create(void) {
+    watch_log_t *log = mmap(NULL, sizeof *log, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    return log == MAP_FAILED ? NULL : log;
+}
+
+/// Log a change, only ever called by one process. The slot's seq is cleared while it is rewritten so a
+/// reader that was still on the old change sees it go
+void watch_post(watch_log_t *log, int change, const char *name) {
+    uint64_t head = log->head;
+    watch_event_t *e = &log->events[head & (WATCH_LOGSIZE - 1)];
+
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->change = change;
+    snprintf(e->name, sizeof e->name, "%s", name);
+    __atomic_store_n(&e->seq, head + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&log->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/// Wake the watchers after a batch of watch_post() calls
+void watch_wake(watch_log_t *log) {
+    __atomic_add_fetch(&log->wake, 1, __ATOMIC_RELEASE);
+    futex_wake(&log->wake);
+}
+
+/// Bump the wake count without waking anyone, safe in a signal handler. A watch_wait() the signal
+/// interrupted restarts, finds the count changed and returns, as does one about to start with an older mark
+void watch_nudge(watch_log_t *log) {
+    __atomic_add_fetch(&log->wake, 1, __ATOMIC_RELEASE);
+}
+
+/// Position just after the last logged change
+uint64_t watch_head(const watch_log_t *log) {
+    return __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+}
+
+/// Copy the change at position seq, returns 0 or -1 if it was already overwritten
+int watch_read(const watch_log_t *log, uint64_t seq, watch_event_t *event) {
+    const watch_event_t *e = &log->events[seq & (WATCH_LOGSIZE - 1)];
+
+    if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != seq + 1) {
+        return -1;
+    }
+    memcpy(event, e, sizeof *event);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq + 1) {
+        return -1;
+    }
+    event->name[MANIFEST_NAMELEN - 1] = '\0';
+    return 0;
+}
+
+/// Current wake count. Take it before looking at the log, then watch_wait() returns at once if a wake came
+/// in between
+uint32_t watch_mark(const watch_log_t *log) {
+    return __atomic_load_n(&log->wake, __ATOMIC_ACQUIRE);
+}
+
+/// Sleep until the log is woken after mark was taken, or for at most timeout milliseconds (-1 for no limit)
+void watch_wait(watch_log_t *log, uint32_t mark, int timeout) {
+    if (timeout != 0) {
+        futex_wait(&log->wake, mark, timeout);
+    }
+}
+
+/// Empty a queue
+void watch_queue_init(watch_queue_t *q) {
+    q->count = 0;
+    q->rescanned = 0;
+    memset(q->index, -1, sizeof q->index);
+}
+
+/// What to report for a name that changed by change while was was still waiting to be sent
+static int merge(int was, int change) {
+    if (change == MANIFEST_DELETED) {
+        return was == MANIFEST_CREATED ? 0 : MANIFEST_DELETED;     // never seen, never mentioned
+    }
+    if (was == MANIFEST_CREATED || (was == 0 && change == MANIFEST_CREATED)) {
+        return MANIFEST_CREATED;
+    }
+    return MANIFEST_MODIFIED;   // replaced, or written again
+}
+
+/// Merge a change into the queue, returns -1 if the queue is full and has to be sent first
+int watch_queue_add(watch_queue_t *q, int change, const char *name) {
+    if (change == MANIFEST_RESCANNED) {
+        q->rescanned = 1;
+        return 0;
+    }
+
+    digest_t digest;
+    digest_init(&digest);
+    digest_update(&digest, name, strlen(name));
+    uint64_t mask = 2 * WATCH_QUEUE - 1, i = digest_final(&digest) & mask;
+
+    for (; q->index[i] != -1; i = (i + 1) & mask) {
+        int at = q->index[i];
+        if (strcmp(q->name[at], name) == 0) {
+            q->change[at] = merge(q->change[at], change);
+            return 0;
+        }
+    }
+    if (q->count == WATCH_QUEUE) {
+        return -1;
+    }
+    q->index[i] = q->count;
+    q->change[q->count] = change;
+    snprintf(q->name[q->count], MANIFEST_NAMELEN, "%s", name);
+    q->count++;
+    return 0;
+}
+
+/// Word for a change, as sent to watchers
+const char *watch_change_name(int change) {
+    switch (change) {
+        case MANIFEST_CREATED:
+            return "created";
+        case MANIFEST_MODIFIED:
+            return "modified";
+        case MANIFEST_DELETED:
+            return "deleted";
+        default:
+            return "rescanned";
+    }
+}
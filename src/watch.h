@@ -0,0 +1,76 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "manifest.h"
+
+/// Changes to the served directory go into one log in shared memory, written only by the accept loop as the
+/// manifest takes them in. Every watching connection's process follows the log at its own pace and merges
+/// the changes to each name until they are sent, so the log never waits for a slow watcher. A watcher that
+/// falls more than the log's length behind has lost changes and is dropped
+#define WATCH_LOGSIZE 4096      ///< Changes kept in the log, a power of two
+#define WATCH_QUEUE 1024        ///< Names with changes waiting to be sent, a full queue is sent at once
+#define WATCH_SETTLE 50         ///< Milliseconds a burst of changes is gathered before it is sent
+
+/// One logged change, seq is its position in the log plus one and 0 while the slot is being rewritten
+typedef struct watch_event {
+    uint64_t seq;
+    uint32_t change;        ///< MANIFEST_CREATED, MANIFEST_MODIFIED, MANIFEST_DELETED or MANIFEST_RESCANNED
+    char name[MANIFEST_NAMELEN];
+} watch_event_t;
+
+/// The shared log
+typedef struct watch_log {
+    uint32_t wake;          ///< futex word, bumped after every batch of changes
+    uint64_t head;          ///< changes logged so far
+    watch_event_t events[WATCH_LOGSIZE];
+} watch_log_t;
+
+/// Changes waiting to be sent to one watcher, merged per name so a burst of writes is one "modified" and a
+/// file created and deleted again before it was reported is not mentioned at all
+typedef struct watch_queue {
+    size_t count;                           ///< names queued, in the order they first changed
+    uint32_t change[WATCH_QUEUE];           ///< change to report for each name, 0 once it cancelled out
+    char name[WATCH_QUEUE][MANIFEST_NAMELEN];
+    int16_t index[2 * WATCH_QUEUE];         ///< hash table of positions in name, -1 for a free slot
+    int rescanned;                          ///< the server lost track, the watcher should list again
+} watch_queue_t;
+
+/// Map an empty log shared with every process forked after it, returns NULL on error
+watch_log_t *watch_log_create(void);
+
+/// Log a change, only ever called by one process
+void watch_post(watch_log_t *log, int change, const char *name);
+
+/// Wake the watchers after a batch of watch_post() calls
+void watch_wake(watch_log_t *log);
+
+/// Bump the wake count without waking anyone, safe in a signal handler. A watch_wait() the signal
+/// interrupted, or one about to start with an older mark, returns instead of sleeping
+void watch_nudge(watch_log_t *log);
+
+/// Position just after the last logged change
+uint64_t watch_head(const watch_log_t *log);
+
+/// Copy the change at position seq, returns 0 or -1 if it was already overwritten
+int watch_read(const watch_log_t *log, uint64_t seq, watch_event_t *event);
+
+/// Current wake count. Take it before looking at the log, then watch_wait() returns at once if a wake came
+/// in between
+uint32_t watch_mark(const watch_log_t *log);
+
+/// Sleep until the log is woken after mark was taken, or for at most timeout milliseconds (-1 for no limit)
+void watch_wait(watch_log_t *log, uint32_t mark, int timeout);
+
+/// Empty a queue
+void watch_queue_init(watch_queue_t *q);
+
+/// Merge a change into the queue, returns -1 if the queue is full and has to be sent first
+int watch_queue_add(watch_queue_t *q, int change, const char *name);
+
+/// Word for a change, as sent to watchers
+const char *watch_change_name(int change);
+
+#endif
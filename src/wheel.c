@@ -0,0 +1,141 @@
+/*
+** wheel.c -- hierarchical timer wheel for connection deadlines
+*/
+
+#include <stddef.h>
+#include <time.h>
+
+#include "wheel.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+/// Start an empty wheel at now milliseconds
+void wheel_init(wheel_t *w, uint64_t now) {
+    *w = (wheel_t) {0};
+    w->now = now;
+}
+
+/// Link t into the slot its deadline falls in, seen from w->now
+static void wheel_place(wheel_t *w, wtimer_t *t) {
+    uint64_t delta = t->expires - w->now;
+    int level = 0;
+
+    while (level < WHEEL_LEVELS - 1 && delta >= (uint64_t) 1 << (WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    uint64_t at = t->expires;
+    if (delta >= (uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) {
+        at = w->now + ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;   // comes back down and is placed again
+    }
+    wtimer_t **slot = &w->slots[level][(at >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    t->next = *slot;
+    if (t->next != NULL) {
+        t->next->pprev = &t->next;
+    }
+    t->pprev = slot;
+    *slot = t;
+}
+
+static void wheel_unlink(wtimer_t *t) {
+    *t->pprev = t->next;
+    if (t->next != NULL) {
+        t->next->pprev = t->pprev;
+    }
+    t->pprev = NULL;
+}
+
+/// Arm t to expire at expires, re-arming it if it already was
+void wheel_arm(wheel_t *w, wtimer_t *t, uint64_t expires) {
+    if (t->pprev != NULL) {
+        wheel_unlink(t);
+    } else {
+        w->count++;
+    }
+    t->expires = expires > w->now ? expires : w->now + 1;
+    wheel_place(w, t);
+}
+
+/// Disarm t if it is armed
+void wheel_cancel(wheel_t *w, wtimer_t *t) {
+    if (t->pprev != NULL) {
+        wheel_unlink(t);
+        w->count--;
+    }
+}
+
+/// Returns 1 if t is armed
+int wheel_armed(const wtimer_t *t) {
+    return t->pprev != NULL;
+}
+
+/// Move the wheel to now and return the timers that expired, disarmed and linked through next. Each
+/// millisecond passed empties its level 0 slot, and at every wrap the next slot of the level above is
+/// spread over the levels below
+wtimer_t *wheel_expire(wheel_t *w, uint64_t now) {
+    wtimer_t *expired = NULL;
+
+    while (w->now < now && w->count > 0) {
+        w->now++;
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if ((w->now & (((uint64_t) 1 << (WHEEL_BITS * level)) - 1)) != 0) {
+                break;
+            }
+            wtimer_t *t = w->slots[level][(w->now >> (WHEEL_BITS * level)) & WHEEL_MASK];
+            w->slots[level][(w->now >> (WHEEL_BITS * level)) & WHEEL_MASK] = NULL;
+            while (t != NULL) {
+                wtimer_t *next = t->next;
+                wheel_place(w, t);
+                t = next;
+            }
+        }
+
+        wtimer_t **slot = &w->slots[0][w->now & WHEEL_MASK];
+        while (*slot != NULL) {
+            wtimer_t *t = *slot;
+            wheel_unlink(t);
+            w->count--;
+            if (t->expires > w->now) {
+                w->count++;
+                wheel_place(w, t);      // a far deadline that was clamped, not due yet
+                continue;
+            }
+            t->next = expired;
+            expired = t;
+        }
+    }
+    if (w->now < now) {
+        w->now = now;
+    }
+    return expired;
+}
+
+/// Milliseconds until the wheel next has work: the first non-empty slot of each level, level 0 slots
+/// falling due at their own millisecond and higher ones when they are spread out
+long wheel_timeout(const wheel_t *w) {
+    long best = -1;
+
+    if (w->count == 0) {
+        return -1;
+    }
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        int shift = WHEEL_BITS * level;
+        uint64_t index = w->now >> shift;
+        for (uint64_t i = 1; i <= WHEEL_SLOTS; i++) {
+            if (w->slots[level][(index + i) & WHEEL_MASK] != NULL) {
+                long wait = (long) (((index + i) << shift) - w->now);
+                if (best == -1 || wait < best) {
+                    best = wait;
+                }
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+/// Monotonic clock in milliseconds
+uint64_t wheel_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
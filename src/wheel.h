@@ -0,0 +1,52 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stdint.h>
+
+/// Hierarchical timer wheel counting in milliseconds. Level 0 has a slot per millisecond for the next
+/// WHEEL_SLOTS of them, and each level above covers WHEEL_SLOTS times the span of the one below. A timer
+/// waits in the lowest level its deadline fits in and moves down as its slot comes up, so arming and
+/// cancelling are constant time and only timers that are due are looked at
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4      ///< Deadlines up to 2^24 ms (4.6 hours) ahead, later ones wait in the last slot
+
+/// A timer, embedded in whatever it times
+typedef struct wtimer {
+    struct wtimer *next;    ///< next timer in its slot, or in the list wheel_expire() returns
+    struct wtimer **pprev;  ///< link pointing at this timer, NULL while not armed
+    uint64_t expires;       ///< deadline in wheel milliseconds
+    void *data;             ///< what the timer is for
+} wtimer_t;
+
+/// The wheel
+typedef struct wheel {
+    uint64_t now;           ///< milliseconds up to which timers were expired
+    int count;              ///< timers armed
+    wtimer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} wheel_t;
+
+/// Start an empty wheel at now milliseconds
+void wheel_init(wheel_t *w, uint64_t now);
+
+/// Arm t to expire at expires, re-arming it if it already was. A deadline already past expires on the next
+/// wheel_expire()
+void wheel_arm(wheel_t *w, wtimer_t *t, uint64_t expires);
+
+/// Disarm t if it is armed
+void wheel_cancel(wheel_t *w, wtimer_t *t);
+
+/// Returns 1 if t is armed
+int wheel_armed(const wtimer_t *t);
+
+/// Move the wheel to now and return the timers that expired, disarmed and linked through next
+wtimer_t *wheel_expire(wheel_t *w, uint64_t now);
+
+/// Milliseconds until the wheel next has work, at most the time to the earliest deadline, or -1 if no timer
+/// is armed
+long wheel_timeout(const wheel_t *w);
+
+/// Monotonic clock in milliseconds, the time base wheels are used with
+uint64_t wheel_now(void);
+
+#endif
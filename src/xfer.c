@@ -0,0 +1,2076 @@
+/*
+** xfer.c -- client commands as non-blocking state machines driven by one epoll loop, so several
+** commands and transfers can be in flight at once without a process per command. Replies arrive as
+** frames, so a connection can also carry a pipeline of commands whose replies come back in order
+*/
+
+#define _GNU_SOURCE     ///< copy_file_range(), recvmmsg(), SEEK_DATA, memrchr()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "xfer.h"
+#include "conn.h"
+#include "tls.h"
+#include "digest.h"
+#include "archive.h"
+#include "cache.h"
+#include "ring.h"
+#include "mcast.h"
+#include "wheel.h"
+#include "pool.h"
+#include "hashring.h"
+
+#define SENDBATCH 16384     ///< Requests queued together go out in one send of up to this size
+
+#define DIRECTMIN 65536     ///< Data frames with at least this much left go straight from the socket to the file
+
+#define COPYBUFSIZE 65536   ///< Cached bodies are printed this many bytes at a time
+
+#define PROGRESSNS 200000000LL  ///< Minimum time between progress line redraws
+
+#define TURNBYTES 1048576   ///< Bulk bytes a connection moves before giving the others a turn
+
+#define RINGPOLLMS 10       ///< Longest sleep on a shared memory ring before epoll gets another look
+
+#define MCASTBATCH 32       ///< Datagrams taken per recvmmsg()
+
+#define MCASTIDLENS 1000000000LL    ///< A multicast reception this long without datagrams is over
+
+#define MAXRANGES 4096      ///< Missed ranges asked for one by one, beyond that the rest of the file comes in one
+
+#define RACEDELAYMS 250     ///< A connection attempt gets this long before the next address races it
+#define MAXATTEMPTS 8       ///< Connection attempts racing at once
+#define MAXADDRS 64         ///< Addresses of a server tried, in the order races take them
+#define NODEWAITMS 3000     ///< Once all its addresses race, a server of a cluster gets this long to answer
+#define NODEDOWNMS 10000    ///< A server that could not be reached is tried last for this long
+
+/// Where a connection is
+typedef enum session_state {
+    SESSION_CONNECTING,     ///< non-blocking connect() under way
+    SESSION_HANDSHAKE,      ///< TLS handshake under way
+    SESSION_OPEN            ///< carrying commands
+} session_state_t;
+
+/// What the command being sent is doing
+enum { SEND_REQUEST, SEND_WAIT, SEND_BODY };
+
+/// Where a multicast download is
+enum { MCAST_JOIN, MCAST_RECV, MCAST_REPAIR };
+
+/// Where a batch download is in its archive
+enum { TAR_HEADER, TAR_LONGNAME, TAR_DATA, TAR_PAD, TAR_END, TAR_DONE };
+
+/// What a step of a state machine returns besides the epoll events it waits for
+enum { STEP_MORE = -2, WAIT_TURN = -1 };
+
+/// Output collected in memory
+typedef struct outbuf {
+    char *data;
+    size_t len, cap;
+} outbuf_t;
+
+/// One connection attempt of a session, racing the others
+typedef struct attempt {
+    int fd;
+    struct addrinfo *addr;
+    size_t early;               ///< request bytes that went out with the SYN, TCP Fast Open
+} attempt_t;
+
+/// One connection to the server and the commands queued on it
+typedef struct session {
+    struct session *next;       ///< every connection
+    conn_t conn;
+    int node;                   ///< server it goes to
+    struct addrinfo *addr;      ///< address connected to
+    attempt_t tries[MAXATTEMPTS];   ///< attempts under way while connecting, the first to connect wins
+    int ntries;
+    int nextAddr;               ///< next address of the node to race
+    wtimer_t race;              ///< when the next address joins the race
+    session_state_t state;
+    uint32_t watching;          ///< events registered with epoll, 0 while not registered
+    int closed;                 ///< connection gone, only kept until the loop is done with it
+    int yielded;                ///< has work left without waiting on epoll, xfer_resume() carries on
+    uint32_t ringWait;          ///< events a connection on shared memory rings waits for in xfer_wait()
+    wtimer_t stall;             ///< deadline for progress while commands are out
+
+    xfer_t *head, *tail;        ///< commands sent or waiting to be, replies arrive in this order
+    xfer_t *sending;            ///< first command not completely sent
+    int sendState;
+    size_t retryLen;            ///< length of a send that did not go through, TLS wants it offered again as is
+
+    char header[FRAME_HEADER];  ///< frame header being collected
+    size_t headerHeld;
+    int inFrame, frameType;
+    size_t frameLeft;           ///< payload bytes of the current frame still to come
+    char text[FRAME_MAXTEXT + 1];   ///< payload of an INFO, END or ERROR frame
+    size_t textLen;
+
+    char *rbuf;                 ///< bytes read but not handled yet, a pool buffer of rsize bytes
+    size_t rpos, rlen, rsize;
+    int rfilled;                ///< the last read filled rbuf, the next one gets a bigger buffer
+} session_t;
+
+struct xfer {
+    struct xfer *next;          ///< commands in the order they were started
+    struct xfer *queueNext;     ///< next command on the same connection
+    session_t *session;         ///< connection carrying it, NULL once its reply ended
+    int id;                     ///< position in the command stream, from 1
+    int finished;               ///< done, only kept around until its held back output is printed
+    int failed;
+    int discard;                ///< the rest of the reply is of no use, drop it
+
+    char *command;              ///< command as typed, for reports
+    char *request;              ///< encoded command
+    size_t requestLen, requestSent;
+    char kind;                  ///< command code, the first byte of the request
+    int download;               ///< V: save to a file instead of printing
+    char *name;                 ///< file the command is about, or the current archive member
+    char *path;                 ///< upload: the local file, name is only its base name
+    int route[XFER_MAXNODES];   ///< servers to try in turn, the file's owner on the hash ring first
+    int routeCount, routeAt;
+    int dropped;                ///< failed because the connection to its server did
+
+    struct xfer *whole;         ///< part of a command sent to every server: that command, otherwise NULL
+    outbuf_t *parts;            ///< command sent to every server: the output of its part on each server
+    int partsLeft, partsLost;   ///< parts still running, and those whose server could not be reached
+    char **taken;               ///< batch download sent to every server: member names received, sorted
+    size_t takenCount;
+    int duplicate;              ///< batch download part: the current member came from another server already
+
+    int filefd;                 ///< file being received into or sent from
+    long long size, done;       ///< bytes of the current file expected and moved so far
+    int sparse;                 ///< D and V: the body comes as data extents, the holes are never written
+    time_t mtime;               ///< batch download: mtime of the current member
+    char tmpPath[4096];         ///< V: cache temp file receiving the body
+    cache_entry_t entry;        ///< V: description of the cached copy
+    char hex[DIGEST_HEXLEN];    ///< upload: digest of the local file
+    int files;                  ///< batch download: members received
+
+    int mcastState;             ///< multicast download: MCAST_JOIN, MCAST_RECV or MCAST_REPAIR
+    int mcastFd;                ///< multicast download: UDP socket in the group while receiving, else -1
+    uint32_t mcastSession;      ///< multicast download: session the datagrams must carry
+    uint32_t mcastCount, mcastGot;  ///< datagrams in the file and received
+    unsigned char *mcastBits;   ///< one bit per datagram received
+    long long mcastLast;        ///< when the last datagram, or the group's address, arrived
+    off_t *ranges;              ///< multicast download: offset and length of each range asked for again
+    int rangeCount, rangeAt;    ///< ranges, and the one DATA frames are filling, at x->done into it
+    long long repaired;         ///< bytes that came over the connection
+
+    int tarState;               ///< batch download: what the archive bytes are
+    char hold[TARBLOCK];        ///< fixed size pieces of the archive are collected here
+    char longName[TAR_MAXNAME]; ///< name from a long name record for the next member, empty without one
+    size_t need, held;
+
+    long long bytes;            ///< data bytes received or uploaded
+    long long started;          ///< when the command was started
+    char message[FRAME_MAXTEXT + 1];    ///< final status
+    outbuf_t pending;           ///< output held back while another command prints, all of it in JSON mode
+};
+
+static const xfer_config_t *config;     ///< Settings from xfer_init()
+static xfer_t *xfers = NULL;            ///< Started commands, oldest first
+static session_t *sessions = NULL;      ///< Connections
+static wheel_t wheel;                   ///< Stall deadlines and connection races of the connections
+static hashring_t hashRing;             ///< Places files on the servers
+
+/// What the client knows about one server
+typedef struct node {
+    struct addrinfo *addrs[MAXADDRS];   ///< its addresses, families taking turns
+    int naddrs;
+    uint64_t downUntil;                 ///< it could not be reached, until then it is tried last
+    session_t *shared;                  ///< connection every command for it is pipelined on
+} node_t;
+
+static node_t nodes[XFER_MAXNODES];
+static xfer_t *stdoutOwner = NULL;      ///< Command printing right now, others hold their output back
+static int active = 0;                  ///< Commands not finished yet
+static int failures = 0;                ///< Commands that failed
+static int lost = 0;                    ///< Commands that failed with their connection
+static int lastId = 0;                  ///< Id of the last command started
+static int connected = 0;               ///< The first connection was announced
+static int showProgress = 0;            ///< stderr is a terminal
+static int progressShown = 0;           ///< A progress line is on screen
+static long long lastProgress = 0;      ///< When it was drawn
+
+/// Monotonic time in nanoseconds
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/// Append len bytes to an output buffer
+static void outbuf_add(outbuf_t *b, const char *data, size_t len) {
+    if (b->len + len > b->cap) {
+        b->cap = (b->len + len) * 2;
+        b->data = realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+/// Append s as a JSON string literal
+static void outbuf_json(outbuf_t *b, const char *s, size_t len) {
+    outbuf_add(b, "\"", 1);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        char escaped[8];
+        if (c == '"' || c == '\\') {
+            escaped[0] = '\\';
+            escaped[1] = c;
+            outbuf_add(b, escaped, 2);
+        } else if (c == '\n' || c == '\t') {
+            escaped[0] = '\\';
+            escaped[1] = c == '\n' ? 'n' : 't';
+            outbuf_add(b, escaped, 2);
+        } else if (c < 0x20 || c == 0x7f) {
+            outbuf_add(b, escaped, snprintf(escaped, sizeof escaped, "\\u%04x", c));
+        } else {
+            outbuf_add(b, s + i, 1);
+        }
+    }
+    outbuf_add(b, "\"", 1);
+}
+
+/// Wipe the progress line so regular output starts at the beginning of a clean line
+static void progress_clear(void) {
+    if (progressShown) {
+        fputs("\r\033[K", stderr);
+        progressShown = 0;
+    }
+}
+
+/// Print straight to stdout
+static void output_now(const char *data, size_t len) {
+    progress_clear();
+    fwrite(data, 1, len, stdout);
+    fflush(stdout);
+}
+
+/// Print output for x, or hold it back if another command is printing so replies never interleave.
+/// In JSON mode output is always held, it goes in the command's report
+static void xfer_output(xfer_t *x, const char *data, size_t len) {
+    if (x->whole != NULL) {
+        // A part's output is merged into its command's at the end, a watch passes whole lines on as they come
+        outbuf_add(&x->pending, data, len);
+        char *end = x->kind == 'W' ? memrchr(x->pending.data, '\n', x->pending.len) : NULL;
+        if (end != NULL) {
+            size_t lines = end + 1 - x->pending.data;
+            xfer_output(x->whole, x->pending.data, lines);
+            memmove(x->pending.data, end + 1, x->pending.len - lines);
+            x->pending.len -= lines;
+        }
+        return;
+    }
+    if (!config->json && stdoutOwner == NULL) {
+        stdoutOwner = x;
+    }
+    if (stdoutOwner == x) {
+        output_now(data, len);
+        return;
+    }
+    outbuf_add(&x->pending, data, len);
+}
+
+/// Print a notice for people through xfer_output(), JSON reports leave them out. A part's notices are its
+/// command's
+static void xfer_printf(xfer_t *x, const char *format, ...) {
+    char line[1024];
+    va_list ap;
+
+    if (config->json) {
+        return;
+    }
+    if (x->whole != NULL) {
+        x = x->whole;
+    }
+    va_start(ap, format);
+    int len = vsnprintf(line, sizeof line, format, ap);
+    va_end(ap);
+    xfer_output(x, line, len < (int) sizeof line ? (size_t) len : sizeof line - 1);
+}
+
+static void xfer_free(xfer_t *x) {
+    free(x->command);
+    free(x->request);
+    free(x->name);
+    free(x->path);
+    free(x->pending.data);
+    free(x->mcastBits);
+    free(x->ranges);
+    for (int i = 0; x->parts != NULL && i < config->nodeCount; i++) {
+        free(x->parts[i].data);
+    }
+    free(x->parts);
+    for (size_t i = 0; i < x->takenCount; i++) {
+        free(x->taken[i]);
+    }
+    free(x->taken);
+    free(x);
+}
+
+/// Stdout is free again: print held back output in the order commands were started and hand stdout to
+/// the first command still running that has some
+static void xfer_release(void) {
+    stdoutOwner = NULL;
+    for (xfer_t *x = xfers; x != NULL; x = x->next) {
+        if (x->pending.len > 0 && x->whole == NULL) {
+            output_now(x->pending.data, x->pending.len);
+            x->pending.len = 0;
+            if (!x->finished) {
+                stdoutOwner = x;
+                return;
+            }
+        }
+    }
+}
+
+/// Forget finished commands that have printed everything
+static void xfer_reap(void) {
+    for (xfer_t **px = &xfers; *px != NULL;) {
+        xfer_t *x = *px;
+        if (x->finished && x->pending.len == 0) {
+            *px = x->next;
+            xfer_free(x);
+        } else {
+            px = &x->next;
+        }
+    }
+    for (session_t **ps = &sessions; *ps != NULL;) {
+        session_t *s = *ps;
+        if (s->closed) {
+            *ps = s->next;
+            pool_put(s->rbuf, s->rsize);
+            free(s);
+        } else {
+            ps = &s->next;
+        }
+    }
+}
+
+/// Print the one line JSON report of a finished command
+static void xfer_report_json(xfer_t *x) {
+    outbuf_t line = {NULL, 0, 0};
+    char number[64];
+
+    outbuf_add(&line, number, snprintf(number, sizeof number, "{\"id\":%d,\"command\":", x->id));
+    outbuf_json(&line, x->command, strlen(x->command));
+    outbuf_add(&line, x->failed ? ",\"status\":\"error\"" : ",\"status\":\"ok\"", x->failed ? 17 : 14);
+    outbuf_add(&line, ",\"message\":", 11);
+    outbuf_json(&line, x->message, strlen(x->message));
+    outbuf_add(&line, number, snprintf(number, sizeof number, ",\"bytes\":%lld,\"ms\":%.3f", x->bytes,
+                                       (now_ns() - x->started) / 1e6));
+    if (x->pending.len > 0) {
+        outbuf_add(&line, ",\"output\":", 10);
+        outbuf_json(&line, x->pending.data, x->pending.len);
+        x->pending.len = 0;
+    }
+    outbuf_add(&line, "}\n", 2);
+    output_now(line.data, line.len);
+    free(line.data);
+}
+
+/// Fail a command with a message, both for the report and for people
+static void xfer_fail(xfer_t *x, const char *message) {
+    snprintf(x->message, sizeof x->message, "%s", message);
+    x->failed = 1;
+    x->discard = 1;
+    xfer_printf(x, "client: %s\n", message);
+}
+
+/// qsort() comparison putting lines in the same order as the server sorts names, equal ones next to each other
+static int compare_lines(const void *a, const void *b) {
+    int rv = strcoll(*(char *const *) a, *(char *const *) b);
+    return rv != 0 ? rv : strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/// Print the lines every server sent for a listing, tree or search in order, each once: replicas send the
+/// same names. A search keeps to the number of matches it asked for
+static void parts_merge_lines(xfer_t *whole) {
+    size_t count = 0, capacity = 64;
+    char **lines = malloc(capacity * sizeof *lines);
+    long limit = whole->kind == 'G' ? strtol(whole->request + 2, NULL, 10) : 0;
+
+    for (int i = 0; i < config->nodeCount && lines != NULL; i++) {
+        outbuf_t *part = &whole->parts[i];
+        if (part->len == 0) {
+            continue;
+        }
+        if (part->data[part->len - 1] != '\n') {
+            outbuf_add(part, "\n", 1);
+        }
+        for (char *line = part->data, *end; line < part->data + part->len; line = end + 1) {
+            end = memchr(line, '\n', part->data + part->len - line);
+            *end = '\0';
+            if (count == capacity) {
+                char **more = realloc(lines, 2 * capacity * sizeof *lines);
+                if (more == NULL) {
+                    free(lines);
+                    lines = NULL;
+                    break;
+                }
+                lines = more;
+                capacity *= 2;
+            }
+            lines[count++] = line;
+        }
+    }
+    if (lines == NULL) {
+        xfer_fail(whole, "out of memory merging the replies");
+        return;
+    }
+    qsort(lines, count, sizeof *lines, compare_lines);
+
+    long kept = 0;
+    for (size_t i = 0; i < count && (limit <= 0 || kept < limit); i++) {
+        if (i > 0 && strcmp(lines[i - 1], lines[i]) == 0) {
+            continue;
+        }
+        size_t len = strlen(lines[i]);
+        lines[i][len] = '\n';      // back where the line's newline was
+        xfer_output(whole, lines[i], len + 1);
+        lines[i][len] = '\0';
+        kept++;
+    }
+    free(lines);
+}
+
+/// A part of a command sent to every server finished. Its output and status go to the command, and with the
+/// last part in the command's output is put together from theirs. The command only fails for servers that
+/// could not be reached when as many were as files have replicas, short of that the others hold every file.
+/// Returns 1 once the command is complete
+static int part_done(xfer_t *x) {
+    xfer_t *whole = x->whole;
+
+    whole->parts[x->route[0]] = x->pending;
+    memset(&x->pending, 0, sizeof x->pending);
+    whole->bytes += x->bytes;
+    whole->files += x->files;
+    if (x->dropped) {
+        whole->partsLost++;
+    } else if (x->failed && !whole->failed) {
+        snprintf(whole->message, sizeof whole->message, "%s", x->message);
+        whole->failed = 1;
+    } else if (!x->failed && whole->message[0] == '\0') {
+        snprintf(whole->message, sizeof whole->message, "%s", x->message);
+    }
+    if (--whole->partsLeft > 0) {
+        return 0;
+    }
+
+    if (whole->partsLost > 0 && (whole->partsLost >= config->replicas || whole->partsLost == config->nodeCount)) {
+        char why[64];
+        snprintf(why, sizeof why, "%d of %d servers could not be reached", whole->partsLost, config->nodeCount);
+        xfer_fail(whole, why);
+        lost++;
+    } else if (whole->partsLost > 0) {
+        xfer_printf(whole, "client: %d of %d servers could not be reached, the others have copies of their files\n",
+                    whole->partsLost, config->nodeCount);
+    }
+    if (whole->kind == 'L' || whole->kind == 'T' || whole->kind == 'G') {
+        parts_merge_lines(whole);
+    } else {
+        // Stats under the name of their server, what is left of a watch as it came
+        for (int i = 0; i < config->nodeCount; i++) {
+            outbuf_t *part = &whole->parts[i];
+            if (whole->kind == 'S' && part->len > 0) {
+                char header[1024];
+                int len = snprintf(header, sizeof header, "server %s\n", config->nodes[i].name);
+                xfer_output(whole, header, len < (int) sizeof header ? (size_t) len : sizeof header - 1);
+            }
+            xfer_output(whole, part->data, part->len);
+        }
+    }
+    if (whole->kind == 'B' && !whole->failed) {
+        snprintf(whole->message, sizeof whole->message, "received %d files from %d servers", whole->files,
+                 config->nodeCount - whole->partsLost);
+    }
+    return 1;
+}
+
+/// End a command: close its files, report it and pass stdout on
+static void xfer_finish(xfer_t *x) {
+    if (x->filefd != -1) {
+        close(x->filefd);
+        x->filefd = -1;
+    }
+    if (x->mcastFd != -1) {
+        close(x->mcastFd);      // also leaves the group and epoll
+        x->mcastFd = -1;
+    }
+    if (x->tmpPath[0] != '\0') {
+        unlink(x->tmpPath);     // a body that never made it into the cache
+        x->tmpPath[0] = '\0';
+    }
+    x->finished = 1;
+    if (x->whole != NULL) {
+        if (part_done(x)) {
+            xfer_finish(x->whole);
+        }
+        return;
+    }
+    active--;
+    if (x->failed) {
+        failures++;
+    }
+    if (config->json) {
+        xfer_report_json(x);
+    } else if (stdoutOwner == NULL || stdoutOwner == x) {
+        xfer_release();
+    }
+}
+
+/// Fail a command because the connection to its server did, and end it
+static void xfer_drop(xfer_t *x, const char *why) {
+    xfer_fail(x, why);
+    x->dropped = 1;
+    if (x->whole == NULL) {
+        lost++;     // a part only counts through its command
+    }
+    xfer_finish(x);
+}
+
+/// Register interest in events on the connection's socket
+static int session_watch(session_t *s, uint32_t events) {
+    struct epoll_event ev;
+
+    if (s->watching == events) {
+        return 0;
+    }
+    ev.events = events;
+    ev.data.ptr = s;
+    if (epoll_ctl(config->epfd, s->watching != 0 ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, s->conn.fd, &ev) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    s->watching = events;
+    return 0;
+}
+
+/// Close the connection, the session is freed by xfer_reap()
+static void session_close(session_t *s) {
+    wheel_cancel(&wheel, &s->stall);
+    wheel_cancel(&wheel, &s->race);
+    while (s->ntries > 0) {
+        close(s->tries[--s->ntries].fd);
+    }
+    if (s->conn.fd != -1) {
+        conn_close(&s->conn);   // closing the socket also takes it out of epoll
+    }
+    s->closed = 1;
+    if (nodes[s->node].shared == s) {
+        nodes[s->node].shared = NULL;
+    }
+}
+
+/// Take the oldest command off the connection
+static xfer_t *session_dequeue(session_t *s) {
+    xfer_t *x = s->head;
+
+    s->head = x->queueNext;
+    if (s->head == NULL) {
+        s->tail = NULL;
+    }
+    if (s->sending == x) {
+        s->sending = x->queueNext;
+        s->sendState = SEND_REQUEST;
+    }
+    x->session = NULL;
+    return x;
+}
+
+/// The connection failed or the server hung up: every command still on it fails with why
+static void session_lost(session_t *s, const char *why) {
+    while (s->head != NULL) {
+        xfer_drop(session_dequeue(s), why);
+    }
+    session_close(s);
+}
+
+/// Connect fd to a with the first request riding in the SYN, TCP Fast Open. Only plain TCP requests that
+/// are safe to repeat go this way, as an attempt that loses the race may have delivered its copy too.
+/// Returns the request bytes that went with the SYN, 0 if it went without them because the server gave no
+/// cookie yet, or -1 if connect() has to be used instead
+static ssize_t session_fastopen(session_t *s, int fd, const struct addrinfo *a) {
+    const xfer_t *x = s->sending;
+
+    if (config->useTls || a->ai_family == AF_UNIX || x == NULL || s->sendState != SEND_REQUEST ||
+        x->requestSent > 0 || x->kind == 'U' || x->kind == 'F') {
+        return -1;
+    }
+    ssize_t n = sendto(fd, x->request, x->requestLen, MSG_FASTOPEN | MSG_NOSIGNAL, a->ai_addr, a->ai_addrlen);
+    if (n == -1) {
+        return errno == EINPROGRESS ? 0 : -1;
+    }
+    return n;
+}
+
+/// Start a non-blocking connect to the next address in the race, skipping those that fail at once.
+/// Returns 0 once an attempt is under way or -1 when no address is left
+static int session_try(session_t *s) {
+    node_t *n = &nodes[s->node];
+
+    while (s->nextAddr < n->naddrs && s->ntries < MAXATTEMPTS) {
+        struct addrinfo *a = n->addrs[s->nextAddr++];
+        int fd = socket(a->ai_family, a->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, a->ai_protocol);
+        if (fd == -1) {
+            perror("client: socket");
+            continue;
+        }
+        ssize_t early = session_fastopen(s, fd, a);
+        if (early == -1 && connect(fd, a->ai_addr, a->ai_addrlen) == -1 && errno != EINPROGRESS) {
+            perror("client: connect");
+            close(fd);
+            continue;
+        }
+        struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = s};
+        if (epoll_ctl(config->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror("epoll_ctl");
+            close(fd);
+            continue;
+        }
+        s->tries[s->ntries++] = (attempt_t) {fd, a, early > 0 ? (size_t) early : 0};
+        return 0;
+    }
+    return -1;
+}
+
+/// Arm the race timer for the next address of the node to join, or with every address racing, for a
+/// server of a cluster to be given up on
+static void session_race_next(session_t *s) {
+    if (s->nextAddr < nodes[s->node].naddrs) {
+        wheel_arm(&wheel, &s->race, wheel_now() + RACEDELAYMS);
+    } else if (config->nodeCount > 1) {
+        wheel_arm(&wheel, &s->race, wheel_now() + NODEWAITMS);
+    }
+}
+
+/// Start connecting, Happy Eyeballs style: an address that has not answered within RACEDELAYMS gets the next
+/// one racing it, an address that fails hands over at once, and the first connection made wins. Returns 0
+/// or -1 if no attempt could be started
+static int session_connect(session_t *s) {
+    s->state = SESSION_CONNECTING;
+    s->nextAddr = 0;
+    if (session_try(s) == -1) {
+        fprintf(stderr, "client: failed to connect to %s\n", config->nodes[s->node].name);
+        return -1;
+    }
+    session_race_next(s);
+    return 0;
+}
+
+/// Credit n bytes that went out to the requests they came from
+static void session_credit(session_t *s, size_t n) {
+    while (n > 0) {
+        xfer_t *x = s->sending;
+        size_t take = x->requestLen - x->requestSent < n ? x->requestLen - x->requestSent : n;
+        x->requestSent += take;
+        n -= take;
+        if (x->requestSent < x->requestLen) {
+            break;
+        }
+        if (x->kind == 'U' || (x->kind == 'F' && x->mcastState == MCAST_JOIN)) {
+            s->sendState = SEND_WAIT;   // the server answers before anything else may follow
+            break;
+        }
+        s->sending = x->queueNext;
+    }
+}
+
+/// Look at the attempts after epoll saw one of them move. A failed one is dropped and the next address
+/// started in its place, the first one connected becomes the connection and the others are closed.
+/// Returns 1 once connected, 0 while the race goes on or -1 when every address failed
+static int session_race(session_t *s) {
+    for (int i = 0; i < s->ntries; i++) {
+        attempt_t *t = &s->tries[i];
+        struct pollfd pfd = {t->fd, POLLOUT, 0};
+        if (poll(&pfd, 1, 0) != 1) {
+            continue;
+        }
+        int err = 0;
+        socklen_t len = sizeof err;
+        getsockopt(t->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err == 0) {
+            attempt_t won = *t;
+            *t = s->tries[--s->ntries];
+            while (s->ntries > 0) {
+                close(s->tries[--s->ntries].fd);    // also drops their epoll registrations
+            }
+            wheel_cancel(&wheel, &s->race);
+            s->conn.fd = won.fd;
+            s->addr = won.addr;
+            s->watching = EPOLLOUT;
+            session_credit(s, won.early);
+            return 1;
+        }
+        errno = err;
+        perror("client: connect");
+        close(t->fd);
+        *t = s->tries[--s->ntries];
+        i--;
+        session_try(s);
+    }
+    return s->ntries > 0 ? 0 : -1;
+}
+
+/// Move the new unix socket connection to shared memory rings. The handshake is one short request and reply,
+/// so it runs on the socket in blocking mode. From then on epoll only watches the socket for the server
+/// hanging up. Returns 0 or -1
+static int session_ring(session_t *s) {
+    int flags = fcntl(s->conn.fd, F_GETFL);
+
+    fcntl(s->conn.fd, F_SETFL, flags & ~O_NONBLOCK);
+    int rv = ring_connect(&s->conn, 1);
+    fcntl(s->conn.fd, F_SETFL, flags);
+    return rv == -1 ? -1 : session_watch(s, EPOLLRDHUP);
+}
+
+/// Copy bytes start to end of bodyfd to the same place in outfd, in the kernel when it can. Returns 0 or -1
+static int copy_extent(int outfd, int bodyfd, off_t start, off_t end) {
+    off_t in = start, out = start;
+
+    while (in < end) {
+        ssize_t n = copy_file_range(bodyfd, &in, outfd, &out, end - in, 0);
+        if (n <= 0) {
+            break;
+        }
+    }
+
+    char buf[COPYBUFSIZE];
+    while (in < end) {
+        ssize_t n = pread(bodyfd, buf, end - in < COPYBUFSIZE ? end - in : COPYBUFSIZE, in);
+        if (n <= 0 || pwrite(outfd, buf, n, in) != n) {
+            return -1;
+        }
+        in += n;
+    }
+    return 0;
+}
+
+/// Copy size bytes of a cached body to outfd, in the kernel when outfd is a file and through a buffer
+/// when it is a terminal or pipe. Into a file only the body's data extents are copied, so the holes of a
+/// sparse body stay holes. Returns 0 or -1 on error
+static int copy_body(int outfd, int bodyfd, off_t size) {
+    struct stat st;
+    off_t in = 0;
+
+    if (fstat(outfd, &st) == 0 && S_ISREG(st.st_mode) && ftruncate(outfd, size) == 0) {
+        while (in < size && (in = lseek(bodyfd, in, SEEK_DATA)) != -1) {   // ENXIO once only a hole is left
+            off_t hole = lseek(bodyfd, in, SEEK_HOLE);
+            if (hole == -1 || hole > size) {
+                hole = size;
+            }
+            if (in < hole && copy_extent(outfd, bodyfd, in, hole) == -1) {
+                return -1;
+            }
+            in = hole;
+        }
+        return 0;
+    }
+
+    while (in < size) {
+        ssize_t n = copy_file_range(bodyfd, &in, outfd, NULL, size - in, 0);
+        if (n <= 0) {
+            break;
+        }
+    }
+
+    char buf[COPYBUFSIZE];
+    while (in < size) {
+        ssize_t n = pread(bodyfd, buf, size - in < COPYBUFSIZE ? size - in : COPYBUFSIZE, in);
+        if (n <= 0 || write(outfd, buf, n) != n) {
+            return -1;
+        }
+        in += n;
+    }
+    return 0;
+}
+
+/// V: the cached body in x->filefd is current, save it as the file or print it
+static void xfer_deliver(xfer_t *x, int fromCache) {
+    if (x->download) {
+        int filefd = open(x->name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (filefd == -1 || copy_body(filefd, x->filefd, x->entry.size) == -1) {
+            perror("client: download");
+            xfer_fail(x, "could not save the file");
+        } else {
+            snprintf(x->message, sizeof x->message, "downloaded %s (%lld bytes, %s)", x->name, x->entry.size,
+                     fromCache ? "not modified, from cache" : "transferred");
+            xfer_printf(x, "client: %s\n", x->message);
+        }
+        if (filefd != -1) {
+            close(filefd);
+        }
+    } else if (!config->json && (stdoutOwner == NULL || stdoutOwner == x)) {
+        stdoutOwner = x;
+        progress_clear();
+        fflush(stdout);
+        copy_body(STDOUT_FILENO, x->filefd, x->entry.size);
+    } else {
+        // Someone else is printing or the body goes in a report, keep all of it
+        char buf[COPYBUFSIZE];
+        for (off_t at = 0; at < x->entry.size;) {
+            ssize_t n = pread(x->filefd, buf, sizeof buf, at);
+            if (n <= 0) {
+                break;
+            }
+            xfer_output(x, buf, n);
+            at += n;
+        }
+    }
+    xfer_finish(x);
+}
+
+/// V: the modified body arrived in the cache temp file, make it the cached copy and hand it over
+static void xfer_body_done(xfer_t *x) {
+    digest_t digest;
+
+    if (x->sparse && ftruncate(x->filefd, x->size) == -1) {
+        perror("client: cache");
+    }
+    digest_init(&digest);
+    digest_update_fd(&digest, x->filefd, 0, x->size);
+    digest_hex(digest_final(&digest), x->entry.hash);
+    x->entry.size = x->size;
+    if (cache_commit(config->cacheKey, x->name, x->tmpPath, &x->entry) == -1) {
+        perror("client: cache");
+    }
+    x->tmpPath[0] = '\0';
+    xfer_deliver(x, 0);
+}
+
+/// Batch download: collect the next need bytes of the archive before moving on from state
+static void tar_expect(xfer_t *x, int state, size_t need) {
+    x->tarState = state;
+    x->need = need;
+    x->held = 0;
+}
+
+/// Batch download: the current member arrived completely
+static void tar_member_done(xfer_t *x) {
+    struct timespec times[2] = {{0, UTIME_OMIT}, {x->mtime, 0}};
+    futimens(x->filefd, times);
+    close(x->filefd);
+    x->filefd = -1;
+    if (!x->duplicate) {
+        x->files++;
+        xfer_printf(x, "client: received %s (%lld bytes)\n", x->name, x->size);
+    }
+    x->duplicate = 0;
+    size_t pad = tar_padding(x->size);
+    if (pad > 0) {
+        tar_expect(x, TAR_PAD, pad);
+    } else {
+        tar_expect(x, TAR_HEADER, TARBLOCK);
+    }
+}
+
+/// Batch download sent to every server: claim the member name for the part receiving it. Returns 1, or 0 if
+/// another server's part already took it, the replicas of a file send it too
+static int tar_claim(xfer_t *whole, const char *name) {
+    size_t lo = 0, hi = whole->takenCount;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int rv = strcmp(whole->taken[mid], name);
+        if (rv == 0) {
+            return 0;
+        }
+        if (rv < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    char **taken = realloc(whole->taken, (whole->takenCount + 1) * sizeof *taken);
+    char *copy = strdup(name);
+    if (taken == NULL || copy == NULL) {
+        free(copy);
+        if (taken != NULL) {
+            whole->taken = taken;
+        }
+        return 1;   // without memory to remember it, receiving a copy twice beats losing it
+    }
+    whole->taken = taken;
+    memmove(taken + lo + 1, taken + lo, (whole->takenCount - lo) * sizeof *taken);
+    taken[lo] = copy;
+    whole->takenCount++;
+    return 1;
+}
+
+/// Batch download: react to a fixed size piece of the archive that was collected in hold
+static void tar_collected(xfer_t *x) {
+    char name[TAR_MAXNAME];
+    off_t size;
+    int rv;
+
+    switch (x->tarState) {
+        case TAR_HEADER:
+            rv = tar_parse(x->hold, name, &size, &x->mtime);
+            if (rv == 0) {
+                tar_expect(x, TAR_END, TARBLOCK);
+                return;
+            }
+            if (rv == -1 || (rv == 2 && (size < 1 || size > TAR_MAXNAME))) {
+                xfer_fail(x, "corrupt archive stream");
+                return;
+            }
+            if (rv == 2) {
+                tar_expect(x, TAR_LONGNAME, TARBLOCK);
+                return;
+            }
+            if (x->longName[0] != '\0') {
+                strcpy(name, x->longName);
+                x->longName[0] = '\0';
+            }
+
+            // Never let the stream write outside the current directory
+            free(x->name);
+            x->name = strdup(name);
+            x->filefd = -1;
+            x->duplicate = x->whole != NULL && !tar_claim(x->whole, name);
+            if (x->duplicate) {
+                x->filefd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+            } else if (name[0] != '.' && strchr(name, '/') == NULL) {
+                x->filefd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            }
+            if (x->filefd == -1) {
+                fprintf(stderr, "client: skipping %s\n", name);
+                x->filefd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+            }
+            x->tarState = TAR_DATA;
+            x->size = size;
+            x->done = 0;
+            if (size == 0) {
+                tar_member_done(x);
+            }
+            return;
+
+        case TAR_LONGNAME:
+            snprintf(x->longName, sizeof x->longName, "%.*s", TAR_MAXNAME - 1, x->hold);
+            tar_expect(x, TAR_HEADER, TARBLOCK);
+            return;
+
+        case TAR_PAD:
+            tar_expect(x, TAR_HEADER, TARBLOCK);
+            return;
+
+        case TAR_END:
+            x->tarState = TAR_DONE;
+            return;
+    }
+}
+
+/// n bytes were stored in x->filefd at x->done
+static void xfer_stored(xfer_t *x, size_t n) {
+    x->done += n;
+    if (x->kind == 'B' && x->done == x->size) {
+        tar_member_done(x);
+    } else if (x->kind == 'F' && x->done == x->ranges[2 * x->rangeAt + 1]) {
+        x->repaired += x->done;
+        x->rangeAt++;
+        x->done = 0;
+    }
+}
+
+/// The file data of the reply can go straight into right now, as fd, offset and at most max bytes.
+/// Returns 0 when the data needs looking at instead
+static int xfer_sink(xfer_t *x, int *fd, off_t *offset, long long *max) {
+    if (x->discard) {
+        return 0;
+    }
+    if (x->kind == 'D' && x->filefd == -1 &&
+        (x->filefd = open(x->name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1) {
+        perror("client: download");
+        xfer_fail(x, "could not save the file");
+        return 0;
+    }
+    if (x->kind == 'D') {
+        *max = 1LL << 62;
+    } else if ((x->kind == 'V' && x->tmpPath[0] != '\0') || (x->kind == 'B' && x->tarState == TAR_DATA)) {
+        *max = x->size - x->done;
+    } else if (x->kind == 'F' && x->mcastState == MCAST_REPAIR && x->rangeAt < x->rangeCount) {
+        *max = x->ranges[2 * x->rangeAt + 1] - x->done;
+    } else {
+        return 0;
+    }
+    *fd = x->filefd;
+    *offset = x->done + (x->kind == 'F' ? x->ranges[2 * x->rangeAt] : 0);
+    return 1;
+}
+
+/// Take n bytes of DATA frame payload for x
+static void xfer_data(xfer_t *x, const char *data, size_t n) {
+    int fd;
+    off_t offset;
+    long long max;
+
+    x->bytes += n;
+    if (x->discard) {
+        return;
+    }
+    if (x->kind == 'U' || x->kind == 'C' || (x->kind == 'V' && x->tmpPath[0] == '\0')) {
+        return;     // nothing expected
+    }
+    if (x->kind != 'D' && x->kind != 'V' && x->kind != 'B' && x->kind != 'F') {
+        xfer_output(x, data, n);    // File contents arrive raw, not as strings
+        return;
+    }
+    while (n > 0 && !x->discard) {
+        if (xfer_sink(x, &fd, &offset, &max)) {
+            size_t take = (long long) n < max ? n : (size_t) max;
+            if (pwrite(fd, data, take, offset) != (ssize_t) take) {
+                perror("client: write");
+                xfer_fail(x, "could not save the file");
+                return;
+            }
+            data += take;
+            n -= take;
+            xfer_stored(x, take);
+            continue;
+        }
+        if (x->kind != 'B' || x->tarState == TAR_DONE) {
+            return;
+        }
+        size_t take = n < x->need - x->held ? n : x->need - x->held;
+        memcpy(x->hold + x->held, data, take);
+        x->held += take;
+        data += take;
+        n -= take;
+        if (x->held == x->need) {
+            tar_collected(x);
+        }
+    }
+}
+
+/// The whole upload was sent, hash our copy while the server finishes writing its own
+static void xfer_upload_done(xfer_t *x) {
+    digest_t digest;
+
+    digest_init(&digest);
+    digest_update_fd(&digest, x->filefd, 0, x->size);
+    digest_hex(digest_final(&digest), x->hex);
+    close(x->filefd);
+    x->filefd = -1;
+}
+
+/// F: multicast reception is over. Leave the group and ask for every range still missing, then a bare N.
+/// The command sends again, its reply carries the ranges in the order they were asked for
+static void mcast_repair(session_t *s, xfer_t *x) {
+    outbuf_t request = {NULL, 0, 0};
+    char line[64];
+
+    if (x->mcastFd != -1) {
+        close(x->mcastFd);
+        x->mcastFd = -1;
+    }
+    for (uint32_t seq = 0; seq < x->mcastCount && !x->discard;) {
+        if (x->mcastBits[seq / 8] & (1 << (seq % 8))) {
+            seq++;
+            continue;
+        }
+        uint32_t end = seq;
+        while (end < x->mcastCount && !(x->mcastBits[end / 8] & (1 << (end % 8)))) {
+            end++;
+        }
+        if (x->rangeCount == MAXRANGES - 1) {
+            end = x->mcastCount;
+        }
+        off_t offset = (off_t) seq * MCASTPAYLOAD;
+        off_t last = (off_t) end * MCASTPAYLOAD < x->size ? (off_t) end * MCASTPAYLOAD : x->size;
+        x->ranges = realloc(x->ranges, 2 * (x->rangeCount + 1) * sizeof *x->ranges);
+        x->ranges[2 * x->rangeCount] = offset;
+        x->ranges[2 * x->rangeCount + 1] = last - offset;
+        x->rangeCount++;
+        int len = snprintf(line, sizeof line, "N %lld %lld\n", (long long) offset, (long long) (last - offset));
+        outbuf_add(&request, line, len);
+        seq = end;
+    }
+    outbuf_add(&request, "N\n", 2);
+
+    free(x->request);
+    x->request = request.data;
+    x->requestLen = request.len;
+    x->requestSent = 0;
+    x->mcastState = MCAST_REPAIR;
+    x->done = 0;
+    s->sendState = SEND_REQUEST;    // it was waiting as the command being sent
+    s->yielded = 1;
+}
+
+/// F: the server named the group, join it and get the file ready to be filled in as datagrams arrive.
+/// Anything going wrong here leaves the whole file to come over the connection
+static void mcast_begin(session_t *s, xfer_t *x, const char *groupName) {
+    struct in_addr group;
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = s};
+
+    x->filefd = open(x->name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (x->filefd == -1 || ftruncate(x->filefd, x->size) == -1) {
+        perror("client: mcast");
+        xfer_fail(x, "could not save the file");
+        mcast_repair(s, x);
+        return;
+    }
+    x->mcastCount = mcast_count(x->size);
+    x->mcastBits = calloc(x->mcastCount / 8 + 1, 1);
+    x->mcastState = MCAST_RECV;
+    x->mcastLast = now_ns();
+    if (inet_pton(AF_INET, groupName, &group) != 1 ||
+        (x->mcastFd = mcast_join(group, mcast_interface(s->conn.fd))) == -1 ||
+        epoll_ctl(config->epfd, EPOLL_CTL_ADD, x->mcastFd, &ev) == -1) {
+        perror("client: multicast group");
+        mcast_repair(s, x);
+    } else if (x->mcastCount == 0) {
+        mcast_repair(s, x);
+    }
+}
+
+/// F: store the datagrams that arrived for the command receiving by multicast, and ask for what is missing
+/// once the end marker came or every datagram did. Returns STEP_MORE if any arrived, otherwise 0
+static int session_mcast(session_t *s, long long *moved) {
+    static char datagrams[MCASTBATCH][MCASTDATAGRAM];
+    struct mmsghdr msgs[MCASTBATCH];
+    struct iovec iov[MCASTBATCH];
+    xfer_t *x = s->head;
+    int ended = 0;
+
+    if (x == NULL || x->kind != 'F' || x->mcastState != MCAST_RECV) {
+        return 0;
+    }
+    memset(msgs, 0, sizeof msgs);
+    for (int i = 0; i < MCASTBATCH; i++) {
+        iov[i].iov_base = datagrams[i];
+        iov[i].iov_len = MCASTDATAGRAM;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int n = recvmmsg(x->mcastFd, msgs, MCASTBATCH, 0, NULL);
+    if (n <= 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < n; i++) {
+        uint32_t session, seq, count;
+        ssize_t len = mcast_parse(datagrams[i], msgs[i].msg_len, &session, &seq, &count);
+        if (len < 0 || session != x->mcastSession || count != x->mcastCount) {
+            continue;   // another version of the file
+        }
+        if (seq == count) {
+            ended = 1;
+            continue;
+        }
+        off_t offset = (off_t) seq * MCASTPAYLOAD;
+        if (seq > count || (x->mcastBits[seq / 8] & (1 << (seq % 8))) ||
+            len != (x->size - offset < MCASTPAYLOAD ? x->size - offset : MCASTPAYLOAD)) {
+            continue;
+        }
+        if (pwrite(x->filefd, datagrams[i] + MCASTHEADER, len, offset) != len) {
+            perror("client: write");
+            xfer_fail(x, "could not save the file");
+            mcast_repair(s, x);
+            return STEP_MORE;
+        }
+        x->mcastBits[seq / 8] |= 1 << (seq % 8);
+        x->mcastGot++;
+        x->bytes += len;
+        *moved += len;
+    }
+    x->mcastLast = now_ns();
+    if (ended || x->mcastGot == x->mcastCount) {
+        mcast_repair(s, x);
+    }
+    return STEP_MORE;
+}
+
+/// Queue x on a connection to the server x->route[x->routeAt], the server's pipelined one when commands
+/// share connections, and start connecting if the connection is new. Returns 0, -1 if not even a
+/// connection attempt could be started or -2 without memory for a new connection
+static int xfer_queue(xfer_t *x) {
+    int node = x->route[x->routeAt];
+    session_t *s = config->pipeline ? nodes[node].shared : NULL;
+
+    if (s == NULL) {
+        if ((s = calloc(1, sizeof *s)) == NULL || (s->rbuf = pool_get(POOL_SMALL, &s->rsize)) == NULL) {
+            free(s);
+            return -2;
+        }
+        s->conn.fd = -1;
+        s->conn.framed = 1;
+        s->node = node;
+        s->stall.data = s;
+        s->race.data = s;
+        s->next = sessions;
+        sessions = s;
+        if (config->pipeline) {
+            nodes[node].shared = s;
+        }
+    }
+    x->session = s;
+    if (s->tail != NULL) {
+        s->tail->queueNext = x;
+    } else {
+        s->head = x;
+    }
+    s->tail = x;
+    if (s->sending == NULL) {
+        s->sending = x;
+        s->sendState = SEND_REQUEST;
+    }
+
+    if (s->conn.fd == -1 && s->ntries == 0 && session_connect(s) == -1) {
+        session_dequeue(s);
+        session_close(s);
+        return -1;
+    }
+    if (config->timeout > 0 && !wheel_armed(&s->stall)) {
+        wheel_arm(&wheel, &s->stall, wheel_now() + config->timeout);    // covers connecting too
+    }
+    // An open connection sends from the loop, so commands started together leave together
+    s->yielded = s->state == SESSION_OPEN;
+    return 0;
+}
+
+/// Send x to the first server on its route from x->routeAt on that is not known to be down, or to the next
+/// one if they all are, moving along while servers can't be reached at once. Returns 0, or -1 with x failed
+/// with why once no server is left, or without memory for a connection
+static int xfer_route(xfer_t *x, const char *why) {
+    uint64_t now = wheel_now();
+
+    while (x->routeAt < x->routeCount) {
+        for (int i = x->routeAt; i < x->routeCount; i++) {
+            if (nodes[x->route[i]].downUntil <= now) {
+                x->routeAt = i;
+                break;
+            }
+        }
+        int rv = xfer_queue(x);
+        if (rv == 0) {
+            return 0;
+        }
+        if (rv == -2) {
+            // Not the server's fault, the command can't go anywhere
+            xfer_fail(x, "out of memory");
+            xfer_finish(x);
+            return -1;
+        }
+        nodes[x->route[x->routeAt]].downUntil = now + NODEDOWNMS;
+        x->routeAt++;
+    }
+    xfer_drop(x, why);
+    return -1;
+}
+
+/// Take an INFO frame for x
+static void xfer_info(session_t *s, xfer_t *x, const char *text) {
+    char group[INET_ADDRSTRLEN];
+    int port;
+    long long offset;
+
+    if (x->kind == 'U' && strcmp(text, "Ready") == 0 && s->sending == x && s->sendState == SEND_WAIT) {
+        s->sendState = SEND_BODY;
+    } else if (x->kind == 'F' && x->mcastState == MCAST_JOIN && s->sending == x && s->sendState == SEND_WAIT &&
+               sscanf(text, "Group %15s %d %u %lld", group, &port, &x->mcastSession, &x->size) == 4) {
+        mcast_begin(s, x, group);
+    } else if (x->kind == 'V' && sscanf(text, "Modified %lld %31s", &x->size, x->entry.mtime) == 2) {
+        if (x->filefd != -1) {
+            close(x->filefd);
+        }
+        if ((x->filefd = cache_begin(x->tmpPath)) == -1) {
+            perror("client: cache");
+            x->tmpPath[0] = '\0';
+            xfer_fail(x, "could not write to the cache");
+            return;
+        }
+        x->done = 0;
+    } else if ((x->kind == 'D' || (x->kind == 'V' && x->tmpPath[0] != '\0')) &&
+               sscanf(text, "Extent %lld", &offset) == 1 && offset >= x->done) {
+        // A sparse file comes as its data extents, what lies between them is left a hole
+        x->done = offset;
+        x->sparse = 1;
+    } else if (x->kind == 'A' && (strcmp(text, "Truncated") == 0 || strcmp(text, "Rotated") == 0)) {
+        // Like tail -F, the notice goes to stderr and stdout keeps only the file's contents
+        progress_clear();
+        fprintf(stderr, "client: %s was %s, following it from its start\n", x->name,
+                text[0] == 'T' ? "truncated" : "replaced");
+    }
+}
+
+/// The reply to x ended with status text, failed if it was an ERROR frame
+static void xfer_end(xfer_t *x, int failed, const char *text) {
+    if (x->discard) {
+        xfer_finish(x);
+        return;
+    }
+    // A file may be on a later server of its route, one that held it before a server joined the ring took
+    // its place, so it is only reported missing once every server was asked
+    if (failed && strcasecmp(text, "File not found") == 0 && x->routeAt + 1 < x->routeCount) {
+        x->routeAt++;
+        x->queueNext = NULL;
+        x->requestSent = 0;
+        x->bytes = 0;
+        xfer_route(x, "failed to connect");
+        return;
+    }
+    snprintf(x->message, sizeof x->message, "%s", text);
+    x->failed = failed;
+
+    switch (x->kind) {
+        case 'V':
+            if (!failed && x->tmpPath[0] != '\0') {
+                if (x->done != x->size) {
+                    xfer_fail(x, "transfer ended early");
+                    break;
+                }
+                xfer_body_done(x);
+                return;
+            }
+            if (!failed && strncmp(text, "Not Modified ", 13) == 0 && x->filefd != -1) {
+                // Same content under a new mtime, remember it so the next check is cheap again
+                if (strcmp(text + 13, x->entry.mtime) != 0) {
+                    snprintf(x->entry.mtime, sizeof x->entry.mtime, "%s", text + 13);
+                    cache_update(config->cacheKey, x->name, &x->entry);
+                }
+                xfer_deliver(x, 1);
+                return;
+            }
+            x->failed = 1;
+            xfer_printf(x, "client: received '%s'\n", text);
+            break;
+
+        case 'U':
+            xfer_printf(x, "client: received '%s'\n", text);
+            if (!failed && strncmp(text, "Upload complete ", 16) == 0 && strcmp(text + 16, x->hex) != 0) {
+                xfer_printf(x, "client: digest mismatch, local copy is %s\n", x->hex);
+                snprintf(x->message, sizeof x->message, "digest mismatch, local copy is %s", x->hex);
+                x->failed = 1;
+            }
+            break;
+
+        case 'B':
+            if (x->tarState == TAR_DATA) {
+                xfer_printf(x, "client: archive ended inside %s\n", x->name);
+                x->failed = 1;
+            }
+            xfer_printf(x, "client: received '%s'\n", text);
+            break;
+
+        case 'F':
+            if (!failed && (x->mcastState != MCAST_REPAIR || x->rangeAt < x->rangeCount)) {
+                xfer_fail(x, "transfer ended early");
+                break;
+            }
+            if (!failed) {
+                snprintf(x->message, sizeof x->message, "received %s by multicast (%lld bytes, %lld sent again)",
+                         x->name, x->size, x->repaired);
+            }
+            xfer_printf(x, "client: %s\n", failed ? text : x->message);
+            break;
+
+        case 'D':
+            if (!failed && x->filefd == -1) {
+                x->filefd = open(x->name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);   // empty file
+            }
+            if (!failed && x->sparse) {
+                if (x->filefd == -1 || ftruncate(x->filefd, x->done) == -1) {
+                    perror("client: download");     // a hole at the end is only made by setting the size
+                }
+                snprintf(x->message, sizeof x->message, "downloaded %s (%lld bytes, %lld of data)", x->name,
+                         x->done, x->bytes);
+            } else if (!failed) {
+                snprintf(x->message, sizeof x->message, "downloaded %s (%lld bytes)", x->name, x->done);
+            } else {
+                xfer_printf(x, "client: received '%s'\n", text);
+            }
+            break;
+
+        default:
+            if (text[0] != '\0') {
+                xfer_printf(x, "client: received '%s'\n", text);
+            }
+            break;
+    }
+    xfer_finish(x);
+}
+
+/// A whole frame arrived
+static int session_frame_done(session_t *s) {
+    xfer_t *x = s->head;
+
+    s->inFrame = 0;
+    s->text[s->textLen] = '\0';
+    if (s->frameType == FRAME_INFO) {
+        xfer_info(s, x, s->text);
+    } else if (s->frameType == FRAME_END || s->frameType == FRAME_ERROR) {
+        session_dequeue(s);
+        xfer_end(x, s->frameType == FRAME_ERROR, s->text);
+        // A connection per command is done with its command, a pipelined one waits for more
+        if (s->head == NULL && !config->pipeline) {
+            session_close(s);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/// Work through the bytes read so far. Returns 0 or -1 once the connection is gone
+static int session_parse(session_t *s, long long *moved) {
+    while (s->rpos < s->rlen) {
+        size_t avail = s->rlen - s->rpos;
+
+        if (!s->inFrame) {
+            size_t take = FRAME_HEADER - s->headerHeld < avail ? FRAME_HEADER - s->headerHeld : avail;
+            memcpy(s->header + s->headerHeld, s->rbuf + s->rpos, take);
+            s->headerHeld += take;
+            s->rpos += take;
+            if (s->headerHeld < FRAME_HEADER) {
+                break;
+            }
+            s->headerHeld = 0;
+            s->frameLeft = frame_parse(s->header, &s->frameType);
+            s->textLen = 0;
+            s->inFrame = 1;
+            if (s->head == NULL || (s->frameType != FRAME_DATA && s->frameLeft > FRAME_MAXTEXT) ||
+                (s->frameType != FRAME_DATA && s->frameType != FRAME_INFO && s->frameType != FRAME_END &&
+                 s->frameType != FRAME_ERROR)) {
+                session_lost(s, "protocol error");
+                return -1;
+            }
+        } else {
+            size_t take = s->frameLeft < avail ? s->frameLeft : avail;
+            if (s->frameType == FRAME_DATA) {
+                xfer_data(s->head, s->rbuf + s->rpos, take);
+                *moved += take;
+            } else {
+                memcpy(s->text + s->textLen, s->rbuf + s->rpos, take);
+                s->textLen += take;
+            }
+            s->rpos += take;
+            s->frameLeft -= take;
+        }
+        if (s->frameLeft == 0 && session_frame_done(s) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/// Read what arrived, big file data goes from the socket to its file directly.
+/// Returns STEP_MORE if something happened, EPOLLIN when nothing has arrived or -1 once the connection is gone
+static int session_recv(session_t *s, long long *moved) {
+    ssize_t n;
+    int fd;
+    off_t offset;
+    long long max;
+
+    if (s->rpos == s->rlen) {
+        xfer_t *x = s->head;
+        if (s->inFrame && s->frameType == FRAME_DATA && s->frameLeft >= DIRECTMIN && x != NULL &&
+            xfer_sink(x, &fd, &offset, &max)) {
+            n = conn_tryrecvfile(&s->conn, fd, offset, (long long) s->frameLeft < max ? s->frameLeft : (size_t) max);
+            if (n > 0) {
+                x->bytes += n;
+                s->frameLeft -= n;
+                *moved += n;
+                xfer_stored(x, n);
+                return s->frameLeft == 0 && session_frame_done(s) == -1 ? -1 : STEP_MORE;
+            }
+        } else {
+            // Replies start out on a small buffer and move up a class each time a read fills it
+            if (s->rfilled) {
+                char *bigger = pool_grow(s->rbuf, &s->rsize, 0);
+                if (bigger != NULL) {
+                    s->rbuf = bigger;   // without memory the reply goes on coming in on the buffer it has
+                }
+            }
+            n = conn_recv(&s->conn, s->rbuf, s->rsize);
+            if (n > 0) {
+                s->rpos = 0;
+                s->rlen = n;
+            }
+            s->rfilled = n == (ssize_t) s->rsize;
+        }
+        if (n == -1 && errno == EAGAIN) {
+            return EPOLLIN;
+        }
+        if (n == 0 && s->head == NULL) {
+            session_close(s);     // an idle connection the server let go, the next command reconnects
+            return -1;
+        }
+        if (n <= 0) {
+            if (n == -1) {
+                perror("recv");
+            }
+            session_lost(s, "server closed the connection");
+            return -1;
+        }
+    }
+    return session_parse(s, moved) == -1 ? -1 : STEP_MORE;
+}
+
+/// Send what is queued: requests go out together, up to an upload which waits for the server's go ahead.
+/// Returns STEP_MORE if something was sent, EPOLLOUT when the socket is full, 0 with nothing to send or -1
+/// once the connection is gone
+static int session_send(session_t *s, long long *moved) {
+    xfer_t *x = s->sending;
+    ssize_t n;
+
+    if (x == NULL || s->sendState == SEND_WAIT) {
+        return 0;
+    }
+
+    if (s->sendState == SEND_BODY) {
+        if (x->done < x->size) {
+            n = conn_trysendfile(&s->conn, x->filefd, x->done, x->size - x->done);
+            if (n == -1 && errno == EAGAIN) {
+                return EPOLLOUT;
+            }
+            if (n <= 0) {
+                perror("sendfile");
+                session_lost(s, "upload failed");
+                return -1;
+            }
+            x->done += n;
+            x->bytes += n;
+            *moved += n;
+            if (x->done < x->size) {
+                return STEP_MORE;
+            }
+        }
+        xfer_upload_done(x);
+        s->sending = x->queueNext;
+        s->sendState = SEND_REQUEST;
+        return STEP_MORE;
+    }
+
+    // Gather the unsent requests, a send that did not go through is offered again with the same length
+    char batch[SENDBATCH];
+    const char *out = batch;
+    size_t len = 0;
+    for (xfer_t *y = x; y != NULL; y = y->queueNext) {
+        size_t left = y->requestLen - y->requestSent;
+        if (s->retryLen > 0 ? len + left > s->retryLen : len + left > sizeof batch) {
+            break;
+        }
+        memcpy(batch + len, y->request + y->requestSent, left);
+        len += left;
+        if (y->kind == 'U' || y->kind == 'F') {
+            break;
+        }
+    }
+    if (len == 0 || (s->retryLen > 0 && len != s->retryLen)) {
+        out = x->request + x->requestSent;  // a request too long for the batch goes out on its own
+        len = x->requestLen - x->requestSent;
+    }
+
+    n = conn_trysend(&s->conn, out, len);
+    if (n == -1) {
+        if (errno == EAGAIN) {
+            s->retryLen = len;
+            return EPOLLOUT;
+        }
+        perror("send");
+        session_lost(s, "server closed the connection");
+        return -1;
+    }
+    s->retryLen = 0;
+    session_credit(s, n);
+    return STEP_MORE;
+}
+
+/// Run the connection until it has to wait on its socket, used up its turn or is gone.
+/// Returns the epoll events to wait for, WAIT_TURN, or 0 once the connection is gone
+static int session_step(session_t *s) {
+    long long moved = 0;
+
+    while (!s->closed) {
+        if (moved >= TURNBYTES) {
+            return WAIT_TURN;
+        }
+        switch (s->state) {
+            case SESSION_CONNECTING:
+                return EPOLLOUT;
+
+            case SESSION_HANDSHAKE:
+                switch (tls_connect_step(&s->conn, config->nodes[s->node].hostname)) {
+                    case 0:
+                        s->state = SESSION_OPEN;
+                        break;
+                    case TLS_WANT_READ:
+                        return EPOLLIN;
+                    case TLS_WANT_WRITE:
+                        return EPOLLOUT;
+                    default:
+                        fprintf(stderr, "client: TLS handshake failed\n");
+                        session_lost(s, "TLS handshake failed");
+                        break;
+                }
+                break;
+
+            case SESSION_OPEN: {
+                int out = session_send(s, &moved);
+                if (out == -1) {
+                    break;
+                }
+                int in = session_recv(s, &moved);
+                if (in == -1) {
+                    break;
+                }
+                if (session_mcast(s, &moved) == STEP_MORE) {
+                    break;
+                }
+                if (out != STEP_MORE && in != STEP_MORE) {
+                    return out | in;    // an idle pipelined connection still watches for the server hanging up
+                }
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+/// Run the state machine and wait for whatever it is blocked on. A connection that used up its turn is
+/// picked up again by xfer_resume() rather than by epoll, TLS may already hold data the socket no longer shows
+static void session_run(session_t *s) {
+    int wait = session_step(s);
+    s->yielded = wait == WAIT_TURN;
+    if (s->conn.ring != NULL && wait > 0) {
+        // xfer_wait() sleeps on the rings while commands are out, epoll only sees the server hang up
+        s->ringWait = s->head != NULL ? (uint32_t) wait : 0;
+        wait = EPOLLRDHUP;
+    }
+    if (wait > 0 && session_watch(s, wait) == -1) {
+        session_lost(s, "connection lost");
+    }
+    // Every run is progress, a connection with commands out gets its whole stall time again. A watch or a
+    // follow waits for changes as long as it takes
+    if (!s->closed && s->head != NULL && s->head->kind != 'W' && s->head->kind != 'A' && config->timeout > 0) {
+        wheel_arm(&wheel, &s->stall, wheel_now() + config->timeout);
+    } else {
+        wheel_cancel(&wheel, &s->stall);
+    }
+    // An idle connection hands a big read buffer back for whichever transfer comes next
+    if (!s->closed && s->head == NULL && s->rpos == s->rlen && s->rsize > POOL_SMALL) {
+        size_t size;
+        char *small = pool_get(POOL_SMALL, &size);
+        if (small != NULL) {
+            pool_put(s->rbuf, s->rsize);
+            s->rbuf = small;
+            s->rsize = size;
+        }
+        s->rfilled = 0;
+    }
+}
+
+/// Order a server's addresses for racing. getaddrinfo() puts the preferred family first, races take its
+/// addresses and the other family's in turn, so a family that can't be reached costs one race delay instead
+/// of a wait for each address
+static void node_addresses(node_t *n, struct addrinfo *servinfo) {
+    struct addrinfo *family[2][MAXADDRS];
+    int count[2] = {0, 0};
+
+    for (struct addrinfo *a = servinfo; a != NULL; a = a->ai_next) {
+        int other = a->ai_family != servinfo->ai_family;
+        if (count[other] < MAXADDRS) {
+            family[other][count[other]++] = a;
+        }
+    }
+    n->naddrs = 0;
+    for (int i = 0; n->naddrs < MAXADDRS && (i < count[0] || i < count[1]); i++) {
+        if (i < count[0]) {
+            n->addrs[n->naddrs++] = family[0][i];
+        }
+        if (i < count[1] && n->naddrs < MAXADDRS) {
+            n->addrs[n->naddrs++] = family[1][i];
+        }
+    }
+}
+
+/// Set up the transfer engine, config must stay valid while transfers run
+void xfer_init(const xfer_config_t *c) {
+    config = c;
+    showProgress = isatty(STDERR_FILENO);
+    wheel_init(&wheel, wheel_now());
+
+    const char *names[XFER_MAXNODES];
+    for (int n = 0; n < c->nodeCount; n++) {
+        names[n] = c->nodes[n].name;
+        node_addresses(&nodes[n], c->nodes[n].servinfo);
+    }
+    if (hashring_init(&hashRing, names, c->nodeCount) == -1) {
+        perror("client: hash ring");
+        exit(1);
+    }
+}
+
+/// Milliseconds until a connection has a deadline or a race to act on in xfer_resume(), -1 if none has
+long xfer_due(void) {
+    return wheel_timeout(&wheel);
+}
+
+/// The server of s could not be reached. It is tried last for NODEDOWNMS, and every command waiting on s
+/// moves on to the next server on its route, nothing of them was sent yet. Those with no server left fail
+/// with why
+static void session_failover(session_t *s, const char *why) {
+    xfer_t *moved = NULL, **tail = &moved;
+
+    nodes[s->node].downUntil = wheel_now() + NODEDOWNMS;
+    while (s->head != NULL) {
+        xfer_t *x = session_dequeue(s);
+        x->queueNext = NULL;
+        *tail = x;
+        tail = &x->queueNext;
+    }
+    session_close(s);
+    while (moved != NULL) {
+        xfer_t *x = moved;
+        moved = x->queueNext;
+        x->queueNext = NULL;
+        x->routeAt++;
+        xfer_route(x, why);
+    }
+}
+
+/// Add x to the end of the started commands
+static void xfer_append(xfer_t *x) {
+    xfer_t **px = &xfers;
+    while (*px != NULL) {
+        px = &(*px)->next;
+    }
+    *px = x;
+}
+
+/// Set up a command for the encoded message, typed as command, and add it to the list. Returns NULL if it
+/// failed already, having been reported
+static xfer_t *xfer_new(const char *message, const char *command, int download) {
+    xfer_t *x = calloc(1, sizeof *x);
+
+    x->id = ++lastId;
+    x->started = now_ns();
+    x->filefd = -1;
+    x->mcastFd = -1;
+    x->command = strdup(command);
+    x->command[strcspn(x->command, "\n")] = '\0';
+    x->request = strdup(message);
+    x->requestLen = strlen(message);
+    x->kind = message[0];
+    x->download = download;
+    tar_expect(x, TAR_HEADER, TARBLOCK);
+
+    // Commands about one file keep its name for output, progress, the cache and finding its server
+    const char *name = message + 2;
+    long long size = 0;
+    int used = 0;
+    if (x->kind == 'V') {
+        sscanf(name, "%*s %*s %*s %n", &used);
+    } else if (x->kind == 'U') {
+        sscanf(name, "%lld %n", &size, &used);
+    } else if (x->kind == 'A') {
+        sscanf(name, "%*s %n", &used);
+    } else if (x->kind == 'R') {
+        sscanf(name, "%*s %*s %n", &used);
+    }
+    x->name = strdup(x->requestLen > 2 ? name + used : "");
+    x->name[strcspn(x->name, "\n\r")] = '\0';
+    x->size = size;
+    xfer_append(x);
+    active++;
+
+    if (x->kind == 'V') {
+        x->filefd = cache_lookup(config->cacheKey, x->name, &x->entry);
+    } else if (x->kind == 'U') {
+        // The typed command names the local file, the request only its base name
+        x->path = strdup(command + strlen("upload "));
+        x->path[strcspn(x->path, "\n\r")] = '\0';
+    }
+    if (x->kind == 'U' && (x->filefd = open(x->path, O_RDONLY | O_CLOEXEC)) == -1) {
+        perror("open");
+        xfer_fail(x, "local file could not be opened");
+        xfer_finish(x);
+        return NULL;
+    }
+    return x;
+}
+
+/// Send whole, a command about no one file, to every server as a part of it each, so listings, trees, searches,
+/// batch downloads, watches and stats cover every file of the cluster. Returns 0 or -1 if it failed already
+static int xfer_scatter(xfer_t *whole) {
+    whole->parts = calloc(config->nodeCount, sizeof *whole->parts);
+    whole->partsLeft = config->nodeCount;
+    for (int node = 0; node < config->nodeCount; node++) {
+        xfer_t *x = calloc(1, sizeof *x);
+        x->id = whole->id;
+        x->started = whole->started;
+        x->filefd = -1;
+        x->mcastFd = -1;
+        x->command = strdup(whole->command);
+        x->request = strdup(whole->request);
+        x->requestLen = whole->requestLen;
+        x->kind = whole->kind;
+        x->name = strdup(whole->name);
+        tar_expect(x, TAR_HEADER, TARBLOCK);
+        x->whole = whole;
+        x->route[0] = node;
+        x->routeCount = 1;
+        xfer_append(x);
+        xfer_route(x, "failed to connect");
+    }
+    return whole->failed ? -1 : 0;
+}
+
+/// Start the encoded command message, typed as command. download says whether a V request saves the file
+/// or prints it. A command about one file goes to the file's server on the hash ring, or when that can't be
+/// reached or does not have the file, to the next server around the ring. An upload goes to each of the
+/// replicas as a command of its own. Commands about no one file go to every server and their replies are
+/// merged. Returns 0 once the command is under way or -1 if it failed
+int xfer_start(const char *message, const char *command, int download) {
+    xfer_t *x = xfer_new(message, command, download);
+    if (x == NULL) {
+        return -1;
+    }
+
+    int keyed = strchr("PDVUCRAF", x->kind) != NULL;
+    if (!keyed && config->nodeCount > 1) {
+        return xfer_scatter(x);
+    }
+    int route[XFER_MAXNODES];
+    int count = hashring_route(&hashRing, keyed ? x->name : "", route, XFER_MAXNODES);
+    if (x->kind == 'U' && count > config->replicas) {
+        count = config->replicas;
+    }
+
+    int rv = 0;
+    for (int copy = 0; copy < count && (copy == 0 || x->kind == 'U'); copy++) {
+        if (copy > 0 && (x = xfer_new(message, command, download)) == NULL) {
+            rv = -1;
+            continue;
+        }
+        if (x->kind == 'U' && count > 1) {
+            x->route[0] = route[copy];      // each copy of an upload belongs on its own replica
+            x->routeCount = 1;
+        } else {
+            memcpy(x->route, route, count * sizeof *route);
+            x->routeCount = count;
+        }
+        if (xfer_route(x, "failed to connect") == -1) {
+            rv = -1;
+        }
+    }
+    return rv;
+}
+
+/// Move a connection forward after epoll reported events on it
+void xfer_event(void *data, uint32_t events) {
+    session_t *s = data;
+
+    if (s->state == SESSION_CONNECTING) {
+        int won = session_race(s);
+        if (won == -1) {
+            fprintf(stderr, "client: failed to connect to %s\n", config->nodes[s->node].name);
+            session_failover(s, "failed to connect");
+            xfer_reap();
+        }
+        if (won != 1) {
+            return;
+        }
+
+        // Only display on the first connection
+        if (!connected && !config->json) {
+            char addr[INET6_ADDRSTRLEN];
+            if (s->addr->ai_family == AF_UNIX) {
+                snprintf(addr, sizeof addr, config->ring ? "shared memory" : "unix socket");
+            } else {
+                void *in = s->addr->ai_family == AF_INET
+                           ? (void *) &((struct sockaddr_in *) s->addr->ai_addr)->sin_addr
+                           : (void *) &((struct sockaddr_in6 *) s->addr->ai_addr)->sin6_addr;
+                inet_ntop(s->addr->ai_family, in, addr, sizeof addr);
+            }
+            progress_clear();
+            printf("client: connecting to %s\n", addr);
+            fflush(stdout);
+        }
+        connected = 1;
+        s->state = config->useTls ? SESSION_HANDSHAKE : SESSION_OPEN;
+        if (config->ring && session_ring(s) == -1) {
+            session_lost(s, "shared memory refused");
+            xfer_reap();
+            return;
+        }
+    } else if (s->conn.ring != NULL && (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        // Nothing but a hang up arrives on the socket of a connection on rings, take what the server left
+        session_run(s);
+        if (!s->closed && s->head == NULL) {
+            session_close(s);
+        } else if (!s->closed) {
+            session_lost(s, "server closed the connection");
+        }
+        xfer_reap();
+        return;
+    }
+    session_run(s);
+    xfer_reap();
+}
+
+/// Number of commands still running
+int xfer_active(void) {
+    return active;
+}
+
+/// Number of commands that failed so far
+int xfer_failed(void) {
+    return failures;
+}
+
+/// Number of commands that failed because the connection to the server did
+int xfer_lost(void) {
+    return lost;
+}
+
+/// Returns 1 if a connection gave up its turn with work left, the loop should poll without waiting
+int xfer_busy(void) {
+    for (session_t *s = sessions; s != NULL; s = s->next) {
+        if (s->yielded && !s->closed) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/// Give every connection that used up its turn another one, move multicast receptions that went quiet on to
+/// asking for what they missed and give up on connections that made no progress in time
+void xfer_resume(void) {
+    long long now = now_ns();
+
+    for (wtimer_t *t = wheel_expire(&wheel, wheel_now()); t != NULL;) {
+        session_t *s = t->data;
+        wtimer_t *due = t;
+        t = t->next;
+        if (s->closed) {
+            continue;
+        }
+        if (due != &s->race) {
+            session_lost(s, "server stopped responding");
+        } else if (s->state == SESSION_CONNECTING && s->nextAddr < nodes[s->node].naddrs) {
+            // Nothing answered in time, the next address joins the race
+            session_try(s);
+            session_race_next(s);
+        } else if (s->state == SESSION_CONNECTING) {
+            fprintf(stderr, "client: %s is not answering\n", config->nodes[s->node].name);
+            session_failover(s, "server stopped responding");
+        }
+    }
+
+    for (session_t *s = sessions; s != NULL; s = s->next) {
+        xfer_t *x = s->head;
+        if (!s->closed && x != NULL && x->kind == 'F' && x->mcastState == MCAST_RECV &&
+            now - x->mcastLast > MCASTIDLENS) {
+            mcast_repair(s, x);
+        }
+        if (s->yielded && !s->closed) {
+            session_run(s);
+        }
+    }
+    xfer_reap();
+}
+
+/// End the watches and follows that are the last command on their connection by hanging up, they last
+/// until the client sends something more or goes away
+void xfer_stop(void) {
+    for (session_t *s = sessions; s != NULL; s = s->next) {
+        xfer_t *x = s->head;
+        if (s->closed || x == NULL || x->queueNext != NULL || (x->kind != 'W' && x->kind != 'A')) {
+            continue;
+        }
+        session_dequeue(s);
+        snprintf(x->message, sizeof x->message, "%s", x->kind == 'W' ? "Watch ended" : "Follow ended");
+        xfer_finish(x);
+        session_close(s);
+    }
+    xfer_reap();
+}
+
+/// Wait like epoll_wait() for events on the epoll instance. A connection on shared memory rings can't be
+/// seen by epoll, so while it waits for the server the time goes to sleeping on its ring in short naps
+/// between looks at epoll, and a ring that became ready counts as a connection with work left
+int xfer_wait(struct epoll_event *events, int max, int timeout) {
+    session_t *r = NULL;
+
+    for (session_t *s = sessions; s != NULL; s = s->next) {
+        if (s->ringWait != 0 && s->conn.ring != NULL && !s->closed && !s->yielded) {
+            r = s;
+        }
+    }
+    if (r == NULL) {
+        return epoll_wait(config->epfd, events, max, timeout);
+    }
+    if (!ring_ready(&r->conn, r->ringWait)) {
+        int n = epoll_wait(config->epfd, events, max, 0);
+        if (n != 0) {
+            return n;
+        }
+        ring_wait(&r->conn, r->ringWait, timeout >= 0 && timeout < RINGPOLLMS ? timeout : RINGPOLLMS);
+    }
+    if (ring_ready(&r->conn, r->ringWait)) {
+        r->yielded = 1;
+    }
+    return epoll_wait(config->epfd, events, max, 0);
+}
+
+/// Write one JSON line for a command that failed before it was sent
+void xfer_report(const char *command, const char *message) {
+    xfer_t *x = calloc(1, sizeof *x);
+
+    x->id = ++lastId;
+    x->started = now_ns();
+    x->filefd = -1;
+    x->mcastFd = -1;
+    x->command = strdup(command);
+    x->command[strcspn(x->command, "\n")] = '\0';
+    snprintf(x->message, sizeof x->message, "%s", message);
+    x->message[strcspn(x->message, "\n")] = '\0';
+    x->failed = 1;
+    active++;
+    xfer_finish(x);
+    xfer_free(x);
+}
+
+/// Redraw the progress line for transfers of known size, at most a few times a second and only on a terminal
+void xfer_progress(void) {
+    char line[512];
+    size_t len = 0;
+    long long now = now_ns();
+
+    if (!showProgress || now - lastProgress < PROGRESSNS) {
+        return;
+    }
+    lastProgress = now;
+    for (xfer_t *x = xfers; x != NULL && len < sizeof line - 64; x = x->next) {
+        session_t *s = x->session;
+        int bulk = (x->kind == 'U' && s != NULL && s->sending == x && s->sendState == SEND_BODY) ||
+                   (x->kind == 'V' && x->tmpPath[0] != '\0') || (x->kind == 'B' && x->tarState == TAR_DATA);
+        if (x->finished || x->size <= 0 || !bulk) {
+            continue;
+        }
+        len += snprintf(line + len, sizeof line - len, "%s[%.24s %lld%%]", len > 0 ? " " : "", x->name,
+                        x->done * 100 / x->size);
+    }
+    if (len > 0) {
+        fprintf(stderr, "\r%s\033[K", line);
+        progressShown = 1;
+    } else {
+        progress_clear();
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef XFER_H
+#define XFER_H
+
+#include <stdint.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+
+#define XFER_MAXNODES 32        ///< Servers a cluster may have
+
+/// One server of the cluster
+typedef struct xfer_node {
+    const char *name;           ///< as given, places the node on the hash ring
+    const char *hostname;       ///< name its certificate is checked against
+    struct addrinfo *servinfo;  ///< its addresses, raced in turns by family
+} xfer_node_t;
+
+/// Settings shared by every transfer
+typedef struct xfer_config {
+    int epfd;                   ///< epoll instance connections register with, the event data is theirs
+    const xfer_node_t *nodes;   ///< servers, files are spread over them by consistent hashing
+    int nodeCount;
+    int replicas;               ///< nodes an upload is stored on, the ones a file is looked for on
+    int useTls;                 ///< run TLS on every connection
+    const char *cacheKey;       ///< identifies the server in the download cache, NULL without a cache
+    int pipeline;               ///< send every command over one connection without waiting for replies
+    int json;                   ///< report each command as one JSON line instead of printing its output
+    int ring;                   ///< move unix socket connections to shared memory rings, needs pipeline
+    int timeout;                ///< milliseconds a connection with commands out may go without progress, 0 for ever
+} xfer_config_t;
+
+/// One command in flight
+typedef struct xfer xfer_t;
+
+/// Set up the transfer engine, config must stay valid while transfers run
+void xfer_init(const xfer_config_t *config);
+
+/// Start the encoded command message, typed as command. download says whether a V request saves the file
+/// or prints it. A command about one file goes to the file's server on the hash ring, or the next server
+/// around the ring when that one is down or does not have the file, and an upload goes to every replica.
+/// Commands about no one file go to every server with their replies merged. Returns 0 once the command is
+/// under way or -1 if it failed
+int xfer_start(const char *message, const char *command, int download);
+
+/// Move a connection forward after epoll reported events on it, data is the epoll event data
+void xfer_event(void *data, uint32_t events);
+
+/// Wait like epoll_wait() on config->epfd, also sleeping on the shared memory rings of a connection that is
+/// waiting for the server on them
+int xfer_wait(struct epoll_event *events, int max, int timeout);
+
+/// Number of commands still running
+int xfer_active(void);
+
+/// Number of commands that failed so far
+int xfer_failed(void);
+
+/// Number of commands that failed because the connection to the server did
+int xfer_lost(void);
+
+/// Returns 1 if a connection gave up its turn with work left, the loop should poll without waiting
+int xfer_busy(void);
+
+/// Milliseconds until a connection has a deadline or a race to act on in xfer_resume(), -1 if none has
+long xfer_due(void);
+
+/// Give every connection that used up its turn another one, end multicast receptions that went quiet and
+/// fail the commands on connections that made no progress for config->timeout
+void xfer_resume(void);
+
+/// End the watches and follows that are the last command on their connection by hanging up, they last
+/// until the client sends something more or goes away
+void xfer_stop(void);
+
+/// Redraw the progress line for transfers of known size, at most a few times a second and only on a terminal
+void xfer_progress(void);
+
+/// Write one JSON line for a command that failed before it was sent
+void xfer_report(const char *command, const char *message);
+
+#endif
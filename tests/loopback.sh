@@ -0,0 +1,206 @@
+#!/bin/sh
+#
+# loopback.sh -- start servers on 127.0.0.1 and drive the client against them, comparing what comes back with
+# the files served. Run by ctest as: loopback.sh <plain|tls|shm|cluster> <server> <client> <port>
+# Each test uses the ports from <port> on, so the tests can run in parallel
+
+TEST=$1
+SERVER=$2
+CLIENT=$3
+PORT=$4
+
+LC_ALL=C
+export LC_ALL
+
+TMP=$(mktemp -d "${TMPDIR:-/tmp}/loopback.XXXXXX") || exit 1
+PIDS=""
+
+cleanup() {
+    for pid in $PIDS; do
+        kill "$pid" 2>/dev/null
+    done
+    rm -rf "$TMP"
+}
+trap cleanup EXIT
+trap 'exit 1' HUP INT PIPE TERM
+
+fail() {
+    echo "FAIL: $*" >&2
+    for log in "$TMP"/*.log; do
+        [ -f "$log" ] && { echo "--- $log" >&2; tail -20 "$log" >&2; }
+    done
+    exit 1
+}
+
+# start_server <name> <args...>: serve $TMP/<name> with its own index directory, wait until it listens. The
+# server's stdout goes to a file, so it is line buffered to see the listening message
+start_server() {
+    name=$1
+    shift
+    mkdir -p "$TMP/$name"
+    (cd "$TMP/$name" && exec stdbuf -oL "$SERVER" -i "$TMP/index-$name" "$@") > "$TMP/$name.log" 2>&1 &
+    eval "PID_$name=$!"
+    PIDS="$PIDS $!"
+    for i in $(seq 50); do
+        grep -q "waiting for connections" "$TMP/$name.log" && return 0
+        sleep 0.1
+    done
+    fail "server $name did not start"
+}
+
+# stop_server <name>
+stop_server() {
+    eval "kill \$PID_$1"
+    eval "wait \$PID_$1" 2>/dev/null
+}
+
+# run <target> <command>: one command in interactive mode, printing only what the server sent
+run() {
+    printf '%s\nquit\n' "$2" | (cd "$TMP/cli" && "$CLIENT" -n $CLIENTOPTS "$1" 2>/dev/null) |
+        sed "s/Command(enter 'h' for help) ://g" | grep -v -e '^client: ' -e '^Quiting client' -e '^$'
+}
+
+# batch <target> <file>: run the commands in file in batch mode and print "<id> <status>" in command order
+batch() {
+    (cd "$TMP/cli" && "$CLIENT" -n $CLIENTOPTS -b "$2" "$1" 2>> "$TMP/client.log") |
+        sed -n 's/^{"id":\([0-9]*\),.*"status":"\([a-z]*\)".*/\1 \2/p' | sort -n
+}
+
+# expect <what> <expected file>: stdin must match the file
+expect() {
+    cat > "$TMP/got"
+    diff "$2" "$TMP/got" > "$TMP/diff" || { cat "$TMP/diff" >&2; fail "$1"; }
+}
+
+# Files every single server test serves: text to display by lines, a binary file bigger than the buffers,
+# and a name too long for a ustar name field
+LONGNAME=$(printf 'n%.0s' $(seq 150)).txt
+make_files() {
+    mkdir -p "$TMP/$1" "$TMP/cli"
+    seq 1 2000 > "$TMP/$1/lines.txt"
+    head -c 3000000 /dev/urandom > "$TMP/$1/big.bin"
+    echo "long name" > "$TMP/$1/$LONGNAME"
+    head -c 100000 /dev/urandom > "$TMP/cli/up.bin"
+}
+
+# exercise <server directory> <target>: check, display, download, upload, get and a batch against one server
+exercise() {
+    dir=$TMP/$1
+    target=$2
+
+    run "$target" "display lines.txt" | expect "display" "$dir/lines.txt"
+    seq 5 9 > "$TMP/want"
+    run "$target" "display -l 5-9 lines.txt" | expect "display -l 5-9" "$TMP/want"
+    seq 1995 2000 > "$TMP/want"
+    run "$target" "display -l 1995- lines.txt" | expect "display -l 1995-" "$TMP/want"
+    seq 1998 2000 > "$TMP/want"
+    run "$target" "display -t 3 lines.txt" | expect "display -t 3" "$TMP/want"
+    seq 1 2 > "$TMP/want"
+    run "$target" "display -h 2 lines.txt" | expect "display -h 2" "$TMP/want"
+    ls "$dir" > "$TMP/want"
+    run "$target" "ls" | expect "ls" "$TMP/want"
+
+    run "$target" "download big.bin" > /dev/null
+    cmp "$dir/big.bin" "$TMP/cli/big.bin" || fail "download"
+    run "$target" "upload up.bin" > /dev/null
+    cmp "$TMP/cli/up.bin" "$dir/up.bin" || fail "upload"
+    rm -f "$TMP/cli/lines.txt" "$TMP/cli/$LONGNAME"
+    run "$target" "get lines.txt n*.txt" > /dev/null
+    cmp "$dir/lines.txt" "$TMP/cli/lines.txt" && cmp "$dir/$LONGNAME" "$TMP/cli/$LONGNAME" || fail "get"
+
+    cat > "$TMP/commands" <<END
+check lines.txt
+check nope.txt
+download big.bin
+display -h 2 lines.txt
+ls
+bogus
+END
+    printf '1 ok\n2 error\n3 ok\n4 ok\n5 ok\n6 error\n' > "$TMP/want"
+    batch "$target" "$TMP/commands" | expect "batch" "$TMP/want"
+}
+
+case $TEST in
+    plain)
+        make_files srv
+        start_server srv -p "$PORT"
+        exercise srv "localhost:$PORT"
+        ;;
+
+    tls)
+        command -v openssl > /dev/null || { echo "openssl not found, skipping"; exit 77; }
+        openssl req -x509 -newkey rsa:2048 -nodes -keyout "$TMP/key.pem" -out "$TMP/cert.pem" -days 1 \
+            -subj /CN=localhost -addext "subjectAltName=DNS:localhost,IP:127.0.0.1" 2> /dev/null ||
+            fail "could not make a certificate"
+        make_files srv
+        start_server srv -p "$PORT" -c "$TMP/cert.pem" -k "$TMP/key.pem"
+        CLIENTOPTS="-c $TMP/cert.pem"
+        exercise srv "localhost:$PORT"
+        # A client that does not trust the certificate must not get through
+        CLIENTOPTS="-t"
+        [ "$(run "localhost:$PORT" "display lines.txt")" = "" ] || fail "untrusted certificate accepted"
+        ;;
+
+    shm)
+        make_files srv
+        start_server srv -p "$PORT" -u "$TMP/sock"
+        exercise srv "unix:$TMP/sock"
+        exercise srv "shm:$TMP/sock"
+        ;;
+
+    cluster)
+        # Three servers with every upload on two of them
+        NODES="localhost:$PORT,localhost:$((PORT + 1)),localhost:$((PORT + 2))"
+        for n in 1 2 3; do
+            start_server "n$n" -p "$((PORT + n - 1))"
+        done
+        mkdir -p "$TMP/cli" "$TMP/files"
+        : > "$TMP/commands"
+        for f in a b c d e f g h i j; do
+            echo "hello $f" > "$TMP/cli/$f.txt"
+            echo "hello $f" > "$TMP/files/$f.txt"
+            echo "upload $f.txt" >> "$TMP/commands"
+        done
+        batch "$NODES" "$TMP/commands" | grep -c " ok" | grep -qx 20 || fail "uploads to both replicas"
+        [ "$(cat "$TMP"/n?/*.txt | wc -l)" -eq 20 ] || fail "each file on two servers"
+
+        # Commands about no one file see every server's files, each once
+        ls "$TMP/files" > "$TMP/want"
+        run "$NODES" "ls" | expect "cluster ls" "$TMP/want"
+        grep -n hello "$TMP"/files/*.txt | sed 's|.*/||; s/:hello.*//' | sort > "$TMP/want"
+        run "$NODES" "search hello" | expect "cluster search" "$TMP/want"
+        rm -f "$TMP"/cli/*.txt
+        run "$NODES" "get *.txt" > /dev/null
+        for f in "$TMP"/files/*.txt; do
+            cmp "$f" "$TMP/cli/${f##*/}" || fail "cluster get"
+        done
+
+        # With a server down every file is still read from its other replica
+        stop_server n2
+        rm -f "$TMP"/cli/*.txt
+        sed 's/^upload/download/' "$TMP/commands" > "$TMP/downloads"
+        batch "$NODES" "$TMP/downloads" | grep -c " ok" | grep -qx 10 || fail "failover downloads"
+        for f in "$TMP"/files/*.txt; do
+            cmp "$f" "$TMP/cli/${f##*/}" || fail "failover download of ${f##*/}"
+        done
+        ls "$TMP/files" > "$TMP/want"
+        run "$NODES" "ls" | expect "ls with a server down" "$TMP/want"
+        echo ls > "$TMP/list"
+        CLIENTOPTS="-r 1"
+        batch "$NODES" "$TMP/list" | grep -q "1 error" || fail "ls with one replica and a server down"
+        CLIENTOPTS=""
+
+        # A server that joins owns keys it has no data for, reads go on to the servers that still have it
+        start_server n4 -p "$((PORT + 3))"
+        rm -f "$TMP"/cli/*.txt
+        batch "$NODES,localhost:$((PORT + 3))" "$TMP/downloads" | grep -c " ok" | grep -qx 10 ||
+            fail "downloads after a server joined"
+        grep -q "received D" "$TMP/n4.log" || fail "no file moved to the new server"
+        ;;
+
+    *)
+        echo "usage: loopback.sh <plain|tls|shm|cluster> <server> <client> <port>" >&2
+        exit 2
+        ;;
+esac
+echo "PASS: $TEST"